@@ -0,0 +1,423 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/*
+ * Serves SX block downloads straight from the datafiles.
+ *
+ * When sx.fcgi is told (via the SX_BLOCKS_SENDFILE fastcgi param) that this
+ * filter is active, it replies to GET /.data requests with all the regular
+ * headers, an empty body and an "X-SX-Blocks" header listing the byte ranges
+ * to be sent, in the form "offset,length,datafile;...", where datafile is an
+ * absolute, url-encoded path.
+ * The filter strips that header and replaces the (empty) upstream body with
+ * file buffers, which are then sent via sendfile where possible.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+typedef struct {
+    ngx_flag_t    enable;
+} ngx_http_sxblocks_conf_t;
+
+
+typedef struct {
+    ngx_chain_t  *out;
+} ngx_http_sxblocks_ctx_t;
+
+
+static ngx_int_t ngx_http_sxblocks_add_range(ngx_http_request_t *r,
+    ngx_http_core_loc_conf_t *clcf, u_char *p, u_char *end, ngx_chain_t ***ll);
+static void *ngx_http_sxblocks_create_conf(ngx_conf_t *cf);
+static char *ngx_http_sxblocks_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static ngx_int_t ngx_http_sxblocks_filter_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_sxblocks_filter_commands[] = {
+
+    { ngx_string("sxblocks"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_sxblocks_conf_t, enable),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_sxblocks_filter_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_sxblocks_filter_init,         /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_sxblocks_create_conf,         /* create location configuration */
+    ngx_http_sxblocks_merge_conf           /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_sxblocks_filter_module = {
+    NGX_MODULE_V1,
+    &ngx_http_sxblocks_filter_module_ctx,  /* module context */
+    ngx_http_sxblocks_filter_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
+static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+
+
+static ngx_int_t
+ngx_http_sxblocks_header_filter(ngx_http_request_t *r)
+{
+    u_char                    *p, *end, *next;
+    off_t                      len;
+    ngx_uint_t                 i;
+    ngx_chain_t               *out, **ll, *cl;
+    ngx_list_part_t           *part;
+    ngx_table_elt_t           *h, *ranges;
+    ngx_http_sxblocks_ctx_t   *ctx;
+    ngx_http_sxblocks_conf_t  *conf;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_sxblocks_filter_module);
+
+    if (!conf->enable
+        || r->upstream == NULL
+        || r->headers_out.status != NGX_HTTP_OK)
+    {
+        return ngx_http_next_header_filter(r);
+    }
+
+    ranges = NULL;
+    part = &r->headers_out.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash != 0
+            && h[i].key.len == sizeof("X-SX-Blocks") - 1
+            && ngx_strncasecmp(h[i].key.data, (u_char *) "X-SX-Blocks",
+                               sizeof("X-SX-Blocks") - 1)
+               == 0)
+        {
+            ranges = &h[i];
+            break;
+        }
+    }
+
+    if (ranges == NULL) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    /* never leak the datafile layout to the client */
+    ranges->hash = 0;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    out = NULL;
+    ll = &out;
+    p = ranges->value.data;
+    end = p + ranges->value.len;
+
+    while (p < end) {
+        next = ngx_strlchr(p, end, ';');
+        if (next == NULL) {
+            next = end;
+        }
+
+        if (ngx_http_sxblocks_add_range(r, clcf, p, next, &ll) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p = next + 1;
+    }
+
+    if (out == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sxblocks: empty block list");
+        return NGX_ERROR;
+    }
+
+    len = 0;
+    for (cl = out; cl->next; cl = cl->next) {
+        len += cl->buf->file_last - cl->buf->file_pos;
+    }
+    len += cl->buf->file_last - cl->buf->file_pos;
+
+    if (r->headers_out.content_length_n != len) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sxblocks: block list doesn't match content length");
+        return NGX_ERROR;
+    }
+
+    if (r == r->main) {
+        cl->buf->last_buf = 1;
+
+    } else {
+        cl->buf->last_in_chain = 1;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_sxblocks_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->out = out;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_sxblocks_filter_module);
+
+    return ngx_http_next_header_filter(r);
+}
+
+
+static ngx_int_t
+ngx_http_sxblocks_add_range(ngx_http_request_t *r,
+    ngx_http_core_loc_conf_t *clcf, u_char *p, u_char *end, ngx_chain_t ***ll)
+{
+    u_char                *start, *comma, *dst;
+    off_t                  offset, length;
+    ngx_buf_t             *b;
+    ngx_str_t              path;
+    ngx_chain_t           *cl;
+    ngx_open_file_info_t   of;
+
+    start = p;
+
+    comma = ngx_strlchr(p, end, ',');
+    if (comma == NULL) {
+        goto invalid;
+    }
+
+    offset = ngx_atoof(p, comma - p);
+    p = comma + 1;
+
+    comma = ngx_strlchr(p, end, ',');
+    if (comma == NULL) {
+        goto invalid;
+    }
+
+    length = ngx_atoof(p, comma - p);
+    p = comma + 1;
+
+    if (offset == NGX_ERROR || length == NGX_ERROR || length == 0
+        || p == end)
+    {
+        goto invalid;
+    }
+
+    path.data = ngx_pnalloc(r->pool, end - p + 1);
+    if (path.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = path.data;
+    ngx_unescape_uri(&dst, &p, end - p, 0);
+    path.len = dst - path.data;
+    *dst = '\0';
+
+    if (path.len == 0 || path.data[0] != '/') {
+        goto invalid;
+    }
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = clcf->directio;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
+                      "sxblocks: %s \"%s\" failed", of.failed, path.data);
+        return NGX_ERROR;
+    }
+
+    if (!of.is_file || offset + length > of.size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "sxblocks: range %O+%O is not within \"%s\"",
+                      offset, length, path.data);
+        return NGX_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->in_file = 1;
+    b->file_pos = offset;
+    b->file_last = offset + length;
+
+    b->file->fd = of.fd;
+    b->file->name = path;
+    b->file->log = r->connection->log;
+    b->file->directio = of.is_directio;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    **ll = cl;
+    *ll = &cl->next;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "sxblocks: invalid block range \"%*s\"",
+                  (size_t) (end - start), start);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_sxblocks_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_uint_t                last;
+    ngx_chain_t              *cl, *out;
+    ngx_http_sxblocks_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_sxblocks_filter_module);
+
+    if (ctx == NULL || ctx->out == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    /* the upstream body is expected to be empty: consume whatever comes in
+     * and send the file ranges in its place once the upstream is done */
+
+    last = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+
+        if (ngx_buf_size(cl->buf)) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "sxblocks: discarding unexpected upstream body");
+        }
+
+        cl->buf->pos = cl->buf->last;
+        cl->buf->file_pos = cl->buf->file_last;
+
+        if (cl->buf->last_buf || cl->buf->last_in_chain) {
+            last = 1;
+        }
+    }
+
+    if (!last) {
+        return NGX_OK;
+    }
+
+    out = ctx->out;
+    ctx->out = NULL;
+
+    return ngx_http_next_body_filter(r, out);
+}
+
+
+static void *
+ngx_http_sxblocks_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_sxblocks_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_sxblocks_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->enable = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_sxblocks_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_sxblocks_conf_t *prev = parent;
+    ngx_http_sxblocks_conf_t *conf = child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_sxblocks_filter_init(ngx_conf_t *cf)
+{
+    ngx_http_next_header_filter = ngx_http_top_header_filter;
+    ngx_http_top_header_filter = ngx_http_sxblocks_header_filter;
+
+    ngx_http_next_body_filter = ngx_http_top_body_filter;
+    ngx_http_top_body_filter = ngx_http_sxblocks_body_filter;
+
+    return NGX_OK;
+}
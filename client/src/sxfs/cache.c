@@ -38,6 +38,13 @@
 #define BLOCK_STATUS_DONE 2
 #define BLOCK_STATUS_FAILED 3
 
+/* Block cache directories, one per cached block size */
+#define CACHE_DIRS 4
+static const char *cache_dirnames[CACHE_DIRS] = { "medium", "64k", "256k", "large" };
+static const unsigned int cache_blocksizes[CACHE_DIRS] = { SX_BS_MEDIUM, SX_BS_64K, SX_BS_256K, SX_BS_LARGE };
+static const unsigned int cache_amounts[CACHE_DIRS] = { SXFS_BS_MEDIUM_AMOUNT, SXFS_BS_64K_AMOUNT, SXFS_BS_256K_AMOUNT, SXFS_BS_LARGE_AMOUNT };
+#define CACHE_MAX_AMOUNT MAX(MAX(SXFS_BS_MEDIUM_AMOUNT, SXFS_BS_64K_AMOUNT), MAX(SXFS_BS_256K_AMOUNT, SXFS_BS_LARGE_AMOUNT))
+
 struct _block_state_t {
     int waiting, status;
 };
@@ -45,19 +52,20 @@ typedef struct _block_state_t block_state_t;
 
 struct _sxfs_cache_t {
     ssize_t used, size; /* can be negative due to race conditions with small size */
-    char *tempdir, *dir_medium, *dir_large;
+    char *tempdir, *dirs[CACHE_DIRS];
     pthread_mutex_t mutex;
     sxi_ht *blocks;
 };
 
 static void cache_free (sxfs_state_t *sxfs, sxfs_cache_t *cache) {
     int err;
+    unsigned int i;
 
     if(!sxfs || !cache)
         return;
     free(cache->tempdir);
-    free(cache->dir_medium);
-    free(cache->dir_large);
+    for(i=0; i<CACHE_DIRS; i++)
+        free(cache->dirs[i]);
     sxi_ht_free(cache->blocks);
     if((err = pthread_mutex_destroy(&cache->mutex)))
         SXFS_ERROR("Cannot destroy cache mutex: %s", strerror(err));
@@ -66,6 +74,7 @@ static void cache_free (sxfs_state_t *sxfs, sxfs_cache_t *cache) {
 
 int sxfs_cache_init (sxc_client_t *sx, sxfs_state_t *sxfs, size_t size, const char *path) {
     int ret = -1, err;
+    unsigned int i;
     sxfs_cache_t *cache;
 
     if(!sxfs)
@@ -100,27 +109,22 @@ int sxfs_cache_init (sxc_client_t *sx, sxfs_state_t *sxfs, size_t size, const ch
         fprintf(stderr, "ERROR: Out of memory");
         goto sxfs_cache_init_err;
     }
-    cache->dir_medium = (char*)malloc(strlen(path) + 1 + lenof("medium") + 1);
-    if(!cache->dir_medium) {
-        fprintf(stderr, "ERROR: Out of memory");
-        goto sxfs_cache_init_err;
-    }
-    cache->dir_large = (char*)malloc(strlen(path) + 1 + lenof("large") + 1);
-    if(!cache->dir_large) {
-        fprintf(stderr, "ERROR: Out of memory");
-        goto sxfs_cache_init_err;
-    }
-    sprintf(cache->dir_medium, "%s/medium", path);
-    sprintf(cache->dir_large, "%s/large", path);
-    if(mkdir(cache->dir_medium, 0700)) {
-        fprintf(stderr, "ERROR: Cannot create '%s' directory: %s", cache->dir_medium, strerror(errno));
-        goto sxfs_cache_init_err;
-    }
-    if(mkdir(cache->dir_large, 0700)) {
-        fprintf(stderr, "ERROR: Cannot create '%s' directory: %s", cache->dir_large, strerror(errno));
-        if(rmdir(cache->dir_medium))
-            fprintf(stderr, "ERROR: Cannot remove '%s' directory: %s", cache->dir_medium, strerror(errno));
-        goto sxfs_cache_init_err;
+    for(i=0; i<CACHE_DIRS; i++) {
+        cache->dirs[i] = (char*)malloc(strlen(path) + 1 + strlen(cache_dirnames[i]) + 1);
+        if(!cache->dirs[i]) {
+            fprintf(stderr, "ERROR: Out of memory");
+            goto sxfs_cache_init_err;
+        }
+        sprintf(cache->dirs[i], "%s/%s", path, cache_dirnames[i]);
+    }
+    for(i=0; i<CACHE_DIRS; i++) {
+        if(mkdir(cache->dirs[i], 0700)) {
+            fprintf(stderr, "ERROR: Cannot create '%s' directory: %s", cache->dirs[i], strerror(errno));
+            while(i--)
+                if(rmdir(cache->dirs[i]))
+                    fprintf(stderr, "ERROR: Cannot remove '%s' directory: %s", cache->dirs[i], strerror(errno));
+            goto sxfs_cache_init_err;
+        }
     }
     cache->used = 0;
     cache->size = size;
@@ -134,12 +138,14 @@ sxfs_cache_init_err:
 } /* sxfs_cache_init */
 
 static void ENOSPC_handler (sxfs_state_t *sxfs) {
+    unsigned int i;
+
     pthread_mutex_lock(&sxfs->limits_mutex);
     if(!sxfs->need_file) {
         SXFS_ERROR("Disabling the block cache, restart SXFS (possibly with a different cache dir) to re-enable the cache");
         sxfs->need_file = 1;
-        sxi_rmdirs(sxfs->cache->dir_medium);
-        sxi_rmdirs(sxfs->cache->dir_large);
+        for(i=0; i<CACHE_DIRS; i++)
+            sxi_rmdirs(sxfs->cache->dirs[i]);
     }
     pthread_mutex_unlock(&sxfs->limits_mutex);
 } /* ENOSPC_handler */
@@ -220,39 +226,39 @@ load_files_err:
 
 static int cache_make_space (sxfs_state_t *sxfs, unsigned int size) {
     int ret;
-    unsigned int blocksize;
+    unsigned int i, oldest;
     char path[PATH_MAX];
-    size_t i_m = 0, i_l = 0, nfiles_medium = 0, nfiles_large = 0, removed = 0;
-    blockfile_t *list_medium = NULL, *list_large = NULL;
+    size_t pos[CACHE_DIRS], nfiles[CACHE_DIRS], removed = 0;
+    blockfile_t *lists[CACHE_DIRS];
 
+    memset(pos, 0, sizeof(pos));
+    memset(nfiles, 0, sizeof(nfiles));
+    memset(lists, 0, sizeof(lists));
     if(sxfs->cache->used + size > sxfs->cache->size) {
-        if((ret = load_files(sxfs, sxfs->cache->dir_medium, &list_medium, &nfiles_medium)))
-            goto cache_make_space_err;
-        if((ret = load_files(sxfs, sxfs->cache->dir_large, &list_large, &nfiles_large)))
-            goto cache_make_space_err;
+        for(i=0; i<CACHE_DIRS; i++)
+            if((ret = load_files(sxfs, sxfs->cache->dirs[i], &lists[i], &nfiles[i])))
+                goto cache_make_space_err;
 
         while(sxfs->cache->used + size > sxfs->cache->size) {
-            if(i_m == nfiles_medium && i_l == nfiles_large) {
+            /* remove the least recently used file of all the directories */
+            oldest = CACHE_DIRS;
+            for(i=0; i<CACHE_DIRS; i++)
+                if(pos[i] != nfiles[i] && (oldest == CACHE_DIRS || lists[i][pos[i]].mtime < lists[oldest][pos[oldest]].mtime))
+                    oldest = i;
+            if(oldest == CACHE_DIRS) {
                 SXFS_ERROR("Cache inconsistency error");
                 ret = -ENOMSG;
                 goto cache_make_space_err;
             }
-            if(i_l == nfiles_large || (i_m != nfiles_medium && list_medium[i_m].mtime < list_large[i_l].mtime)) {
-                snprintf(path, sizeof(path), "%s/%s", sxfs->cache->dir_medium, list_medium[i_m].name);
-                i_m++;
-                blocksize = SX_BS_MEDIUM;
-            } else {
-                snprintf(path, sizeof(path), "%s/%s", sxfs->cache->dir_large, list_large[i_l].name);
-                i_l++;
-                blocksize = SX_BS_LARGE;
-            }
+            snprintf(path, sizeof(path), "%s/%s", sxfs->cache->dirs[oldest], lists[oldest][pos[oldest]].name);
+            pos[oldest]++;
             if(unlink(path)) {
                 ret = -errno;
                 SXFS_ERROR("Cannot remove '%s' file: %s", path, strerror(errno));
                 goto cache_make_space_err;
             }
             removed++;
-            sxfs->cache->used -= blocksize;
+            sxfs->cache->used -= cache_blocksizes[oldest];
         }
     }
     if(removed)
@@ -260,15 +266,12 @@ static int cache_make_space (sxfs_state_t *sxfs, unsigned int size) {
 
     ret = 0;
 cache_make_space_err:
-    if(list_medium) {
-        for(i_m = 0; i_m<nfiles_medium; i_m++)
-            free(list_medium[i_m].name);
-        free(list_medium);
-    }
-    if(list_large) {
-        for(i_l = 0; i_l<nfiles_large; i_l++)
-            free(list_large[i_l].name);
-        free(list_large);
+    for(i=0; i<CACHE_DIRS; i++) {
+        if(lists[i]) {
+            for(pos[i] = 0; pos[i]<nfiles[i]; pos[i]++)
+                free(lists[i][pos[i]].name);
+            free(lists[i]);
+        }
     }
     return ret;
 } /* cache_make_space */
@@ -392,8 +395,8 @@ cache_download_err:
 } /* cache_download */
 
 struct _cache_thread_data_t {
-    int fds[MAX(SXFS_BS_MEDIUM_AMOUNT, SXFS_BS_LARGE_AMOUNT)];
-    unsigned int nblocks, blocks[MAX(SXFS_BS_MEDIUM_AMOUNT, SXFS_BS_LARGE_AMOUNT)];
+    int fds[CACHE_MAX_AMOUNT];
+    unsigned int nblocks, blocks[CACHE_MAX_AMOUNT];
     char *dir;
     sxfs_state_t *sxfs;
     sxfs_file_t *sxfs_file;
@@ -636,7 +639,7 @@ cache_read_background_err:
 
 ssize_t sxfs_cache_read (sxfs_state_t *sxfs, sxfs_file_t *sxfs_file, void *buff, size_t length, off_t offset) {
     int fd = -1, cache_locked = 0, download = 0;
-    unsigned int block, nblocks = 0;
+    unsigned int i, block, nblocks = 0;
     ssize_t ret;
     char *path;
     const char *dir = "foo"; /* shut up warnings */
@@ -658,21 +661,18 @@ ssize_t sxfs_cache_read (sxfs_state_t *sxfs, sxfs_file_t *sxfs_file, void *buff,
             return -EINVAL;
         }
         if(fdata) { /* file opened by create() doesn't have fdata but always has write_fd */
-            switch(fdata->blocksize) {
-                case SX_BS_SMALL:
-                    download = 1;
-                    break;
-                case SX_BS_MEDIUM:
-                    dir = cache->dir_medium;
-                    nblocks = SXFS_BS_MEDIUM_AMOUNT;
-                    break;
-                case SX_BS_LARGE:
-                    dir = cache->dir_large;
-                    nblocks = SXFS_BS_LARGE_AMOUNT;
-                    break;
-                default:
+            if(fdata->blocksize == SX_BS_SMALL) {
+                download = 1;
+            } else {
+                for(i=0; i<CACHE_DIRS; i++)
+                    if(fdata->blocksize == cache_blocksizes[i])
+                        break;
+                if(i == CACHE_DIRS) {
                     SXFS_ERROR("Unknown block size");
                     return -EINVAL;
+                }
+                dir = cache->dirs[i];
+                nblocks = cache_amounts[i];
             }
         }
     }
@@ -798,12 +798,13 @@ sxfs_cache_read_err:
 } /* sxfs_cache_read */
 
 void sxfs_cache_free (sxfs_state_t *sxfs) {
+    unsigned int i;
+
     if(!sxfs || !sxfs->cache)
         return;
-    if(sxi_rmdirs(sxfs->cache->dir_medium) && errno != ENOENT)
-        SXFS_ERROR("Cannot remove '%s' directory: %s", sxfs->cache->dir_medium, strerror(errno));
-    if(sxi_rmdirs(sxfs->cache->dir_large) && errno != ENOENT)
-        SXFS_ERROR("Cannot remove '%s' directory: %s", sxfs->cache->dir_large, strerror(errno));
+    for(i=0; i<CACHE_DIRS; i++)
+        if(sxi_rmdirs(sxfs->cache->dirs[i]) && errno != ENOENT)
+            SXFS_ERROR("Cannot remove '%s' directory: %s", sxfs->cache->dirs[i], strerror(errno));
     cache_free(sxfs, sxfs->cache);
 } /* sxfs_cache_free */
 
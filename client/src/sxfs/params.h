@@ -52,6 +52,8 @@
 #define SXFS_DIR_SIZE SX_BS_SMALL
 
 #define SXFS_BS_MEDIUM_AMOUNT 128   /* 16 kB * 128 = 2MB */
+#define SXFS_BS_64K_AMOUNT 32       /* 64 kB * 32  = 2MB */
+#define SXFS_BS_256K_AMOUNT 16      /* 256 kB * 16 = 4MB */
 #define SXFS_BS_LARGE_AMOUNT 4      /*  1 MB *  4  = 4MB */
 
 #define SXFS_THREAD_WAIT 200000L /* microseconds to wait for other threads (200000 -> 0.2s) */
@@ -1245,7 +1245,7 @@ static int sxfs_truncate (const char *path, off_t length) {
                         free(tmp_sxfs_file.remote_path);
                         goto sxfs_truncate_err;
                     }
-                    fdata = sxi_sxfs_download_init(file_remote);
+                    fdata = sxi_sxfs_download_init(file_remote, length);
                     if(!fdata) {
                         SXFS_ERROR("Cannot initialize file downloading: %s", sxc_geterrmsg(sx));
                         ret = -sxfs_sx_err(sx);
@@ -1511,7 +1511,7 @@ static int sxfs_open (const char *path, struct fuse_file_info *file_info) {
             ret = -sxfs_sx_err(sx);
             goto sxfs_open_err;
         }
-        sxfs_file->fdata = sxi_sxfs_download_init(file_remote);
+        sxfs_file->fdata = sxi_sxfs_download_init(file_remote, -1);
         if(!sxfs_file->fdata) {
             SXFS_ERROR("Cannot initialize file downloading: %s", sxc_geterrmsg(sx));
             ret = -sxfs_sx_err(sx);
@@ -30,6 +30,8 @@
 
 #define SX_BS_SMALL (4*1024)
 #define SX_BS_MEDIUM (16*1024)
+#define SX_BS_64K (64*1024)
+#define SX_BS_256K (256*1024)
 #define SX_BS_LARGE (1*1024*1024)
 
 #define UPLOAD_CHUNK_SIZE (4*SX_BS_LARGE)
@@ -1674,7 +1674,8 @@ static void cb_listfiles_file_complete(jparse_t *J, void *ctx) {
 	}
 	yactx->file.filesize = 0;
 	yactx->file.blocksize = 0;
-	yactx->file.created_at = 0;
+	if(yactx->file.created_at < 0) /* Only reported by nodes with a directory index */
+	    yactx->file.created_at = 0;
 	yactx->file.metalen = 0;
     } else if(yactx->file.filesize < 0 || !yactx->file.blocksize || yactx->file.created_at < 0) {
 	sxi_jparse_cancel(J, "Missing attributes for file '%s'", fname);
@@ -4167,6 +4168,30 @@ static void cb_nodest_swap_free(jparse_t *J, void *ctx, int64_t num) {
     struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
     yactx->status.swap_free = num;
 }
+static void cb_nodest_bloom_neg(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.bloom_neg = num;
+}
+static void cb_nodest_bloom_fp(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.bloom_fp = num;
+}
+static void cb_nodest_worker_open(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.worker_open_usec = num;
+}
+static void cb_nodest_worker_prepared(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.worker_prepared = num;
+}
+static void cb_nodest_worker_lazy(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.worker_lazy = num;
+}
+static void cb_nodest_worker_maxrss(jparse_t *J, void *ctx, int64_t num) {
+    struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
+    yactx->status.worker_maxrss = num;
+}
 static void cb_nodest_sysjobs(jparse_t *J, void *ctx, int64_t num) {
     struct node_status_ctx *yactx = (struct node_status_ctx *)ctx;
     yactx->status.sysjobs = num;
@@ -4268,6 +4293,12 @@ int sxi_cluster_status(sxc_cluster_t *cluster, const node_status_cb_t status_cb,
                      JPACT(cb_nodest_mem_avail, JPKEY("memAvailable")),
                      JPACT(cb_nodest_swap, JPKEY("swapTotal")),
                      JPACT(cb_nodest_swap_free, JPKEY("swapFree")),
+		     JPACT(cb_nodest_bloom_neg, JPKEY("blockIndex"), JPKEY("bloomNegatives")),
+		     JPACT(cb_nodest_bloom_fp, JPKEY("blockIndex"), JPKEY("bloomFalsePositives")),
+		     JPACT(cb_nodest_worker_open, JPKEY("worker"), JPKEY("openTimeUsec")),
+		     JPACT(cb_nodest_worker_prepared, JPKEY("worker"), JPKEY("preparedStatements")),
+		     JPACT(cb_nodest_worker_lazy, JPKEY("worker"), JPKEY("lazyStatements")),
+		     JPACT(cb_nodest_worker_maxrss, JPKEY("worker"), JPKEY("maxRSS")),
 		     JPACT(cb_nodest_sysjobs, JPKEY("queueStatus"), JPKEY("eventQueue"), JPKEY("systemJobs")),
 		     JPACT(cb_nodest_usrjobs, JPKEY("queueStatus"), JPKEY("eventQueue"), JPKEY("userJobs")),
 		     JPACT(cb_nodest_bq_ready, JPKEY("queueStatus"), JPKEY("transferQueue"), JPANYKEY, JPKEY("ready")),
@@ -188,6 +188,12 @@ typedef struct _node_status_t {
     char *network_traffic_json;
     size_t network_traffic_json_size;
 
+    /* Block index bloom filters */
+    int64_t bloom_neg, bloom_fp;
+
+    /* Worker startup */
+    int64_t worker_open_usec, worker_prepared, worker_lazy, worker_maxrss;
+
     /* Event queue */
     int64_t sysjobs, usrjobs;
     /* Block queue */
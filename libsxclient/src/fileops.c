@@ -2677,6 +2677,7 @@ static int local_to_remote_iterate(sxc_file_t *source, int single_source, int re
   "fileSize":9876,
   "createdAt":1234,
   "fileRevision":"FILEREV",
+  "fileDataStart":0, (only in replies to ranged requests)
   "fileData":[
     { "block" : [ "host1", "host2" ] },
     ...
@@ -2689,7 +2690,7 @@ struct cb_getfile_ctx {
     jparse_t *J;
     const struct jparse_actions *acts;
     FILE *f;
-    int64_t filesize, blocksize, created_at;
+    int64_t filesize, blocksize, created_at, datastart;
     unsigned int nblocks;
     enum sxc_error_t err;
 };
@@ -2721,6 +2722,15 @@ static void cb_getfile_time(jparse_t *J, void *ctx, int64_t num) {
     }
     yactx->created_at = num;
 }
+static void cb_getfile_start(jparse_t *J, void *ctx, int64_t num) {
+    struct cb_getfile_ctx *yactx = (struct cb_getfile_ctx *)ctx;
+    if(num < 0) {
+	sxi_jparse_cancel(J, "Invalid file data start");
+	yactx->err = SXE_ECOMM;
+	return;
+    }
+    yactx->datastart = num;
+}
 
 static void cb_getfile_blockinit(jparse_t *J, void *ctx) {
     const char *block = sxi_jpath_mapkey(sxi_jpath_down(sxi_jpath_down(sxi_jparse_whereami(J))));
@@ -2799,6 +2809,7 @@ static int getfile_setup_cb(curlev_context_t *cbdata, void *ctx, const char *hos
     yactx->filesize = -1;
     yactx->nblocks = 0;
     yactx->created_at = -1;
+    yactx->datastart = -1;
 
     return 0;
 }
@@ -3127,14 +3138,18 @@ static int path_is_root(const char *path)
     return !*path;
 }
 
-static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE **tf, char **tfname, unsigned int *blocksize, int64_t *filesize, int64_t *created_at) {
+/* When size is not negative only the blocks covering the first size bytes of
+ * the file are requested; nblocks (optional) is set to the number of blocks
+ * actually retrieved, as older servers always return all of them */
+static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE **tf, char **tfname, unsigned int *blocksize, int64_t *filesize, int64_t *created_at, int64_t size, unsigned int *nblocks) {
     const struct jparse_actions acts = {
 	JPACTS_INT32(
 		     JPACT(cb_getfile_bs, JPKEY("blockSize"))
 		     ),
 	JPACTS_INT64(
 		     JPACT(cb_getfile_size, JPKEY("fileSize")),
-		     JPACT(cb_getfile_time, JPKEY("createdAt"))
+		     JPACT(cb_getfile_time, JPKEY("createdAt")),
+		     JPACT(cb_getfile_start, JPKEY("fileDataStart"))
 		     ),
 	JPACTS_STRING(
 		      JPACT(cb_getfile_host, JPKEY("fileData"), JPANYITM, JPANYKEY, JPANYITM)
@@ -3150,6 +3165,7 @@ static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE
     struct cb_getfile_ctx yctx;
     sxc_client_t *sx = source->sx;
     unsigned int urlen;
+    int64_t expected;
     int ret = 1;
 
     memset(&yctx, 0, sizeof(yctx));
@@ -3177,6 +3193,8 @@ static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE
 	}
 	urlen += lenof("?rev=") + strlen(enc_rev);
     }
+    if(size >= 0)
+	urlen += lenof("&length=") + 20;
 
     url = malloc(urlen);
     if(!url) {
@@ -3189,6 +3207,8 @@ static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE
 	sprintf(url, "%s/%s?rev=%s", enc_vol, enc_path, enc_rev);
     else
 	sprintf(url, "%s/%s", enc_vol, enc_path);
+    if(size >= 0)
+	sprintf(url + strlen(url), "%clength=%lld", enc_rev ? '&' : '?', (long long)size);
 
     if(!(hsfname = sxi_tempfile_track(source->sx, NULL, &yctx.f))) {
 	SXDEBUG("failed to generate results file");
@@ -3205,7 +3225,11 @@ static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE
 	goto hashes_to_download_err;
     }
 
-    if(!yctx.blocksize || yctx.filesize < 0 || yctx.blocksize * yctx.nblocks < yctx.filesize || yctx.blocksize * yctx.nblocks >= yctx.filesize + yctx.blocksize) {
+    if(yctx.datastart >= 0)
+	expected = MIN(size, yctx.filesize);
+    else
+	expected = yctx.filesize;
+    if(!yctx.blocksize || yctx.filesize < 0 || yctx.datastart > 0 || yctx.blocksize * yctx.nblocks < expected || yctx.blocksize * yctx.nblocks >= expected + yctx.blocksize) {
 	SXDEBUG("bad reply from cluster");
 	sxi_seterr(sx, SXE_ECOMM, "Failed to retrieve the blocks to download: Communication error");
 	goto hashes_to_download_err;
@@ -3218,6 +3242,8 @@ static int hashes_to_download(sxc_file_t *source, sxi_hostlist_t *volnodes, FILE
     *filesize = yctx.filesize;
     if (created_at)
         *created_at = yctx.created_at;
+    if(nblocks)
+	*nblocks = yctx.nblocks;
     ret = 0;
 
 hashes_to_download_err:
@@ -3830,7 +3856,7 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
         goto remote_to_local_err;
     }
 
-    if(hashes_to_download(source, &volnodes, &hf, &hashfile, &blocksize, &filesize, &created_at)) {
+    if(hashes_to_download(source, &volnodes, &hf, &hashfile, &blocksize, &filesize, &created_at, -1, NULL)) {
         SXDEBUG("failed to retrieve hash list");
         goto remote_to_local_err;
     }
@@ -4316,7 +4342,7 @@ remote_to_local_err:
     return ret;
 }
 
-sxi_sxfs_data_t *sxi_sxfs_download_init(sxc_file_t *source)
+sxi_sxfs_data_t *sxi_sxfs_download_init(sxc_file_t *source, int64_t size)
 {
     int i = 0, ha_i = 0;
     off_t curoff = 0;
@@ -4408,12 +4434,12 @@ sxi_sxfs_data_t *sxi_sxfs_download_init(sxc_file_t *source)
         goto sxi_sxfs_download_init_err;
     }
 
-    if(hashes_to_download(source, &volnodes, &hfd, &hashfile, &sxfs->blocksize, &sxfs->filesize, NULL)) {
+    if(hashes_to_download(source, &volnodes, &hfd, &hashfile, &sxfs->blocksize, &sxfs->filesize, NULL, size, &sxfs->nhashes)) {
 	SXDEBUG("failed to retrieve hash list");
 	goto sxi_sxfs_download_init_err;
     }
 
-    sxfs->nhashes = bh->n = (sxfs->filesize + sxfs->blocksize - 1) / sxfs->blocksize;
+    bh->n = sxfs->nhashes;
     sxfs->ha = (char**)calloc(sxfs->nhashes, sizeof(char*));
     if(!sxfs->ha) {
 	SXDEBUG("failed to create hash list");
@@ -4783,7 +4809,7 @@ static sxi_job_t* remote_to_remote_fast(sxc_file_t *source, sxc_file_t *dest) {
         goto remote_to_remote_fast_err;
     }
 
-    if(hashes_to_download(source, &volhosts, &hf, &src_hashfile, &blocksize, &filesize, NULL)) {
+    if(hashes_to_download(source, &volhosts, &hf, &src_hashfile, &blocksize, &filesize, NULL, -1, NULL)) {
 	SXDEBUG("failed to retrieve hash list");
         goto remote_to_remote_fast_err;
     }
@@ -5411,7 +5437,7 @@ static int cat_remote_file(sxc_file_t *source, int dest) {
         return 1;
     }
 
-    if(hashes_to_download(source, &volnodes, &hf, &hashfile, &blocksize, &filesize, NULL)) {
+    if(hashes_to_download(source, &volnodes, &hf, &hashfile, &blocksize, &filesize, NULL, -1, NULL)) {
 	SXDEBUG("failed to retrieve hash list");
         sxi_hostlist_empty(&volnodes);
 	return 1;
@@ -67,7 +67,9 @@ typedef struct _sxi_sxfs_data_t {
     void *bh;
 } sxi_sxfs_data_t;
 
-sxi_sxfs_data_t *sxi_sxfs_download_init(sxc_file_t *source);
+/* size < 0 fetches the whole block map, otherwise only the blocks covering
+ * the first size bytes are fetched and nhashes is set accordingly */
+sxi_sxfs_data_t *sxi_sxfs_download_init(sxc_file_t *source, int64_t size);
 int sxi_sxfs_download_run(sxi_sxfs_data_t *sxfs, sxc_cluster_t *cluster, sxc_file_t *dest, off_t offset, long int size);
 void sxi_sxfs_download_finish(sxi_sxfs_data_t *sxfs);
 
@@ -701,6 +701,12 @@ void sxi_node_status_init(sxi_node_status_t *status) {
     status->processes_running = -1;
     status->processes_blocked = -1;
     status->btime = -1;
+    status->bloom_neg = -1;
+    status->bloom_fp = -1;
+    status->worker_open_usec = -1;
+    status->worker_prepared = -1;
+    status->worker_lazy = -1;
+    status->worker_maxrss = -1;
 }
 
 void sxi_node_status_empty(sxi_node_status_t *status) {
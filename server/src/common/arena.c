@@ -0,0 +1,240 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+#include "log.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+#define CHUNK_HDR ARENA_ROUND(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c) ((uint8_t *)(c) + CHUNK_HDR)
+
+struct _sx_arena_t {
+    struct arena_chunk *base; /* Kept across resets */
+    struct arena_chunk *cur; /* Where small allocations are carved from */
+    struct arena_chunk *chunks; /* All the other chunks */
+    size_t chunk_size;
+    void *last;
+    size_t last_size;
+    uint64_t used, peak;
+};
+
+static sx_arena_t *current;
+
+static struct arena_chunk *chunk_new(size_t size) {
+    struct arena_chunk *c = wrap_malloc(CHUNK_HDR + size);
+    if(!c) {
+	PWARN("Failed to allocate arena chunk of %llu bytes", (unsigned long long)size);
+	return NULL;
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+sx_arena_t *sx_arena_new(size_t chunk_size) {
+    sx_arena_t *a = wrap_calloc(1, sizeof(*a));
+
+    if(!a) {
+	PWARN("Failed to allocate arena");
+	return NULL;
+    }
+    a->chunk_size = ARENA_ROUND(chunk_size ? chunk_size : 4096);
+    if(!(a->base = chunk_new(a->chunk_size))) {
+	free(a);
+	return NULL;
+    }
+    a->cur = a->base;
+    return a;
+}
+
+static void free_chunks(sx_arena_t *a) {
+    struct arena_chunk *c = a->chunks;
+
+    while(c) {
+	struct arena_chunk *next = c->next;
+	free(c);
+	c = next;
+    }
+    a->chunks = NULL;
+}
+
+void sx_arena_free(sx_arena_t *a) {
+    if(!a)
+	return;
+    if(current == a)
+	current = NULL;
+    free_chunks(a);
+    free(a->base);
+    free(a);
+}
+
+void sx_arena_reset(sx_arena_t *a) {
+    if(!a)
+	return;
+    free_chunks(a);
+    a->base->used = 0;
+    a->cur = a->base;
+    a->last = NULL;
+    a->last_size = 0;
+    a->used = 0;
+}
+
+void sx_arena_mark(const sx_arena_t *a, sx_arena_mark_t *mark) {
+    mark->cur = a->cur;
+    mark->chunks = a->chunks;
+    mark->cur_used = a->cur->used;
+    mark->used = a->used;
+}
+
+void sx_arena_release(sx_arena_t *a, const sx_arena_mark_t *mark) {
+    /* Chunks are pushed at the head of the list: the ones allocated after
+     * the mark come first */
+    while(a->chunks && a->chunks != mark->chunks) {
+	struct arena_chunk *c = a->chunks;
+	a->chunks = c->next;
+	free(c);
+    }
+    a->cur = mark->cur;
+    a->cur->used = mark->cur_used;
+    a->last = NULL;
+    a->last_size = 0;
+    a->used = mark->used;
+}
+
+void *sx_arena_alloc(sx_arena_t *a, size_t size) {
+    struct arena_chunk *c;
+    void *ret;
+
+    if(!a)
+	return NULL;
+    size = ARENA_ROUND(size ? size : 1);
+    c = a->cur;
+    if(c->size - c->used < size) {
+	if(size > a->chunk_size / 4) {
+	    /* Large allocations get their own chunk and don't replace cur */
+	    if(!(c = chunk_new(size)))
+		return NULL;
+	    c->used = size;
+	    c->next = a->chunks;
+	    a->chunks = c;
+	    a->used += size;
+	    if(a->used > a->peak)
+		a->peak = a->used;
+	    return CHUNK_DATA(c);
+	}
+	if(!(c = chunk_new(a->chunk_size)))
+	    return NULL;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->cur = c;
+    }
+    ret = CHUNK_DATA(c) + c->used;
+    c->used += size;
+    a->last = ret;
+    a->last_size = size;
+    a->used += size;
+    if(a->used > a->peak)
+	a->peak = a->used;
+    return ret;
+}
+
+void *sx_arena_calloc(sx_arena_t *a, size_t size) {
+    void *ret = sx_arena_alloc(a, size);
+    if(ret)
+	memset(ret, 0, size);
+    return ret;
+}
+
+void *sx_arena_realloc(sx_arena_t *a, void *ptr, size_t oldsize, size_t newsize) {
+    void *ret;
+
+    if(!ptr)
+	return sx_arena_alloc(a, newsize);
+    if(newsize <= oldsize)
+	return ptr;
+    if(ptr == a->last) {
+	struct arena_chunk *c = a->cur;
+	size_t grow = ARENA_ROUND(newsize) - a->last_size;
+	if(c->size - c->used >= grow) {
+	    c->used += grow;
+	    a->last_size += grow;
+	    a->used += grow;
+	    if(a->used > a->peak)
+		a->peak = a->used;
+	    return ptr;
+	}
+    }
+    if((ret = sx_arena_alloc(a, newsize)))
+	memcpy(ret, ptr, oldsize);
+    return ret;
+}
+
+char *sx_arena_strdup(sx_arena_t *a, const char *s) {
+    size_t len;
+    char *ret;
+
+    if(!s)
+	return NULL;
+    len = strlen(s) + 1;
+    if((ret = sx_arena_alloc(a, len)))
+	memcpy(ret, s, len);
+    return ret;
+}
+
+void sx_arena_stats(const sx_arena_t *a, uint64_t *used, uint64_t *peak) {
+    if(used)
+	*used = a ? a->used : 0;
+    if(peak)
+	*peak = a ? a->peak : 0;
+}
+
+sx_arena_t *sx_arena_enter(sx_arena_t *a) {
+    sx_arena_t *prev = current;
+    current = a;
+    return prev;
+}
+
+void sx_arena_leave(sx_arena_t *prev) {
+    current = prev;
+}
+
+sx_arena_t *sx_arena_current(void) {
+    return current;
+}
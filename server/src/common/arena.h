@@ -0,0 +1,78 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "default.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump allocator for short lived objects
+ *
+ * Memory is carved out of fixed size chunks and is only given back in bulk by
+ * sx_arena_reset(), which keeps the first chunk around for reuse: objects
+ * allocated from an arena must not be freed individually.
+ * Allocations larger than a quarter of the chunk size get a chunk of their
+ * own, so the arena never wastes more than that in a single chunk. */
+
+typedef struct _sx_arena_t sx_arena_t;
+
+sx_arena_t *sx_arena_new(size_t chunk_size);
+void sx_arena_free(sx_arena_t *a);
+void sx_arena_reset(sx_arena_t *a);
+
+void *sx_arena_alloc(sx_arena_t *a, size_t size);
+void *sx_arena_calloc(sx_arena_t *a, size_t size);
+/* Grows ptr (of oldsize bytes) in place when it's the last allocation made,
+ * otherwise behaves like alloc + memcpy; the old copy is left in the arena */
+void *sx_arena_realloc(sx_arena_t *a, void *ptr, size_t oldsize, size_t newsize);
+char *sx_arena_strdup(sx_arena_t *a, const char *s);
+
+/* Allocations made after a mark can be released in bulk, without touching
+ * the ones made before it */
+typedef struct {
+    void *cur, *chunks;
+    size_t cur_used;
+    uint64_t used;
+} sx_arena_mark_t;
+void sx_arena_mark(const sx_arena_t *a, sx_arena_mark_t *mark);
+void sx_arena_release(sx_arena_t *a, const sx_arena_mark_t *mark);
+
+/* Bytes handed out since the last reset and the highest such value seen */
+void sx_arena_stats(const sx_arena_t *a, uint64_t *used, uint64_t *peak);
+
+/* Scoped allocation: while an arena is current, nodes and node lists
+ * (see nodes.h) are allocated from it and their delete functions become
+ * no-ops. Returns the previously current arena, which must be passed to
+ * sx_arena_leave(). Only suitable around code which does not retain the
+ * objects it creates beyond the scope. */
+sx_arena_t *sx_arena_enter(sx_arena_t *a);
+void sx_arena_leave(sx_arena_t *prev);
+sx_arena_t *sx_arena_current(void);
+
+#endif
@@ -0,0 +1,568 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blockidx.h"
+#include "log.h"
+
+/* On disk layout: a header page followed by nslots slots (nslots is a power
+ * of two), collisions are resolved by linear probing.
+ * A slot is in use when its blockno is non zero (block 0 is the datafile
+ * header): writers store the hash and the length first and the blockno last,
+ * readers do the opposite and re-check the blockno after comparing the hash.
+ * The length of a live block never changes, only its blockno can.
+ *
+ * The slots are followed by a counting bloom filter with 4 bit counters
+ * (8 counters per slot), split into cache line sized buckets: all the
+ * counters for a hash live in the same bucket so a negative answer costs a
+ * single cache miss instead of a walk over the slots.
+ * Counters are incremented before a slot is published and decremented after
+ * it's been deleted; saturated counters are never decremented. */
+
+#define BIDX_MAGIC "SXBIDX03"
+#define BIDX_HDRSIZE 4096
+#define BIDX_MINSLOTS 1024
+#define BIDX_EMPTY 0
+#define BIDX_DELETED UINT64_MAX
+#define BIDX_RETRY 5 /* Seconds between attempts at mapping a missing index */
+#define BIDX_REBUILD_RETRY 60 /* Seconds between attempts at rebuilding after a failure */
+#define BIDX_BLOOM_BUCKET 64 /* Bytes per bloom bucket (128 counters) */
+#define BIDX_BLOOM_K 5 /* Counters per hash */
+#define BIDX_BLOOM_MAX 15
+#define BIDX_STATS_BATCH 1024 /* Lookups counted locally before updating the header */
+
+/* Header flags */
+#define BIDX_OBSOLETE (1<<0) /* The file was replaced by a rebuilt one */
+#define BIDX_INVALID (1<<1) /* The file must be rebuilt before use */
+
+struct bidx_hdr {
+    char magic[8];
+    uint32_t flags;
+    uint32_t siglen;
+    uint64_t nslots;
+    uint64_t nused; /* Live and deleted slots */
+    uint64_t nlive;
+    int64_t gen;
+    uint8_t sig[BLOCKIDX_MAX_SIG];
+    /* Lookup stats, updated in batches by all readers: keep them off the line above */
+    uint8_t pad[BIDX_BLOOM_BUCKET];
+    uint64_t bloom_neg; /* Lookups answered by the filter alone */
+    uint64_t bloom_fp; /* Lookups which passed the filter but found nothing */
+};
+
+struct bidx_slot {
+    sx_hash_t hash;
+    uint32_t clen; /* Stored length of compressed blocks, 0 if uncompressed */
+    uint64_t blockno;
+};
+
+struct _sx_blockidx_t {
+    char *path;
+    uint8_t sig[BLOCKIDX_MAX_SIG];
+    unsigned int siglen;
+    struct bidx_hdr *hdr;
+    struct bidx_slot *slots;
+    uint8_t *bloom;
+    size_t maplen;
+    time_t lastmap;
+    time_t lastfail;
+    uint64_t bloom_neg; /* Lookup stats of this process not yet in the header */
+    uint64_t bloom_fp;
+};
+
+static inline uint64_t slot_get(const struct bidx_slot *s) {
+    return *(volatile const uint64_t *)&s->blockno;
+}
+
+static inline void slot_set(struct bidx_slot *s, uint64_t blockno) {
+    __sync_synchronize();
+    *(volatile uint64_t *)&s->blockno = blockno;
+}
+
+static inline uint32_t hdr_flags(const struct bidx_hdr *hdr) {
+    return *(volatile const uint32_t *)&hdr->flags;
+}
+
+static inline uint64_t slot_start(const sx_hash_t *hash, uint64_t mask) {
+    uint64_t ret;
+    /* The shard is picked by hashing the whole hash, the bytes are uniform */
+    memcpy(&ret, &hash->b[sizeof(hash->b) - sizeof(ret)], sizeof(ret));
+    return ret & mask;
+}
+
+static size_t bidx_len(uint64_t nslots) {
+    if(nslots > (SIZE_MAX - BIDX_HDRSIZE) / (sizeof(struct bidx_slot) + 4))
+	return 0;
+    return BIDX_HDRSIZE + nslots * (sizeof(struct bidx_slot) + 4);
+}
+
+static inline uint8_t *bloom_start(struct bidx_hdr *hdr) {
+    return (uint8_t *)hdr + BIDX_HDRSIZE + hdr->nslots * sizeof(struct bidx_slot);
+}
+
+/* Picks the bucket and fills in the counter offsets within it */
+static uint8_t *bloom_bucket(uint8_t *bloom, uint64_t nslots, const sx_hash_t *hash, unsigned int *ctrs) {
+    uint64_t nbuckets = nslots * 4 / BIDX_BLOOM_BUCKET, b, c;
+    unsigned int i;
+
+    /* The tail of the hash is used by slot_start() */
+    memcpy(&b, &hash->b[0], sizeof(b));
+    memcpy(&c, &hash->b[sizeof(b)], sizeof(c));
+    for(i = 0; i < BIDX_BLOOM_K; i++) {
+	ctrs[i] = c & (BIDX_BLOOM_BUCKET * 2 - 1);
+	c >>= 7;
+    }
+    return bloom + (b & (nbuckets - 1)) * BIDX_BLOOM_BUCKET;
+}
+
+static inline unsigned int bloom_ctr(const uint8_t *bucket, unsigned int ctr) {
+    uint8_t v = *(volatile const uint8_t *)&bucket[ctr / 2];
+    return (ctr & 1) ? v >> 4 : v & 0xf;
+}
+
+static void bloom_update(uint8_t *bloom, uint64_t nslots, const sx_hash_t *hash, int delta) {
+    unsigned int i, ctrs[BIDX_BLOOM_K];
+    uint8_t *bucket = bloom_bucket(bloom, nslots, hash, ctrs);
+
+    for(i = 0; i < BIDX_BLOOM_K; i++) {
+	unsigned int v = bloom_ctr(bucket, ctrs[i]);
+	uint8_t *p = &bucket[ctrs[i] / 2];
+	if(v == BIDX_BLOOM_MAX || (delta < 0 && !v))
+	    continue; /* Saturated (or corrupt): stuck forever */
+	v += delta;
+	if(ctrs[i] & 1)
+	    *(volatile uint8_t *)p = (*p & 0x0f) | (v << 4);
+	else
+	    *(volatile uint8_t *)p = (*p & 0xf0) | v;
+    }
+}
+
+static int bloom_maybe(const uint8_t *bloom, uint64_t nslots, const sx_hash_t *hash) {
+    unsigned int i, ctrs[BIDX_BLOOM_K];
+    const uint8_t *bucket = bloom_bucket((uint8_t *)bloom, nslots, hash, ctrs);
+
+    for(i = 0; i < BIDX_BLOOM_K; i++)
+	if(!bloom_ctr(bucket, ctrs[i]))
+	    return 0;
+    return 1;
+}
+
+sx_blockidx_t *sx_blockidx_new(const char *path, const void *sig, unsigned int siglen) {
+    sx_blockidx_t *bi;
+
+    if(!path || (siglen && !sig) || siglen > BLOCKIDX_MAX_SIG) {
+	NULLARG();
+	return NULL;
+    }
+    if(!(bi = calloc(1, sizeof(*bi))))
+	return NULL;
+    if(!(bi->path = strdup(path))) {
+	free(bi);
+	return NULL;
+    }
+    if(siglen)
+	memcpy(bi->sig, sig, siglen);
+    bi->siglen = siglen;
+    return bi;
+}
+
+/* Adds the lookup stats of this process to the shared header */
+static void bidx_flush_stats(sx_blockidx_t *bi) {
+    if(bi->hdr) {
+	if(bi->bloom_neg)
+	    __sync_fetch_and_add(&bi->hdr->bloom_neg, bi->bloom_neg);
+	if(bi->bloom_fp)
+	    __sync_fetch_and_add(&bi->hdr->bloom_fp, bi->bloom_fp);
+    }
+    bi->bloom_neg = 0;
+    bi->bloom_fp = 0;
+}
+
+static void bidx_unmap(sx_blockidx_t *bi) {
+    bidx_flush_stats(bi);
+    if(bi->hdr)
+	munmap(bi->hdr, bi->maplen);
+    bi->hdr = NULL;
+    bi->slots = NULL;
+    bi->bloom = NULL;
+    bi->maplen = 0;
+}
+
+void sx_blockidx_free(sx_blockidx_t *bi) {
+    if(!bi)
+	return;
+    bidx_unmap(bi);
+    free(bi->path);
+    free(bi);
+}
+
+static int bidx_map(sx_blockidx_t *bi) {
+    struct bidx_hdr hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    bidx_unmap(bi);
+    bi->lastmap = time(NULL);
+
+    fd = open(bi->path, O_RDWR);
+    if(fd < 0) {
+	if(errno != ENOENT)
+	    WARN("Failed to open block index %s: %s", bi->path, strerror(errno));
+	return -1;
+    }
+    if(fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+	WARN("Failed to read block index %s", bi->path);
+	close(fd);
+	return -1;
+    }
+    if(memcmp(hdr.magic, BIDX_MAGIC, sizeof(hdr.magic)) ||
+       hdr.siglen != bi->siglen || memcmp(hdr.sig, bi->sig, bi->siglen) ||
+       !hdr.nslots || (hdr.nslots & (hdr.nslots - 1)) ||
+       (hdr.flags & BIDX_OBSOLETE) ||
+       bidx_len(hdr.nslots) != st.st_size) {
+	DEBUG("Block index %s is stale", bi->path);
+	close(fd);
+	return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+	WARN("Failed to map block index %s: %s", bi->path, strerror(errno));
+	return -1;
+    }
+    bi->hdr = map;
+    bi->slots = (struct bidx_slot *)((uint8_t *)map + BIDX_HDRSIZE);
+    bi->bloom = bloom_start(bi->hdr);
+    bi->maplen = st.st_size;
+    return 0;
+}
+
+/* Make sure the current index file is mapped; returns 0 if it can be used */
+static int bidx_current(sx_blockidx_t *bi, int force) {
+    if(bi->hdr && (hdr_flags(bi->hdr) & BIDX_OBSOLETE)) {
+	bidx_unmap(bi);
+	force = 1;
+    }
+    if(!bi->hdr) {
+	if(!force && time(NULL) - bi->lastmap < BIDX_RETRY)
+	    return -1;
+	if(bidx_map(bi))
+	    return -1;
+    }
+    if(hdr_flags(bi->hdr) & BIDX_INVALID)
+	return -1;
+    return 0;
+}
+
+int sx_blockidx_get(sx_blockidx_t *bi, const sx_hash_t *hash, uint64_t *blockno, unsigned int *clen) {
+    uint64_t mask, pos, n;
+
+    if(!bi || !hash || !blockno) {
+	NULLARG();
+	return -1;
+    }
+    if(bidx_current(bi, 0))
+	return -1;
+
+    mask = bi->hdr->nslots - 1;
+    if(!bloom_maybe(bi->bloom, bi->hdr->nslots, hash)) {
+	if(++bi->bloom_neg + bi->bloom_fp >= BIDX_STATS_BATCH)
+	    bidx_flush_stats(bi);
+	return 0;
+    }
+    pos = slot_start(hash, mask);
+    for(n = 0; n <= mask; n++, pos = (pos + 1) & mask) {
+	const struct bidx_slot *s = &bi->slots[pos];
+	uint64_t b = slot_get(s);
+	if(b == BIDX_EMPTY) {
+	    if(bi->bloom_neg + ++bi->bloom_fp >= BIDX_STATS_BATCH)
+		bidx_flush_stats(bi);
+	    return 0;
+	}
+	if(b == BIDX_DELETED)
+	    continue;
+	__sync_synchronize();
+	if(memcmp(s->hash.b, hash->b, sizeof(hash->b)))
+	    continue;
+	if(clen)
+	    *clen = *(volatile const uint32_t *)&s->clen;
+	__sync_synchronize();
+	if(slot_get(s) != b)
+	    return -1; /* Being modified, let the caller ask the db */
+	*blockno = b;
+	return 1;
+    }
+    return -1;
+}
+
+int sx_blockidx_current(sx_blockidx_t *bi, int64_t gen) {
+    if(!bi) {
+	NULLARG();
+	return 0;
+    }
+    if(bidx_current(bi, 0))
+	return 0;
+    __sync_synchronize();
+    return *(volatile const int64_t *)&bi->hdr->gen == gen;
+}
+
+static int bidx_insert(struct bidx_hdr *hdr, struct bidx_slot *slots, uint8_t *bloom, const sx_hash_t *hash, uint64_t blockno, unsigned int clen) {
+    uint64_t mask = hdr->nslots - 1, pos, n;
+    struct bidx_slot *s = NULL, *reuse = NULL;
+
+    pos = slot_start(hash, mask);
+    for(n = 0; n <= mask; n++, pos = (pos + 1) & mask) {
+	uint64_t b;
+	s = &slots[pos];
+	b = slot_get(s);
+	if(b == BIDX_EMPTY)
+	    break;
+	if(b == BIDX_DELETED) {
+	    if(!reuse)
+		reuse = s;
+	    continue;
+	}
+	if(!memcmp(s->hash.b, hash->b, sizeof(hash->b))) {
+	    s->clen = clen;
+	    slot_set(s, blockno);
+	    return 0;
+	}
+    }
+    if(!reuse) {
+	if(n > mask)
+	    return -1;
+	reuse = s;
+	hdr->nused++;
+    }
+    bloom_update(bloom, hdr->nslots, hash, 1);
+    memcpy(reuse->hash.b, hash->b, sizeof(hash->b));
+    reuse->clen = clen;
+    slot_set(reuse, blockno);
+    hdr->nlive++;
+    return 0;
+}
+
+int sx_blockidx_check(sx_blockidx_t *bi, int64_t gen, unsigned int nadd) {
+    if(!bi) {
+	NULLARG();
+	return -1;
+    }
+    if(bidx_current(bi, 1))
+	return 1;
+    if(bi->hdr->gen != gen) {
+	DEBUG("Block index %s is out of sync", bi->path);
+	return 1;
+    }
+    if((bi->hdr->nused + nadd) * 4 > bi->hdr->nslots * 3) {
+	DEBUG("Block index %s is full", bi->path);
+	return 1;
+    }
+    return 0;
+}
+
+int sx_blockidx_rebuild(sx_blockidx_t *bi, int64_t gen, uint64_t nitems, sx_blockidx_scan_cb cb, void *ctx) {
+    struct bidx_hdr *hdr;
+    struct bidx_slot *slots;
+    uint8_t *bloom;
+    uint64_t nslots, blockno;
+    unsigned int clen;
+    sx_hash_t hash;
+    char *tmppath;
+    void *map;
+    size_t len;
+    int fd, r;
+
+    if(!bi || !cb) {
+	NULLARG();
+	return -1;
+    }
+    if(bi->lastfail && time(NULL) - bi->lastfail < BIDX_REBUILD_RETRY)
+	return -1;
+    bi->lastfail = time(NULL);
+
+    for(nslots = BIDX_MINSLOTS; nslots < nitems * 2 && nslots < (1ULL<<62); nslots <<= 1);
+    if(!(len = bidx_len(nslots))) {
+	WARN("Block index %s would be too big", bi->path);
+	return -1;
+    }
+    if(!(tmppath = malloc(strlen(bi->path) + sizeof(".tmp"))))
+	return -1;
+    sprintf(tmppath, "%s.tmp", bi->path);
+
+    fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) {
+	WARN("Failed to create block index %s: %s", tmppath, strerror(errno));
+	free(tmppath);
+	return -1;
+    }
+    if(ftruncate(fd, len)) {
+	WARN("Failed to resize block index %s: %s", tmppath, strerror(errno));
+	goto rebuild_err;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+	WARN("Failed to map block index %s: %s", tmppath, strerror(errno));
+	goto rebuild_err;
+    }
+
+    hdr = map;
+    slots = (struct bidx_slot *)((uint8_t *)map + BIDX_HDRSIZE);
+    hdr->nslots = nslots;
+    bloom = bloom_start(hdr);
+    while((r = cb(ctx, &hash, &blockno, &clen)) > 0) {
+	if(blockno == BIDX_EMPTY || blockno == BIDX_DELETED)
+	    continue;
+	if((hdr->nused + 1) * 4 > nslots * 3) {
+	    WARN("Block index %s overflow: more than %llu items found", bi->path, (unsigned long long)nitems);
+	    r = -1;
+	    break;
+	}
+	bidx_insert(hdr, slots, bloom, &hash, blockno, clen);
+    }
+    if(r) {
+	munmap(map, len);
+	goto rebuild_err;
+    }
+    if(bi->hdr) {
+	/* Carry the stats over */
+	bidx_flush_stats(bi);
+	hdr->bloom_neg = bi->hdr->bloom_neg;
+	hdr->bloom_fp = bi->hdr->bloom_fp;
+    }
+    hdr->gen = gen;
+    hdr->siglen = bi->siglen;
+    memcpy(hdr->sig, bi->sig, bi->siglen);
+    memcpy(hdr->magic, BIDX_MAGIC, sizeof(hdr->magic));
+    munmap(map, len);
+    close(fd);
+
+    if(rename(tmppath, bi->path)) {
+	WARN("Failed to rename block index %s: %s", tmppath, strerror(errno));
+	unlink(tmppath);
+	free(tmppath);
+	return -1;
+    }
+    free(tmppath);
+
+    /* Other processes still have the old file mapped */
+    if(bi->hdr)
+	__sync_fetch_and_or(&bi->hdr->flags, BIDX_OBSOLETE);
+    if(bidx_map(bi))
+	return -1;
+
+    bi->lastfail = 0;
+    DEBUG("Block index %s rebuilt with %llu slots", bi->path, (unsigned long long)nslots);
+    return 0;
+
+ rebuild_err:
+    close(fd);
+    unlink(tmppath);
+    free(tmppath);
+    return -1;
+}
+
+void sx_blockidx_add(sx_blockidx_t *bi, const sx_hash_t *hash, uint64_t blockno, unsigned int clen) {
+    if(!bi || !hash) {
+	NULLARG();
+	return;
+    }
+    if(!bi->hdr || (hdr_flags(bi->hdr) & BIDX_INVALID))
+	return;
+    if(blockno == BIDX_EMPTY || blockno == BIDX_DELETED ||
+       bidx_insert(bi->hdr, bi->slots, bi->bloom, hash, blockno, clen))
+	sx_blockidx_invalidate(bi);
+}
+
+void sx_blockidx_del(sx_blockidx_t *bi, const sx_hash_t *hash) {
+    uint64_t mask, pos, n;
+
+    if(!bi || !hash) {
+	NULLARG();
+	return;
+    }
+    if(!bi->hdr || (hdr_flags(bi->hdr) & BIDX_INVALID))
+	return;
+
+    mask = bi->hdr->nslots - 1;
+    pos = slot_start(hash, mask);
+    for(n = 0; n <= mask; n++, pos = (pos + 1) & mask) {
+	struct bidx_slot *s = &bi->slots[pos];
+	uint64_t b = slot_get(s);
+	if(b == BIDX_EMPTY)
+	    return;
+	if(b == BIDX_DELETED || memcmp(s->hash.b, hash->b, sizeof(hash->b)))
+	    continue;
+	slot_set(s, BIDX_DELETED);
+	__sync_synchronize();
+	bloom_update(bi->bloom, bi->hdr->nslots, hash, -1);
+	bi->hdr->nlive--;
+	return;
+    }
+}
+
+void sx_blockidx_setgen(sx_blockidx_t *bi, int64_t gen) {
+    if(!bi) {
+	NULLARG();
+	return;
+    }
+    if(bi->hdr)
+	bi->hdr->gen = gen;
+}
+
+void sx_blockidx_stats(sx_blockidx_t *bi, uint64_t *bloom_neg, uint64_t *bloom_fp) {
+    if(!bi || !bloom_neg || !bloom_fp) {
+	NULLARG();
+	return;
+    }
+    if(bidx_current(bi, 1) && !bi->hdr)
+	return;
+    *bloom_neg += *(volatile const uint64_t *)&bi->hdr->bloom_neg + bi->bloom_neg;
+    *bloom_fp += *(volatile const uint64_t *)&bi->hdr->bloom_fp + bi->bloom_fp;
+}
+
+void sx_blockidx_invalidate(sx_blockidx_t *bi) {
+    if(!bi) {
+	NULLARG();
+	return;
+    }
+    if(bi->hdr && (hdr_flags(bi->hdr) & BIDX_OBSOLETE))
+	bidx_unmap(bi);
+    if(!bi->hdr && bidx_map(bi))
+	return; /* Nothing usable on disk */
+    __sync_fetch_and_or(&bi->hdr->flags, BIDX_INVALID);
+}
@@ -0,0 +1,78 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef BLOCKIDX_H
+#define BLOCKIDX_H
+
+#include "default.h"
+#include <stdint.h>
+#include "../libsxclient/src/sxproto.h"
+
+/* Memory mapped hash -> blockno index for a single datadb shard
+ *
+ * The index is a cache of the blocks table: the SQLite db remains the source
+ * of truth. Lookups are lockless and can be performed by any process which
+ * has the file mapped; all modifications must be performed while holding the
+ * write lock on the datadb the index belongs to.
+ * Staleness is detected by comparing the generation stored in the index
+ * with the one stored in the datadb, which is bumped inside the same
+ * transaction as each modification, before any entry is touched. */
+
+#define BLOCKIDX_MAX_SIG 128
+
+typedef struct _sx_blockidx_t sx_blockidx_t;
+
+/* Returns 1 and fills in hash, blockno and clen for each row, 0 at the end,
+ * -1 on error */
+typedef int (*sx_blockidx_scan_cb)(void *ctx, sx_hash_t *hash, uint64_t *blockno, unsigned int *clen);
+
+sx_blockidx_t *sx_blockidx_new(const char *path, const void *sig, unsigned int siglen);
+void sx_blockidx_free(sx_blockidx_t *bi);
+
+/* Returns 1 if found, 0 if not found, -1 if the index cannot be used;
+ * clen (optional) is set to the stored length of compressed blocks, 0 otherwise */
+int sx_blockidx_get(sx_blockidx_t *bi, const sx_hash_t *hash, uint64_t *blockno, unsigned int *clen);
+/* Returns 1 if the index is usable and at generation gen: answers obtained
+ * after reading gen from the db and before this call can then be trusted,
+ * since the generation is bumped before any entry is modified */
+int sx_blockidx_current(sx_blockidx_t *bi, int64_t gen);
+/* Adds the number of lookups answered by the bloom filter alone and the
+ * number of false positives to bloom_neg and bloom_fp; each process publishes
+ * its own counts in batches, so the totals can lag slightly behind */
+void sx_blockidx_stats(sx_blockidx_t *bi, uint64_t *bloom_neg, uint64_t *bloom_fp);
+
+/* The following require the datadb write lock */
+
+/* Returns 0 if the index matches gen and has room for nadd more items */
+int sx_blockidx_check(sx_blockidx_t *bi, int64_t gen, unsigned int nadd);
+int sx_blockidx_rebuild(sx_blockidx_t *bi, int64_t gen, uint64_t nitems, sx_blockidx_scan_cb cb, void *ctx);
+void sx_blockidx_add(sx_blockidx_t *bi, const sx_hash_t *hash, uint64_t blockno, unsigned int clen);
+void sx_blockidx_del(sx_blockidx_t *bi, const sx_hash_t *hash);
+void sx_blockidx_setgen(sx_blockidx_t *bi, int64_t gen);
+void sx_blockidx_invalidate(sx_blockidx_t *bi);
+
+#endif
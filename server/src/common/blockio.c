@@ -0,0 +1,362 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "blockio.h"
+#include "log.h"
+#include "utils.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+
+struct blockio_req {
+    struct iovec *iov;
+    unsigned int iovcnt;
+    uint64_t off;
+    size_t len;
+    int fd;
+    int write;
+};
+
+struct _sx_blockio_t {
+    int ringfd;
+    unsigned int depth, maxiov;
+    unsigned int queued, inflight, nfree;
+    void *sqmap, *cqmap;
+    size_t sqmaplen, cqmaplen;
+    struct io_uring_sqe *sqes;
+    size_t sqeslen;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct blockio_req *reqs;
+    unsigned int *freereqs;
+    int err;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+sx_blockio_t *sx_blockio_new(unsigned int depth, unsigned int maxiov) {
+    struct io_uring_params p;
+    sx_blockio_t *io;
+    struct iovec *iovs;
+    unsigned int i;
+
+    if(!depth || !maxiov)
+	return NULL;
+    if(!(io = wrap_calloc(1, sizeof(*io))))
+	return NULL;
+    io->ringfd = -1;
+    io->sqmap = io->cqmap = MAP_FAILED;
+    io->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    io->ringfd = uring_setup(depth, &p);
+    if(io->ringfd < 0) {
+	DEBUG("io_uring setup failed: %s", strerror(errno));
+	goto blockio_fail;
+    }
+    /* The kernel rounds the number of entries up */
+    io->depth = p.sq_entries < p.cq_entries ? p.sq_entries : p.cq_entries;
+    io->maxiov = maxiov;
+
+    io->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    io->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && io->cqmaplen > io->sqmaplen)
+	io->sqmaplen = io->cqmaplen;
+    io->sqmap = mmap(NULL, io->sqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_SQ_RING);
+    if(io->sqmap == MAP_FAILED) {
+	PWARN("Failed to map the io_uring submission queue");
+	goto blockio_fail;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+	io->cqmap = io->sqmap;
+    else {
+	io->cqmap = mmap(NULL, io->cqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_CQ_RING);
+	if(io->cqmap == MAP_FAILED) {
+	    PWARN("Failed to map the io_uring completion queue");
+	    goto blockio_fail;
+	}
+    }
+    io->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_SQES);
+    if(io->sqes == MAP_FAILED) {
+	PWARN("Failed to map the io_uring submission entries");
+	goto blockio_fail;
+    }
+
+    io->sq_head = (unsigned int *)((uint8_t *)io->sqmap + p.sq_off.head);
+    io->sq_tail = (unsigned int *)((uint8_t *)io->sqmap + p.sq_off.tail);
+    io->sq_mask = (unsigned int *)((uint8_t *)io->sqmap + p.sq_off.ring_mask);
+    io->sq_array = (unsigned int *)((uint8_t *)io->sqmap + p.sq_off.array);
+    io->cq_head = (unsigned int *)((uint8_t *)io->cqmap + p.cq_off.head);
+    io->cq_tail = (unsigned int *)((uint8_t *)io->cqmap + p.cq_off.tail);
+    io->cq_mask = (unsigned int *)((uint8_t *)io->cqmap + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)((uint8_t *)io->cqmap + p.cq_off.cqes);
+
+    /* One request per queue slot, each with room for maxiov buffers */
+    io->reqs = wrap_calloc(io->depth, sizeof(*io->reqs));
+    io->freereqs = wrap_malloc(io->depth * sizeof(*io->freereqs));
+    iovs = wrap_malloc(io->depth * maxiov * sizeof(*iovs));
+    if(!io->reqs || !io->freereqs || !iovs) {
+	free(iovs);
+	goto blockio_fail;
+    }
+    for(i=0; i<io->depth; i++) {
+	io->reqs[i].iov = iovs + i * maxiov;
+	io->freereqs[i] = io->depth - i - 1;
+    }
+    io->nfree = io->depth;
+    return io;
+
+ blockio_fail:
+    sx_blockio_free(io);
+    return NULL;
+}
+
+void sx_blockio_free(sx_blockio_t *io) {
+    if(!io)
+	return;
+    if(io->sqes != MAP_FAILED)
+	munmap(io->sqes, io->sqeslen);
+    if(io->cqmap != MAP_FAILED && io->cqmap != io->sqmap)
+	munmap(io->cqmap, io->cqmaplen);
+    if(io->sqmap != MAP_FAILED)
+	munmap(io->sqmap, io->sqmaplen);
+    if(io->ringfd >= 0)
+	close(io->ringfd);
+    if(io->reqs)
+	free(io->reqs[0].iov);
+    free(io->reqs);
+    free(io->freereqs);
+    free(io);
+}
+
+/* Finishes a short transfer synchronously */
+static int blockio_finish(struct blockio_req *req, size_t done) {
+    unsigned int i = 0;
+    uint64_t off = req->off + done;
+
+    while(i < req->iovcnt && done >= req->iov[i].iov_len)
+	done -= req->iov[i++].iov_len;
+    for(; i < req->iovcnt; i++, done = 0) {
+	uint8_t *buf = (uint8_t *)req->iov[i].iov_base + done;
+	size_t len = req->iov[i].iov_len - done;
+
+	while(len) {
+	    ssize_t l = req->write ? pwrite(req->fd, buf, len, off) : pread(req->fd, buf, len, off);
+	    if(l < 0) {
+		if(errno == EINTR)
+		    continue;
+		return errno;
+	    }
+	    if(!l)
+		return EIO; /* Incomplete block read */
+	    buf += l;
+	    len -= l;
+	    off += l;
+	}
+    }
+    return 0;
+}
+
+static void blockio_reap(sx_blockio_t *io) {
+    unsigned int head = *io->cq_head;
+
+    while(head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+	struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+	struct blockio_req *req = &io->reqs[cqe->user_data];
+	int err = 0;
+
+	if(cqe->res < 0)
+	    err = -cqe->res;
+	else if((size_t)cqe->res < req->len)
+	    err = blockio_finish(req, cqe->res);
+#ifdef HAVE_POSIX_FADVISE
+	/* See write_block() in hashfs.c */
+	if(!err && req->write && posix_fadvise(req->fd, req->off, req->len, POSIX_FADV_DONTNEED))
+	    PWARN("fadvise failed");
+#endif
+	if(err && !io->err)
+	    io->err = err;
+	io->freereqs[io->nfree++] = cqe->user_data;
+	io->inflight--;
+	head++;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submits all the queued requests and waits until at least min_complete of
+ * those in flight are done */
+static int blockio_enter(sx_blockio_t *io, unsigned int min_complete) {
+    while(io->queued || min_complete) {
+	int r = uring_enter(io->ringfd, io->queued, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+	if(r < 0) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno == EAGAIN || errno == EBUSY) {
+		/* Out of kernel resources: make room and retry */
+		if(io->inflight == io->queued)
+		    return -1;
+		r = uring_enter(io->ringfd, 0, 1, IORING_ENTER_GETEVENTS);
+		if(r < 0 && errno != EINTR)
+		    return -1;
+		blockio_reap(io);
+		continue;
+	    }
+	    return -1;
+	}
+	io->queued -= r;
+	if(!io->queued) {
+	    blockio_reap(io);
+	    break;
+	}
+    }
+    return 0;
+}
+
+static int blockio_queue(sx_blockio_t *io, int write, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off) {
+    struct io_uring_sqe *sqe;
+    struct blockio_req *req;
+    unsigned int slot, tail, i;
+
+    if(!io || !iov || !iovcnt || iovcnt > io->maxiov) {
+	NULLARG();
+	return -1;
+    }
+    while(!io->nfree) {
+	if(blockio_enter(io, 1)) {
+	    msg_set_errno_reason("Failed to submit block I/O");
+	    return -1;
+	}
+	blockio_reap(io);
+    }
+
+    slot = io->freereqs[--io->nfree];
+    req = &io->reqs[slot];
+    req->fd = fd;
+    req->write = write;
+    req->off = off;
+    req->iovcnt = iovcnt;
+    req->len = 0;
+    for(i=0; i<iovcnt; i++) {
+	req->iov[i] = iov[i];
+	req->len += iov[i].iov_len;
+    }
+
+    tail = *io->sq_tail;
+    sqe = &io->sqes[tail & *io->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)req->iov;
+    sqe->len = iovcnt;
+    sqe->off = off;
+    sqe->user_data = slot;
+    io->sq_array[tail & *io->sq_mask] = tail & *io->sq_mask;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->queued++;
+    io->inflight++;
+
+    /* Keep the device busy while the caller prepares the next request */
+    if(blockio_enter(io, 0)) {
+	msg_set_errno_reason("Failed to submit block I/O");
+	return -1;
+    }
+    return 0;
+}
+
+int sx_blockio_wait(sx_blockio_t *io) {
+    int err;
+
+    if(!io) {
+	NULLARG();
+	return -1;
+    }
+    while(io->inflight) {
+	if(blockio_enter(io, io->inflight - io->queued)) {
+	    /* The buffers cannot be released before the kernel is done */
+	    CRIT("Failed to wait for block I/O: %s", strerror(errno));
+	    abort();
+	}
+	blockio_reap(io);
+    }
+    err = io->err;
+    io->err = 0;
+    if(err) {
+	errno = err;
+	msg_set_errno_reason("Block I/O failed");
+	return -1;
+    }
+    return 0;
+}
+
+#else
+
+sx_blockio_t *sx_blockio_new(unsigned int depth, unsigned int maxiov) {
+    return NULL;
+}
+
+void sx_blockio_free(sx_blockio_t *io) {
+}
+
+static int blockio_queue(sx_blockio_t *io, int write, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off) {
+    NULLARG();
+    return -1;
+}
+
+int sx_blockio_wait(sx_blockio_t *io) {
+    NULLARG();
+    return -1;
+}
+
+#endif
+
+int sx_blockio_readv(sx_blockio_t *io, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off) {
+    return blockio_queue(io, 0, fd, iov, iovcnt, off);
+}
+
+int sx_blockio_writev(sx_blockio_t *io, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off) {
+    return blockio_queue(io, 1, fd, iov, iovcnt, off);
+}
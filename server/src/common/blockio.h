@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include "default.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Batched block I/O on the datafiles through io_uring
+ *
+ * Vectored reads and writes are queued to the kernel as they are added and
+ * are only guaranteed to be complete after sx_blockio_wait(); the buffers
+ * must stay valid until then, the iovec arrays are copied.
+ * sx_blockio_new() returns NULL if io_uring is not available (not built in,
+ * not supported by the kernel or denied), in which case callers perform the
+ * I/O synchronously. */
+
+typedef struct _sx_blockio_t sx_blockio_t;
+
+/* depth is the maximum number of requests in flight, maxiov the maximum
+ * number of buffers in a single request */
+sx_blockio_t *sx_blockio_new(unsigned int depth, unsigned int maxiov);
+void sx_blockio_free(sx_blockio_t *io);
+
+/* Return 0 if the request was queued */
+int sx_blockio_readv(sx_blockio_t *io, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off);
+int sx_blockio_writev(sx_blockio_t *io, int fd, const struct iovec *iov, unsigned int iovcnt, uint64_t off);
+
+/* Waits for all the queued requests, returns 0 if all of them succeeded */
+int sx_blockio_wait(sx_blockio_t *io);
+
+#endif
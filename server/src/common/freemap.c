@@ -0,0 +1,135 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "freemap.h"
+#include "log.h"
+#include "utils.h"
+
+struct freemap_ext {
+    int64_t start;
+    int64_t len;
+};
+
+struct _sx_freemap_t {
+    struct freemap_ext *ext;
+    unsigned int next, nalloc;
+    int64_t nfree;
+};
+
+sx_freemap_t *sx_freemap_new(void) {
+    return wrap_calloc(1, sizeof(sx_freemap_t));
+}
+
+void sx_freemap_free(sx_freemap_t *fm) {
+    if(!fm)
+	return;
+    free(fm->ext);
+    free(fm);
+}
+
+void sx_freemap_clear(sx_freemap_t *fm) {
+    if(!fm)
+	return;
+    fm->next = 0;
+    fm->nfree = 0;
+}
+
+int sx_freemap_add(sx_freemap_t *fm, int64_t blockno) {
+    struct freemap_ext *last;
+
+    if(!fm) {
+	NULLARG();
+	return -1;
+    }
+
+    last = fm->next ? &fm->ext[fm->next - 1] : NULL;
+    if(last && blockno < last->start + last->len) {
+	WARN("Slot %lld added out of order", (long long)blockno);
+	return -1;
+    }
+    if(last && blockno == last->start + last->len) {
+	last->len++;
+    } else {
+	if(fm->next == fm->nalloc) {
+	    unsigned int nalloc = fm->nalloc ? fm->nalloc * 2 : 64;
+	    struct freemap_ext *ext = wrap_realloc(fm->ext, nalloc * sizeof(*ext));
+	    if(!ext)
+		return -1;
+	    fm->ext = ext;
+	    fm->nalloc = nalloc;
+	}
+	fm->ext[fm->next].start = blockno;
+	fm->ext[fm->next].len = 1;
+	fm->next++;
+    }
+    fm->nfree++;
+    return 0;
+}
+
+int64_t sx_freemap_get(sx_freemap_t *fm, int64_t want, int64_t *start) {
+    unsigned int i, pick = 0;
+    struct freemap_ext *e;
+    int64_t got;
+
+    if(!fm || !start) {
+	NULLARG();
+	return 0;
+    }
+    if(!fm->next || want <= 0)
+	return 0;
+
+    /* First fit, falling back to the largest extent */
+    for(i = 0; i < fm->next; i++) {
+	if(fm->ext[i].len >= want)
+	    break;
+	if(fm->ext[i].len > fm->ext[pick].len)
+	    pick = i;
+    }
+    if(i < fm->next)
+	pick = i;
+
+    e = &fm->ext[pick];
+    got = want < e->len ? want : e->len;
+    *start = e->start;
+    e->start += got;
+    e->len -= got;
+    if(!e->len) {
+	fm->next--;
+	memmove(e, e + 1, (fm->next - pick) * sizeof(*e));
+    }
+    fm->nfree -= got;
+    return got;
+}
+
+int64_t sx_freemap_count(const sx_freemap_t *fm) {
+    return fm ? fm->nfree : 0;
+}
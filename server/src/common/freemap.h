@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include "default.h"
+#include <stdint.h>
+
+/* In memory map of the free slots of a datafile, kept as a sorted array of
+ * extents so that runs of adjacent slots can be handed out at once.
+ * The map is a cache of the avail table and doesn't do any locking: see
+ * hashfs.c for how it's kept in sync. */
+
+typedef struct _sx_freemap_t sx_freemap_t;
+
+sx_freemap_t *sx_freemap_new(void);
+void sx_freemap_free(sx_freemap_t *fm);
+void sx_freemap_clear(sx_freemap_t *fm);
+
+/* Marks a slot as free; slots must be added in ascending order.
+ * Returns 0 on success, -1 on error */
+int sx_freemap_add(sx_freemap_t *fm, int64_t blockno);
+
+/* Takes a run of up to want adjacent free slots: a hole large enough for the
+ * whole request is preferred, otherwise the largest hole is used.
+ * Returns the length of the run (0 if no slot is free) and sets start */
+int64_t sx_freemap_get(sx_freemap_t *fm, int64_t want, int64_t *start);
+
+/* Returns the number of free slots */
+int64_t sx_freemap_count(const sx_freemap_t *fm);
+
+#endif
@@ -28,6 +28,8 @@
 #include "default.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -37,6 +39,11 @@
 #include <errno.h>
 #include <fnmatch.h>
 #include <ctype.h>
+#include <zlib.h>
+#ifdef HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+#endif
 
 #include "vfs_unix_waitsem.h"
 #include "sxdbi.h"
@@ -48,6 +55,10 @@
 
 #include "sx.h"
 #include "qsort.h"
+#include "blockidx.h"
+#include "freemap.h"
+#include "blockio.h"
+#include "sha1batch.h"
 #include "utils.h"
 #include "blob.h"
 #include "../libsxclient/src/vcrypto.h"
@@ -60,8 +71,8 @@
 #define fdatasync fsync
 #endif
 
-#define HASHDBS 16
-#define METADBS 16
+#define HASHDBS_MAX SX_DB_SHARDS_MAX
+#define METADBS_MAX SX_DB_SHARDS_MAX
 #define GCDBS 1
 
 
@@ -89,10 +100,17 @@
 #define HASHFS_VERSION_CURRENT MAKE_HASHFS_VER(SRC_MAJOR_VERSION, SRC_MINOR_VERSION)
 #endif
 
-#define SIZES 3
-const char sizedirs[SIZES] = "sml";
-const char *sizelongnames[SIZES] = { "small", "medium", "large" };
-const unsigned int bsz[SIZES] = {SX_BS_SMALL, SX_BS_MEDIUM, SX_BS_LARGE};
+/* Block size classes, ordered by block size
+ * The 64k and 256k classes were introduced later: see size_to_blocks() */
+#define SIZES 5
+#define SIZE_MEDIUM 1
+#define SIZE_LARGEST (SIZES-1)
+const char sizedirs[SIZES] = "smxyl";
+const char *sizelongnames[SIZES] = { "small", "medium", "64k", "256k", "large" };
+const unsigned int bsz[SIZES] = {SX_BS_SMALL, SX_BS_MEDIUM, SX_BS_64K, SX_BS_256K, SX_BS_LARGE};
+
+/* Number of hashes per row of file_chunks: see file_is_chunked() */
+#define FILE_CHUNK_BLOCKS 1024
 
 #define HDIST_SEED 0x1337
 #define MURMUR_SEED 0xacab
@@ -257,11 +275,166 @@ static int read_block(int fd, uint8_t *dt, uint64_t off, unsigned int buf_len) {
     return 0;
 }
 
+/* Reads a run of adjacent blocks at off into the buffers described by iov */
+static int read_blocks(int fd, struct iovec *iov, int iovcnt, uint64_t off) {
+#ifdef HAVE_PREADV
+    while(iovcnt) {
+	ssize_t l = preadv(fd, iov, iovcnt, off);
+	if(l<0) {
+	    if(errno == EINTR)
+		continue;
+	    msg_set_errno_reason("Failed to read blocks");
+	    return 1;
+	}
+	if(!l) {
+	    msg_set_reason("Incomplete block read");
+	    return 1;
+	}
+	off += l;
+	/* Skip what was fully read, then trim any partially filled buffer */
+	while(iovcnt && (size_t)l >= iov->iov_len) {
+	    l -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if(l) {
+	    iov->iov_base = (uint8_t *)iov->iov_base + l;
+	    iov->iov_len -= l;
+	}
+    }
+#else
+    for(; iovcnt; iov++, iovcnt--) {
+	if(read_block(fd, iov->iov_base, off, iov->iov_len))
+	    return 1;
+	off += iov->iov_len;
+    }
+#endif
+    return 0;
+}
+
+static int write_blocks(int fd, struct iovec *iov, int iovcnt, uint64_t off) {
+#ifdef HAVE_PWRITEV
+    uint64_t orig_off = off;
+    while(iovcnt) {
+	ssize_t l = pwritev(fd, iov, iovcnt, off);
+	if(l<0) {
+	    if(errno == EINTR)
+		continue;
+	    msg_set_errno_reason("Failed to write blocks");
+	    return 1;
+	}
+	off += l;
+	while(iovcnt && (size_t)l >= iov->iov_len) {
+	    l -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if(l) {
+	    iov->iov_base = (uint8_t *)iov->iov_base + l;
+	    iov->iov_len -= l;
+	}
+    }
+    /* See write_block() */
+#ifdef HAVE_POSIX_FADVISE
+    if (posix_fadvise(fd, orig_off, off - orig_off, POSIX_FADV_DONTNEED))
+        PWARN("fadvise failed");
+#endif
+#else
+    for(; iovcnt; iov++, iovcnt--) {
+	if(write_block(fd, iov->iov_base, off, iov->iov_len))
+	    return 1;
+	off += iov->iov_len;
+    }
+#endif
+    return 0;
+}
+
+/* Compressed blocks are stored at the start of their slot and the rest of the
+ * slot is handed back to the filesystem, so compression only pays off when
+ * at least one filesystem page is saved */
+#define BLOCK_COMPRESS_PAGE 4096
+
+/* Compresses a block of size bs into dst (bs - BLOCK_COMPRESS_PAGE bytes):
+ * returns the compressed length or 0 if the block is not worth compressing */
+static unsigned int block_compress(const uint8_t *src, unsigned int bs, uint8_t *dst) {
+    uLongf dlen;
+
+    if(bs <= BLOCK_COMPRESS_PAGE)
+	return 0;
+    dlen = bs - BLOCK_COMPRESS_PAGE;
+    if(compress2(dst, &dlen, src, bs, Z_BEST_SPEED) != Z_OK)
+	return 0;
+    return dlen;
+}
+
+static int block_uncompress(const uint8_t *src, unsigned int clen, uint8_t *dst, unsigned int bs) {
+    uLongf dlen = bs;
+
+    if(uncompress(dst, &dlen, src, clen) != Z_OK || dlen != bs) {
+	msg_set_reason("Corrupt compressed block");
+	return 1;
+    }
+    return 0;
+}
+
+/* Releases the part of the slot at off not used by a block of length clen */
+static void punch_slot(int fd, uint64_t off, unsigned int bs, unsigned int clen) {
+#if defined(HAVE_LINUX_FALLOC_H) && defined(FALLOC_FL_PUNCH_HOLE) && defined(SYS_fallocate)
+    unsigned int keep = (clen + BLOCK_COMPRESS_PAGE - 1) & ~(BLOCK_COMPRESS_PAGE - 1);
+
+    if(keep < bs && syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(off + keep), (off_t)(bs - keep)) && errno != EOPNOTSUPP)
+	PWARN("Failed to release unused datafile space");
+#endif
+}
+
+/* Datafiles always extend to the end of the last slot, even when its tail
+ * is a hole, so that whole slots can be read back anywhere */
+static int cover_slot(int fd, uint64_t end) {
+    struct stat st;
+
+    if(fstat(fd, &st)) {
+	msg_set_errno_reason("Failed to stat datafile");
+	return 1;
+    }
+    if(st.st_size < (off_t)end && ftruncate(fd, end)) {
+	msg_set_errno_reason("Failed to extend datafile");
+	return 1;
+    }
+    return 0;
+}
+
+/* Reads the block in the slot at off into dt (bs bytes), uncompressing it if
+ * clen is not 0; tmp must hold clen bytes */
+static int read_slot(int fd, uint8_t *dt, uint64_t off, unsigned int bs, unsigned int clen, uint8_t *tmp) {
+    if(!clen)
+	return read_block(fd, dt, off, bs);
+    if(read_block(fd, tmp, off, clen))
+	return 1;
+    return block_uncompress(tmp, clen, dt, bs);
+}
+
+/* Copies the content of a slot as stored, preserving any holes */
+static int copy_slot(int fromfd, uint64_t fromoff, int tofd, uint64_t tooff, unsigned int bs, unsigned int clen, uint8_t *buf) {
+    unsigned int len = clen ? clen : bs;
+
+    if(read_block(fromfd, buf, fromoff, len) ||
+       write_block(tofd, buf, tooff, len))
+	return 1;
+    if(!clen)
+	return 0;
+    punch_slot(tofd, tooff, bs, clen);
+    return cover_slot(tofd, tooff + bs);
+}
+
 int sx_hashfs_hash_buf(const void *salt, unsigned int salt_len, const void *buf, unsigned int buf_len, sx_hash_t *hash) {
     return sxi_sha1_calc(salt, salt_len, buf, buf_len, hash->b);
 }
 #define hash_buf sx_hashfs_hash_buf
 
+int sx_hashfs_hash_bufs(const void *salt, unsigned int salt_len, const uint8_t *data, unsigned int nbufs, unsigned int buf_len, sx_hash_t *hashes) {
+    return sx_sha1batch(salt, salt_len, data, nbufs, buf_len, hashes);
+}
+
 static sxi_db_t *create_db(const char *path, const char *dbtype, const sx_uuid_t *cluster, const char *hashfsver, sqlite3_stmt **insq) {
     sqlite3 *dbh = NULL;
     sxi_db_t *db;
@@ -323,11 +496,124 @@ static sxi_db_t *create_db(const char *path, const char *dbtype, const sx_uuid_t
     return NULL;
 }
 
+/* Creates a database with the same schema as src */
+static sxi_db_t *create_db_like(sxi_db_t *src, const char *path, const char *dbtype, const sx_uuid_t *cluster, const char *hashfsver, sqlite3_stmt **insq) {
+    sqlite3_stmt *qsel = NULL, *q = NULL;
+    sxi_db_t *db;
+    int r;
+
+    if(!(db = create_db(path, dbtype, cluster, hashfsver, insq)))
+	return NULL;
+    if(qprep(src, &qsel, "SELECT sql FROM sqlite_master WHERE type IN ('table', 'index') AND sql IS NOT NULL AND name <> 'hashfs' ORDER BY type = 'index'"))
+	goto createlike_fail;
+    while((r = qstep(qsel)) == SQLITE_ROW) {
+	if(qprep(db, &q, (const char *)sqlite3_column_text(qsel, 0)) || qstep_noret(q))
+	    goto createlike_fail;
+	qnullify(q);
+    }
+    if(r != SQLITE_DONE)
+	goto createlike_fail;
+    qnullify(qsel);
+    return db;
+
+ createlike_fail:
+    WARN("Cannot create %s database %s", dbtype, path);
+    sqlite3_finalize(qsel);
+    sqlite3_finalize(q);
+    if(insq)
+	qnullify(*insq);
+    qclose(&db);
+    return NULL;
+}
+
 
 static int qlog_set = 0;
 
-static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size) {
-    unsigned int dirlen, i, j;
+int sx_storage_valid_shards(unsigned int shards) {
+    return shards == 16 || shards == 64 || shards == 256;
+}
+
+/* Reads the number of metadata and block databases, storage created before
+ * the count became configurable has SX_DB_SHARDS_DEFAULT of each */
+static int get_shard_counts(sqlite3_stmt *qgetval, unsigned int *metadbs, unsigned int *hashdbs) {
+    const char *keys[] = { "metadbs", "hashdbs" };
+    unsigned int *counts[] = { metadbs, hashdbs }, i;
+    int r;
+
+    for(i=0; i<sizeof(keys)/sizeof(keys[0]); i++) {
+	sqlite3_reset(qgetval);
+	if(qbind_text(qgetval, ":k", keys[i]))
+	    return -1;
+	r = qstep(qgetval);
+	if(r == SQLITE_ROW)
+	    *counts[i] = sqlite3_column_int(qgetval, 0);
+	else if(r == SQLITE_DONE)
+	    *counts[i] = SX_DB_SHARDS_DEFAULT;
+	sqlite3_reset(qgetval);
+	if(r != SQLITE_ROW && r != SQLITE_DONE)
+	    return -1;
+	if(!sx_storage_valid_shards(*counts[i])) {
+	    CRIT("Invalid number of %s: %u", keys[i], *counts[i]);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Parses a datafile layout of the form "CLASS:DIR[,CLASS:DIR]...", where
+ * CLASS is the name of a block size class, into the absolute directories the
+ * datafiles of each class are placed in (NULL for the storage directory) */
+static int parse_layout(const char *layout, char **datadirs) {
+    const char *item, *sep, *end;
+    char *dir = NULL;
+    unsigned int hs;
+
+    memset(datadirs, 0, SIZES * sizeof(*datadirs));
+    for(item = layout; item && *item; item = *end ? end + 1 : end) {
+	end = strchr(item, ',');
+	if(!end)
+	    end = item + strlen(item);
+	sep = memchr(item, ':', end - item);
+	if(!sep || sep == item || sep + 1 == end) {
+	    CRIT("Invalid datafile layout item '%.*s': must be CLASS:DIR", (int)(end - item), item);
+	    goto parse_layout_fail;
+	}
+	for(hs = 0; hs < SIZES; hs++)
+	    if(strlen(sizelongnames[hs]) == (size_t)(sep - item) && !strncmp(item, sizelongnames[hs], sep - item))
+		break;
+	if(hs == SIZES) {
+	    CRIT("Unknown block size class '%.*s' in datafile layout", (int)(sep - item), item);
+	    goto parse_layout_fail;
+	}
+	if(datadirs[hs]) {
+	    CRIT("Block size class %s is listed twice in datafile layout", sizelongnames[hs]);
+	    goto parse_layout_fail;
+	}
+	if(!(dir = wrap_malloc(end - sep)))
+	    goto parse_layout_fail;
+	memcpy(dir, sep + 1, end - sep - 1);
+	dir[end - sep - 1] = '\0';
+	if(!(datadirs[hs] = realpath(dir, NULL)) || access(datadirs[hs], R_OK | W_OK | X_OK)) {
+	    PCRIT("Cannot access datafile directory %s", dir);
+	    goto parse_layout_fail;
+	}
+	free(dir);
+	dir = NULL;
+    }
+    return 0;
+
+ parse_layout_fail:
+    free(dir);
+    for(hs = 0; hs < SIZES; hs++) {
+	free(datadirs[hs]);
+	datadirs[hs] = NULL;
+    }
+    return -1;
+}
+
+static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size, unsigned int shards, const char *layout) {
+    unsigned int dirlen, i, j, nextern[SIZES];
+    char *datadirs[SIZES];
     sxi_db_t *db = NULL;
     sqlite3_stmt *q = NULL;
     char *path, dbitem[64];
@@ -342,12 +628,24 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
     if(ssl_version_check())
 	return FAIL_EINIT;
 
+    if(!sx_storage_valid_shards(shards)) {
+	CRIT("Invalid number of shards %u", shards);
+	return EINVAL;
+    }
+
     if(access(dir, R_OK | W_OK | X_OK)) {
 	PCRIT("Cannot access storage directory %s", dir);
 	return FAIL_EINIT;
     }
 
-    if(!(path = wrap_malloc(dirlen + bsz[SIZES-1])))
+    memset(nextern, 0, sizeof(nextern));
+    if(parse_layout(layout, datadirs))
+	return EINVAL;
+    for(j = 0; j < SIZES; j++)
+	if(datadirs[j] && strlen(datadirs[j]) > dirlen)
+	    dirlen = strlen(datadirs[j]);
+
+    if(!(path = wrap_malloc(dirlen + bsz[SIZE_LARGEST])))
 	goto create_hashfs_fail;
 
     /* --- HASHFS db --- */
@@ -362,9 +660,15 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
     sqlite3_reset(q);
     if(qbind_text(q, ":k", "current_dist") || qbind_blob(q, ":v", "", 0) || qstep_noret(q))
 	goto create_hashfs_fail;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":k", "metadbs") || qbind_int(q, ":v", shards) || qstep_noret(q))
+	goto create_hashfs_fail;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":k", "hashdbs") || qbind_int(q, ":v", shards) || qstep_noret(q))
+	goto create_hashfs_fail;
 
     /* Set the path to the file dbs */
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<shards; i++) {
 	sprintf(dbitem, "metadb_%08x", i);
 	sprintf(path, "f%08x.db", i);
 	sqlite3_reset(q);
@@ -374,7 +678,13 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
 
     /* Set the path to the block dbs */
     for(j = 0; j < SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	if(datadirs[j]) {
+	    sprintf(dbitem, "datadir_%c", sizedirs[j]);
+	    sqlite3_reset(q);
+	    if(qbind_text(q, ":k", dbitem) || qbind_text(q, ":v", datadirs[j]) || qstep_noret(q))
+		goto create_hashfs_fail;
+	}
+	for(i=0; i<shards; i++) {
 	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
 	    sprintf(path, "h%c%08x.db", sizedirs[j], i);
 	    sqlite3_reset(q);
@@ -382,7 +692,10 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
 		goto create_hashfs_fail;
 
 	    sprintf(dbitem, "datafile_%c_%08x", sizedirs[j], i);
-	    sprintf(path, "h%c%08x.bin", sizedirs[j], i);
+	    if(datadirs[j])
+		sprintf(path, "%s/h%c%08x.bin", datadirs[j], sizedirs[j], i);
+	    else
+		sprintf(path, "h%c%08x.bin", sizedirs[j], i);
 	    sqlite3_reset(q);
 	    if(qbind_text(q, ":k", dbitem) || qbind_text(q, ":v", path) || qstep_noret(q))
 		goto create_hashfs_fail;
@@ -456,7 +769,7 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
     qclose(&db);
 
     /* --- META dbs --- */
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<shards; i++) {
 	sprintf(path, "%s/f%08x.db", dir, i);
 	sprintf(dbitem, "metadb_%08x", i);
 	if(!(db = create_db(path, dbitem, cluster, HASHFS_VERSION_INITIAL, NULL)))
@@ -478,7 +791,7 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
 
     /* --- HASH dbs --- */
     for(j = 0; j < SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<shards; i++) {
 	    int fd;
 
 	    sprintf(path, "%s/h%c%08x.db", dir, sizedirs[j], i);
@@ -497,6 +810,7 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
                 id INTEGER PRIMARY KEY NOT NULL,\
                 hash BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
                 blockno INTEGER NOT NULL,\
+                clen INTEGER,\
                 created_at INTEGER NOT NULL,\
                 UNIQUE(hash))") || qstep_noret(q))
 		goto create_hashfs_fail;
@@ -512,9 +826,16 @@ static rc_ty create_initial_storage(const char *dir, sx_uuid_t *cluster, uint8_t
 
 	    qclose(&db);
 
-	    /* Create DATA files */
-	    sprintf(path, "%s/h%c%08x.bin", dir, sizedirs[j], i);
-	    fd = creat(path, 0666);
+	    /* Create DATA files: never overwrite those found in a shared dir */
+	    if(datadirs[j]) {
+		sprintf(path, "%s/h%c%08x.bin", datadirs[j], sizedirs[j], i);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if(fd >= 0)
+		    nextern[j]++;
+	    } else {
+		sprintf(path, "%s/h%c%08x.bin", dir, sizedirs[j], i);
+		fd = creat(path, 0666);
+	    }
 	    if(fd < 0) {
 		PCRIT("Cannot create data file %s", path);
 		goto create_hashfs_fail;
@@ -599,6 +920,13 @@ create_hashfs_fail:
     sqlite3_finalize(q);
     if(db)
         qclose(&db);
+    for(j = 0; j < SIZES; j++) {
+	for(i = 0; ret && path && i < nextern[j]; i++) {
+	    sprintf(path, "%s/h%c%08x.bin", datadirs[j], sizedirs[j], i);
+	    unlink(path);
+	}
+	free(datadirs[j]);
+    }
     free(path);
     sxc_free_uri(uri);
     if(ret)
@@ -606,8 +934,8 @@ create_hashfs_fail:
     return ret;
 }
 
-rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size) {
-    rc_ty ret = create_initial_storage(dir, cluster, key, key_size);
+rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size, unsigned int shards, const char *layout) {
+    rc_ty ret = create_initial_storage(dir, cluster, key, key_size, shards, layout);
     if (ret == OK)
         ret = sx_storage_upgrade(dir);
     if (ret == OK)
@@ -722,8 +1050,8 @@ struct rebalance_iter {
     unsigned ndbidx;
     unsigned rebalance_ver;
     int retry_mode;
-    sqlite3_stmt *q[SIZES][HASHDBS];
-    sqlite3_stmt *q_num[SIZES][HASHDBS];
+    sqlite3_stmt *q[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *q_num[SIZES][HASHDBS_MAX];
     sqlite3_stmt *q_add;
     sqlite3_stmt *q_sel;
     sqlite3_stmt *q_remove;
@@ -745,10 +1073,48 @@ typedef struct {
     char name[SXLIMIT_MAX_FILENAME_LEN+2];
     char revision[REV_LEN+1];
     sx_hash_t revision_id;
+    int64_t dir_files;
 } list_entry_t;
 
+/* Number of rows each metadb cursor prefetches during listings */
+#define LIST_BATCH 32
+
+typedef struct {
+    unsigned int pos, count; /* Next row to merge and rows in the batch */
+    int eof; /* No more rows past the current batch */
+} list_cursor_t;
+
+/* Size of each of the volume, user and access lookup caches */
+#define LOOKUP_CACHE_SIZE 64
+
+typedef struct {
+    uint64_t gen; /* Lookup generation the entry was loaded at */
+    uint64_t usage_gen; /* Commit generation the usage was loaded at */
+    sx_hashfs_volume_t vol;
+} volume_cache_t;
+
+typedef struct {
+    uint64_t gen;
+    uint8_t user[AUTH_UID_LEN];
+    uint8_t key[AUTH_KEY_LEN];
+    sx_uid_t uid;
+    sx_priv_t basepriv;
+    int64_t quota;
+} user_cache_t;
+
+typedef struct {
+    uint64_t gen;
+    uint8_t user[AUTH_UID_LEN];
+    int64_t volid;
+    sx_priv_t access;
+} access_cache_t;
+
 struct _sx_hashfs_t {
     uint8_t *blockbuf;
+    char **dropfiles; /* Removed on close, once the dbs are no longer open */
+    sx_blockio_t *blockio;
+    pid_t blockio_pid;
+    unsigned int ndropfiles;
 
     sxi_db_t *db;
     sqlite3_stmt *q_getval;
@@ -775,6 +1141,7 @@ struct _sx_hashfs_t {
     sqlite3_stmt *q_revoke;
     sqlite3_stmt *q_volbyname;
     sqlite3_stmt *q_volbyid;
+    sqlite3_stmt *q_volusage;
     sqlite3_stmt *q_volbygid;
     sqlite3_stmt *q_umetaget;
     sqlite3_stmt *q_addumeta;
@@ -787,6 +1154,7 @@ struct _sx_hashfs_t {
     sqlite3_stmt *q_iterate_prefixed_keyval;
     sqlite3_stmt *q_drop_cluster_meta;
     sqlite3_stmt *q_nextvol;
+    sqlite3_stmt *q_nextchangedvol;
     sqlite3_stmt *q_getaccess;
     sqlite3_stmt *q_addvol;
     sqlite3_stmt *q_addvolmeta;
@@ -814,7 +1182,8 @@ struct _sx_hashfs_t {
     sqlite3_stmt *qt_new;
     sqlite3_stmt *qt_new4del;
     sqlite3_stmt *qt_update;
-    sqlite3_stmt *qt_updateuniq;
+    sqlite3_stmt *qt_updateavail;
+    sqlite3_stmt *qt_setcheckpos;
     sqlite3_stmt *qt_extend;
     sqlite3_stmt *qt_addmeta;
     sqlite3_stmt *qt_delmeta;
@@ -824,78 +1193,102 @@ struct _sx_hashfs_t {
     sqlite3_stmt *qt_tokendata;
     sqlite3_stmt *qt_tmpbyrev;
     sqlite3_stmt *qt_tmpdata;
+    sqlite3_stmt *qt_tmpinfo;
     sqlite3_stmt *qt_delete;
     sqlite3_stmt *qt_flush;
     sqlite3_stmt *qt_gc_revisions;
 
-    sxi_db_t *metadb[METADBS];
-    sqlite3_stmt *qm_ins[METADBS];
-    sqlite3_stmt *qm_list[METADBS];
-    sqlite3_stmt *qm_list_eq[METADBS];
-    sqlite3_stmt *qm_listrevs[METADBS];
-    sqlite3_stmt *qm_listrevs_rev[METADBS];
-    unsigned char qm_list_done[METADBS];
+    unsigned int metadbs, hashdbs;
+    sxi_db_t *metadb[METADBS_MAX];
+    sqlite3_stmt *qm_ins[METADBS_MAX];
+    sqlite3_stmt *qm_list[METADBS_MAX];
+    sqlite3_stmt *qm_list_eq[METADBS_MAX];
+    sqlite3_stmt *qm_listrevs[METADBS_MAX];
+    sqlite3_stmt *qm_listrevs_rev[METADBS_MAX];
+    unsigned char qm_list_done[METADBS_MAX];
     uint64_t qm_list_queries;
-    sqlite3_stmt *qm_get[METADBS];
-    sqlite3_stmt *qm_getrev[METADBS];
-    sqlite3_stmt *qm_getrev_or_tombstone[METADBS];
-    sqlite3_stmt *qm_findrev[METADBS];
-    sqlite3_stmt *qm_oldrevs[METADBS];
-    sqlite3_stmt *qm_metaget[METADBS];
-    sqlite3_stmt *qm_metaset[METADBS];
-    sqlite3_stmt *qm_metadel[METADBS];
-    sqlite3_stmt *qm_delfile[METADBS];
-    sqlite3_stmt *qm_del_tombstone[METADBS];
-    sqlite3_stmt *qm_mvfile[METADBS];
-    sqlite3_stmt *qm_wiperelocs[METADBS];
-    sqlite3_stmt *qm_countrelocs[METADBS];
-    sqlite3_stmt *qm_addrelocs[METADBS];
-    sqlite3_stmt *qm_getreloc[METADBS];
-    sqlite3_stmt *qm_delreloc[METADBS];
-    sqlite3_stmt *qm_delbyvol[METADBS];
-    sqlite3_stmt *qm_sumfilesizes[METADBS];
-    sqlite3_stmt *qm_newest[METADBS];
-    sqlite3_stmt *qm_count[METADBS];
-    sqlite3_stmt *qm_list_rev_dec[METADBS];
-    sqlite3_stmt *qm_list_file[METADBS];
-    sqlite3_stmt *qm_add_heal[METADBS];
-    sqlite3_stmt *qm_del_heal[METADBS];
-    sqlite3_stmt *qm_get_rb[METADBS];
-    sqlite3_stmt *qm_count_rb[METADBS];
-    sqlite3_stmt *qm_add_heal_volume[METADBS];
-    sqlite3_stmt *qm_sel_heal_volume[METADBS];
-    sqlite3_stmt *qm_upd_heal_volume[METADBS];
-    sqlite3_stmt *qm_del_heal_volume[METADBS];
-    sqlite3_stmt *qm_needs_upgrade[METADBS];
-
-    sxi_db_t *datadb[SIZES][HASHDBS];
-    sqlite3_stmt *qb_nextavail[SIZES][HASHDBS];
-    sqlite3_stmt *qb_nextalloc[SIZES][HASHDBS];
-    sqlite3_stmt *qb_add[SIZES][HASHDBS];
-    sqlite3_stmt *qb_setfree[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc1[SIZES][HASHDBS];
-    sqlite3_stmt *qb_get[SIZES][HASHDBS];
-    sqlite3_stmt *qb_bumpavail[SIZES][HASHDBS];
-    sqlite3_stmt *qb_bumpalloc[SIZES][HASHDBS];
-    sqlite3_stmt *qb_addtoken[SIZES][HASHDBS];
-    sqlite3_stmt *qb_moduse[SIZES][HASHDBS];
-    sqlite3_stmt *qb_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_get_meta[SIZES][HASHDBS];
-    sqlite3_stmt *qb_get_meta_volrep[SIZES][HASHDBS];
-    sqlite3_stmt *qb_del_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_unused_revision[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_unused_block[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_gc_block[SIZES][HASHDBS];
-    sqlite3_stmt *qb_deleteold[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_expired_reservation[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_expired_reservation2[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_revision_blocks[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_revision[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_upgrade_2_1_4_revid_update[SIZES][HASHDBS];
-    sqlite3_stmt *qb_volrep_block_by_global_vol_id[SIZES][HASHDBS];
-    sqlite3_stmt *qb_volrep_release_revid_blocks[SIZES][HASHDBS];
-    sqlite3_stmt *qb_volrep_update_replica[SIZES][HASHDBS];
+    sqlite3_stmt *qm_get[METADBS_MAX];
+    sqlite3_stmt *qm_getrev[METADBS_MAX];
+    sqlite3_stmt *qm_getrev_or_tombstone[METADBS_MAX];
+    sqlite3_stmt *qm_findrev[METADBS_MAX];
+    sqlite3_stmt *qm_oldrevs[METADBS_MAX];
+    sqlite3_stmt *qm_metaget[METADBS_MAX];
+    sqlite3_stmt *qm_metaset[METADBS_MAX];
+    sqlite3_stmt *qm_metadel[METADBS_MAX];
+    sqlite3_stmt *qm_delfile[METADBS_MAX];
+    sqlite3_stmt *qm_delrange[METADBS_MAX];
+    sqlite3_stmt *qm_del_tombstone[METADBS_MAX];
+    sqlite3_stmt *qm_mvfile[METADBS_MAX];
+    sqlite3_stmt *qm_wiperelocs[METADBS_MAX];
+    sqlite3_stmt *qm_countrelocs[METADBS_MAX];
+    sqlite3_stmt *qm_addrelocs[METADBS_MAX];
+    sqlite3_stmt *qm_getreloc[METADBS_MAX];
+    sqlite3_stmt *qm_delreloc[METADBS_MAX];
+    sqlite3_stmt *qm_delbyvol[METADBS_MAX];
+    sqlite3_stmt *qm_sumfilesizes[METADBS_MAX];
+    sqlite3_stmt *qm_getsums[METADBS_MAX];
+    sqlite3_stmt *qm_setsums[METADBS_MAX];
+    sqlite3_stmt *qm_delsums[METADBS_MAX];
+    sqlite3_stmt *qm_getchunk[METADBS_MAX];
+    sqlite3_stmt *qm_addchunk[METADBS_MAX];
+    sqlite3_stmt *qm_list_rev_dec[METADBS_MAX];
+    sqlite3_stmt *qm_list_file[METADBS_MAX];
+    sqlite3_stmt *qm_add_heal[METADBS_MAX];
+    sqlite3_stmt *qm_del_heal[METADBS_MAX];
+    sqlite3_stmt *qm_get_rb[METADBS_MAX];
+    sqlite3_stmt *qm_count_rb[METADBS_MAX];
+    sqlite3_stmt *qm_add_heal_volume[METADBS_MAX];
+    sqlite3_stmt *qm_sel_heal_volume[METADBS_MAX];
+    sqlite3_stmt *qm_upd_heal_volume[METADBS_MAX];
+    sqlite3_stmt *qm_del_heal_volume[METADBS_MAX];
+    sqlite3_stmt *qm_needs_upgrade[METADBS_MAX];
+    sqlite3_stmt *qm_list_depth[METADBS_MAX];
+    sqlite3_stmt *qm_list_depth_eq[METADBS_MAX];
+    sqlite3_stmt *qm_list_dirs[METADBS_MAX];
+    sqlite3_stmt *qm_list_dirs_eq[METADBS_MAX];
+    sqlite3_stmt *qm_dirs_add[METADBS_MAX];
+    sqlite3_stmt *qm_dirs_upd[METADBS_MAX];
+    sqlite3_stmt *qm_dirs_prune[METADBS_MAX];
+    sqlite3_stmt *qm_dirs_others[METADBS_MAX];
+    sqlite3_stmt *qm_dirs_delbyvol[METADBS_MAX];
+    unsigned char dir_index[METADBS_MAX]; /* The dirs table of the metadb is maintained */
+    int dir_index_all; /* ...and complete on every metadb */
+
+    sxi_db_t *datadb[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_nextalloc[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_add[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_setfree[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_deferfree[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_gc1[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_get[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_getidxgen[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_setidxgen[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_bumpavail[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_countavail[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_takeavail[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_listavail[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_addalloc[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_getallocgen[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_bumpallocgen[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_addtoken[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_moduse[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_reserve[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_get_meta[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_get_meta_volrep[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_del_reserve[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_find_unused_revision[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_find_unused_block[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_find_gc_block[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_deleteold[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_find_expired_reservation[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_find_expired_reservation2[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_gc_revision_blocks[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_gc_revision[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_gc_reserve[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_upgrade_2_1_4_revid_update[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_volrep_block_by_global_vol_id[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_volrep_release_revid_blocks[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb_volrep_update_replica[SIZES][HASHDBS_MAX];
 
     sxi_db_t *eventdb;
     sqlite3_stmt *qe_getjob;
@@ -931,6 +1324,7 @@ struct _sx_hashfs_t {
     sqlite3_stmt *qh_delval;
 
     struct timeval volsizes_push_timestamp;
+    uint64_t volsizes_gen, volsizes_clean_gen;
 
     char *ssl_ca_file;
     char *cluster_name;
@@ -946,6 +1340,7 @@ struct _sx_hashfs_t {
 
     sx_hashfs_volume_t curvol;
     const uint8_t *curvoluser;
+    int64_t curvolsince; /* Set when iterating the volumes changed since then, -1 otherwise */
 
     sx_hashfs_user_t curclone;
     int listinactiveclones;
@@ -954,7 +1349,15 @@ struct _sx_hashfs_t {
     int list_recurse;
     int64_t list_volid;
     char list_pattern[2*SXLIMIT_MAX_FILENAME_LEN+3];
-    list_entry_t list_cache[METADBS];
+    list_entry_t *list_rows; /* LIST_BATCH rows per cursor */
+    unsigned int list_rows_cursors; /* Number of cursors list_rows has room for */
+    list_cursor_t list_cur[2*METADBS_MAX]; /* The files of each metadb, then its dirs */
+    unsigned int list_heap[2*METADBS_MAX]; /* Non exhausted cursors, by head row */
+    unsigned int list_heap_len, list_ncur;
+    int list_dirs; /* Fake dirs come from the directory index */
+    char list_last[SXLIMIT_MAX_FILENAME_LEN+2];
+    uint64_t list_nrows;
+    struct timeval list_start;
     unsigned int list_pattern_slashes; /* Number of slashes in pattern */
     int list_pattern_end_with_slash; /* 1 if pattern ends with slash */
 
@@ -962,11 +1365,16 @@ struct _sx_hashfs_t {
     /* No need to append byte for asterisk, because that limit is up to first NUL byte */
     char list_lower_limit[2*SXLIMIT_MAX_FILENAME_LEN+3];
     char list_upper_limit[2*SXLIMIT_MAX_FILENAME_LEN+3];
+    char list_dir_lower_limit[2*SXLIMIT_MAX_FILENAME_LEN+3];
     int list_limit_len; /* Both itername and itername_limit will have the same length */
 
     int64_t get_id;
     const sx_hash_t *get_content;
     unsigned int get_nblocks;
+    /* Chunked files: next block to load and number of blocks in get_chunk */
+    unsigned int get_pos, get_buffered;
+    int get_chunked;
+    sx_hash_t get_chunk[FILE_CHUNK_BLOCKS];
     unsigned int get_replica;
     int get_ndb;
     int rev_ndb;
@@ -1011,7 +1419,13 @@ struct _sx_hashfs_t {
         char value[SXLIMIT_SETTINGS_MAX_VALUE_LEN+1];
     } current_setting;
 
-    int datafd[SIZES][HASHDBS];
+    int datafd[SIZES][HASHDBS_MAX];
+    char *datapath[SIZES][HASHDBS_MAX];
+    char *datadir[SIZES]; /* NULL if the datafiles live in the storage dir */
+    sx_blockidx_t *blockidx[SIZES][HASHDBS_MAX];
+    sx_freemap_t *freemap[SIZES][HASHDBS_MAX];
+    int64_t freemap_gen[SIZES][HASHDBS_MAX]; /* -1 = not loaded */
+    int64_t freemap_next[SIZES][HASHDBS_MAX];
     sx_uuid_t cluster_uuid, node_uuid; /* MODHDIST: store sx_node_t instead - see sx_hashfs_self */
     sx_hashfs_version_t cversion;
     sx_hash_t tokenkey;
@@ -1031,8 +1445,286 @@ struct _sx_hashfs_t {
 
     int readonly;
     int lockfd;
+
+    double open_time;
+    unsigned int nprepared; /* Lazy statements prepared so far */
+
+    uint64_t *cluster_gens; /* Shared, see cluster_gen_map() */
+    unsigned int cluster_gens_touched; /* Bitmask, see cluster_gen_touch() */
+    uint64_t mode_gen, dist_gen; /* Generation of the cached mode and distribution */
+
+    /* See lookup_cache_gen() */
+    volume_cache_t volcache[LOOKUP_CACHE_SIZE];
+    user_cache_t usercache[LOOKUP_CACHE_SIZE];
+    access_cache_t accesscache[LOOKUP_CACHE_SIZE];
+    unsigned int volcache_next, usercache_next, accesscache_next;
+};
+
+/* The statements on the datadbs and metadbs are many (one set per db) and
+ * most processes only ever use a handful of them: they are prepared on first
+ * use by qlazy() from the tables below */
+struct lazy_query {
+    size_t offset; /* Of the statement array in sx_hashfs_t */
+    const char *query;
 };
 
+static const struct lazy_query datadb_queries[] = {
+    { offsetof(sx_hashfs_t, qb_nextalloc), "SELECT value FROM hashfs WHERE key = 'next_blockno'" },
+    { offsetof(sx_hashfs_t, qb_add), "INSERT OR IGNORE INTO blocks(hash, blockno, clen, created_at) VALUES(:hash, :next, :clen, :now)" },
+    { offsetof(sx_hashfs_t, qb_setfree), "INSERT OR IGNORE INTO avail VALUES(:blockno)" },
+    { offsetof(sx_hashfs_t, qb_deferfree), "INSERT OR REPLACE INTO pending_free (blocknumber, freed_at) VALUES (:blockno, :now)" },
+    { offsetof(sx_hashfs_t, qb_gc1), "DELETE FROM blocks WHERE id = :blockid" },
+    { offsetof(sx_hashfs_t, qb_get), "SELECT blockno, clen FROM blocks WHERE hash = :hash AND blockno IS NOT NULL" },
+    { offsetof(sx_hashfs_t, qb_getidxgen), "SELECT value FROM hashfs WHERE key = 'blockidx_gen'" },
+    { offsetof(sx_hashfs_t, qb_setidxgen), "INSERT OR REPLACE INTO hashfs (key, value) VALUES ('blockidx_gen', :gen)" },
+    { offsetof(sx_hashfs_t, qb_bumpavail), "DELETE FROM avail WHERE blocknumber = :next" },
+    { offsetof(sx_hashfs_t, qb_countavail), "SELECT COUNT(*) FROM avail WHERE blocknumber >= :start AND blocknumber < :end" },
+    { offsetof(sx_hashfs_t, qb_takeavail), "DELETE FROM avail WHERE blocknumber >= :start AND blocknumber < :end" },
+    { offsetof(sx_hashfs_t, qb_listavail), "SELECT blocknumber FROM avail ORDER BY blocknumber ASC" },
+    { offsetof(sx_hashfs_t, qb_addalloc), "UPDATE hashfs SET value = value + :n WHERE key = 'next_blockno' AND value = :next" },
+    { offsetof(sx_hashfs_t, qb_getallocgen), "SELECT value FROM hashfs WHERE key = 'alloc_gen'" },
+    { offsetof(sx_hashfs_t, qb_bumpallocgen), "INSERT OR REPLACE INTO hashfs (key, value) VALUES ('alloc_gen', COALESCE((SELECT value FROM hashfs WHERE key = 'alloc_gen'), 0) + 1)" },
+    { offsetof(sx_hashfs_t, qb_addtoken), "INSERT OR IGNORE INTO revision_ops(revision_id, op, age) VALUES(:revision_id, :op, :age)" },
+    /* OR IGNORE to avoid subjournal */
+    { offsetof(sx_hashfs_t, qb_moduse), "INSERT OR IGNORE INTO revision_blocks(revision_id, blocks_hash, age, replica, global_vol_id) VALUES(:revision_id, :hash, :age, :replica, :global_vol_id)" },
+    { offsetof(sx_hashfs_t, qb_reserve), "INSERT OR IGNORE INTO reservations(reservations_id, revision_id, ttl) VALUES(:reserve_id, :revision_id, :ttl)" },
+    /* Select just the revisions that are part of a fully uploaded file (i.e. no reservations).
+       if a hash has both reservations (incomplete upload), and fully uploaded references, this returns just the fully uploaded references.
+       As long as file flush atomically checks for presence and bumps reference counter there shouldn't be race conditions here.
+    */
+    { offsetof(sx_hashfs_t, qb_get_meta), "SELECT replica, SUM(op), revision_blocks.revision_id, revision_blocks.global_vol_id FROM revision_blocks INNER JOIN revision_ops ON revision_blocks.revision_id=revision_ops.revision_id NATURAL LEFT JOIN reservations WHERE blocks_hash=:hash AND revision_blocks.age < :current_age AND reservations_id IS NULL GROUP BY revision_blocks.revision_id" },
+    { offsetof(sx_hashfs_t, qb_get_meta_volrep), "SELECT replica, SUM(op), revision_blocks.revision_id, revision_blocks.global_vol_id FROM revision_blocks INNER JOIN revision_ops ON revision_blocks.revision_id=revision_ops.revision_id NATURAL LEFT JOIN reservations WHERE blocks_hash=:hash AND reservations_id IS NULL GROUP BY revision_blocks.revision_id" },
+    { offsetof(sx_hashfs_t, rit.q), "SELECT hash FROM blocks WHERE hash > :prevhash" },
+    { offsetof(sx_hashfs_t, rit.q_num), "SELECT COUNT(hash) FROM blocks" }, /* SLOWQ */
+    { offsetof(sx_hashfs_t, qb_del_reserve), "DELETE FROM reservations WHERE reservations_id=:reserve_id" },
+    { offsetof(sx_hashfs_t, qb_find_unused_revision), "SELECT revision_id FROM revision_ops WHERE revision_id IN (SELECT revision_id FROM revision_ops NATURAL LEFT JOIN reservations WHERE op in (-1, 0) AND age <= :age AND revision_id > :last_revision_id AND reservations_id IS NULL) GROUP BY revision_id HAVING SUM(op)=0 ORDER BY revision_id" },
+    { offsetof(sx_hashfs_t, qb_find_unused_block), "SELECT id, blockno, hash FROM blocks LEFT JOIN revision_blocks ON blocks.hash=blocks_hash WHERE id  > :last AND revision_id IS NULL ORDER BY id" },
+
+    /*
+       This is a much faster version of the next query which however may return dups:
+       SELECT id, blockno, hash FROM revision_blocks AS a LEFT JOIN revision_blocks AS b ON b.blocks_hash=a.blocks_hash AND b.revision_id <> a.revision_id JOIN blocks ON blocks.hash = a.blocks_hash WHERE a.revision_id=:revision_id AND b.revision_id IS NULL
+    */
+    { offsetof(sx_hashfs_t, qb_find_gc_block), "SELECT id, blockno, hash FROM blocks WHERE hash IN ( SELECT blocks_hash FROM revision_blocks WHERE blocks_hash IN ( SELECT blocks_hash from revision_blocks where revision_id=:revision_id ) GROUP BY blocks_hash HAVING revision_id=:revision_id AND COUNT(*)=1 )" },
+
+    /* hash moved,
+     * hashes that are not moved don't have the old counters deleted,
+     * and must be taken into account when GCing!
+     * this is to avoid updating the entire table during rebalance
+     * */
+    { offsetof(sx_hashfs_t, qb_deleteold), "DELETE FROM revision_blocks WHERE blocks_hash=:hash AND age < :current_age" },
+    { offsetof(sx_hashfs_t, qb_find_expired_reservation), "SELECT reservations_id, revision_id FROM reservations NATURAL INNER JOIN revision_blocks INNER JOIN blocks ON blocks.hash = blocks_hash WHERE reservations_id > :lastreserve_id GROUP BY reservations_id HAVING MAX(created_at) < :expires ORDER BY reservations_id LIMIT 1" },
+    { offsetof(sx_hashfs_t, qb_find_expired_reservation2), "SELECT revision_id from reservations WHERE ttl < :now LIMIT 1" },
+    { offsetof(sx_hashfs_t, qb_gc_revision_blocks), "DELETE FROM revision_blocks WHERE revision_id=:revision_id" },
+    { offsetof(sx_hashfs_t, qb_gc_revision), "DELETE FROM revision_ops WHERE revision_id=:revision_id" },
+    { offsetof(sx_hashfs_t, qb_gc_reserve), "DELETE FROM reservations WHERE revision_id=:revision_id" },
+    { offsetof(sx_hashfs_t, qb_upgrade_2_1_4_revid_update), "UPDATE revision_blocks SET global_vol_id = :global_vol_id WHERE revision_id = :revision_id" },
+    { offsetof(sx_hashfs_t, qb_volrep_block_by_global_vol_id), "SELECT blocks_hash FROM revision_blocks WHERE global_vol_id = :global_vol_id AND blocks_hash > :prevhash" },
+    { offsetof(sx_hashfs_t, qb_volrep_release_revid_blocks), "DELETE FROM revision_blocks WHERE blocks_hash = :hash" },
+
+    /* Note: we do not want an index on global_vol_id since it is only used during volume replica changes
+       and it would be pointlessly expensive to maintain under normal usage */
+    { offsetof(sx_hashfs_t, qb_volrep_update_replica), "UPDATE revision_blocks SET replica = :next_replica WHERE global_vol_id = :global_vol_id AND replica = :prev_replica" }, /* SLOWQ */
+};
+
+static const struct lazy_query metadb_queries[] = {
+    { offsetof(sx_hashfs_t, qm_ins), "INSERT INTO files (volume_id, name, size, content, rev, revision_id, age, depth) VALUES (:volume, :name, :size, :hashes, :revision, :revision_id, :age, length(:name) - length(replace(:name, '/', '')))" },
+    { offsetof(sx_hashfs_t, qm_list), "SELECT name, size, rev, revision_id, length(content) FROM files WHERE volume_id = :volume AND name > :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_list_eq), "SELECT name, size, rev, revision_id, length(content) FROM files WHERE volume_id = :volume AND name >= :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_listrevs), "SELECT size, rev, revision_id, length(content) FROM files WHERE volume_id = :volume AND name = :name AND rev > :previous AND age >= 0 ORDER BY rev ASC LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_get), "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0) FROM files WHERE volume_id = :volume AND name = :name AND age >= 0 GROUP BY name HAVING rev = MAX(rev) LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_listrevs_rev), "SELECT size, rev, revision_id, length(content) FROM files WHERE volume_id = :volume AND name = :name AND (:previous IS NULL OR rev < :previous) AND age >= 0 ORDER BY rev DESC LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_getrev), "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0), age, revision_id FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision AND age >= 0 LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_getrev_or_tombstone), "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0), age, revision_id FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_findrev), "SELECT volume_id, name, size, revision_id, length(content) FROM files WHERE rev = :revision AND age >= 0 LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_oldrevs), "SELECT rev, size, (SELECT COUNT(*) FROM files AS b WHERE b.volume_id = a.volume_id AND b.name = a.name AND age >= 0), fid, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = a.fid),0) FROM files AS a WHERE a.volume_id = :volume AND a.name = :name AND age >= 0 ORDER BY rev ASC" },
+    { offsetof(sx_hashfs_t, qm_metaget), "SELECT key, value FROM fmeta WHERE file_id = :file" },
+    { offsetof(sx_hashfs_t, qm_metaset), "INSERT OR REPLACE INTO fmeta (file_id, key, value) VALUES (:file, :key, :value)" },
+    { offsetof(sx_hashfs_t, qm_metadel), "DELETE FROM fmeta WHERE file_id = :file AND key = :key" },
+    { offsetof(sx_hashfs_t, qm_delfile), "DELETE FROM files WHERE fid = :file AND age >= 0" },
+    { offsetof(sx_hashfs_t, qm_delrange), "SELECT fid, name, rev, revision_id, size, length(content), LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0) FROM files WHERE volume_id = :volume AND name >= :lower AND (:limit IS NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND substr(rev, 1, length(:maxtime)) <= :maxtime AND age >= 0 ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_del_tombstone), "DELETE FROM files WHERE fid = :file AND age < 0" },
+    { offsetof(sx_hashfs_t, qm_mvfile), "UPDATE files SET name = :newname, rev = :newrev, depth = length(:newname) - length(replace(:newname, '/', '')) WHERE name = :oldname AND rev = :rev AND age >= 0" },
+    { offsetof(sx_hashfs_t, qm_wiperelocs), "DELETE FROM relocs" },
+    { offsetof(sx_hashfs_t, qm_countrelocs), "SELECT COUNT(*) FROM relocs" },
+    { offsetof(sx_hashfs_t, qm_addrelocs), "INSERT INTO relocs (file_id, dest) SELECT fid, :node FROM files WHERE volume_id = :volid AND age >= 0" },
+    { offsetof(sx_hashfs_t, qm_getreloc), "SELECT file_id, dest, volume_id, name, size, rev, content, revision_id, age FROM relocs LEFT JOIN files ON relocs.file_id = files.fid WHERE file_id > :prev LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_delreloc), "DELETE FROM relocs WHERE file_id = :fileid" },
+    { offsetof(sx_hashfs_t, qm_delbyvol), "DELETE FROM files WHERE volume_id = :volid" },
+    { offsetof(sx_hashfs_t, qm_sumfilesizes), "SELECT SUM(files.size + LENGTH(CAST(files.name AS BLOB))) + SUM(COALESCE((SELECT SUM(LENGTH(CAST(fmeta.key AS BLOB)) + LENGTH(CAST(fmeta.value AS BLOB))) FROM fmeta WHERE fmeta.file_id = files.fid), 0)), SUM(files.size), COUNT(*) FROM files WHERE files.volume_id = :volid AND age >= 0" },
+    { offsetof(sx_hashfs_t, qm_getsums), "SELECT nfiles, digest FROM listsums WHERE volume_id = :volume" },
+    { offsetof(sx_hashfs_t, qm_setsums), "INSERT OR REPLACE INTO listsums (volume_id, nfiles, digest) VALUES (:volume, :nfiles, :digest)" },
+    { offsetof(sx_hashfs_t, qm_delsums), "DELETE FROM listsums WHERE volume_id = :volid" },
+    { offsetof(sx_hashfs_t, qm_getchunk), "SELECT hashes FROM file_chunks WHERE file_id = :file AND chunk = :chunk" },
+    { offsetof(sx_hashfs_t, qm_addchunk), "INSERT INTO file_chunks (file_id, chunk, hashes) VALUES (:file, :chunk, :hashes)" },
+    { offsetof(sx_hashfs_t, qm_list_rev_dec), "SELECT size, rev, content, revision_id, fid FROM files WHERE volume_id=:volid AND name = :name AND rev < :maxrev AND age >= 0 ORDER BY rev DESC LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_list_file), "SELECT size, rev, content, name, revision_id, fid FROM files WHERE volume_id=:volid AND name > :previous AND rev < :maxrev AND age >= 0 ORDER BY name ASC, rev DESC LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_del_heal), "DELETE FROM heal WHERE revision_id=:revision_id" },
+    { offsetof(sx_hashfs_t, qm_add_heal), "INSERT OR IGNORE INTO heal(revision_id, remote_volume, blocks, blocksize, replica_count) VALUES(:revision_id, :remote_volid, :blocks, :blocksize, :replica_count)" },
+    { offsetof(sx_hashfs_t, qm_get_rb), "SELECT size, revision_id, content, name, fid FROM files WHERE volume_id=:volume_id AND age < :age_limit AND revision_id > :min_revision_id AND age >= 0 ORDER BY revision_id" },
+    { offsetof(sx_hashfs_t, qm_count_rb), "SELECT COUNT(revision_id) FROM files WHERE volume_id=:volume_id AND age < :age_limit AND revision_id > :min_revision_id AND age >= 0 ORDER BY revision_id" },
+    { offsetof(sx_hashfs_t, qm_add_heal_volume), "INSERT OR REPLACE INTO heal_volume(name, max_age, min_revision) VALUES(:name,:max_age,:min_revision_id)" },
+    { offsetof(sx_hashfs_t, qm_sel_heal_volume), "SELECT name, max_age, min_revision FROM heal_volume WHERE name > :prev" }, /* SLOWQ */
+    { offsetof(sx_hashfs_t, qm_upd_heal_volume), "UPDATE heal_volume SET min_revision=:min_revision_id WHERE name=:name" }, /* SLOWQ */
+    { offsetof(sx_hashfs_t, qm_del_heal_volume), "DELETE FROM heal_volume WHERE name=:name" }, /* SLOWQ */
+    { offsetof(sx_hashfs_t, qm_needs_upgrade), "SELECT fid, volume_id, name, rev, size, length(content) FROM files WHERE revision_id IS NULL AND age >= 0" }, /* SLOWQ */
+    /* Directory index, see dirs_update() */
+    { offsetof(sx_hashfs_t, qm_list_depth), "SELECT name, size, rev, revision_id, length(content) FROM files INDEXED BY files_depth WHERE volume_id = :volume AND depth = :depth AND name > :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_list_depth_eq), "SELECT name, size, rev, revision_id, length(content) FROM files INDEXED BY files_depth WHERE volume_id = :volume AND depth = :depth AND name >= :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_list_dirs), "SELECT name, nfiles, mtime FROM dirs WHERE volume_id = :volume AND depth = :depth AND name > :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_list_dirs_eq), "SELECT name, nfiles, mtime FROM dirs WHERE volume_id = :volume AND depth = :depth AND name >= :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 ORDER BY name ASC LIMIT :batch" },
+    { offsetof(sx_hashfs_t, qm_dirs_add), "INSERT OR IGNORE INTO dirs (volume_id, name, depth, nfiles, mtime) VALUES (:volume, :name, :depth, 0, 0)" },
+    { offsetof(sx_hashfs_t, qm_dirs_upd), "UPDATE dirs SET nfiles = nfiles + :delta, mtime = MAX(mtime, :mtime) WHERE volume_id = :volume AND name = :name" },
+    { offsetof(sx_hashfs_t, qm_dirs_prune), "DELETE FROM dirs WHERE volume_id = :volume AND name = :name AND nfiles <= 0" },
+    { offsetof(sx_hashfs_t, qm_dirs_others), "SELECT 1 FROM files WHERE volume_id = :volume AND name = :name AND rev <> :rev AND age >= 0 LIMIT 1" },
+    { offsetof(sx_hashfs_t, qm_dirs_delbyvol), "DELETE FROM dirs WHERE volume_id = :volid" },
+};
+
+#define LAZY_DATADB_COUNT (sizeof(datadb_queries) / sizeof(datadb_queries[0]))
+#define LAZY_METADB_COUNT (sizeof(metadb_queries) / sizeof(metadb_queries[0]))
+
+static sqlite3_stmt *lazy_prep(sx_hashfs_t *h, sqlite3_stmt **q) {
+    size_t off = (const char *)q - (const char *)h, idx;
+    const char *query = NULL;
+    sxi_db_t *db = NULL;
+    unsigned int i;
+
+    for(i=0; i<LAZY_DATADB_COUNT; i++) {
+	if(off < datadb_queries[i].offset || off >= datadb_queries[i].offset + sizeof(h->qb_get))
+	    continue;
+	idx = (off - datadb_queries[i].offset) / sizeof(*q);
+	db = h->datadb[idx / HASHDBS_MAX][idx % HASHDBS_MAX];
+	query = datadb_queries[i].query;
+	break;
+    }
+    for(i=0; !query && i<LAZY_METADB_COUNT; i++) {
+	if(off < metadb_queries[i].offset || off >= metadb_queries[i].offset + sizeof(h->qm_get))
+	    continue;
+	idx = (off - metadb_queries[i].offset) / sizeof(*q);
+	db = h->metadb[idx];
+	query = metadb_queries[i].query;
+    }
+    if(!query) {
+	CRIT("Statement at offset %lu is not lazily prepared", (unsigned long)off);
+	return NULL;
+    }
+    if(qprep(db, q, query))
+	return NULL;
+    h->nprepared++;
+    return *q;
+}
+
+/* Q must be one of the statements in the tables above */
+#define qlazy(h, Q) (LIKELY(Q) ? (Q) : lazy_prep((h), &(Q)))
+
+/* The cluster mode and the distribution are kept in hashfs.db and checked
+ * before serving each request. To avoid querying them every time, all the
+ * processes using the storage share a few generation counters, mapped from
+ * CLUSTER_GEN_FILE: the cached values are only reloaded when the relevant
+ * counter changes.
+ * GEN_COMMIT is bumped after every commit to hashfs.db, the others only after
+ * the commit of a transaction which called cluster_gen_touch() on them: this
+ * way readers never cache a value older than the generation they have seen.
+ * A touch followed by a rollback merely causes a spurious reload.
+ * If the file cannot be mapped the values are simply queried every time. */
+#define CLUSTER_GEN_FILE "hashfs.gen"
+
+enum cluster_gen_kind {
+    GEN_COMMIT, /* Any change to hashfs.db */
+    GEN_CLUSTER, /* Cluster mode and distribution */
+    GEN_LOOKUP, /* Volumes (but not their usage), users and privileges */
+    GEN_COUNT
+};
+
+static void cluster_gen_bump(void *ctx) {
+    sx_hashfs_t *h = ctx;
+    unsigned int i;
+
+    __sync_fetch_and_add(&h->cluster_gens[GEN_COMMIT], 1);
+    for(i = GEN_COMMIT + 1; i < GEN_COUNT; i++)
+	if(h->cluster_gens_touched & (1 << i))
+	    __sync_fetch_and_add(&h->cluster_gens[i], 1);
+    h->cluster_gens_touched = 0;
+}
+
+/* Must be called by the writers before committing the change */
+static void cluster_gen_touch(sx_hashfs_t *h, enum cluster_gen_kind kind) {
+    h->cluster_gens_touched |= 1 << kind;
+}
+
+static void cluster_gen_map(sx_hashfs_t *h, const char *dir) {
+    char *path = wrap_malloc(strlen(dir) + sizeof("/" CLUSTER_GEN_FILE));
+    struct stat st;
+    void *map;
+    int fd;
+
+    if(!path)
+	return;
+    sprintf(path, "%s/" CLUSTER_GEN_FILE, dir);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+	WARN("Cannot open %s, the cluster state will not be cached: %s", path, strerror(errno));
+	free(path);
+	return;
+    }
+    free(path);
+    if(fstat(fd, &st) || (st.st_size < (off_t)(GEN_COUNT * sizeof(uint64_t)) && ftruncate(fd, GEN_COUNT * sizeof(uint64_t)))) {
+	WARN("Cannot set up the cluster state generation: %s", strerror(errno));
+	close(fd);
+	return;
+    }
+    map = mmap(NULL, GEN_COUNT * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+	WARN("Cannot map the cluster state generation: %s", strerror(errno));
+	return;
+    }
+    h->cluster_gens = map;
+    h->db->commit_cb = cluster_gen_bump;
+    h->db->commit_ctx = h;
+}
+
+/* Returns 0 if the generation is not available */
+static uint64_t cluster_gen(sx_hashfs_t *h, enum cluster_gen_kind kind) {
+    if(!h->cluster_gens)
+	return 0;
+    return __sync_add_and_fetch(&h->cluster_gens[kind], 0) + 1;
+}
+
+/* Volumes, users and privileges are looked up on nearly every request: each
+ * process keeps the latest ones in small round robin caches. The entries are
+ * stamped with GEN_LOOKUP, which the writers of these tables touch. The usage
+ * of the volumes changes with every file instead, so it is refreshed on its
+ * own when GEN_COMMIT moves. Lookups made within a transaction on hashfs.db
+ * may see uncommitted changes and bypass the caches.
+ * Returns 0 if the caches cannot be used */
+static uint64_t lookup_cache_gen(sx_hashfs_t *h) {
+    if(!sqlite3_get_autocommit(h->db->handle))
+	return 0;
+    return cluster_gen(h, GEN_LOOKUP);
+}
+
+/* Refreshes the usage of a cached volume, returns non zero on failure */
+static int volume_cache_usage(sx_hashfs_t *h, volume_cache_t *c) {
+    uint64_t usage_gen = cluster_gen(h, GEN_COMMIT);
+    sqlite3_stmt *q = h->q_volusage;
+
+    if(usage_gen == c->usage_gen)
+	return 0;
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volid", c->vol.id) || qstep_ret(q)) {
+	sqlite3_reset(q);
+	c->gen = 0;
+	return -1;
+    }
+    c->vol.usage_total = sqlite3_column_int64(q, 0);
+    c->vol.usage_files = sqlite3_column_int64(q, 1);
+    c->vol.nfiles = sqlite3_column_int64(q, 2);
+    c->vol.changed = sqlite3_column_int64(q, 3);
+    c->usage_gen = usage_gen;
+    sqlite3_reset(q);
+    return 0;
+}
+
 static void close_all_dbs(sx_hashfs_t *h) {
     unsigned int i, j;
 
@@ -1076,15 +1768,22 @@ static void close_all_dbs(sx_hashfs_t *h) {
     qclose(&h->eventdb);
 
     for(j=0; j<SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
-	    sqlite3_finalize(h->qb_nextavail[j][i]);
+	for(i=0; i<h->hashdbs; i++) {
 	    sqlite3_finalize(h->qb_nextalloc[j][i]);
 	    sqlite3_finalize(h->qb_add[j][i]);
 	    sqlite3_finalize(h->qb_setfree[j][i]);
+	    sqlite3_finalize(h->qb_deferfree[j][i]);
 	    sqlite3_finalize(h->qb_gc1[j][i]);
 	    sqlite3_finalize(h->qb_get[j][i]);
+	    sqlite3_finalize(h->qb_getidxgen[j][i]);
+	    sqlite3_finalize(h->qb_setidxgen[j][i]);
 	    sqlite3_finalize(h->qb_bumpavail[j][i]);
-	    sqlite3_finalize(h->qb_bumpalloc[j][i]);
+	    sqlite3_finalize(h->qb_countavail[j][i]);
+	    sqlite3_finalize(h->qb_takeavail[j][i]);
+	    sqlite3_finalize(h->qb_listavail[j][i]);
+	    sqlite3_finalize(h->qb_addalloc[j][i]);
+	    sqlite3_finalize(h->qb_getallocgen[j][i]);
+	    sqlite3_finalize(h->qb_bumpallocgen[j][i]);
             sqlite3_finalize(h->qb_addtoken[j][i]);
             sqlite3_finalize(h->qb_moduse[j][i]);
             sqlite3_finalize(h->qb_reserve[j][i]);
@@ -1110,9 +1809,14 @@ static void close_all_dbs(sx_hashfs_t *h) {
 
 	    if(h->datafd[j][i] >= 0)
 		close(h->datafd[j][i]);
+	    free(h->datapath[j][i]);
+	    sx_blockidx_free(h->blockidx[j][i]);
+	    sx_freemap_free(h->freemap[j][i]);
 	}
+	free(h->datadir[j]);
+	h->datadir[j] = NULL;
     }
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	sqlite3_finalize(h->qm_ins[i]);
 	sqlite3_finalize(h->qm_list[i]);
         sqlite3_finalize(h->qm_list_eq[i]);
@@ -1127,6 +1831,7 @@ static void close_all_dbs(sx_hashfs_t *h) {
 	sqlite3_finalize(h->qm_metaset[i]);
 	sqlite3_finalize(h->qm_metadel[i]);
 	sqlite3_finalize(h->qm_delfile[i]);
+	sqlite3_finalize(h->qm_delrange[i]);
 	sqlite3_finalize(h->qm_del_tombstone[i]);
         sqlite3_finalize(h->qm_mvfile[i]);
 	sqlite3_finalize(h->qm_wiperelocs[i]);
@@ -1136,8 +1841,11 @@ static void close_all_dbs(sx_hashfs_t *h) {
 	sqlite3_finalize(h->qm_delreloc[i]);
 	sqlite3_finalize(h->qm_delbyvol[i]);
         sqlite3_finalize(h->qm_sumfilesizes[i]);
-        sqlite3_finalize(h->qm_newest[i]);
-        sqlite3_finalize(h->qm_count[i]);
+        sqlite3_finalize(h->qm_getsums[i]);
+        sqlite3_finalize(h->qm_setsums[i]);
+        sqlite3_finalize(h->qm_delsums[i]);
+        sqlite3_finalize(h->qm_getchunk[i]);
+        sqlite3_finalize(h->qm_addchunk[i]);
         sqlite3_finalize(h->qm_list_rev_dec[i]);
         sqlite3_finalize(h->qm_list_file[i]);
         sqlite3_finalize(h->qm_del_heal[i]);
@@ -1149,6 +1857,15 @@ static void close_all_dbs(sx_hashfs_t *h) {
         sqlite3_finalize(h->qm_upd_heal_volume[i]);
         sqlite3_finalize(h->qm_del_heal_volume[i]);
         sqlite3_finalize(h->qm_needs_upgrade[i]);
+        sqlite3_finalize(h->qm_list_depth[i]);
+        sqlite3_finalize(h->qm_list_depth_eq[i]);
+        sqlite3_finalize(h->qm_list_dirs[i]);
+        sqlite3_finalize(h->qm_list_dirs_eq[i]);
+        sqlite3_finalize(h->qm_dirs_add[i]);
+        sqlite3_finalize(h->qm_dirs_upd[i]);
+        sqlite3_finalize(h->qm_dirs_prune[i]);
+        sqlite3_finalize(h->qm_dirs_others[i]);
+        sqlite3_finalize(h->qm_dirs_delbyvol[i]);
 	qclose(&h->metadb[i]);
     }
 
@@ -1190,6 +1907,7 @@ static void close_all_dbs(sx_hashfs_t *h) {
     sqlite3_finalize(h->q_getuidname);
     sqlite3_finalize(h->q_revoke);
     sqlite3_finalize(h->q_nextvol);
+    sqlite3_finalize(h->q_nextchangedvol);
     sqlite3_finalize(h->q_userisowner);
     sqlite3_finalize(h->q_getprivholder);
     sqlite3_finalize(h->q_modreplica);
@@ -1198,7 +1916,8 @@ static void close_all_dbs(sx_hashfs_t *h) {
     sqlite3_finalize(h->qt_new);
     sqlite3_finalize(h->qt_new4del);
     sqlite3_finalize(h->qt_update);
-    sqlite3_finalize(h->qt_updateuniq);
+    sqlite3_finalize(h->qt_updateavail);
+    sqlite3_finalize(h->qt_setcheckpos);
     sqlite3_finalize(h->qt_extend);
     sqlite3_finalize(h->qt_addmeta);
     sqlite3_finalize(h->qt_delmeta);
@@ -1206,6 +1925,7 @@ static void close_all_dbs(sx_hashfs_t *h) {
     sqlite3_finalize(h->qt_countmeta);
     sqlite3_finalize(h->qt_gettoken);
     sqlite3_finalize(h->qt_tmpdata);
+    sqlite3_finalize(h->qt_tmpinfo);
     sqlite3_finalize(h->qt_tokendata);
     sqlite3_finalize(h->qt_tmpbyrev);
     sqlite3_finalize(h->qt_delete);
@@ -1214,6 +1934,7 @@ static void close_all_dbs(sx_hashfs_t *h) {
 
     sqlite3_finalize(h->q_volbyname);
     sqlite3_finalize(h->q_volbyid);
+    sqlite3_finalize(h->q_volusage);
     sqlite3_finalize(h->q_volbygid);
     sqlite3_finalize(h->q_umetaget);
     sqlite3_finalize(h->q_vmetaget);
@@ -1229,6 +1950,10 @@ static void close_all_dbs(sx_hashfs_t *h) {
     sqlite3_finalize(h->q_getval);
     qclose(&h->tempdb);
     qclose(&h->db);
+    if(h->cluster_gens) {
+	munmap(h->cluster_gens, GEN_COUNT * sizeof(uint64_t));
+	h->cluster_gens = NULL;
+    }
 }
 
 static sxi_db_t *open_db(const char *basedir, const char *dbname, const sx_uuid_t *cluster_uuid, const sx_hashfs_version_t *hashfsver, sqlite3_stmt *qgetval) {
@@ -1277,10 +2002,10 @@ void sx_hashfs_checkpoint_idle(sx_hashfs_t *h)
      * */
     qcheckpoint_idle(h->db);
     qcheckpoint_idle(h->tempdb);
-    for (i=0;i<METADBS;i++)
+    for (i=0;i<h->metadbs;i++)
         qcheckpoint_idle(h->metadb[i]);
     for (i=0;i<SIZES;i++)
-        for (j=0;j<HASHDBS;j++)
+        for (j=0;j<h->hashdbs;j++)
             qcheckpoint_idle(h->datadb[i][j]);
     qcheckpoint_idle(h->eventdb);
     qcheckpoint_idle(h->xferdb);
@@ -1632,45 +2357,370 @@ static int load_config(sx_hashfs_t *h, sxc_client_t *sx) {
     return ret;
 }
 
-sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
-    unsigned int dirlen, pathlen, i, j;
-    sqlite3_stmt *q = NULL;
-    char *path, dbitem[64], qrybuff[512];
-    sx_hashfs_version_t curver;
-    const char *str;
-    sx_hashfs_t *h;
-    struct flock fl;
+static void get_bootid(char *bootid, unsigned int len) {
+    ssize_t r = -1;
+    int fd;
 
-    if(!dir || !(dirlen = strlen(dir))) {
-	CRIT("Bad path");
-	return NULL;
+    /* Mapped pages of the block index are never synced: an index file
+     * cannot be trusted after a system crash */
+    fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if(fd >= 0) {
+	r = read(fd, bootid, len - 1);
+	close(fd);
     }
-    if (ssl_version_check())
-	return NULL;
-    if(sx_hashfs_version_parse(&curver, HASHFS_VERSION_CURRENT, -1)) {
-	CRIT("Cannot parse version %s", HASHFS_VERSION_CURRENT);
+    bootid[r > 0 ? r : 0] = '\0';
+}
+
+static sx_blockidx_t *blockidx_open(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const sx_hashfs_version_t *ver, const char *bootid) {
+    uint8_t sig[BLOCKIDX_MAX_SIG];
+    unsigned int siglen, pathlen;
+    sx_blockidx_t *ret;
+    struct stat st;
+    char *path;
+
+    /* The index is bound to the cluster, the hashfs version, the datafile
+     * and the current boot */
+    if(fstat(h->datafd[hs][ndb], &st)) {
+	WARN("Cannot stat %s datafile #%u", sizelongnames[hs], ndb);
 	return NULL;
     }
-    if(!(h = wrap_calloc(1, sizeof(*h))))
+    memset(sig, 0, sizeof(sig));
+    memcpy(sig, h->cluster_uuid.binary, sizeof(h->cluster_uuid.binary));
+    siglen = sizeof(h->cluster_uuid.binary);
+    memcpy(sig + siglen, &st.st_dev, sizeof(st.st_dev));
+    siglen += sizeof(st.st_dev);
+    memcpy(sig + siglen, &st.st_ino, sizeof(st.st_ino));
+    siglen += sizeof(st.st_ino);
+    memcpy(sig + siglen, ver->fullstr, strlen(ver->fullstr));
+    siglen += sizeof(ver->fullstr);
+    strncpy((char *)sig + siglen, bootid, sizeof(sig) - siglen);
+    siglen = sizeof(sig);
+
+    /* Placed next to the datafile: hs00000000.bin -> hs00000000.idx */
+    pathlen = strlen(h->datapath[hs][ndb]);
+    if(!(path = wrap_malloc(pathlen + sizeof(".idx"))))
 	return NULL;
-    memset(h->datafd, -1, sizeof(h->datafd));
-    h->lockfd = -1;
-    h->sx = NULL;
-    h->job_trigger = h->xfer_trigger = h->gc_trigger = h->gc_expire_trigger = h->hbeat_trigger = -1;
-    /* TODO: read from hashfs kv store */
-    h->upload_minspeed = GC_UPLOAD_MINSPEED;
+    memcpy(path, h->datapath[hs][ndb], pathlen + 1);
+    if(pathlen > 4 && !strcmp(path + pathlen - 4, ".bin"))
+	pathlen -= 4;
+    strcpy(path + pathlen, ".idx");
+    ret = sx_blockidx_new(path, sig, siglen);
+    free(path);
+    return ret;
+}
 
-    dirlen++;
-    pathlen = 1024;
-    if(!(path = wrap_malloc(dirlen + pathlen)))
-	goto open_hashfs_fail;
-    h->dir = strdup(dir);
-    if (!h->dir)
-        goto open_hashfs_fail;
+static int blockidx_scan(void *ctx, sx_hash_t *hash, uint64_t *blockno, unsigned int *clen) {
+    sqlite3_stmt *q = ctx;
+    int r = qstep(q);
 
-    sprintf(path, "%s/hashfs.lock", dir);
-    h->lockfd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if(h->lockfd < 0) {
+    if(r == SQLITE_DONE)
+	return 0;
+    if(r != SQLITE_ROW || sqlite3_column_bytes(q, 0) != sizeof(hash->b))
+	return -1;
+    memcpy(hash->b, sqlite3_column_blob(q, 0), sizeof(hash->b));
+    *blockno = sqlite3_column_int64(q, 1);
+    *clen = sqlite3_column_int(q, 2);
+    return 1;
+}
+
+/* Reads the generation of the block index of a datadb as recorded in the db */
+static int blockidx_getgen(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, int64_t *gen) {
+    sqlite3_stmt *q = qlazy(h, h->qb_getidxgen[hs][ndb]);
+    int r;
+
+    if(!q)
+	return -1;
+    sqlite3_reset(q);
+    r = qstep(q);
+    if(r == SQLITE_ROW)
+	*gen = sqlite3_column_int64(q, 0);
+    else if(r == SQLITE_DONE)
+	*gen = 0;
+    sqlite3_reset(q);
+    return r == SQLITE_ROW || r == SQLITE_DONE ? 0 : -1;
+}
+
+/* Makes the block index of a datadb ready to receive nadd more items,
+ * rebuilding it from the blocks table if it's stale.
+ * Must be called with the datadb locked (i.e. after qbegin) before any
+ * change to the blocks table. Returns 0 if the index must be updated along
+ * with the table, in which case gen is set to the current generation. */
+static int blockidx_prepare(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, unsigned int nadd, int64_t *gen) {
+    sx_blockidx_t *bi = h->blockidx[hs][ndb];
+    sqlite3_stmt *q;
+    int64_t nitems;
+
+    if(!bi)
+	return -1;
+
+    if(blockidx_getgen(h, hs, ndb, gen)) {
+	sx_blockidx_invalidate(bi);
+	return -1;
+    }
+
+    if(!sx_blockidx_check(bi, *gen, nadd))
+	return 0;
+
+    q = qlazy(h, h->rit.q_num[hs][ndb]);
+    sqlite3_reset(q);
+    if(qstep_ret(q)) {
+	sqlite3_reset(q);
+	sx_blockidx_invalidate(bi);
+	return -1;
+    }
+    nitems = sqlite3_column_int64(q, 0) + nadd;
+    sqlite3_reset(q);
+
+    INFO("Rebuilding %s block index #%u (%lld blocks)", sizelongnames[hs], ndb, (long long)nitems);
+    q = NULL;
+    if(qprep(h->datadb[hs][ndb], &q, "SELECT hash, blockno, clen FROM blocks WHERE blockno IS NOT NULL") ||
+       sx_blockidx_rebuild(bi, *gen, nitems, blockidx_scan, q)) {
+	WARN("Failed to rebuild %s block index #%u", sizelongnames[hs], ndb);
+	qnullify(q);
+	sx_blockidx_invalidate(bi);
+	return -1;
+    }
+    qnullify(q);
+    return 0;
+}
+
+/* Records a change to the block index: must be called inside the same
+ * transaction which modifies the blocks table, before the index entries are
+ * touched (see get_blockno) */
+static void blockidx_bump(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, int64_t gen) {
+    sqlite3_stmt *q = qlazy(h, h->qb_setidxgen[hs][ndb]);
+
+    /* If the db is not updated the index is simply considered stale */
+    sx_blockidx_setgen(h->blockidx[hs][ndb], gen + 1);
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":gen", gen + 1) || qstep_noret(q))
+	WARN("Failed to update generation of %s block index #%u", sizelongnames[hs], ndb);
+    sqlite3_reset(q);
+}
+
+/* Looks up the block number of a hash and the stored length of the block
+ * if compressed (0 otherwise): returns OK, ENOENT or FAIL_EINTERNAL */
+static rc_ty get_blockno(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const sx_hash_t *hash, int64_t *blockno, unsigned int *clen) {
+    sqlite3_stmt *q = qlazy(h, h->qb_get[hs][ndb]);
+    unsigned int len;
+    uint64_t bno;
+    int64_t gen;
+    int r;
+
+    /* The answer of the index, found or not found, is only trusted if the
+     * index was at the generation of the db before and after the lookup */
+    if(!db_no_block_index && h->blockidx[hs][ndb] && !blockidx_getgen(h, hs, ndb, &gen)) {
+	r = sx_blockidx_get(h->blockidx[hs][ndb], hash, &bno, &len);
+	if(r >= 0 && sx_blockidx_current(h->blockidx[hs][ndb], gen)) {
+	    if(!r)
+		return ENOENT;
+	    if(blockno)
+		*blockno = bno;
+	    if(clen)
+		*clen = len;
+	    return OK;
+	}
+    }
+
+    sqlite3_reset(q);
+    if(qbind_blob(q, ":hash", hash, sizeof(*hash)))
+	return FAIL_EINTERNAL;
+    r = qstep(q);
+    if(r == SQLITE_ROW) {
+	if(blockno)
+	    *blockno = sqlite3_column_int64(q, 0);
+	if(clen)
+	    *clen = sqlite3_column_int(q, 1);
+    }
+    sqlite3_reset(q);
+    if(r == SQLITE_ROW)
+	return OK;
+    if(r == SQLITE_DONE)
+	return ENOENT;
+    return FAIL_EINTERNAL;
+}
+
+/* Returns 1 if the blocks table of a datadb records the length of
+ * compressed blocks, 0 if not, -1 on error */
+static int blocks_have_clen(sxi_db_t *db) {
+    sqlite3_stmt *q = NULL;
+    int r, ret = 0;
+
+    if(qprep(db, &q, "PRAGMA table_info(blocks)"))
+	return -1;
+    while((r = qstep(q)) == SQLITE_ROW) {
+	const char *col = (const char *)sqlite3_column_text(q, 1);
+	if(col && !strcmp(col, "clen"))
+	    ret = 1;
+    }
+    if(r != SQLITE_DONE)
+	ret = -1;
+    qnullify(q);
+    return ret;
+}
+
+/* Returns 1 if the tmpfiles table records the position of the presence
+ * check, 0 if not, -1 on error */
+static int tmpfiles_have_checkpos(sxi_db_t *db) {
+    sqlite3_stmt *q = NULL;
+    int r, ret = 0;
+
+    if(qprep(db, &q, "PRAGMA table_info(tmpfiles)"))
+	return -1;
+    while((r = qstep(q)) == SQLITE_ROW) {
+	const char *col = (const char *)sqlite3_column_text(q, 1);
+	if(col && !strcmp(col, "checkpos"))
+	    ret = 1;
+    }
+    if(r != SQLITE_DONE)
+	ret = -1;
+    qnullify(q);
+    return ret;
+}
+
+/* The listing etag of a volume is derived from the number of its live file
+ * revisions and from the xor of the hashes of their names and revisions,
+ * which the metadbs keep per volume in the listsums table. Unlike a change
+ * sequence, these only depend on the files present and so match across the
+ * volnodes */
+static int listsum_hash(const char *name, const char *revision, uint8_t *hash) {
+    return sxi_sha1_calc(name, strlen(name) + 1, revision, strlen(revision), hash);
+}
+
+/* Recomputes the listing sums of a metadb from its files */
+static int listsums_rebuild(sxi_db_t *db) {
+    sqlite3_stmt *qsel = NULL, *qins = NULL;
+    uint8_t digest[SXI_SHA1_BIN_LEN], hash[SXI_SHA1_BIN_LEN];
+    int64_t volid = -1, nfiles = 0;
+    unsigned int i;
+    int r, ret = -1;
+
+    if(qprep(db, &qsel, "DELETE FROM listsums") || qstep_noret(qsel))
+	goto listsums_rebuild_fail;
+    qnullify(qsel);
+    if(qprep(db, &qsel, "SELECT volume_id, name, rev FROM files WHERE age >= 0 ORDER BY volume_id") ||
+       qprep(db, &qins, "INSERT INTO listsums (volume_id, nfiles, digest) VALUES (:volume, :nfiles, :digest)"))
+	goto listsums_rebuild_fail;
+    do {
+	const char *name = NULL, *rev = NULL;
+	r = qstep(qsel);
+	if(r == SQLITE_ROW) {
+	    name = (const char *)sqlite3_column_text(qsel, 1);
+	    rev = (const char *)sqlite3_column_text(qsel, 2);
+	    if(!name || !rev)
+		goto listsums_rebuild_fail;
+	} else if(r != SQLITE_DONE)
+	    goto listsums_rebuild_fail;
+	if(volid >= 0 && (r == SQLITE_DONE || sqlite3_column_int64(qsel, 0) != volid)) {
+	    sqlite3_reset(qins);
+	    if(qbind_int64(qins, ":volume", volid) || qbind_int64(qins, ":nfiles", nfiles) ||
+	       qbind_blob(qins, ":digest", digest, sizeof(digest)) || qstep_noret(qins))
+		goto listsums_rebuild_fail;
+	    volid = -1;
+	}
+	if(r == SQLITE_DONE)
+	    break;
+	if(volid < 0) {
+	    volid = sqlite3_column_int64(qsel, 0);
+	    nfiles = 0;
+	    memset(digest, 0, sizeof(digest));
+	}
+	if(listsum_hash(name, rev, hash))
+	    goto listsums_rebuild_fail;
+	for(i=0; i<sizeof(digest); i++)
+	    digest[i] ^= hash[i];
+	nfiles++;
+    } while(1);
+    ret = 0;
+
+ listsums_rebuild_fail:
+    qnullify(qsel);
+    qnullify(qins);
+    return ret;
+}
+
+/* Returns 1 if the db has the given table or index, 0 if not and -1 on error */
+static int db_has_object(sxi_db_t *db, const char *type, const char *name) {
+    sqlite3_stmt *q = NULL;
+    int ret;
+
+    if(qprep(db, &q, "SELECT COUNT(*) FROM sqlite_master WHERE type = :type AND name = :name") ||
+       qbind_text(q, ":type", type) || qbind_text(q, ":name", name) || qstep_ret(q)) {
+	qnullify(q);
+	return -1;
+    }
+    ret = sqlite3_column_int(q, 0) != 0;
+    qnullify(q);
+    return ret;
+}
+
+static int db_has_table(sxi_db_t *db, const char *table) {
+    return db_has_object(db, "table", table);
+}
+
+/* Returns 2 if the directory index of a metadb is maintained, 1 if the dirs
+ * table exists but the index was never built, 0 if the metadb lacks the
+ * table and -1 on error */
+static int metadb_dir_index(sxi_db_t *db) {
+    sqlite3_stmt *q = NULL;
+    int ret;
+
+    if(qprep(db, &q, "SELECT (SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'dirs'), (SELECT value FROM hashfs WHERE key = 'dir_index')") || qstep_ret(q)) {
+	qnullify(q);
+	return -1;
+    }
+    if(!sqlite3_column_int(q, 0))
+	ret = 0;
+    else
+	ret = sqlite3_column_int(q, 1) ? 2 : 1;
+    qnullify(q);
+    return ret;
+}
+
+sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
+    unsigned int dirlen, pathlen, i, j;
+    int64_t idxgen;
+    sqlite3_stmt *q = NULL;
+    char *path, dbitem[64], qrybuff[512];
+    sx_hashfs_version_t curver;
+    const char *str;
+    char bootid[40];
+    sx_hashfs_t *h;
+    struct timeval tv0, tv1;
+    struct flock fl;
+    int r;
+
+    if(!dir || !(dirlen = strlen(dir))) {
+	CRIT("Bad path");
+	return NULL;
+    }
+    gettimeofday(&tv0, NULL);
+    if (ssl_version_check())
+	return NULL;
+    if(sx_hashfs_version_parse(&curver, HASHFS_VERSION_CURRENT, -1)) {
+	CRIT("Cannot parse version %s", HASHFS_VERSION_CURRENT);
+	return NULL;
+    }
+    if(!(h = wrap_calloc(1, sizeof(*h))))
+	return NULL;
+    memset(h->datafd, -1, sizeof(h->datafd));
+    h->lockfd = -1;
+    h->sx = NULL;
+    h->job_trigger = h->xfer_trigger = h->gc_trigger = h->gc_expire_trigger = h->hbeat_trigger = -1;
+    /* TODO: read from hashfs kv store */
+    h->upload_minspeed = GC_UPLOAD_MINSPEED;
+
+    dirlen++;
+    pathlen = 1024;
+    if(!(path = wrap_malloc(dirlen + pathlen)))
+	goto open_hashfs_fail;
+    h->dir = strdup(dir);
+    if (!h->dir)
+        goto open_hashfs_fail;
+
+    sprintf(path, "%s/hashfs.lock", dir);
+    h->lockfd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(h->lockfd < 0) {
         WARN("Failed to open %s lockfile: %s", path, strerror(errno));
         goto open_hashfs_fail;
     }
@@ -1713,6 +2763,7 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     sprintf(path, "%s/hashfs.db", dir);
     if(qopen(path, &h->db, "hashfs", NULL, &curver))
 	goto open_hashfs_fail;
+    cluster_gen_map(h, dir);
     if(qprep(h->db, &q, "PRAGMA foreign_keys = ON") || qstep_noret(q))
 	goto open_hashfs_fail;
     qnullify(q);
@@ -1739,6 +2790,8 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 	CRIT("Failed to retrieve HashFS version from database");
 	goto open_hashfs_fail;
     }
+    if(get_shard_counts(h->q_getval, &h->metadbs, &h->hashdbs))
+	goto open_hashfs_fail;
 
     if(qprep(h->db, &q, "SELECT key FROM users WHERE uid = 0 AND role = "STRIFY(ROLE_CLUSTER)" AND enabled = 1") || qstep_ret(q)) {
 	CRIT("Failed to retrieve cluster key from database");
@@ -1828,10 +2881,14 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
      * This is preliminary enforced in auth_begin */
     if(qprep(h->db, &h->q_nextvol, "SELECT volumes.vid, volumes.volume, volumes.replica, volumes.cursize, volumes.maxsize, volumes.owner_id, volumes.revs, volumes.changed, volumes.cursize_files, volumes.nfiles, volumes.global_id, volumes.prev_replica FROM volumes LEFT JOIN privs ON privs.volume_id = volumes.vid WHERE volumes.volume > :previous AND volumes.enabled = 1 AND (:user_first IS NULL OR (privs.priv > 0 AND privs.user_id IN (SELECT uid FROM users WHERE user >= :user_first and user <= :user_last))) ORDER BY volumes.volume ASC LIMIT 1"))
 	goto open_hashfs_fail;
+    if(qprep(h->db, &h->q_nextchangedvol, "SELECT vid, volume, replica, cursize, maxsize, owner_id, revs, changed, cursize_files, nfiles, global_id, prev_replica FROM volumes WHERE vid > :previous AND enabled = 1 AND changed > 0 AND changed >= :since ORDER BY vid ASC LIMIT 1"))
+	goto open_hashfs_fail;
     if(qprep(h->db, &h->q_volbyname, "SELECT vid, volume, replica, cursize, maxsize, owner_id, revs, changed, volumes.cursize_files, volumes.nfiles, volumes.global_id, volumes.prev_replica FROM volumes WHERE volume = :name AND enabled = 1"))
 	goto open_hashfs_fail;
     if(qprep(h->db, &h->q_volbyid, "SELECT vid, volume, replica, cursize, maxsize, owner_id, revs, changed, volumes.cursize_files, volumes.nfiles, volumes.global_id, volumes.prev_replica FROM volumes WHERE vid = :volid AND enabled = 1"))
 	goto open_hashfs_fail;
+    if(qprep(h->db, &h->q_volusage, "SELECT cursize, cursize_files, nfiles, changed FROM volumes WHERE vid = :volid AND enabled = 1"))
+	goto open_hashfs_fail;
     if(qprep(h->db, &h->q_volbygid, "SELECT vid, volume, replica, cursize, maxsize, owner_id, revs, changed, volumes.cursize_files, volumes.nfiles, volumes.global_id, volumes.prev_replica FROM volumes WHERE global_id = :global_id AND enabled = 1"))
         goto open_hashfs_fail;
     if(qprep(h->db, &h->q_vmetaget, "SELECT key, value FROM vmeta WHERE volume_id = :volume"))
@@ -1892,6 +2949,10 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 
     if(!(h->tempdb = open_db(dir, "tempdb", &h->cluster_uuid, &curver, h->q_getval)))
         goto open_hashfs_fail;
+    if(tmpfiles_have_checkpos(h->tempdb) != 1) {
+	CRIT("The temporary file database lacks the presence check positions: please run 'sxadm node --upgrade'");
+	goto open_hashfs_fail;
+    }
     /* needed for ON DELETE CASCADE to work */
     if(qprep(h->tempdb, &q, "PRAGMA foreign_keys = ON") || qstep_noret(q))
 	goto open_hashfs_fail;
@@ -1921,7 +2982,11 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
         goto open_hashfs_fail;
     if(qprep(h->tempdb, &h->qt_tmpdata, "SELECT t || ':' || token AS revision, name, size, volume_id, content, uniqidx, flushed, avail, token, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM tmpmeta WHERE tmpmeta.tid = tmpfiles.tid),0) FROM tmpfiles WHERE tid = :id"))
 	goto open_hashfs_fail;
-    if(qprep(h->tempdb, &h->qt_updateuniq, "UPDATE tmpfiles SET uniqidx = :uniq, avail = :avail WHERE tid = :id AND flushed = 1"))
+    if(qprep(h->tempdb, &h->qt_tmpinfo, "SELECT t || ':' || token AS revision, name, size, volume_id, flushed, LENGTH(content), LENGTH(uniqidx), LENGTH(avail), checkpos FROM tmpfiles WHERE tid = :id"))
+	goto open_hashfs_fail;
+    if(qprep(h->tempdb, &h->qt_updateavail, "UPDATE tmpfiles SET avail = :avail, checkpos = 0 WHERE tid = :id AND flushed = 1"))
+	goto open_hashfs_fail;
+    if(qprep(h->tempdb, &h->qt_setcheckpos, "UPDATE tmpfiles SET checkpos = :pos WHERE tid = :id AND flushed = 1"))
 	goto open_hashfs_fail;
     if(qprep(h->tempdb, &h->qt_flush, "UPDATE tmpfiles SET flushed = 1 WHERE tid = :id"))
 	goto open_hashfs_fail;
@@ -1930,94 +2995,57 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     if(qprep(h->tempdb, &h->qt_gc_revisions, "DELETE FROM tmpfiles WHERE ttl < :now AND ttl > 0"))
 	goto open_hashfs_fail;
 
-    if(!(h->blockbuf = wrap_malloc(bsz[SIZES-1])))
+    if(!(h->blockbuf = wrap_malloc(bsz[SIZE_LARGEST])))
 	goto open_hashfs_fail;
 
+    get_bootid(bootid, sizeof(bootid));
     for(j=0; j<SIZES; j++) {
 	char hexsz[9];
 	sprintf(hexsz, "%08x", bsz[j]);
-	for(i=0; i<HASHDBS; i++) {
+	sprintf(dbitem, "datadir_%c", sizedirs[j]);
+	sqlite3_reset(h->q_getval);
+	if(qbind_text(h->q_getval, ":k", dbitem))
+	    goto open_hashfs_fail;
+	r = qstep(h->q_getval);
+	if(r == SQLITE_ROW) {
+	    str = (const char *)sqlite3_column_text(h->q_getval, 0);
+	    if(!str || *str != '/' || !(h->datadir[j] = wrap_strdup(str))) {
+		sqlite3_reset(h->q_getval);
+		CRIT("Bad datafile directory for %s blocks", sizelongnames[j]);
+		goto open_hashfs_fail;
+	    }
+	}
+	sqlite3_reset(h->q_getval);
+	if(r != SQLITE_ROW && r != SQLITE_DONE)
+	    goto open_hashfs_fail;
+	for(i=0; i<h->hashdbs; i++) {
 	    sx_hashfs_version_t binver;
 	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
+	    if(!i) {
+		/* Size classes added later are created by sxadm node --upgrade */
+		sqlite3_reset(h->q_getval);
+		if(qbind_text(h->q_getval, ":k", dbitem) || qstep(h->q_getval) != SQLITE_ROW) {
+		    sqlite3_reset(h->q_getval);
+		    CRIT("The storage lacks the databases for %s blocks: please run 'sxadm node --upgrade'", sizelongnames[j]);
+		    goto open_hashfs_fail;
+		}
+		sqlite3_reset(h->q_getval);
+	    }
 	    if(!(h->datadb[j][i] = open_db(dir, dbitem, &h->cluster_uuid, &curver, h->q_getval)))
 		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_nextavail[j][i], "SELECT blocknumber FROM avail ORDER BY blocknumber ASC LIMIT 1"))
+	    if(blocks_have_clen(h->datadb[j][i]) != 1) {
+		CRIT("The %s database #%u cannot hold compressed blocks: please run 'sxadm node --upgrade'", sizelongnames[j], i);
 		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_nextalloc[j][i], "SELECT value FROM hashfs WHERE key = 'next_blockno'"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_add[j][i], "INSERT OR IGNORE INTO blocks(hash, blockno, created_at) VALUES(:hash, :next, :now)"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_setfree[j][i], "INSERT OR IGNORE INTO avail VALUES(:blockno)"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_gc1[j][i], "DELETE FROM blocks WHERE id = :blockid"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_get[j][i], "SELECT blockno FROM blocks WHERE hash = :hash AND blockno IS NOT NULL"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_bumpavail[j][i], "DELETE FROM avail WHERE blocknumber = :next"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_bumpalloc[j][i], "UPDATE hashfs SET value = value + 1 WHERE key = 'next_blockno'"))
-		goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_addtoken[j][i], "INSERT OR IGNORE INTO revision_ops(revision_id, op, age) VALUES(:revision_id, :op, :age)"))
-                goto open_hashfs_fail;
-            /* OR IGNORE to avoid subjournal */
-            if(qprep(h->datadb[j][i], &h->qb_moduse[j][i], "INSERT OR IGNORE INTO revision_blocks(revision_id, blocks_hash, age, replica, global_vol_id) VALUES(:revision_id, :hash, :age, :replica, :global_vol_id)"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_reserve[j][i], "INSERT OR IGNORE INTO reservations(reservations_id, revision_id, ttl) VALUES(:reserve_id, :revision_id, :ttl)"))
-                goto open_hashfs_fail;
-            /* Select just the revisions that are part of a fully uploaded file (i.e. no reservations).
-               if a hash has both reservations (incomplete upload), and fully uploaded references, this returns just the fully uploaded references.
-               As long as file flush atomically checks for presence and bumps reference counter there shouldn't be race conditions here.
-            */
-            if(qprep(h->datadb[j][i], &h->qb_get_meta[j][i], "SELECT replica, SUM(op), revision_blocks.revision_id, revision_blocks.global_vol_id FROM revision_blocks INNER JOIN revision_ops ON revision_blocks.revision_id=revision_ops.revision_id NATURAL LEFT JOIN reservations WHERE blocks_hash=:hash AND revision_blocks.age < :current_age AND reservations_id IS NULL GROUP BY revision_blocks.revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_get_meta_volrep[j][i], "SELECT replica, SUM(op), revision_blocks.revision_id, revision_blocks.global_vol_id FROM revision_blocks INNER JOIN revision_ops ON revision_blocks.revision_id=revision_ops.revision_id NATURAL LEFT JOIN reservations WHERE blocks_hash=:hash AND reservations_id IS NULL GROUP BY revision_blocks.revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->rit.q[j][i], "SELECT hash FROM blocks WHERE hash > :prevhash"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->rit.q_num[j][i], "SELECT COUNT(hash) FROM blocks")) /* SLOWQ */
-                goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_del_reserve[j][i], "DELETE FROM reservations WHERE reservations_id=:reserve_id"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_find_unused_revision[j][i], "SELECT revision_id FROM revision_ops WHERE revision_id IN (SELECT revision_id FROM revision_ops NATURAL LEFT JOIN reservations WHERE op in (-1, 0) AND age <= :age AND revision_id > :last_revision_id AND reservations_id IS NULL) GROUP BY revision_id HAVING SUM(op)=0 ORDER BY revision_id"))
+	    }
+	    if(db_has_table(h->datadb[j][i], "pending_free") != 1) {
+		CRIT("The %s database #%u lacks the pending free slots: please run 'sxadm node --upgrade'", sizelongnames[j], i);
 		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_find_unused_block[j][i], "SELECT id, blockno, hash FROM blocks LEFT JOIN revision_blocks ON blocks.hash=blocks_hash WHERE id  > :last AND revision_id IS NULL ORDER BY id"))
+	    }
+	    /* Without it every online compaction step scans the whole table */
+	    if(db_has_object(h->datadb[j][i], "index", "blocks_blockno") != 1) {
+		CRIT("The %s database #%u lacks the index over the block positions: please run 'sxadm node --upgrade'", sizelongnames[j], i);
 		goto open_hashfs_fail;
-
-	    /*
-	       This is a much faster version of the next query which however may return dups:
-	       SELECT id, blockno, hash FROM revision_blocks AS a LEFT JOIN revision_blocks AS b ON b.blocks_hash=a.blocks_hash AND b.revision_id <> a.revision_id JOIN blocks ON blocks.hash = a.blocks_hash WHERE a.revision_id=:revision_id AND b.revision_id IS NULL
-	    */
-            if(qprep(h->datadb[j][i], &h->qb_find_gc_block[j][i], "SELECT id, blockno, hash FROM blocks WHERE hash IN ( SELECT blocks_hash FROM revision_blocks WHERE blocks_hash IN ( SELECT blocks_hash from revision_blocks where revision_id=:revision_id ) GROUP BY blocks_hash HAVING revision_id=:revision_id AND COUNT(*)=1 )"))
-                goto open_hashfs_fail;
-
-            /* hash moved,
-             * hashes that are not moved don't have the old counters deleted,
-             * and must be taken into account when GCing!
-             * this is to avoid updating the entire table during rebalance
-             * */
-            if(qprep(h->datadb[j][i], &h->qb_deleteold[j][i], "DELETE FROM revision_blocks WHERE blocks_hash=:hash AND age < :current_age"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_find_expired_reservation[j][i], "SELECT reservations_id, revision_id FROM reservations NATURAL INNER JOIN revision_blocks INNER JOIN blocks ON blocks.hash = blocks_hash WHERE reservations_id > :lastreserve_id GROUP BY reservations_id HAVING MAX(created_at) < :expires ORDER BY reservations_id LIMIT 1"))
-               goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_find_expired_reservation2[j][i], "SELECT revision_id from reservations WHERE ttl < :now LIMIT 1"))
-               goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_revision_blocks[j][i], "DELETE FROM revision_blocks WHERE revision_id=:revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_revision[j][i], "DELETE FROM revision_ops WHERE revision_id=:revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_reserve[j][i], "DELETE FROM reservations WHERE revision_id=:revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_upgrade_2_1_4_revid_update[j][i], "UPDATE revision_blocks SET global_vol_id = :global_vol_id WHERE revision_id = :revision_id"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_volrep_block_by_global_vol_id[j][i], "SELECT blocks_hash FROM revision_blocks WHERE global_vol_id = :global_vol_id AND blocks_hash > :prevhash"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_volrep_release_revid_blocks[j][i], "DELETE FROM revision_blocks WHERE blocks_hash = :hash"))
-                goto open_hashfs_fail;
-
-	    /* Note: we do not want an index on global_vol_id since it is only used during volume replica changes
-	       and it would be pointlessly expensive to maintain under normal usage */
-            if(qprep(h->datadb[j][i], &h->qb_volrep_update_replica[j][i], "UPDATE revision_blocks SET replica = :next_replica WHERE global_vol_id = :global_vol_id AND replica = :prev_replica")) /* SLOWQ */
-                goto open_hashfs_fail;
+	    }
 
 	    sprintf(dbitem, "datafile_%c_%08x", sizedirs[j], i);
 	    sqlite3_reset(h->q_getval);
@@ -2043,6 +3071,10 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 		perror("open");
 		goto open_hashfs_fail;
 	    }
+	    if(!(h->datapath[j][i] = realpath(str, NULL))) {
+		CRIT("Failed to resolve datafile path %s: %s", str, strerror(errno));
+		goto open_hashfs_fail;
+	    }
 	    if(read_block(h->datafd[j][i], h->blockbuf, 0, bsz[j]))
 		goto open_hashfs_fail;
 	    if(sx_hashfs_version_parse(&binver, h->blockbuf, 16)) {
@@ -2056,10 +3088,22 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 		CRIT("Bad header in datafile %s (version %s)", str, binver.fullstr);
 		goto open_hashfs_fail;
 	    }
+
+	    if(!(h->blockidx[j][i] = blockidx_open(h, j, i, &curver, bootid)))
+		goto open_hashfs_fail;
+	    /* The free slot map is loaded on first use, within the write lock */
+	    h->freemap_gen[j][i] = -1;
+	    /* The index is shared: only the first process to find it stale
+	     * takes the lock and rebuilds it, the others just check it */
+	    if((blockidx_getgen(h, j, i, &idxgen) || !sx_blockidx_current(h->blockidx[j][i], idxgen)) &&
+	       !qbegin(h->datadb[j][i])) {
+		blockidx_prepare(h, j, i, 0, &idxgen);
+		qrollback(h->datadb[j][i]);
+	    }
 	}
     }
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	sprintf(dbitem, "metadb_%08x", i);
 	if(!(h->metadb[i] = open_db(dir, dbitem, &h->cluster_uuid, &curver, h->q_getval)))
 	    goto open_hashfs_fail;
@@ -2068,79 +3112,30 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 	qnullify(q);
         if(sqlite3_create_function(h->metadb[i]->handle, "pmatch", 4, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, pmatch, NULL, NULL))
             goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_ins[i], "INSERT INTO files (volume_id, name, size, content, rev, revision_id, age) VALUES (:volume, :name, :size, :hashes, :revision, :revision_id, :age)"))
-	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list[i], "SELECT name, size, rev, revision_id FROM files WHERE volume_id = :volume AND name > :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list_eq[i], "SELECT name, size, rev, revision_id FROM files WHERE volume_id = :volume AND name >= :previous AND (:limit is NULL OR name < :limit) AND pmatch(name, :pattern, :pattern_slashes, :slash_ending) > 0 AND age >= 0 GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT 2"))
-            goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_listrevs[i], "SELECT size, rev, revision_id FROM files WHERE volume_id = :volume AND name = :name AND rev > :previous AND age >= 0 ORDER BY rev ASC LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_get[i], "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0) FROM files WHERE volume_id = :volume AND name = :name AND age >= 0 GROUP BY name HAVING rev = MAX(rev) LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_listrevs_rev[i], "SELECT size, rev, revision_id FROM files WHERE volume_id = :volume AND name = :name AND (:previous IS NULL OR rev < :previous) AND age >= 0 ORDER BY rev DESC LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_getrev[i], "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0), age, revision_id FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision AND age >= 0 LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_getrev_or_tombstone[i], "SELECT fid, size, content, rev, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = fid),0), age, revision_id FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_findrev[i], "SELECT volume_id, name, size, revision_id FROM files WHERE rev = :revision AND age >= 0 LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_oldrevs[i], "SELECT rev, size, (SELECT COUNT(*) FROM files AS b WHERE b.volume_id = a.volume_id AND b.name = a.name AND age >= 0), fid, LENGTH(CAST(name AS BLOB)) + size + COALESCE((SELECT SUM(LENGTH(CAST(key AS BLOB)) + LENGTH(value)) FROM fmeta WHERE file_id = a.fid),0) FROM files AS a WHERE a.volume_id = :volume AND a.name = :name AND age >= 0 ORDER BY rev ASC"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metaget[i], "SELECT key, value FROM fmeta WHERE file_id = :file"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metaset[i], "INSERT OR REPLACE INTO fmeta (file_id, key, value) VALUES (:file, :key, :value)"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metadel[i], "DELETE FROM fmeta WHERE file_id = :file AND key = :key"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delfile[i], "DELETE FROM files WHERE fid = :file AND age >= 0"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_del_tombstone[i], "DELETE FROM files WHERE fid = :file AND age < 0"))
-	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_mvfile[i], "UPDATE files SET name = :newname, rev = :newrev WHERE name = :oldname AND rev = :rev AND age >= 0"))
-            goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_wiperelocs[i], "DELETE FROM relocs"))
+	if((r = metadb_dir_index(h->metadb[i])) < 0)
 	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_countrelocs[i], "SELECT COUNT(*) FROM relocs"))
+	if(!r) {
+	    CRIT("The file database #%u lacks the directory tables: please run 'sxadm node --upgrade'", i);
 	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_addrelocs[i], "INSERT INTO relocs (file_id, dest) SELECT fid, :node FROM files WHERE volume_id = :volid AND age >= 0"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_getreloc[i], "SELECT file_id, dest, volume_id, name, size, rev, content, revision_id, age FROM relocs LEFT JOIN files ON relocs.file_id = files.fid WHERE file_id > :prev LIMIT 1"))
+	}
+	h->dir_index[i] = r == 2;
+	if((r = db_has_table(h->metadb[i], "listsums")) < 0)
 	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delreloc[i], "DELETE FROM relocs WHERE file_id = :fileid"))
+	if(!r) {
+	    CRIT("The file database #%u lacks the listing sums: please run 'sxadm node --upgrade'", i);
 	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delbyvol[i], "DELETE FROM files WHERE volume_id = :volid"))
+	}
+	if((r = db_has_table(h->metadb[i], "file_chunks")) < 0)
 	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_sumfilesizes[i], "SELECT SUM(files.size + LENGTH(CAST(files.name AS BLOB))) + SUM(COALESCE((SELECT SUM(LENGTH(CAST(fmeta.key AS BLOB)) + LENGTH(CAST(fmeta.value AS BLOB))) FROM fmeta WHERE fmeta.file_id = files.fid), 0)), SUM(files.size), COUNT(*) FROM files WHERE files.volume_id = :volid AND age >= 0"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_newest[i], "SELECT MAX(rev) FROM files WHERE volume_id = :volid AND age >= 0"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_count[i], "SELECT COUNT(rev) FROM files WHERE volume_id = :volid AND age >= 0"))
+	if(!r) {
+	    CRIT("The file database #%u lacks the file chunks: please run 'sxadm node --upgrade'", i);
 	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list_rev_dec[i], "SELECT size, rev, content, revision_id FROM files WHERE volume_id=:volid AND name = :name AND rev < :maxrev AND age >= 0 ORDER BY rev DESC LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list_file[i], "SELECT size, rev, content, name, revision_id FROM files WHERE volume_id=:volid AND name > :previous AND rev < :maxrev AND age >= 0 ORDER BY name ASC, rev DESC LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_del_heal[i], "DELETE FROM heal WHERE revision_id=:revision_id"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_add_heal[i], "INSERT OR IGNORE INTO heal(revision_id, remote_volume, blocks, blocksize, replica_count) VALUES(:revision_id, :remote_volid, :blocks, :blocksize, :replica_count)"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_get_rb[i], "SELECT size, revision_id, content, name FROM files WHERE volume_id=:volume_id AND age < :age_limit AND revision_id > :min_revision_id AND age >= 0 ORDER BY revision_id"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_count_rb[i], "SELECT COUNT(revision_id) FROM files WHERE volume_id=:volume_id AND age < :age_limit AND revision_id > :min_revision_id AND age >= 0 ORDER BY revision_id"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_add_heal_volume[i], "INSERT OR REPLACE INTO heal_volume(name, max_age, min_revision) VALUES(:name,:max_age,:min_revision_id)"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_sel_heal_volume[i], "SELECT name, max_age, min_revision FROM heal_volume WHERE name > :prev")) /* SLOWQ */
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_upd_heal_volume[i], "UPDATE heal_volume SET min_revision=:min_revision_id WHERE name=:name")) /* SLOWQ */
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_del_heal_volume[i], "DELETE FROM heal_volume WHERE name=:name")) /* SLOWQ */
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_needs_upgrade[i], "SELECT fid, volume_id, name, rev, size FROM files WHERE revision_id IS NULL AND age >= 0")) /* SLOWQ */
-            goto open_hashfs_fail;
+	}
     }
+    h->dir_index_all = 1;
+    for(i=0; i<h->metadbs; i++)
+	if(!h->dir_index[i])
+	    h->dir_index_all = 0;
 
     if(!(h->eventdb = open_db(dir, "eventdb", &h->cluster_uuid, &curver, h->q_getval)))
         goto open_hashfs_fail;
@@ -2223,7 +3218,11 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     qnullify(q);
     sqlite3_reset(h->q_getval);
 
+    DEBUG("Using the %s SHA1 implementation for block hashing", sx_sha1batch_impl());
     free(path);
+    gettimeofday(&tv1, NULL);
+    h->open_time = timediff(&tv0, &tv1);
+    DEBUG("HashFS opened in %.3fs (%u statements prepared)", h->open_time, h->nprepared);
     return h;
 
 open_hashfs_fail:
@@ -2241,11 +3240,16 @@ open_hashfs_fail:
 }
 
 int sx_hashfs_distcheck(sx_hashfs_t *h) {
+    uint64_t gen;
     int ret = 0;
 
     if(!h)
 	return 0;
 
+    gen = cluster_gen(h, GEN_CLUSTER);
+    if(gen && gen == h->dist_gen)
+	return 0;
+
     sqlite3_reset(h->q_gethdrev);
     switch(qstep(h->q_gethdrev)) {
     case SQLITE_DONE:
@@ -2261,6 +3265,8 @@ int sx_hashfs_distcheck(sx_hashfs_t *h) {
 
     if(ret && load_config(h, h->sx))
 	ret = -1;
+    if(ret >= 0)
+	h->dist_gen = gen;
 
     return ret; /* return 0 = no change, 1 = hdist-change, -1 = error */
 }
@@ -2317,6 +3323,20 @@ void sx_hashfs_set_triggers(sx_hashfs_t *h, int job_trigger, int xfer_trigger, i
     set_nonblock(hbeat_trigger);
 }
 
+static void reshard_unlink(const char *path) {
+    char *aux = wrap_malloc(strlen(path) + sizeof("-wal"));
+
+    if(unlink(path) && errno != ENOENT)
+	PWARN("Cannot remove %s", path);
+    if(!aux)
+	return;
+    sprintf(aux, "%s-wal", path);
+    unlink(aux);
+    sprintf(aux, "%s-shm", path);
+    unlink(aux);
+    free(aux);
+}
+
 void sx_hashfs_close(sx_hashfs_t *h) {
     if(!h)
 	return;
@@ -2334,8 +3354,18 @@ void sx_hashfs_close(sx_hashfs_t *h) {
     sx_nodelist_delete(h->ignored_nodes);
 
     close_all_dbs(h);
+    sx_blockio_free(h->blockio);
+    if(h->dropfiles) {
+	unsigned int i;
+	for(i=0; i<h->ndropfiles; i++) {
+	    reshard_unlink(h->dropfiles[i]);
+	    free(h->dropfiles[i]);
+	}
+	free(h->dropfiles);
+    }
 
     free(h->blockbuf);
+    free(h->list_rows);
 /*    if(h->sx)
 	sx_shutdown(h->sx, 0);
     do not free sx here: it is not owned by hashfs.c!
@@ -2386,6 +3416,7 @@ rc_ty sx_storage_activate(sx_hashfs_t *h, const char *name, const sx_node_t *fir
 
     if(qbegin(h->db))
 	return FAIL_EINTERNAL;
+    cluster_gen_touch(h, GEN_CLUSTER);
 
     admin_uid = hash.b;
     if(sx_hashfs_hash_buf(NULL, 0, "admin", 5, &hash)) {
@@ -2447,6 +3478,10 @@ rc_ty sx_storage_activate(sx_hashfs_t *h, const char *name, const sx_node_t *fir
     if(update_raft_timeout(h) != OK)
         goto storage_activate_fail;
 
+    /* All the nodes of a new cluster know the 64k and 256k classes */
+    if(sx_hashfs_cluster_settings_set_bool(h, "blocksizes_64k_256k", 1))
+	goto storage_activate_fail;
+
     if(qcommit(h->db))
 	goto storage_activate_fail;
 
@@ -2467,12 +3502,12 @@ rc_ty sx_storage_activate(sx_hashfs_t *h, const char *name, const sx_node_t *fir
 
 #define BS_UPPER_BOUND 128*1024*1024
 #define BS_LOWER_BOUND 128*1024
+/* The largest file stored in each size class */
+static const uint64_t size_limits[SIZES] = { BS_LOWER_BOUND - 1, 2*1024*1024, 16*1024*1024, BS_UPPER_BOUND, UINT64_MAX };
+
 static unsigned int size_to_blocks(uint64_t size, unsigned int *size_type, unsigned int *block_size) {
-    unsigned int ret, sizenum = 1, bs;
-    if(size > BS_UPPER_BOUND)
-	sizenum = 2;
-    else if(size < BS_LOWER_BOUND)
-	sizenum = 0;
+    unsigned int ret, sizenum, bs;
+    for(sizenum = 0; size > size_limits[sizenum]; sizenum++);
     bs = bsz[sizenum];
     ret = size / bs;
     if(size % bs)
@@ -2484,7 +3519,163 @@ static unsigned int size_to_blocks(uint64_t size, unsigned int *size_type, unsig
     return ret;
 }
 
-int64_t sx_hashfs_growable_filesize(void) {
+/* Same as size_to_blocks() for a stored file made of nblocks blocks
+ * Before the 64k and 256k classes existed all the files between
+ * BS_LOWER_BOUND and BS_UPPER_BOUND were stored with medium blocks: such
+ * files are told apart by their block count, which never matches that
+ * of a larger class */
+static unsigned int file_to_blocks(uint64_t size, unsigned int nblocks, unsigned int *size_type, unsigned int *block_size) {
+    unsigned int ret = size_to_blocks(size, size_type, block_size);
+
+    if(ret != nblocks && size >= BS_LOWER_BOUND && size <= BS_UPPER_BOUND &&
+       (size + SX_BS_MEDIUM - 1) / SX_BS_MEDIUM == nblocks) {
+	ret = nblocks;
+	if(size_type)
+	    *size_type = SIZE_MEDIUM;
+	if(block_size)
+	    *block_size = SX_BS_MEDIUM;
+    }
+    return ret;
+}
+
+/* The block list of a file is normally kept in the content of its row;
+ * files above BS_UPPER_BOUND made of more than FILE_CHUNK_BLOCKS blocks
+ * instead have an empty content and their hashes split in file_chunks, so
+ * that they can be read piecewise. The block count of such files only
+ * depends on their size, see file_to_blocks() */
+static int file_is_chunked(int64_t size, unsigned int content_len) {
+    return !content_len && size > BS_UPPER_BOUND;
+}
+
+static int file_wants_chunks(int64_t size, unsigned int nblocks) {
+    return size > BS_UPPER_BOUND && nblocks > FILE_CHUNK_BLOCKS;
+}
+
+/* Splits the block list of a new file into its chunks */
+static rc_ty file_chunks_store(sx_hashfs_t *h, unsigned int mdb, int64_t fid, const sx_hash_t *blocks, unsigned int nblocks) {
+    sqlite3_stmt *q = qlazy(h, h->qm_addchunk[mdb]);
+    unsigned int chunk, n;
+
+    for(chunk = 0; chunk * FILE_CHUNK_BLOCKS < nblocks; chunk++) {
+	n = MIN(nblocks - chunk * FILE_CHUNK_BLOCKS, FILE_CHUNK_BLOCKS);
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":file", fid) || qbind_int(q, ":chunk", chunk) ||
+	   qbind_blob(q, ":hashes", blocks + chunk * FILE_CHUNK_BLOCKS, n * sizeof(*blocks)) ||
+	   qstep_noret(q)) {
+	    WARN("Failed to store chunk %u of file %lld", chunk, (long long)fid);
+	    sqlite3_reset(q);
+	    return FAIL_EINTERNAL;
+	}
+    }
+    sqlite3_reset(q);
+    return OK;
+}
+
+/* Reads count hashes of a chunked file starting with block first */
+static rc_ty file_chunks_read(sx_hashfs_t *h, unsigned int mdb, int64_t fid, unsigned int first, unsigned int count, sx_hash_t *out) {
+    sqlite3_stmt *q = qlazy(h, h->qm_getchunk[mdb]);
+    const sx_hash_t *hashes;
+    unsigned int skip, n;
+
+    while(count) {
+	skip = first % FILE_CHUNK_BLOCKS;
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":file", fid) || qbind_int(q, ":chunk", first / FILE_CHUNK_BLOCKS) ||
+	   qstep_ret(q))
+	    goto file_chunks_read_fail;
+	hashes = sqlite3_column_blob(q, 0);
+	n = sqlite3_column_bytes(q, 0) / sizeof(*hashes);
+	if(!hashes || n <= skip)
+	    goto file_chunks_read_fail;
+	n = MIN(n - skip, count);
+	memcpy(out, hashes + skip, n * sizeof(*out));
+	out += n;
+	first += n;
+	count -= n;
+    }
+    sqlite3_reset(q);
+    return OK;
+
+ file_chunks_read_fail:
+    WARN("Failed to read block %u of file %lld", first, (long long)fid);
+    sqlite3_reset(q);
+    return FAIL_EINTERNAL;
+}
+
+/* Resolves the content of a file row into its whole block list: for chunked
+ * files content and content_len are replaced with a copy of the hashes held
+ * in *buf, which the caller must free */
+static rc_ty file_content_load(sx_hashfs_t *h, unsigned int mdb, int64_t fid, int64_t size, const void **content, unsigned int *content_len, sx_hash_t **buf) {
+    unsigned int nblocks;
+
+    *buf = NULL;
+    if(!file_is_chunked(size, *content_len))
+	return OK;
+    nblocks = size_to_blocks(size, NULL, NULL);
+    if(!(*buf = wrap_malloc(nblocks * sizeof(sx_hash_t))))
+	return ENOMEM;
+    if(file_chunks_read(h, mdb, fid, 0, nblocks, *buf)) {
+	free(*buf);
+	*buf = NULL;
+	return FAIL_EINTERNAL;
+    }
+    *content = *buf;
+    *content_len = nblocks * sizeof(sx_hash_t);
+    return OK;
+}
+
+/* Same as size_to_blocks() for a file about to be uploaded
+ * The 64k and 256k classes are only picked once the "blocksizes_64k_256k"
+ * cluster setting is on: nodes predating these classes don't know the
+ * setting and fail the job changing it, so it can't be turned on before the
+ * whole cluster is upgraded; until then such files keep using medium blocks */
+static unsigned int upload_to_blocks(sx_hashfs_t *h, uint64_t size, unsigned int *size_type, unsigned int *block_size) {
+    unsigned int ret, hs, bs;
+    int enabled;
+
+    ret = size_to_blocks(size, &hs, &bs);
+    if(size >= BS_LOWER_BOUND && size <= BS_UPPER_BOUND && hs != SIZE_MEDIUM &&
+       (sx_hashfs_cluster_settings_get_boolean(h, "blocksizes_64k_256k", &enabled) || !enabled)) {
+	hs = SIZE_MEDIUM;
+	bs = SX_BS_MEDIUM;
+	ret = (size + bs - 1) / bs;
+    }
+    if(size_type)
+	*size_type = hs;
+    if(block_size)
+	*block_size = bs;
+    return ret;
+}
+
+unsigned int sx_hashfs_blocksize(int64_t size) {
+    unsigned int bs;
+    size_to_blocks(size, NULL, &bs);
+    return bs;
+}
+
+unsigned int sx_hashfs_nsizes(void) {
+    return SIZES;
+}
+
+unsigned int sx_hashfs_size_blocksize(unsigned int hs) {
+    return hs < SIZES ? bsz[hs] : 0;
+}
+
+const char *sx_hashfs_size_name(unsigned int hs) {
+    return hs < SIZES ? sizelongnames[hs] : NULL;
+}
+
+static const char *datafile_dir(sx_hashfs_t *h, unsigned int hs) {
+    return h->datadir[hs] ? h->datadir[hs] : h->dir;
+}
+
+const char *sx_hashfs_size_datadir(sx_hashfs_t *h, unsigned int hs) {
+    if(!h || hs >= SIZES)
+	return NULL;
+    return datafile_dir(h, hs);
+}
+
+int64_t sx_hashfs_growable_filesize(void) {
     return BS_UPPER_BOUND + 1;
 }
 
@@ -2492,11 +3683,13 @@ static int cmphash(const void *a, const void *b) {
     return memcmp(a, b, sizeof(sx_hash_t));
 }
 
-static unsigned int gethashdb(const sx_hash_t *hash) {
-    return MurmurHash64(hash, sizeof(*hash), MURMUR_SEED) & (HASHDBS-1);
+/* Shard counts are powers of two, so that growing the count only splits
+ * each shard into several new ones */
+static unsigned int gethashdb(const sx_hash_t *hash, unsigned int ndbs) {
+    return MurmurHash64(hash, sizeof(*hash), MURMUR_SEED) & (ndbs-1);
 }
 
-static int getmetadb(const char *filename) {
+static int getmetadb(const char *filename, unsigned int ndbs) {
     sx_hash_t hash;
     if(hash_buf(NULL, 0, filename, strlen(filename), &hash)) {
 	msg_set_reason("Failed to locate metadb");
@@ -2504,7 +3697,7 @@ static int getmetadb(const char *filename) {
 	return -1;
     }
 
-    return MurmurHash64(&hash, sizeof(hash), MURMUR_SEED) & (METADBS-1);
+    return MurmurHash64(&hash, sizeof(hash), MURMUR_SEED) & (ndbs-1);
 }
 
 static rc_ty check_path_element(const char *name, unsigned name_min, unsigned name_max, const char *what, int path_check)
@@ -3104,7 +4297,7 @@ void sx_hashfs_stats(sx_hashfs_t *h)
     INFO("Volume#: %lld", get_count(h->db, "volumes"));
     INFO("Volume metadata#: %lld", get_count(h->db, "vmeta"));
     long long files = 0, fmeta = 0;
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	files += get_count(h->metadb[i], "files");
 	fmeta += get_count(h->metadb[i], "fmeta");
     }
@@ -3113,7 +4306,7 @@ void sx_hashfs_stats(sx_hashfs_t *h)
     INFO("Block counts:");
     for (j=0; j<SIZES; j++) {
 	long long blocks = 0;
-	for(i=0;i<HASHDBS;i++)
+	for(i=0;i<h->hashdbs;i++)
 	    blocks += get_count(h->datadb[j][i], "blocks");
 	INFO("\t%-8s (%8d byte) block#: %lld", sizelongnames[j], bsz[j], blocks);
     }
@@ -3220,13 +4413,13 @@ int sx_hashfs_analyze(sx_hashfs_t *h, int verbose)
         return -1;
     ret += r;
     unsigned i, j;
-    for(i=0; i<METADBS; i++)
+    for(i=0; i<h->metadbs; i++)
 	r = analyze_db(h->metadb[i], verbose);
         if(r == -1)
             return -1;
         ret += r;
     for (j=0; j<SIZES; j++) {
-	for(i=0;i<HASHDBS;i++) {
+	for(i=0;i<h->hashdbs;i++) {
 	    r = analyze_db(h->datadb[j][i], verbose);
             if(r == -1)
                 return -1;
@@ -3337,10 +4530,10 @@ static int check_file_hashes(sx_hashfs_t *h, int debug, const sx_hash_t *hashes,
 
     for(j = 0; j < hashes_count; j++) {
         const sx_hash_t* hash = hashes + j;
-        unsigned int ndb = gethashdb(hash);
+        unsigned int ndb = gethashdb(hash, h->hashdbs);
         int r;
         sxi_db_t *db = h->datadb[bs][ndb];
-        q = h->qb_get[bs][ndb];
+        q = qlazy(h, h->qb_get[bs][ndb]);
         char hex[SXI_SHA1_TEXT_LEN+1];
         sx_nodelist_t *hashnodes;
 
@@ -3452,8 +4645,8 @@ static int check_file_sizes(sx_hashfs_t *h, const sx_hashfs_volume_t *vol) {
         return 0;
 
     /* Sum up all files */
-    for(i = 0; i < METADBS; i++) {
-        q = h->qm_sumfilesizes[i];
+    for(i = 0; i < h->metadbs; i++) {
+        q = qlazy(h, h->qm_sumfilesizes[i]);
 
         sqlite3_reset(q);
         if(qbind_int64(q, ":volid", vol->id)) {
@@ -3633,8 +4826,9 @@ static int check_files(sx_hashfs_t *h, int debug) {
     int ret = 0, r;
     unsigned int i;
     const sx_hashfs_volume_t *vol = NULL;
+    sx_hash_t *chunks = NULL;
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
         sqlite3_stmt *list = NULL;
         int rows = 0;
 
@@ -3646,7 +4840,7 @@ static int check_files(sx_hashfs_t *h, int debug) {
 
         if(debug) {
             rows = get_count(h->metadb[i], "files");
-            CHECK_INFO("Checking consistency of %lld files in metadata database %u / %u...", (long long int)rows, i+1, METADBS);
+            CHECK_INFO("Checking consistency of %lld files in metadata database %u / %u...", (long long int)rows, i+1, h->metadbs);
         }
 
         while(1) {
@@ -3655,7 +4849,7 @@ static int check_files(sx_hashfs_t *h, int debug) {
             unsigned int listlen;
             r = qstep(list);
             unsigned int block_size, blocks;
-            const sx_hash_t *hashes;
+            const void *hashes;
             int64_t volid;
 
             if(r == SQLITE_DONE)
@@ -3674,17 +4868,22 @@ static int check_files(sx_hashfs_t *h, int debug) {
                 CHECK_ERROR("Found invalid name on row %lld in metadata database %08x: %s", (long long int)row, i, msg_get_reason());
 
             /* Check if current meta database is correct for given file */
-            if(getmetadb(name) != (int)i)
-                CHECK_ERROR("File %s is stored in metadata database %d, but should be stored in database %d", name, i, getmetadb(name));
+            if(getmetadb(name, h->metadbs) != (int)i)
+                CHECK_ERROR("File %s is stored in metadata database %d, but should be stored in database %d", name, i, getmetadb(name, h->metadbs));
 
             size = sqlite3_column_int64(list, 3);
             hashes = sqlite3_column_blob(list, 4);
+            listlen = sqlite3_column_bytes(list, 4);
+            free(chunks);
+            if(file_content_load(h, i, row, size, &hashes, &listlen, &chunks)) {
+                CHECK_ERROR("Failed to load the chunks of file %s", name);
+                continue;
+            }
             if(size && !hashes) {
                 CHECK_ERROR("Empty list of hashes for non-empty file %s", name);
                 continue;
             }
-            listlen = sqlite3_column_bytes(list, 4);
-            blocks = size_to_blocks(size, NULL, &block_size);
+            blocks = file_to_blocks(size, listlen / SXI_SHA1_BIN_LEN, NULL, &block_size);
             if(size < 0 || (listlen % SXI_SHA1_BIN_LEN) || blocks != listlen / SXI_SHA1_BIN_LEN)
                 CHECK_ERROR("Invalid size for file %s (row %lld) in metadata database %08x", name, (long long int)row, i);
 
@@ -3736,6 +4935,167 @@ static int check_files(sx_hashfs_t *h, int debug) {
     }
 
 check_files_err:
+    free(chunks);
+    return ret;
+}
+
+/* Compares the listing sums of a volume with those recounted from its files */
+static int check_listsums_volume(sx_hashfs_t *h, unsigned int mdb, int64_t volid, int64_t nfiles, const uint8_t *digest) {
+    sqlite3_stmt *q = qlazy(h, h->qm_getsums[mdb]);
+    uint8_t stored[SXI_SHA1_BIN_LEN];
+    int64_t snfiles = 0;
+    int ret = 0, r;
+
+    memset(stored, 0, sizeof(stored));
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", volid))
+        return -1;
+    r = qstep(q);
+    if(r == SQLITE_ROW) {
+        snfiles = sqlite3_column_int64(q, 0);
+        if(sqlite3_column_bytes(q, 1) == sizeof(stored))
+            memcpy(stored, sqlite3_column_blob(q, 1), sizeof(stored));
+    } else if(r != SQLITE_DONE)
+        ret = -1;
+    sqlite3_reset(q);
+    if(ret)
+        return ret;
+    if(snfiles != nfiles)
+        CHECK_ERROR("Listing sums of volume %lld in metadata database %u count %lld files, but %lld were found", (long long)volid, mdb, (long long)snfiles, (long long)nfiles);
+    else if(memcmp(stored, digest, sizeof(stored)))
+        CHECK_ERROR("Listing sums of volume %lld in metadata database %u do not match its files", (long long)volid, mdb);
+    return ret;
+}
+
+/* Check the listing sums the listing ETags are derived from */
+static int check_listsums(sx_hashfs_t *h, int debug) {
+    int ret = 0, r;
+    unsigned int i, j;
+    sqlite3_stmt *qsel = NULL, *qstale = NULL;
+    uint8_t digest[SXI_SHA1_BIN_LEN], hash[SXI_SHA1_BIN_LEN];
+
+    for(i=0; i<h->metadbs; i++) {
+        int64_t volid = -1, nfiles = 0;
+
+        if(qprep(h->metadb[i], &qsel, "SELECT volume_id, name, rev FROM files WHERE age >= 0 ORDER BY volume_id") ||
+           qprep(h->metadb[i], &qstale, "SELECT volume_id, nfiles FROM listsums WHERE nfiles != 0 AND volume_id NOT IN (SELECT volume_id FROM files WHERE age >= 0)")) {
+            ret = -1;
+            CHECK_FATAL("Failed to prepare queries");
+            goto check_listsums_err;
+        }
+        if(debug)
+            CHECK_INFO("Checking listing sums of metadata database %u / %u...", i+1, h->metadbs);
+
+        do {
+            const char *name = NULL, *rev = NULL;
+            r = qstep(qsel);
+            if(r == SQLITE_ROW) {
+                name = (const char *)sqlite3_column_text(qsel, 1);
+                rev = (const char *)sqlite3_column_text(qsel, 2);
+            } else if(r != SQLITE_DONE) {
+                ret = -1;
+                goto check_listsums_err;
+            }
+            if(volid >= 0 && (r == SQLITE_DONE || sqlite3_column_int64(qsel, 0) != volid)) {
+                int e = check_listsums_volume(h, i, volid, nfiles, digest);
+                if(e < 0) {
+                    ret = -1;
+                    goto check_listsums_err;
+                }
+                ret += e;
+                volid = -1;
+            }
+            if(r == SQLITE_DONE)
+                break;
+            CHECK_PGRS;
+            if(volid < 0) {
+                volid = sqlite3_column_int64(qsel, 0);
+                nfiles = 0;
+                memset(digest, 0, sizeof(digest));
+            }
+            if(!name || !rev || listsum_hash(name, rev, hash)) {
+                ret = -1;
+                goto check_listsums_err;
+            }
+            for(j=0; j<sizeof(digest); j++)
+                digest[j] ^= hash[j];
+            nfiles++;
+        } while(1);
+
+        while((r = qstep(qstale)) == SQLITE_ROW)
+            CHECK_ERROR("Listing sums of volume %lld in metadata database %u count %lld files, but none were found", (long long)sqlite3_column_int64(qstale, 0), i, (long long)sqlite3_column_int64(qstale, 1));
+        if(r != SQLITE_DONE) {
+            ret = -1;
+            goto check_listsums_err;
+        }
+        qnullify(qsel);
+        qnullify(qstale);
+    }
+
+check_listsums_err:
+    if(ret == -1)
+        CHECK_FATAL("Verification of listing sums in metadata database %08x aborted due to errors", i);
+    qnullify(qsel);
+    qnullify(qstale);
+    return ret;
+}
+
+/* Check the directory index against the files it counts */
+static int check_dirs(sx_hashfs_t *h, int debug) {
+    int ret = 0, r;
+    unsigned int i;
+    sqlite3_stmt *qcount = NULL, *qmissing = NULL;
+
+    for(i=0; i<h->metadbs; i++) {
+        int errs = ret;
+
+        if(!h->dir_index[i]) {
+            if(debug)
+                CHECK_INFO("Directory index of metadata database %u is not built, skipping", i);
+            continue;
+        }
+        /* Files below a dir sort between "dir/" and "dir0" */
+        if(qprep(h->metadb[i], &qcount, "SELECT d.volume_id, d.name, d.nfiles, (SELECT COUNT(*) FROM files f WHERE f.volume_id = d.volume_id AND f.name > d.name AND f.name < substr(d.name, 1, length(d.name) - 1) || '0' AND f.age >= 0) FROM dirs d") ||
+           /* Live files and dirs whose parent dir is not indexed */
+           qprep(h->metadb[i], &qmissing, "SELECT volume_id, name FROM files f WHERE age >= 0 AND depth > 0 AND NOT EXISTS (SELECT 1 FROM dirs d WHERE d.volume_id = f.volume_id AND d.name = rtrim(f.name, replace(f.name, '/', ''))) UNION ALL SELECT volume_id, name FROM dirs p WHERE depth > 1 AND NOT EXISTS (SELECT 1 FROM dirs d WHERE d.volume_id = p.volume_id AND d.name = rtrim(substr(p.name, 1, length(p.name) - 1), replace(p.name, '/', '')))")) {
+            ret = -1;
+            CHECK_FATAL("Failed to prepare queries");
+            goto check_dirs_err;
+        }
+        if(debug)
+            CHECK_INFO("Checking directory index of metadata database %u / %u...", i+1, h->metadbs);
+
+        while((r = qstep(qcount)) == SQLITE_ROW) {
+            const char *name = (const char *)sqlite3_column_text(qcount, 1);
+            int64_t nfiles = sqlite3_column_int64(qcount, 2), found = sqlite3_column_int64(qcount, 3);
+
+            CHECK_PGRS;
+            if(nfiles != found || nfiles <= 0)
+                CHECK_ERROR("Directory %s of volume %lld counts %lld files, but %lld were found", name, (long long)sqlite3_column_int64(qcount, 0), (long long)nfiles, (long long)found);
+        }
+        if(r != SQLITE_DONE) {
+            ret = -1;
+            CHECK_FATAL("Failed to query directory index of metadata database %u", i);
+            goto check_dirs_err;
+        }
+        while((r = qstep(qmissing)) == SQLITE_ROW) {
+            CHECK_PGRS;
+            CHECK_ERROR("Parent directory of %s in volume %lld is missing from the directory index", (const char *)sqlite3_column_text(qmissing, 1), (long long)sqlite3_column_int64(qmissing, 0));
+        }
+        if(r != SQLITE_DONE) {
+            ret = -1;
+            CHECK_FATAL("Failed to query directory index of metadata database %u", i);
+            goto check_dirs_err;
+        }
+        if(ret != errs)
+            CHECK_PRINT_WARN("Directory index of metadata database %u is damaged, run 'sxadm node --dir-index' with the node stopped to rebuild it", i);
+        qnullify(qcount);
+        qnullify(qmissing);
+    }
+
+check_dirs_err:
+    qnullify(qcount);
+    qnullify(qmissing);
     return ret;
 }
 
@@ -3743,9 +5103,11 @@ check_files_err:
 static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, unsigned int ndb) {
     int ret = 0, r;
     sqlite3_stmt *q = NULL;
+    uint8_t *cbuf = NULL;
+    unsigned int clen;
     sxi_db_t *db;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs || !(cbuf = wrap_malloc(bsz[hs]))) {
         ret = -1;
         goto check_blocks_existence_err;
     }
@@ -3754,10 +5116,10 @@ static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, un
 
     if(debug) {
         CHECK_INFO("Checking consistency of %lld blocks in %s hash database %u / %u...",
-             (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, HASHDBS);
+             (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
-    if(qprep(db, &q, "SELECT id, hash, blockno FROM blocks WHERE blockno IS NOT NULL ORDER BY blockno ASC")) { /* SLOWQ */
+    if(qprep(db, &q, "SELECT id, hash, blockno, clen FROM blocks WHERE blockno IS NOT NULL ORDER BY blockno ASC")) { /* SLOWQ */
         ret = -1;
         goto check_blocks_existence_err;
     }
@@ -3794,13 +5156,21 @@ static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, un
         }
         off *= bsz[hs];
 
-        if(gethashdb(refhash) != ndb) {
+        if(gethashdb(refhash, h->hashdbs) != ndb) {
+            bin2hex(refhash->b, sizeof(*refhash), h1, sizeof(h1));
+            CHECK_ERROR("Block %s is misplaced (should be stored in %d, but is stored in %d)", h1, ndb, gethashdb(refhash, h->hashdbs));
+            continue;
+        }
+
+        clen = sqlite3_column_int(q, 3);
+        if(clen >= bsz[hs]) {
             bin2hex(refhash->b, sizeof(*refhash), h1, sizeof(h1));
-            CHECK_ERROR("Block %s is misplaced (should be stored in %d, but is stored in %d)", h1, ndb, gethashdb(refhash));
+            CHECK_ERROR("Invalid compressed length (%u) found for hash %s (row %lld) in %s data file %08x",
+                clen, h1, (long long int)row, sizelongnames[hs], ndb);
             continue;
         }
 
-        if(read_block(h->datafd[hs][ndb], h->blockbuf, off, bsz[hs])) {
+        if(read_slot(h->datafd[hs][ndb], h->blockbuf, off, bsz[hs], clen, cbuf)) {
             bin2hex(refhash->b, sizeof(*refhash), h1, sizeof(h1));
             CHECK_ERROR("Failed to read hash %s (row %lld) from %s data file %08x at offset %lld", h1, (long long int)row, sizelongnames[hs], ndb, (long long int)off);
             continue;
@@ -3820,6 +5190,7 @@ static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, un
 
 check_blocks_existence_err:
     sqlite3_finalize(q);
+    free(cbuf);
     return ret;
 }
 
@@ -3829,7 +5200,7 @@ static int check_blocks_dups(sx_hashfs_t *h, int debug, unsigned int hs, unsigne
     sqlite3_stmt *q = NULL;
     sxi_db_t *db;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs) {
         ret = -1;
         goto check_blocks_dups_err;
     }
@@ -3838,7 +5209,7 @@ static int check_blocks_dups(sx_hashfs_t *h, int debug, unsigned int hs, unsigne
 
     if(debug) {
         CHECK_INFO("Checking duplicates within %lld blocks in %s hash database %u / %u...",
-            (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, HASHDBS);
+            (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
     if(qprep(db, &q, "SELECT b1.id, b1.hash, b2.id, b2.hash, b1.blockno FROM blocks AS b1 LEFT JOIN blocks AS b2 ON b1.id < b2.id WHERE b1.blockno = b2.blockno")) /* SLOWQ */
@@ -3889,7 +5260,7 @@ static int check_blocks_revmaps(sx_hashfs_t *h, int debug, unsigned int hs, unsi
     sqlite3_stmt *q = NULL, *qvol = NULL;
     sxi_db_t *db;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs) {
         ret = -1;
         goto check_blocks_revmaps_err;
     }
@@ -3898,7 +5269,7 @@ static int check_blocks_revmaps(sx_hashfs_t *h, int debug, unsigned int hs, unsi
 
     if(debug) {
         CHECK_INFO("Checking reverse hash maps within %lld revision_blocks entries in %s hash database %u / %u...",
-            (long long int)get_count(db, "revision_blocks"), sizelongnames[hs], ndb+1, HASHDBS);
+            (long long int)get_count(db, "revision_blocks"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
     if(qprep(db, &q, "SELECT revision_id, global_vol_id, replica FROM revision_blocks"))
@@ -3985,7 +5356,7 @@ static int check_blocks(sx_hashfs_t *h, int debug) {
     unsigned int i, j;
 
     for(j = 0; j < SIZES; j++) {
-        for(i = 0; i < HASHDBS; i++) {
+        for(i = 0; i < h->hashdbs; i++) {
             sqlite3_stmt *index = NULL;
             sqlite3_stmt *avail = NULL;
 
@@ -4210,7 +5581,7 @@ lock_db_err:
 }
 
 #define RUN_CHECK(func) do { r = func(h, debug); if(r == -1) { ret = -1; goto sx_hashfs_check_err; } ret += r; } while(0)
-#define NLOCKS (METADBS + SIZES * HASHDBS + 5)
+#define NLOCKS (METADBS_MAX + SIZES * HASHDBS_MAX + 5)
 int sx_hashfs_check(sx_hashfs_t *h, int debug, int show_progress) {
     int ret = -1, r = 0, i, j;
     sqlite3_stmt *locks[NLOCKS], *unlocks[NLOCKS];
@@ -4227,7 +5598,7 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug, int show_progress) {
     memset(locks, 0, sizeof(locks));
     memset(unlocks, 0, sizeof(unlocks));
 
-    for(i = 0; i < METADBS; i++, r++) {
+    for(i = 0; i < h->metadbs; i++, r++) {
         if(lock_db(h->metadb[i], locks + r, unlocks + r)) {
             CHECK_FATAL("Failed to lock database meta database");
             goto sx_hashfs_check_err;
@@ -4235,7 +5606,7 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug, int show_progress) {
     }
 
     for(i = 0; i < SIZES; i++) {
-        for(j = 0; j < HASHDBS; j++, r++) {
+        for(j = 0; j < h->hashdbs; j++, r++) {
             if(lock_db(h->datadb[i][j], locks + r, unlocks + r)) {
                 CHECK_FATAL("Failed to lock database hash database");
                 goto sx_hashfs_check_err;
@@ -4279,6 +5650,10 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug, int show_progress) {
     RUN_CHECK(check_volumes);
     /* Check files correctness */
     RUN_CHECK(check_files);
+    /* Check the listing sums */
+    RUN_CHECK(check_listsums);
+    /* Check the directory index */
+    RUN_CHECK(check_dirs);
     /* Check blocks sanity */
     RUN_CHECK(check_blocks);
     /* Check users table */
@@ -4314,8 +5689,9 @@ sx_hashfs_check_err:
 
 typedef struct {
     sxi_db_t *hashfs;
-    sxi_db_t *meta[METADBS];
-    sxi_db_t *data[SIZES][HASHDBS];
+    unsigned int metadbs, hashdbs;
+    sxi_db_t *meta[METADBS_MAX];
+    sxi_db_t *data[SIZES][HASHDBS_MAX];
     sxi_db_t *temp;
     sxi_db_t *event;
     sxi_db_t *xfer;
@@ -4750,9 +6126,9 @@ static rc_ty alldb_2_1_5_to_2_1_6(sxi_all_db_t *alldb)
 static rc_ty alldb_2_1_4_to_2_1_5(sxi_all_db_t *alldb)
 {
     rc_ty ret = FAIL_EINTERNAL;
-    sqlite3_stmt *qrename[METADBS], *qsel[METADBS], *qsize = NULL;
-    sqlite3_stmt *qins[METADBS], *qdel[METADBS];
-    sqlite3_stmt *qmget[METADBS], *qmset[METADBS];
+    sqlite3_stmt *qrename[METADBS_MAX], *qsel[METADBS_MAX], *qsize = NULL;
+    sqlite3_stmt *qins[METADBS_MAX], *qdel[METADBS_MAX];
+    sqlite3_stmt *qmget[METADBS_MAX], *qmset[METADBS_MAX];
     unsigned int i;
 
     memset(qrename, 0, sizeof(qrename));
@@ -4765,7 +6141,7 @@ static rc_ty alldb_2_1_4_to_2_1_5(sxi_all_db_t *alldb)
     if(qprep(alldb->hashfs, &qsize, "UPDATE volumes SET cursize = cursize - :sizediff WHERE vid = :vid"))
         goto alldb_2_1_4_to_2_1_5_err;
 
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < alldb->metadbs; i++) {
         if(qprep(alldb->meta[i], &qsel[i], "SELECT fid, volume_id, name, rev, size, revision_id, content, age FROM files WHERE name LIKE '%//%' LIMIT 1"))
             goto alldb_2_1_4_to_2_1_5_err;
         if(qprep(alldb->meta[i], &qrename[i], "UPDATE files SET name = :name WHERE fid = :fid"))
@@ -4780,7 +6156,7 @@ static rc_ty alldb_2_1_4_to_2_1_5(sxi_all_db_t *alldb)
             goto alldb_2_1_4_to_2_1_5_err;
     }
 
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < alldb->metadbs; i++) {
         int r;
 
         while((r = qstep(qsel[i])) == SQLITE_ROW) {
@@ -4808,7 +6184,7 @@ static rc_ty alldb_2_1_4_to_2_1_5(sxi_all_db_t *alldb)
             if(oldlen < len)
                 goto alldb_2_1_4_to_2_1_5_err;
 
-            newdb = getmetadb(name);
+            newdb = getmetadb(name, alldb->metadbs);
             if(newdb < 0)
                 goto alldb_2_1_4_to_2_1_5_err;
 
@@ -4832,7 +6208,7 @@ static rc_ty alldb_2_1_4_to_2_1_5(sxi_all_db_t *alldb)
 
     ret = OK;
 alldb_2_1_4_to_2_1_5_err:
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < alldb->metadbs; i++) {
         qnullify(qrename[i]);
         qnullify(qsel[i]);
         qnullify(qins[i]);
@@ -5009,7 +6385,7 @@ static rc_ty alldb_2_1_to_2_1_3(sxi_all_db_t *alldb)
         if(qprep(alldb->hashfs, &qvol, "UPDATE volumes SET cursize_files = cursize_files + :cursize_files, nfiles = nfiles + :nfiles WHERE vid = :vid"))
             break;
 
-        for(i = 0; i < METADBS; i++) {
+        for(i = 0; i < alldb->metadbs; i++) {
             if(qprep(alldb->meta[i], &q, "SELECT volume_id, SUM(size), COUNT(*) FROM files WHERE age >= 0 GROUP BY volume_id"))
                 break;
 
@@ -5699,11 +7075,11 @@ static int qcommit_alldb(sxi_all_db_t *alldb) {
     unsigned i,j;
     if(qcommit(alldb->hashfs))
 	return -1;
-    for(i=0;i<METADBS;i++)
+    for(i=0;i<alldb->metadbs;i++)
         if(qcommit(alldb->meta[i]))
             return -1;
     for(j=0; j<SIZES; j++)
-        for(i=0; i<HASHDBS; i++)
+        for(i=0; i<alldb->hashdbs; i++)
             if(qcommit(alldb->data[j][i]))
                 return -1;
     if(qcommit(alldb->temp))
@@ -5721,10 +7097,10 @@ static void qrollback_alldb(sxi_all_db_t *alldb)
 {
     unsigned i, j;
     qrollback(alldb->hashfs);
-    for(i=0;i<METADBS;i++)
+    for(i=0;i<alldb->metadbs;i++)
         qrollback(alldb->meta[i]);
     for(j=0; j<SIZES; j++)
-        for(i=0; i<HASHDBS; i++)
+        for(i=0; i<alldb->hashdbs; i++)
             qrollback(alldb->data[j][i]);
     qrollback(alldb->temp);
     qrollback(alldb->event);
@@ -5736,10 +7112,10 @@ static void qclose_alldb(sxi_all_db_t *alldb)
 {
     unsigned i, j;
     qclose(&alldb->hashfs);
-    for(i=0;i<METADBS;i++)
+    for(i=0;i<alldb->metadbs;i++)
         qclose(&alldb->meta[i]);
     for(j=0; j<SIZES; j++)
-        for(i=0; i<HASHDBS; i++)
+        for(i=0; i<alldb->hashdbs; i++)
             qclose(&alldb->data[j][i]);
     qclose(&alldb->temp);
     qclose(&alldb->event);
@@ -5747,91 +7123,462 @@ static void qclose_alldb(sxi_all_db_t *alldb)
     qclose(&alldb->hbeat);
 }
 
-rc_ty sx_storage_upgrade(const char *dir) {
-    sxi_all_db_t alldb;
-    unsigned i,j,pathlen, upno;
-    sx_uuid_t cluster;
-    sqlite3_stmt *qgetval = NULL;
-    char *path, dbitem[64];
-    const void *ptr;
-    struct timeval tv_start, tv_integrity_done, tv_upgrade_done, tv_close;
-    int lockfd = -1;
-    rc_ty fnret = OK, ret = FAIL_EINTERNAL;
+/* Adds the compressed length column to the blocks tables which lack it */
+static rc_ty upgrade_add_clen(sxi_all_db_t *alldb) {
     sqlite3_stmt *q = NULL;
+    unsigned int i, j;
+    int r;
 
-    pathlen = strlen(dir) + 1024;
-    memset(&alldb, 0, sizeof(alldb));
-
-    if(!(path = wrap_malloc(pathlen)))
-        return FAIL_EINTERNAL;
-    if (!qlog_set) {
-        sqlite3_config(SQLITE_CONFIG_LOG, qlog, NULL);
-        qlog_set = 1;
+    for(j=0; j<SIZES; j++) {
+	for(i=0; i<alldb->hashdbs; i++) {
+	    if((r = blocks_have_clen(alldb->data[j][i])) < 0)
+		return FAIL_EINTERNAL;
+	    if(r)
+		continue;
+	    INFO("Adding compressed block lengths to %s db #%u", sizelongnames[j], i);
+	    if(qprep(alldb->data[j][i], &q, "ALTER TABLE blocks ADD COLUMN clen INTEGER") || qstep_noret(q)) {
+		qnullify(q);
+		return FAIL_EINTERNAL;
+	    }
+	    qnullify(q);
+	}
     }
+    return OK;
+}
 
-    INFO("Performing integrity check on %s", dir);
-    gettimeofday(&tv_start, NULL);
+/* Creates the index over the depth of the file names and flags the directory
+ * index of a metadb as maintained */
+static int dirs_enable(sxi_db_t *db) {
+    sqlite3_stmt *q = NULL;
 
-    snprintf(path, pathlen, "%s/hashfs.db", dir);
-    if(qopen(path, &alldb.hashfs, "hashfs", NULL, NULL) ||
-       (fnret = upgrade_db_precheck(&alldb.hashfs, "hashfs")))
-	goto upgrade_fail;
+    if(qprep(db, &q, "CREATE INDEX IF NOT EXISTS files_depth ON files(volume_id, depth, name)") || qstep_noret(q))
+	goto dirs_enable_fail;
+    qnullify(q);
+    if(qprep(db, &q, "INSERT OR REPLACE INTO hashfs (key, value) VALUES ('dir_index', 1)") || qstep_noret(q))
+	goto dirs_enable_fail;
+    qnullify(q);
+    return 0;
 
-    if(qprep(alldb.hashfs, &qgetval, "SELECT value FROM hashfs WHERE key = :k"))
-	goto upgrade_fail;
+ dirs_enable_fail:
+    qnullify(q);
+    return -1;
+}
 
-    if(qbind_text(qgetval, ":k", "cluster") || qstep_ret(qgetval))
-	goto upgrade_fail;
-    ptr = (const void *)sqlite3_column_blob(qgetval, 0);
-    if(!ptr || sqlite3_column_bytes(qgetval, 0) != sizeof(cluster.binary)) {
-	CRIT("Failed to lookup the cluster UUID");
-	goto upgrade_fail;
+/* Adds the directory table and the depth of the file names to the metadbs
+ * which lack them; the index is only turned on for the metadbs which hold
+ * no files yet, the others need 'sxadm node --dir-index' */
+static rc_ty upgrade_add_dirs(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    unsigned int i;
+    int r;
+
+    for(i=0; i<alldb->metadbs; i++) {
+	sxi_db_t *db = alldb->meta[i];
+	if((r = metadb_dir_index(db)) < 0)
+	    return FAIL_EINTERNAL;
+	if(r)
+	    continue;
+	DEBUG("Adding the directory tables to file db #%u", i);
+	if(qprep(db, &q, "ALTER TABLE files ADD COLUMN depth INTEGER") || qstep_noret(q))
+	    goto upgrade_add_dirs_fail;
+	qnullify(q);
+	if(qprep(db, &q, "CREATE TABLE dirs (volume_id INTEGER NOT NULL, name TEXT ("STRIFY(SXLIMIT_MAX_FILENAME_LEN)") NOT NULL, depth INTEGER NOT NULL, nfiles INTEGER NOT NULL, mtime INTEGER NOT NULL, PRIMARY KEY(volume_id, name))") || qstep_noret(q))
+	    goto upgrade_add_dirs_fail;
+	qnullify(q);
+	if(qprep(db, &q, "CREATE INDEX dirs_depth ON dirs(volume_id, depth, name)") || qstep_noret(q))
+	    goto upgrade_add_dirs_fail;
+	qnullify(q);
+	if(qprep(db, &q, "SELECT 1 FROM files LIMIT 1"))
+	    goto upgrade_add_dirs_fail;
+	r = qstep(q);
+	qnullify(q);
+	if(r != SQLITE_ROW && r != SQLITE_DONE)
+	    goto upgrade_add_dirs_fail;
+	if(r == SQLITE_DONE && dirs_enable(db))
+	    goto upgrade_add_dirs_fail;
     }
-    uuid_from_binary(&cluster, ptr);
-    sqlite3_reset(qgetval);
+    return OK;
 
-    if(qprep(alldb.hashfs, &q, "INSERT OR REPLACE INTO hashfs (key, value) SELECT 'upgraded_from', value FROM hashfs WHERE key='version'") ||
-       qstep_noret(q))
-        goto upgrade_fail;
+ upgrade_add_dirs_fail:
     qnullify(q);
+    return FAIL_EINTERNAL;
+}
 
-    for(upno=0;upno<sizeof(upgrade_sequence)/sizeof(upgrade_sequence[0]);upno++) {
-	sx_upgrade_t desc = upgrade_sequence[upno];
-	const struct newdbdef *nudbs = desc.new_dbs;
-	if(nudbs) {
-	    sqlite3_stmt *qsetval;
-	    if(qprep(alldb.hashfs, &qsetval, "INSERT OR IGNORE INTO hashfs (key, value) VALUES (:k, :v)"))
-		goto upgrade_fail;
-
-	    for(; nudbs->dbtype; nudbs++) {
-		sxi_db_t *db;
-		snprintf(path, pathlen, "%s/%s", dir, nudbs->fname);
-		if(!(db = create_db(path, nudbs->dbtype, &cluster, desc.from, NULL)))
-		    break;
-		qclose(&db);
+/* Adds the listing sums to the metadbs which lack them */
+static rc_ty upgrade_add_listsums(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    unsigned int i;
+    int r;
 
-		if(qbind_text(qsetval, ":k", nudbs->dbtype) ||
-		   qbind_text(qsetval, ":v", nudbs->fname) ||
-		   qstep_noret(qsetval))
-		    break;
-	    }
-	    qnullify(qsetval);
-	    if(nudbs->dbtype) {
-		CRIT("Failed to create new %s database in %s", nudbs->dbtype, nudbs->fname);
-		goto upgrade_fail;
-	    }
+    for(i=0; i<alldb->metadbs; i++) {
+	sxi_db_t *db = alldb->meta[i];
+	if((r = db_has_table(db, "listsums")) < 0)
+	    return FAIL_EINTERNAL;
+	if(r)
+	    continue;
+	DEBUG("Adding the listing sums to file db #%u", i);
+	if(qprep(db, &q, "CREATE TABLE listsums (volume_id INTEGER NOT NULL PRIMARY KEY, nfiles INTEGER NOT NULL, digest BLOB NOT NULL)") || qstep_noret(q)) {
+	    qnullify(q);
+	    return FAIL_EINTERNAL;
 	}
+	qnullify(q);
+	if(listsums_rebuild(db))
+	    return FAIL_EINTERNAL;
     }
+    return OK;
+}
 
-    for(i=0; i<METADBS; i++) {
-	snprintf(dbitem, sizeof(dbitem), "metadb_%08x", i);
-	if(!(alldb.meta[i] = open_db(dir, dbitem, &cluster, NULL, qgetval)) ||
-	   upgrade_db_precheck(&alldb.meta[i], dbitem))
-	    goto upgrade_fail;
-    }
+/* Adds the table holding the block lists of the largest files to the metadbs
+ * which lack it */
+static rc_ty upgrade_add_chunks(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    unsigned int i;
+    int r;
+
+    for(i=0; i<alldb->metadbs; i++) {
+	sxi_db_t *db = alldb->meta[i];
+	if((r = db_has_table(db, "file_chunks")) < 0)
+	    return FAIL_EINTERNAL;
+	if(r)
+	    continue;
+	DEBUG("Adding the file chunks to file db #%u", i);
+	if(qprep(db, &q, "CREATE TABLE file_chunks (file_id INTEGER NOT NULL REFERENCES files(fid) ON DELETE CASCADE ON UPDATE CASCADE, chunk INTEGER NOT NULL, hashes BLOB NOT NULL, PRIMARY KEY(file_id, chunk))") || qstep_noret(q)) {
+	    qnullify(q);
+	    return FAIL_EINTERNAL;
+	}
+	qnullify(q);
+    }
+    return OK;
+}
+
+/* Adds the position of the presence check to the tmpfiles table */
+static rc_ty upgrade_add_checkpos(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    int r;
+
+    if((r = tmpfiles_have_checkpos(alldb->temp)) < 0)
+	return FAIL_EINTERNAL;
+    if(r)
+	return OK;
+    INFO("Adding presence check positions to the temporary file db");
+    if(qprep(alldb->temp, &q, "ALTER TABLE tmpfiles ADD COLUMN checkpos INTEGER NOT NULL DEFAULT 0") || qstep_noret(q)) {
+	qnullify(q);
+	return FAIL_EINTERNAL;
+    }
+    qnullify(q);
+    return OK;
+}
+
+/* Adds the table of the datafile slots freed recently, which only return to
+ * the freelist after gc_compact_grace seconds; the slots vacated by the online
+ * compaction used to be kept in the hashfs table and are carried over */
+static rc_ty upgrade_add_pending_free(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL, *qins = NULL;
+    unsigned int i, j, k;
+    int r;
+
+    for(j=0; j<SIZES; j++) {
+	for(i=0; i<alldb->hashdbs; i++) {
+	    sxi_db_t *db = alldb->data[j][i];
+	    int64_t at = 0;
+
+	    if((r = db_has_table(db, "pending_free")) < 0)
+		return FAIL_EINTERNAL;
+	    if(r)
+		continue;
+	    INFO("Adding the pending free slots to %s db #%u", sizelongnames[j], i);
+	    if(qprep(db, &q, "CREATE TABLE pending_free (blocknumber INTEGER NOT NULL PRIMARY KEY, freed_at INTEGER NOT NULL)") || qstep_noret(q))
+		goto add_pending_free_fail;
+	    qnullify(q);
+	    if(qprep(db, &q, "CREATE INDEX pending_free_at ON pending_free(freed_at)") || qstep_noret(q))
+		goto add_pending_free_fail;
+	    qnullify(q);
+
+	    if(qprep(db, &q, "SELECT value FROM hashfs WHERE key = 'compact_at'"))
+		goto add_pending_free_fail;
+	    r = qstep(q);
+	    if(r == SQLITE_ROW)
+		at = sqlite3_column_int64(q, 0);
+	    else if(r != SQLITE_DONE)
+		goto add_pending_free_fail;
+	    qnullify(q);
+	    if(qprep(db, &q, "SELECT value FROM hashfs WHERE key = 'compact_vacated'") ||
+	       qprep(db, &qins, "INSERT OR REPLACE INTO pending_free (blocknumber, freed_at) VALUES (:blockno, :now)"))
+		goto add_pending_free_fail;
+	    r = qstep(q);
+	    if(r == SQLITE_ROW) {
+		const uint8_t *vac = sqlite3_column_blob(q, 0);
+		unsigned int nvac = sqlite3_column_bytes(q, 0) / sizeof(int64_t);
+		for(k=0; k<nvac; k++) {
+		    int64_t blockno;
+		    memcpy(&blockno, vac + k * sizeof(blockno), sizeof(blockno));
+		    sqlite3_reset(qins);
+		    if(qbind_int64(qins, ":blockno", blockno) || qbind_int64(qins, ":now", at) || qstep_noret(qins))
+			goto add_pending_free_fail;
+		}
+	    } else if(r != SQLITE_DONE)
+		goto add_pending_free_fail;
+	    qnullify(q);
+	    qnullify(qins);
+	    if(qprep(db, &q, "DELETE FROM hashfs WHERE key IN ('compact_at', 'compact_vacated')") || qstep_noret(q))
+		goto add_pending_free_fail;
+	    qnullify(q);
+	}
+    }
+    return OK;
+
+ add_pending_free_fail:
+    qnullify(q);
+    qnullify(qins);
+    return FAIL_EINTERNAL;
+}
+
+/* Adds the index over the block positions, walked by the online compaction */
+static rc_ty upgrade_add_blockno_index(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    unsigned int i, j;
+
+    for(j=0; j<SIZES; j++) {
+	for(i=0; i<alldb->hashdbs; i++) {
+	    if(qprep(alldb->data[j][i], &q, "CREATE INDEX IF NOT EXISTS blocks_blockno ON blocks(blockno)") || qstep_noret(q)) {
+		qnullify(q);
+		return FAIL_EINTERNAL;
+	    }
+	    qnullify(q);
+	}
+    }
+    return OK;
+}
+
+/* Storages upgraded from before the 64k and 256k classes only pick them once
+ * the whole cluster is upgraded: see upload_to_blocks() */
+static rc_ty upgrade_add_blocksizes_setting(sxi_all_db_t *alldb) {
+    sqlite3_stmt *q = NULL;
+    sx_blob_t *b;
+    const void *data;
+    unsigned int data_len;
+    rc_ty ret = FAIL_EINTERNAL;
+
+    if(!(b = sx_blob_new()) || sx_blob_add_bool(b, 0)) {
+	WARN("Failed to add setting value to the blob");
+	sx_blob_free(b);
+	return FAIL_EINTERNAL;
+    }
+    sx_blob_to_data(b, &data, &data_len);
+    if(!qprep(alldb->hashfs, &q, "INSERT OR IGNORE INTO hashfs (key,value) VALUES (:prefix || :k, :v)") &&
+       !qbind_text(q, ":prefix", SX_CLUSTER_SETTINGS_PREFIX) && !qbind_text(q, ":k", "blocksizes_64k_256k") &&
+       !qbind_blob(q, ":v", data, data_len) && !qstep_noret(q))
+	ret = OK;
+    qnullify(q);
+    sx_blob_free(b);
+    return ret;
+}
+
+/* Creates the block databases and datafiles of the size classes introduced
+ * after the storage was created; they start empty, with the same schema and
+ * version as the medium ones, and are then upgraded along with them */
+static rc_ty upgrade_add_sizes(const char *dir, sxi_db_t *hashfsdb, sqlite3_stmt *qgetval, const sx_uuid_t *cluster, unsigned int hashdbs) {
+    sqlite3_stmt *qset = NULL, *qins = NULL, *qver = NULL;
+    sxi_db_t *tpl = NULL, *db = NULL;
+    char dbitem[64], *path, *blockbuf = NULL;
+    unsigned int i, j;
+    int fd = -1, r;
+    rc_ty ret = FAIL_EINTERNAL;
+
+    if(!(path = wrap_malloc(strlen(dir) + 64)))
+	return FAIL_EINTERNAL;
+    if(qprep(hashfsdb, &qset, "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k, :v)"))
+	goto add_sizes_fail;
+
+    for(j=0; j<SIZES; j++) {
+	sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], 0);
+	sqlite3_reset(qgetval);
+	if(qbind_text(qgetval, ":k", dbitem))
+	    goto add_sizes_fail;
+	r = qstep(qgetval);
+	sqlite3_reset(qgetval);
+	if(r == SQLITE_ROW)
+	    continue;
+	if(r != SQLITE_DONE)
+	    goto add_sizes_fail;
+
+	INFO("Adding the %s block size class", sizelongnames[j]);
+	if(!(blockbuf = wrap_malloc(bsz[j])))
+	    goto add_sizes_fail;
+	for(i=0; i<hashdbs; i++) {
+	    const char *ver;
+
+	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[SIZE_MEDIUM], i);
+	    if(!(tpl = open_db(dir, dbitem, cluster, NULL, qgetval)) ||
+	       qprep(tpl, &qver, "SELECT value FROM hashfs WHERE key = 'version'") || qstep_ret(qver) ||
+	       !(ver = (const char *)sqlite3_column_text(qver, 0)))
+		goto add_sizes_fail;
+
+	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
+	    sprintf(path, "%s/h%c%08x.db", dir, sizedirs[j], i);
+	    reshard_unlink(path); /* Leftover of an interrupted run */
+	    if(!(db = create_db_like(tpl, path, dbitem, cluster, ver, &qins)) ||
+	       qbind_text(qins, ":k", "block_size") || qbind_int(qins, ":v", bsz[j]) || qstep_noret(qins))
+		goto add_sizes_fail;
+	    sqlite3_reset(qins);
+	    if(qbind_text(qins, ":k", "next_blockno") || qbind_int(qins, ":v", 1) || qstep_noret(qins))
+		goto add_sizes_fail;
+	    qnullify(qins);
+	    qclose(&db);
+
+	    /* The version header of the data files is taken from the medium one */
+	    memset(blockbuf, 0, bsz[j]);
+	    sprintf(path, "%s/h%c%08x.bin", dir, sizedirs[SIZE_MEDIUM], i);
+	    fd = open(path, O_RDONLY);
+	    if(fd < 0 || read_block(fd, (uint8_t *)blockbuf, 0, 16)) {
+		PCRIT("Cannot read the header of data file %s", path);
+		goto add_sizes_fail;
+	    }
+	    close(fd);
+	    sprintf(path, "%s/h%c%08x.bin", dir, sizedirs[j], i);
+	    fd = creat(path, 0666);
+	    if(fd < 0) {
+		PCRIT("Cannot create data file %s", path);
+		goto add_sizes_fail;
+	    }
+	    snprintf(blockbuf + 16, bsz[j] - 16, "datafile_%c_%08x             %08x", sizedirs[j], i, bsz[j]);
+	    memcpy(blockbuf + 64, cluster->binary, sizeof(cluster->binary));
+	    if(write_block(fd, blockbuf, 0, bsz[j]))
+		goto add_sizes_fail;
+	    r = close(fd);
+	    fd = -1;
+	    if(r) {
+		PCRIT("Cannot close data file %s", path);
+		goto add_sizes_fail;
+	    }
+	    qnullify(qver);
+	    qclose(&tpl);
+	}
+	free(blockbuf);
+	blockbuf = NULL;
+
+	/* The class only becomes visible once all of its files are in place
+	 * (hashfsdb is held in an exclusive transaction during the upgrade) */
+	for(i=0; i<hashdbs; i++) {
+	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
+	    sprintf(path, "h%c%08x.db", sizedirs[j], i);
+	    sqlite3_reset(qset);
+	    if(qbind_text(qset, ":k", dbitem) || qbind_text(qset, ":v", path) || qstep_noret(qset))
+		goto add_sizes_fail;
+	    sprintf(dbitem, "datafile_%c_%08x", sizedirs[j], i);
+	    sprintf(path, "h%c%08x.bin", sizedirs[j], i);
+	    sqlite3_reset(qset);
+	    if(qbind_text(qset, ":k", dbitem) || qbind_text(qset, ":v", path) || qstep_noret(qset))
+		goto add_sizes_fail;
+	}
+    }
+    ret = OK;
+
+ add_sizes_fail:
+    if(fd >= 0)
+	close(fd);
+    qnullify(qset);
+    qnullify(qins);
+    qnullify(qver);
+    qclose(&db);
+    qclose(&tpl);
+    free(blockbuf);
+    free(path);
+    if(ret != OK)
+	CRIT("Failed to add the new block size classes");
+    return ret;
+}
+
+rc_ty sx_storage_upgrade(const char *dir) {
+    sxi_all_db_t alldb;
+    unsigned i,j,pathlen, upno;
+    sx_uuid_t cluster;
+    sqlite3_stmt *qgetval = NULL;
+    char *path, dbitem[64];
+    const void *ptr;
+    struct timeval tv_start, tv_integrity_done, tv_upgrade_done, tv_close;
+    int lockfd = -1;
+    rc_ty fnret = OK, ret = FAIL_EINTERNAL;
+    sqlite3_stmt *q = NULL;
+
+    pathlen = strlen(dir) + 1024;
+    memset(&alldb, 0, sizeof(alldb));
+
+    if(!(path = wrap_malloc(pathlen)))
+        return FAIL_EINTERNAL;
+    if (!qlog_set) {
+        sqlite3_config(SQLITE_CONFIG_LOG, qlog, NULL);
+        qlog_set = 1;
+    }
+
+    INFO("Performing integrity check on %s", dir);
+    gettimeofday(&tv_start, NULL);
+
+    snprintf(path, pathlen, "%s/hashfs.db", dir);
+    if(qopen(path, &alldb.hashfs, "hashfs", NULL, NULL) ||
+       (fnret = upgrade_db_precheck(&alldb.hashfs, "hashfs")))
+	goto upgrade_fail;
+
+    if(qprep(alldb.hashfs, &qgetval, "SELECT value FROM hashfs WHERE key = :k"))
+	goto upgrade_fail;
+
+    if(qbind_text(qgetval, ":k", "cluster") || qstep_ret(qgetval))
+	goto upgrade_fail;
+    ptr = (const void *)sqlite3_column_blob(qgetval, 0);
+    if(!ptr || sqlite3_column_bytes(qgetval, 0) != sizeof(cluster.binary)) {
+	CRIT("Failed to lookup the cluster UUID");
+	goto upgrade_fail;
+    }
+    uuid_from_binary(&cluster, ptr);
+    sqlite3_reset(qgetval);
+    if(get_shard_counts(qgetval, &alldb.metadbs, &alldb.hashdbs))
+	goto upgrade_fail;
+
+    if(qprep(alldb.hashfs, &q, "INSERT OR REPLACE INTO hashfs (key, value) SELECT 'upgraded_from', value FROM hashfs WHERE key='version'") ||
+       qstep_noret(q))
+        goto upgrade_fail;
+    qnullify(q);
+
+    for(upno=0;upno<sizeof(upgrade_sequence)/sizeof(upgrade_sequence[0]);upno++) {
+	sx_upgrade_t desc = upgrade_sequence[upno];
+	const struct newdbdef *nudbs = desc.new_dbs;
+	if(nudbs) {
+	    sqlite3_stmt *qsetval;
+	    if(qprep(alldb.hashfs, &qsetval, "INSERT OR IGNORE INTO hashfs (key, value) VALUES (:k, :v)"))
+		goto upgrade_fail;
+
+	    for(; nudbs->dbtype; nudbs++) {
+		sxi_db_t *db;
+		snprintf(path, pathlen, "%s/%s", dir, nudbs->fname);
+		if(!(db = create_db(path, nudbs->dbtype, &cluster, desc.from, NULL)))
+		    break;
+		qclose(&db);
+
+		if(qbind_text(qsetval, ":k", nudbs->dbtype) ||
+		   qbind_text(qsetval, ":v", nudbs->fname) ||
+		   qstep_noret(qsetval))
+		    break;
+	    }
+	    qnullify(qsetval);
+	    if(nudbs->dbtype) {
+		CRIT("Failed to create new %s database in %s", nudbs->dbtype, nudbs->fname);
+		goto upgrade_fail;
+	    }
+	}
+    }
+
+    if((fnret = upgrade_add_sizes(dir, alldb.hashfs, qgetval, &cluster, alldb.hashdbs)))
+	goto upgrade_fail;
+
+    for(i=0; i<alldb.metadbs; i++) {
+	snprintf(dbitem, sizeof(dbitem), "metadb_%08x", i);
+	if(!(alldb.meta[i] = open_db(dir, dbitem, &cluster, NULL, qgetval)) ||
+	   upgrade_db_precheck(&alldb.meta[i], dbitem))
+	    goto upgrade_fail;
+    }
 
     for(j=0; j<SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<alldb.hashdbs; i++) {
 	    snprintf(dbitem, sizeof(dbitem), "hashdb_%c_%08x", sizedirs[j], i);
 	    if(!(alldb.data[j][i] = open_db(dir, dbitem, &cluster, NULL, qgetval)) ||
 	       upgrade_db_precheck(&alldb.data[j][i], dbitem))
@@ -5892,13 +7639,13 @@ rc_ty sx_storage_upgrade(const char *dir) {
 	}
         if ((fnret = upgrade_db(lockfd, dir, alldb.hashfs, &vfrom, &vto, desc.upgrade_hashfsdb)))
             goto upgrade_fail;
-        for(i=0; i<METADBS; i++) {
+        for(i=0; i<alldb.metadbs; i++) {
             if ((fnret = upgrade_db(lockfd, dir, alldb.meta[i], &vfrom, &vto, desc.upgrade_metadb)))
                 goto upgrade_fail;
         }
 
         for(j=0; j<SIZES; j++) {
-            for(i=0; i<HASHDBS; i++) {
+            for(i=0; i<alldb.hashdbs; i++) {
 		const char *binpath;
                 if ((fnret = upgrade_db(lockfd, dir, alldb.data[j][i], &vfrom, &vto, desc.upgrade_datadb)))
                     goto upgrade_fail;
@@ -5944,6 +7691,15 @@ rc_ty sx_storage_upgrade(const char *dir) {
         if (desc.upgrade_alldb && (fnret = desc.upgrade_alldb(&alldb)))
             goto upgrade_fail;
     }
+    if((fnret = upgrade_add_clen(&alldb)) ||
+       (fnret = upgrade_add_dirs(&alldb)) ||
+       (fnret = upgrade_add_listsums(&alldb)) ||
+       (fnret = upgrade_add_chunks(&alldb)) ||
+       (fnret = upgrade_add_checkpos(&alldb)) ||
+       (fnret = upgrade_add_pending_free(&alldb)) ||
+       (fnret = upgrade_add_blockno_index(&alldb)) ||
+       (fnret = upgrade_add_blocksizes_setting(&alldb)))
+	goto upgrade_fail;
     INFO("Committing changes");
     if (qcommit_alldb(&alldb))
         goto upgrade_fail;
@@ -6090,7 +7846,7 @@ sx_hashfs_upgrade_2_1_4_init_err:
 
 rc_ty sx_hashfs_upgrade_2_1_4_update_revid(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const sx_hash_t *revision_id) {
     rc_ty ret = FAIL_EINTERNAL;
-    sqlite3_stmt *q;
+    sqlite3_stmt *q = NULL;
     unsigned int j, i;
 
     if(!h || !vol || !revision_id) {
@@ -6100,8 +7856,8 @@ rc_ty sx_hashfs_upgrade_2_1_4_update_revid(sx_hashfs_t *h, const sx_hashfs_volum
 
     /* We could probably take the file size into consideration and skip the outer loop. */
     for(j = 0; j < SIZES; j++) {
-        for(i = 0; i < HASHDBS; i++) {
-            q = h->qb_upgrade_2_1_4_revid_update[j][i];
+        for(i = 0; i < h->hashdbs; i++) {
+            q = qlazy(h, h->qb_upgrade_2_1_4_revid_update[j][i]);
 
             sqlite3_reset(q);
             if(qbind_blob(q, ":revision_id", revision_id->b, sizeof(revision_id->b)) || qbind_blob(q, ":global_vol_id", vol->global_id.b, sizeof(vol->global_id.b)) || qstep_noret(q)) {
@@ -6198,7 +7954,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
     bulk_start(&bulk);
     gettimeofday(&tv0, NULL);
     sx_hashfs_set_progress_info(h, INPRG_UPGRADE_RUNNING, "Upgrade: preparing");
-    for(i=0;i<METADBS;i++) {
+    for(i=0;i<h->metadbs;i++) {
         db = h->metadb[i];
         if(qprep(db, &q, "SELECT COUNT(*) FROM files WHERE revision_id IS NULL") ||
            qstep_ret(q))
@@ -6212,15 +7968,17 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
         qnullify(q);
     }
     qnullify(q);
-    if (i < METADBS)
+    if (i < h->metadbs)
         return FAIL_EINTERNAL;
 
     int64_t age = sxi_hdist_version(h->hd);
-    for(i=0;i<METADBS;i++) {
-        sqlite3_stmt *qsel = h->qm_needs_upgrade[i], *qupd = NULL;
+    for(i=0;i<h->metadbs;i++) {
+        sqlite3_stmt *qsel = qlazy(h, h->qm_needs_upgrade[i]), *qheal = qlazy(h, h->qm_add_heal[i]), *qupd = NULL;
         int ret;
         db = h->metadb[i];
         rc = FAIL_EINTERNAL;
+        if(!qsel || !qheal)
+            break;
         /* OR FAIL - avoid creation of temp file, it can only affect one row,
          * since fid is a primary key */
         if(qprep(db, &qupd, "UPDATE OR FAIL files SET revision_id=:revision_id WHERE fid=:fid")) {
@@ -6242,7 +8000,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
                 int64_t volid = sqlite3_column_int64(qsel, 1);
                 const unsigned char *rev = sqlite3_column_text(qsel, 3);
                 int64_t size = sqlite3_column_int64(qsel, 4);
-                unsigned blocks = size_to_blocks(size, NULL, &bsize);
+                unsigned blocks = file_to_blocks(size, sqlite3_column_int(qsel, 5) / sizeof(sx_hash_t), NULL, &bsize);
                 ret = -1;
                 if ((rc = sx_hashfs_volume_by_id(h, volid, &volume))) {
                     WARN("volume_by_id failed");
@@ -6253,7 +8011,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
                     break;
                 }
                 sqlite3_reset(qupd);
-                sqlite3_reset(h->qm_add_heal[i]);
+                sqlite3_reset(qheal);
                 DEBUGHASH("preparing for upgrade", &revision_id);
                 unsigned int hs;
                 for(hs = 0; hs < SIZES; hs++)
@@ -6263,12 +8021,12 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
                     WARN("bad blocksize: %d", bsize);
                     break;
                 }
-                if (qbind_blob(h->qm_add_heal[i], ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
-                    qbind_null(h->qm_add_heal[i], ":remote_volid") ||
-                    qbind_int(h->qm_add_heal[i], ":blocks", blocks) ||
-                    qbind_int(h->qm_add_heal[i], ":blocksize", bsize) ||
-                    qbind_int(h->qm_add_heal[i], ":replica_count", volume->max_replica) ||
-                    qstep_noret(h->qm_add_heal[i]) ||
+                if (qbind_blob(qheal, ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
+                    qbind_null(qheal, ":remote_volid") ||
+                    qbind_int(qheal, ":blocks", blocks) ||
+                    qbind_int(qheal, ":blocksize", bsize) ||
+                    qbind_int(qheal, ":replica_count", volume->max_replica) ||
+                    qstep_noret(qheal) ||
                     sx_hashfs_revision_op_internal(h, hs, &revision_id, 1, age) ||
                     qbind_int64(qupd, ":fid", fid) ||
                     qbind_blob(qupd, ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
@@ -6280,7 +8038,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_prepare(sx_hashfs_t *h)
             }
             sqlite3_reset(qsel);
             sqlite3_reset(qupd);
-            sqlite3_reset(h->qm_add_heal[i]);
+            sqlite3_reset(qheal);
             if (ret != SQLITE_ROW && ret != SQLITE_DONE) {
                 rc = FAIL_EINTERNAL;
                 datadb_rollbackall(h);
@@ -6342,7 +8100,7 @@ static rc_ty hash_of_blob_result(sx_hash_t *hash, sqlite3_stmt *stmt, int col);
 
 static rc_ty datadb_begin(sx_hashfs_t *h, unsigned int hs)
 {
-    for(int ndb=0;ndb<HASHDBS;ndb++)
+    for(int ndb=0;ndb<h->hashdbs;ndb++)
         if (qbegin(h->datadb[hs][ndb])) {
             while (ndb-->0)
                 qrollback(h->datadb[hs][ndb]);
@@ -6353,13 +8111,13 @@ static rc_ty datadb_begin(sx_hashfs_t *h, unsigned int hs)
 
 static void datadb_rollback(sx_hashfs_t *h, unsigned int hs)
 {
-    for(int ndb=0;ndb<HASHDBS;ndb++)
+    for(int ndb=0;ndb<h->hashdbs;ndb++)
         qrollback(h->datadb[hs][ndb]);
 }
 
 static rc_ty datadb_commit(sx_hashfs_t *h, unsigned int hs)
 {
-    for(int ndb=0;ndb<HASHDBS;ndb++)
+    for(int ndb=0;ndb<h->hashdbs;ndb++)
         if (qcommit(h->datadb[hs][ndb])) {
             datadb_rollback(h, hs);
             return FAIL_EINTERNAL;
@@ -6422,7 +8180,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
     gettimeofday(&tv0, NULL);
 
     sx_hashfs_set_progress_info(h, INPRG_UPGRADE_RUNNING, "Upgrade - local file blocks");
-    for(i=0;i<METADBS;i++) {
+    for(i=0;i<h->metadbs;i++) {
         db = h->metadb[i];
         if(qprep(db, &q, "SELECT SUM(blocks) FROM heal WHERE remote_volume IS NULL") ||
            qstep_ret(q))
@@ -6432,7 +8190,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
         qnullify(q);
     }
     qnullify(q);
-    for(i=0;i<METADBS;i++) {
+    for(i=0;i<h->metadbs;i++) {
         sqlite3_stmt *qsel = NULL;
         int ret;
         db = h->metadb[i];
@@ -6479,14 +8237,15 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
                 int64_t age = sxi_hdist_version(h->hd);
                 for (j=0;j<blocks;j++) {
                     const sx_hash_t *hash = &content[j];
-                    if (sx_hashfs_hashop_moduse_internal(h, &vol->global_id, &revision_id, hs, gethashdb(hash), hash, replica, age))
+                    if (sx_hashfs_hashop_moduse_internal(h, &vol->global_id, &revision_id, hs, gethashdb(hash, h->hashdbs), hash, replica, age))
                         break;
                 }
                 if (j != blocks)
                     break;
                 DEBUG("rebuilt revmap for %lld blocks", (long long)blocks);
-                if (qbind_blob(h->qm_del_heal[i],":revision_id", revision_id.b, sizeof(revision_id.b)) ||
-                    qstep_noret(h->qm_del_heal[i]))
+                sqlite3_stmt *qdelheal = qlazy(h, h->qm_del_heal[i]);
+                if (!qdelheal || qbind_blob(qdelheal, ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
+                    qstep_noret(qdelheal))
                     break;
                 heal_done += blocks;
             }
@@ -6508,10 +8267,10 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
     if (rc == OK) {
         sx_hashfs_set_progress_info(h, INPRG_UPGRADE_RUNNING, "Upgrade - local file blocks checkpointing");
         gettimeofday(&tv1, NULL);
-        for(i=0;i<METADBS;i++)
+        for(i=0;i<h->metadbs;i++)
             qcheckpoint_idle(h->metadb[i]);
         for(unsigned j=0;j<SIZES;j++)
-            for(i=0;i<HASHDBS;i++)
+            for(i=0;i<h->hashdbs;i++)
                 qcheckpoint_idle(h->datadb[j][i]);
         sx_hashfs_set_progress_info(h, INPRG_UPGRADE_RUNNING, "Upgrade - local file blocks done");
         gettimeofday(&tv2, NULL);
@@ -6522,8 +8281,8 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
         for(rc = sx_hashfs_volume_first(h, &volume, 0);rc == OK;rc = sx_hashfs_volume_next(h)) {
             if (sx_hashfs_is_or_was_my_volume(h, volume, 0))
                 continue;/* we've already imported this data from the local volnode */
-            for(i=0;i<METADBS;i++) {
-                sqlite3_stmt *q = h->qm_add_heal_volume[i];
+            for(i=0;i<h->metadbs;i++) {
+                sqlite3_stmt *q = qlazy(h, h->qm_add_heal_volume[i]);
                 sqlite3_reset(q);
                 if(qbind_text(q,":name", volume->name) ||
                    qbind_int64(q,":max_age", max_age) ||
@@ -6533,7 +8292,7 @@ rc_ty sx_hashfs_upgrade_1_0_or_1_1_local(sx_hashfs_t *h)
                     break;
                 }
             }
-            if (i != METADBS) {
+            if (i != h->metadbs) {
                 rc = FAIL_EINTERNAL;
                 break;
             }
@@ -6662,6 +8421,7 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
     int64_t i;
     int fd = -1;
     char *fname = NULL;
+    uint8_t *cbuf = NULL;
     sx_hash_t zerohash;
 
     if(!destpath || !volname || !name || !restored_hashes || (nhashes > 0 && !hashes)) {
@@ -6670,7 +8430,7 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
     }
 
     /* Get block size for file */
-    size_to_blocks(size, NULL, &blocksize);
+    file_to_blocks(size, nhashes, NULL, &blocksize);
 
     if(!blocksize) {
         WARN("Failed to compute block size for file %s", name);
@@ -6687,6 +8447,8 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
         WARN("Failed to get hash size database, blocksize: %u", blocksize);
         goto extract_file_err;
     }
+    if(!(cbuf = wrap_malloc(blocksize)))
+        goto extract_file_err;
 
     memset(h->blockbuf, 0, blocksize);
     /* Calculate zerohash */
@@ -6718,8 +8480,8 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
         /* Used for printing hash, can be remove if not needed */
         bin2hex(hash->b, sizeof(sx_hash_t), hex, SXI_SHA1_TEXT_LEN+1);
 
-        hdb = gethashdb(hash);
-        q = h->qb_get[hs][hdb];
+        hdb = gethashdb(hash, h->hashdbs);
+        q = qlazy(h, h->qb_get[hs][hdb]);
 
         sqlite3_reset(q);
         if(qbind_blob(q, ":hash", hash->b, sizeof(sx_hash_t))) {
@@ -6738,8 +8500,10 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
         if(r == SQLITE_ROW) {
             /* Hash was found in database, now get its offset */
             int64_t offset = sqlite3_column_int64(q, 0);
+            unsigned int clen = sqlite3_column_int(q, 1);
             offset *= blocksize;
-            if(read_block(h->datafd[hs][hdb], h->blockbuf, offset, to_write)) /* Block was not found in storage, but continue extraction */
+            if(clen >= blocksize ||
+               read_slot(h->datafd[hs][hdb], h->blockbuf, offset, clen ? blocksize : to_write, clen, cbuf)) /* Block was not found in storage, but continue extraction */
                 continue;
 
             if(lseek(fd, hoff, SEEK_SET) != hoff) {
@@ -6762,13 +8526,14 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
     ret = 0;
 extract_file_err:
     sqlite3_reset(q);
+    free(cbuf);
     close_partfile(h, destpath, volname, name, fname, fd, nhashes, *restored_hashes);
     return ret;
 }
 
 static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *destpath, int64_t *restored, int64_t *nfiles) {
     int ret = -1, r, i;
-    sqlite3_stmt *list[METADBS];
+    sqlite3_stmt *list[METADBS_MAX];
 
     if(!vol || !destpath || !restored || !nfiles) {
         NULLARG();
@@ -6777,8 +8542,8 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
 
     memset(list, 0, sizeof(list));
 
-    for(i = 0; i < METADBS; i++) {
-        if(qprep(h->metadb[i], &list[i], "SELECT name, size, content FROM files WHERE volume_id = :volid AND age >= 0")
+    for(i = 0; i < h->metadbs; i++) {
+        if(qprep(h->metadb[i], &list[i], "SELECT name, size, content, fid FROM files WHERE volume_id = :volid AND age >= 0")
            || qbind_int64(list[i], ":volid", vol->id)) {
             WARN("Failed to prepare files list query for volume %s", vol->name);
             goto extract_volume_files_err;
@@ -6790,19 +8555,25 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
     ret = 0; /* Start counting errors during extraction */
     *restored = 0;
     *nfiles = 0;
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < h->metadbs; i++) {
         while((r = qstep(list[i])) == SQLITE_ROW) {
             const char *name = (const char*)sqlite3_column_text(list[i], 0);
             int64_t size = sqlite3_column_int64(list[i], 1);
-            const sx_hash_t *hashes = (const sx_hash_t*)sqlite3_column_blob(list[i], 2);
-            int64_t nhashes = sqlite3_column_bytes(list[i], 2);
-            int64_t restored_hashes = 0;
+            const void *hashes = sqlite3_column_blob(list[i], 2);
+            unsigned int hashes_len = sqlite3_column_bytes(list[i], 2);
+            int64_t nhashes, restored_hashes = 0;
+            sx_hash_t *chunks;
 
-            if(nhashes % sizeof(sx_hash_t)) {
+            if(hashes_len % sizeof(sx_hash_t)) {
                 WARN("Bad list of hashes for file: %s", name);
                 continue;
             }
-            nhashes /= sizeof(sx_hash_t);
+            if(file_content_load(h, i, sqlite3_column_int64(list[i], 3), size, &hashes, &hashes_len, &chunks)) {
+                ret++;
+                WARN("Failed to load the list of hashes for file: %s", name);
+                continue;
+            }
+            nhashes = hashes_len / sizeof(sx_hash_t);
 
             if(extract_file(h, destpath, vol->name, name, size, hashes, nhashes, &restored_hashes) < 0) {
                 ret++;
@@ -6810,16 +8581,17 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
             } else
                 (*restored)++;
             (*nfiles)++;
+            free(chunks);
         }
 
         if(r != SQLITE_DONE) {
             ret++;
-            WARN("Failed to list files from meta database %d / %d for volume %s", i, METADBS, vol->name);
+            WARN("Failed to list files from meta database %d / %d for volume %s", i, h->metadbs, vol->name);
         }
     }
 
 extract_volume_files_err:
-    for(i = 0; i < METADBS; i++)
+    for(i = 0; i < h->metadbs; i++)
         sqlite3_finalize(list[i]);
 
     return ret;
@@ -6829,7 +8601,7 @@ static rc_ty volume_next_common(sx_hashfs_t *h);
 
 int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     int ret = -1, s, r, i;
-    sqlite3_stmt *locks[METADBS+1], *unlocks[METADBS+1];
+    sqlite3_stmt *locks[METADBS_MAX+1], *unlocks[METADBS_MAX+1];
     const sx_hashfs_volume_t *vol = &h->curvol;
 
     if(!destpath || !*destpath) {
@@ -6841,7 +8613,7 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     memset(unlocks, 0, sizeof(unlocks));
 
     /* Lock meta databases */
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < h->metadbs; i++) {
         if(qprep(h->metadb[i], &locks[i], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->metadb[i], &unlocks[i], "ROLLBACK") || qstep_noret(locks[i])) {
             WARN("Failed to lock meta database at index %d", i);
             goto sx_hashfs_extract_err;
@@ -6849,13 +8621,14 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     }
 
     /* Lock hahsfs database */
-    if(qprep(h->db, &locks[METADBS], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->db, &unlocks[METADBS], "ROLLBACK") || qstep_noret(locks[METADBS])) {
+    if(qprep(h->db, &locks[METADBS_MAX], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->db, &unlocks[METADBS_MAX], "ROLLBACK") || qstep_noret(locks[METADBS_MAX])) {
         WARN("Failed to lock volumes database");
         goto sx_hashfs_extract_err;
     }
 
     h->curvol.name[0] = '\0';
     h->curvoluser = 0;
+    h->curvolsince = -1;
 
     /* Iterate over all volumes */
     for(s = volume_next_common(h); s == OK; s = volume_next_common(h)) {
@@ -6910,7 +8683,7 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
 
 sx_hashfs_extract_err:
     /* Unlock all databases */
-    for(i = METADBS; i >= 0; i--) {
+    for(i = h->metadbs; i >= 0; i--) {
         if(unlocks[i] && qstep_noret(unlocks[i]))
 	    WARN("Failed to unlock database");
         sqlite3_finalize(locks[i]);
@@ -7132,11 +8905,11 @@ rc_ty sx_hashfs_revision_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume,
 	return EINVAL;
     }
 
-    h->rev_ndb = getmetadb(name);
+    h->rev_ndb = getmetadb(name, h->metadbs);
     if(h->rev_ndb < 0)
 	return FAIL_EINTERNAL;
 
-    q = (reversed ? h->qm_listrevs_rev[h->rev_ndb] : h->qm_listrevs[h->rev_ndb]);
+    q = (reversed ? qlazy(h, h->qm_listrevs_rev[h->rev_ndb]) : qlazy(h, h->qm_listrevs[h->rev_ndb]));
     sqlite3_reset(q);
 
     sxi_strlcpy(h->list_file.name, name, sizeof(h->list_file.name));
@@ -7149,7 +8922,7 @@ rc_ty sx_hashfs_revision_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume,
 
 
 rc_ty sx_hashfs_revision_next(sx_hashfs_t *h, int reversed) {
-    sqlite3_stmt *q = (reversed ? h->qm_listrevs_rev[h->rev_ndb] : h->qm_listrevs[h->rev_ndb]);
+    sqlite3_stmt *q = (reversed ? qlazy(h, h->qm_listrevs_rev[h->rev_ndb]) : qlazy(h, h->qm_listrevs[h->rev_ndb]));
     const char *revision;
     const void *revid;
     int r;
@@ -7183,7 +8956,7 @@ rc_ty sx_hashfs_revision_next(sx_hashfs_t *h, int reversed) {
 	return FAIL_EINTERNAL;
     }
     sxi_strlcpy(h->list_file.revision, revision, sizeof(h->list_file.revision));
-    size_to_blocks(h->list_file.file_size, NULL, &h->list_file.block_size);
+    file_to_blocks(h->list_file.file_size, sqlite3_column_int(q, 3) / sizeof(sx_hash_t), NULL, &h->list_file.block_size);
 
     revid = sqlite3_column_blob(q, 2);
     if(!revid || sqlite3_column_bytes(q, 2) != SXI_SHA1_BIN_LEN) {
@@ -7214,9 +8987,10 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
 {
     sxi_md_ctx *hash_ctx;
     rc_ty rc = OK;
-    unsigned i;
-    char *vol_newest;
+    unsigned i, j;
+    uint8_t digest[SXI_SHA1_BIN_LEN];
     int64_t total = 0;
+    int r;
 
     if (!h || !volume || !pattern || !etag) {
         NULLARG();
@@ -7227,31 +9001,24 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
         msg_set_reason("Wrong node for volume '%s': ...", volume->name);
         return ENOENT;
     }
-    if (!(vol_newest = wrap_strdup("")))
-        rc = ENOMEM;
-    for (i=0;i<METADBS && !rc;i++) {
-        sqlite3_reset(h->qm_newest[i]);
-        sqlite3_reset(h->qm_count[i]);
-        if (qbind_int64(h->qm_newest[i], ":volid", volume->id) ||
-            qbind_int64(h->qm_count[i], ":volid", volume->id) ||
-            qstep_ret(h->qm_newest[i]) ||
-            qstep_ret(h->qm_count[i])) {
+    /* The listing sums of each metadb are kept up to date with the files, see listsums_update() */
+    memset(digest, 0, sizeof(digest));
+    for (i=0;i<h->metadbs && !rc;i++) {
+        sqlite3_stmt *q = qlazy(h, h->qm_getsums[i]);
+        sqlite3_reset(q);
+        if (qbind_int64(q, ":volume", volume->id)) {
             rc = FAIL_EINTERNAL;
-        } else {
-            /* detects newly created or updated files */
-            const char *newest = (const char*)sqlite3_column_text(h->qm_newest[i], 0);
+        } else if ((r = qstep(q)) == SQLITE_ROW) {
+            const uint8_t *d = sqlite3_column_blob(q, 1);
             /* detects deleted files */
-            total += sqlite3_column_int64(h->qm_count[i], 0);
-            if (newest) {
-                if (strcmp(newest, vol_newest) > 0) {
-                    free(vol_newest);
-                    if (!(vol_newest = wrap_strdup(newest)))
-                        rc = ENOMEM;
-                }
-            }
-        }
-        sqlite3_reset(h->qm_newest[i]);
-        sqlite3_reset(h->qm_count[i]);
+            total += sqlite3_column_int64(q, 0);
+            /* detects newly created, updated and renamed files */
+            if (d && sqlite3_column_bytes(q, 1) == sizeof(digest))
+                for (j=0;j<sizeof(digest);j++)
+                    digest[j] ^= d[j];
+        } else if (r != SQLITE_DONE)
+            rc = FAIL_EINTERNAL;
+        sqlite3_reset(q);
     }
     hash_ctx = sxi_md_init();
     if (!hash_ctx) {
@@ -7260,19 +9027,18 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
     }
     if (rc == OK) {
         /* must be same on all volnodes */
-        DEBUG("%d: newest: %s, total: %lld", i, vol_newest, (long long)total);
+        DEBUG("total: %lld", (long long)total);
         if (!sxi_sha1_init(hash_ctx) ||
             !sxi_sha1_update(hash_ctx, h->cluster_uuid.binary, sizeof(h->cluster_uuid.binary)) ||
             !sxi_sha1_update(hash_ctx, pattern, strlen(pattern)+1) ||
             !sxi_sha1_update(hash_ctx, &recurse, sizeof(recurse)) ||
-            !sxi_sha1_update(hash_ctx, vol_newest, strlen(vol_newest)+1) ||
+            !sxi_sha1_update(hash_ctx, digest, sizeof(digest)) ||
             !sxi_sha1_update(hash_ctx, &total, sizeof(total)) ||
             !sxi_sha1_final(hash_ctx, etag->b, NULL)) {
             WARN("failed to calculate etag hash");
             rc = FAIL_EINTERNAL;
         }
     }
-    free(vol_newest);
     sxi_md_cleanup(&hash_ctx);
     return rc;
 }
@@ -7322,117 +9088,187 @@ static int pcmp(sx_hashfs_t *h, const char *p1, const char *p2, unsigned int max
     return r;
 }
 
-static rc_ty lookup_file_name(sx_hashfs_t *h, int db_idx, int update_cache) {
-    int r;
+#define list_head(h, db_idx) (&(h)->list_rows[(db_idx) * LIST_BATCH + (h)->list_cur[db_idx].pos])
+
+/* Prefetches the next batch of rows for a cursor: the first batch starts at
+ * list_lower_limit, the following ones right after the last row fetched.
+ * When the directory index is used, the cursors past the first metadbs ones
+ * read the subdirectories from the dirs table of each metadb, while the
+ * others only read the files at the depth of the pattern */
+static rc_ty list_fetch(sx_hashfs_t *h, unsigned int cur_idx, int first) {
+    list_entry_t *rows = &h->list_rows[cur_idx * LIST_BATCH];
+    list_cursor_t *c = &h->list_cur[cur_idx];
+    unsigned int db_idx = cur_idx % h->metadbs, isdir = cur_idx >= h->metadbs;
+    char from[sizeof(rows->name)];
     rc_ty ret = FAIL_EINTERNAL;
-    const char *n, *revision;
-    sqlite3_stmt *stmt;
-    list_entry_t *e = &h->list_cache[db_idx];
     const char *q = NULL;
-    const void *revid;
-
-    if(!h->list_recurse && (q = ith_slash(e->name, h->list_pattern_slashes + 1))) {
-        /* We are not searching recursively and next slash was found in pervious name,
-         * we can skip all files that are prefixed by that dir. To achieve that we can simply move
-         * starting name to the next one, but we will have to also be careful and use >= for name matching
-         */
-        e->name[q - e->name]++;
-        e->name[q - e->name + 1] = '\0';
+    unsigned int n = 0;
+    sqlite3_stmt *stmt;
+    int r = SQLITE_DONE;
+
+    if(!first) {
+        memcpy(from, rows[c->count - 1].name, sizeof(from));
+        if(!h->list_recurse && (q = ith_slash(from, h->list_pattern_slashes + 1))) {
+            /* We are not searching recursively and next slash was found in pervious name,
+             * we can skip all files that are prefixed by that dir. To achieve that we can simply move
+             * starting name to the next one, but we will have to also be careful and use >= for name matching
+             */
+            from[q - from]++;
+            from[q - from + 1] = '\0';
+        }
     }
 
     /* Use statement with > or >= regarding to previous q assignment (or if using h->list_lower_limit) */
-    if(q || !update_cache)
-        stmt = h->qm_list_eq[db_idx];
+    if(isdir && (q || first))
+        stmt = qlazy(h, h->qm_list_dirs_eq[db_idx]);
+    else if(isdir)
+        stmt = qlazy(h, h->qm_list_dirs[db_idx]);
+    else if(h->list_dirs && (q || first))
+        stmt = qlazy(h, h->qm_list_depth_eq[db_idx]);
+    else if(h->list_dirs)
+        stmt = qlazy(h, h->qm_list_depth[db_idx]);
+    else if(q || first)
+        stmt = qlazy(h, h->qm_list_eq[db_idx]);
     else
-        stmt = h->qm_list[db_idx];
+        stmt = qlazy(h, h->qm_list[db_idx]);
     sqlite3_reset(stmt);
+    if(h->list_dirs && qbind_int(stmt, ":depth", h->list_pattern_slashes + isdir)) {
+        WARN("Failed to bind list query depth");
+        goto list_fetch_err;
+    }
     if(qbind_int64(stmt, ":volume", h->list_volid) ||
-       qbind_text(stmt, ":previous", update_cache ? e->name : h->list_lower_limit) ||
+       qbind_text(stmt, ":previous", first ? (isdir ? h->list_dir_lower_limit : h->list_lower_limit) : from) ||
        qbind_text(stmt, ":pattern", h->list_pattern) ||
        qbind_int(stmt, ":pattern_slashes", h->list_pattern_slashes) ||
-       qbind_int(stmt, ":slash_ending", h->list_pattern_end_with_slash)) {
+       qbind_int(stmt, ":slash_ending", h->list_pattern_end_with_slash) ||
+       qbind_int(stmt, ":batch", LIST_BATCH)) {
         WARN("Failed to bind list query values");
-        goto lookup_file_name_err;
+        goto list_fetch_err;
     }
 
     if(h->list_limit_len) {
         if(qbind_text(stmt, ":limit", h->list_upper_limit)) {
             WARN("Failed to bind upper limit");
-            goto lookup_file_name_err;
+            goto list_fetch_err;
         }
     } else {
         if(qbind_null(stmt, ":limit")) {
             WARN("Failed to bind upper limit (null)");
-            goto lookup_file_name_err;
+            goto list_fetch_err;
         }
     }
 
-    r = qstep(stmt);
     h->qm_list_queries++;
-    if(r == SQLITE_DONE) {
-        e->name[0] = '\0';
-        /* Done for this db, no more reading needed */
-        ret = OK;
-        goto lookup_file_name_err;
-    }
-
-    if(r != SQLITE_ROW)
-        goto lookup_file_name_err;
-
-    n = (const char *)sqlite3_column_text(stmt, 0);
-    if(!n) {
-        WARN("Cannot list NULL filename on meta database %u", db_idx);
-        goto lookup_file_name_err;
-    }
-
-    e->file_size = sqlite3_column_int64(stmt, 1);
-    e->nblocks = size_to_blocks(e->file_size, NULL, &e->block_size);
+    while(n < LIST_BATCH && (r = qstep(stmt)) == SQLITE_ROW) {
+        list_entry_t *e = &rows[n];
+        const char *name, *revision;
+        const void *revid;
 
-    revision = (const char *)sqlite3_column_text(stmt, 2);
-    if(!revision || parse_revision(revision, &e->created_at)) {
-        WARN("Bad revision found on file %s, volid %lld", h->list_file.name, (long long)h->list_volid);
-        goto lookup_file_name_err;
-    } else {
-        strncpy(e->revision, revision, sizeof(e->revision));
-        e->revision[sizeof(e->revision)-1] = '\0';
-    }
+        name = (const char *)sqlite3_column_text(stmt, 0);
+        if(!name) {
+            WARN("Cannot list NULL filename on meta database %u", db_idx);
+            goto list_fetch_err;
+        }
 
-    strncpy(e->name, n, sizeof(e->name));
-    e->name[sizeof(e->name)-1] = '\0';
+        if(isdir) {
+            sxi_strlcpy(e->name, name, sizeof(e->name));
+            e->dir_files = sqlite3_column_int64(stmt, 1);
+            e->created_at = sqlite3_column_int64(stmt, 2);
+            n++;
+            continue;
+        }
+        e->dir_files = -1;
+        e->file_size = sqlite3_column_int64(stmt, 1);
+        e->nblocks = file_to_blocks(e->file_size, sqlite3_column_int(stmt, 4) / sizeof(sx_hash_t), NULL, &e->block_size);
+
+        revision = (const char *)sqlite3_column_text(stmt, 2);
+        if(!revision || parse_revision(revision, &e->created_at)) {
+            WARN("Bad revision found on file %s, volid %lld", name, (long long)h->list_volid);
+            goto list_fetch_err;
+        }
+        sxi_strlcpy(e->revision, revision, sizeof(e->revision));
+        sxi_strlcpy(e->name, name, sizeof(e->name));
 
-    revid = sqlite3_column_blob(stmt, 3);
-    if(!revid || sqlite3_column_bytes(stmt, 3) != SXI_SHA1_BIN_LEN) {
-        WARN("Invalid revision ID");
-        goto lookup_file_name_err;
-    }
-    memcpy(e->revision_id.b, revid, SXI_SHA1_BIN_LEN);
+        revid = sqlite3_column_blob(stmt, 3);
+        if(!revid || sqlite3_column_bytes(stmt, 3) != SXI_SHA1_BIN_LEN) {
+            WARN("Invalid revision ID");
+            goto list_fetch_err;
+        }
+        memcpy(e->revision_id.b, revid, SXI_SHA1_BIN_LEN);
 
     #ifdef DEBUG_REVISION_ID
         sx_hash_t revid_ref;
         if(sx_unique_fileid(h->sx, e->revision, &revid_ref)) {
-            WARN("Failed to check revision ID for %s", h->list_file.revision);
-            goto lookup_file_name_err;
+            WARN("Failed to check revision ID for %s", e->revision);
+            goto list_fetch_err;
         }
 
         if(memcmp(revid_ref.b, e->revision_id.b, sizeof(revid_ref.b))) {
-            WARN("Revision ID mismatch for %s", h->list_file.revision);
-            goto lookup_file_name_err;
+            WARN("Revision ID mismatch for %s", e->revision);
+            goto list_fetch_err;
         }
     #endif
+        n++;
+    }
+    if(r != SQLITE_ROW && r != SQLITE_DONE)
+        goto list_fetch_err;
 
+    c->pos = 0;
+    c->count = n;
+    c->eof = n < LIST_BATCH;
     ret = OK;
-    lookup_file_name_err:
+
+    list_fetch_err:
     /* Always reset statement to avoid locking server */
     sqlite3_reset(stmt);
 
     return ret;
 }
 
-static int parse_pattern(sx_hashfs_t *h, const char *pattern, int escape) {
-    unsigned int plen, l, r;
+/* Moves a cursor past the rows matching name (modulo the fake dir name),
+ * returns 1 if more rows are available, 0 if the cursor is exhausted and
+ * -1 on error */
+static int list_advance(sx_hashfs_t *h, unsigned int db_idx, const char *name) {
+    list_cursor_t *c = &h->list_cur[db_idx];
 
-    /* If pattern is empty, make it a single slash */
-    if(!pattern)
+    while(1) {
+        while(c->pos < c->count && !pcmp(h, list_head(h, db_idx)->name, name, sizeof(h->list_last)))
+            c->pos++;
+        if(c->pos < c->count)
+            return 1;
+        if(c->eof)
+            return 0;
+        if(list_fetch(h, db_idx, 0))
+            return -1;
+    }
+}
+
+/* Min-heap of cursors ordered by their head row */
+static int list_heap_less(sx_hashfs_t *h, unsigned int a, unsigned int b) {
+    return pcmp(h, list_head(h, h->list_heap[a])->name, list_head(h, h->list_heap[b])->name, sizeof(h->list_last)) < 0;
+}
+
+static void list_heap_down(sx_hashfs_t *h, unsigned int i) {
+    while(1) {
+        unsigned int l = 2 * i + 1, min = i, t;
+        if(l < h->list_heap_len && list_heap_less(h, l, min))
+            min = l;
+        if(l + 1 < h->list_heap_len && list_heap_less(h, l + 1, min))
+            min = l + 1;
+        if(min == i)
+            break;
+        t = h->list_heap[i];
+        h->list_heap[i] = h->list_heap[min];
+        h->list_heap[min] = t;
+        i = min;
+    }
+}
+
+static int parse_pattern(sx_hashfs_t *h, const char *pattern, int escape) {
+    unsigned int plen, l, r;
+
+    /* If pattern is empty, make it a single slash */
+    if(!pattern)
         pattern = "/";
 
     while(pattern[0] == '/')
@@ -7532,18 +9368,33 @@ static int parse_pattern(sx_hashfs_t *h, const char *pattern, int escape) {
 
 rc_ty sx_hashfs_list_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *pattern, const sx_hashfs_file_t **file, int recurse, const char *after, int escape) {
     unsigned int l = 0;
+    const char *q;
 
     if(!h || !volume) {
         NULLARG();
         return EINVAL;
     }
 
+    h->list_heap_len = 0;
     if(!sx_hashfs_is_or_was_my_volume(h, volume, 0)) {
         /* TODO: got, expected: */
         msg_set_reason("Wrong node for volume '%s': ...", volume->name);
         return ENOENT;
     }
 
+    /* Non recursive listings take the fake dirs from the directory index, if complete */
+    h->list_dirs = !recurse && h->dir_index_all;
+    h->list_ncur = h->list_dirs ? 2 * h->metadbs : h->metadbs;
+    if(h->list_rows_cursors < h->list_ncur) {
+        free(h->list_rows);
+        h->list_rows_cursors = 0;
+        if(!(h->list_rows = wrap_malloc(h->list_ncur * LIST_BATCH * sizeof(*h->list_rows)))) {
+            msg_set_reason("Out of memory");
+            return ENOMEM;
+        }
+        h->list_rows_cursors = h->list_ncur;
+    }
+
     /* Check given search pattern for globbing characters */
     if(parse_pattern(h, pattern, escape)) {
         WARN("Failed to parse listing pattern");
@@ -7572,73 +9423,65 @@ rc_ty sx_hashfs_list_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, con
     if(h->list_limit_len > 0)
         h->list_upper_limit[h->list_limit_len-1]++;
 
+    /* A fake dir is listed if any of its files is past the lower limit */
+    sxi_strlcpy(h->list_dir_lower_limit, h->list_lower_limit, sizeof(h->list_dir_lower_limit));
+    if((q = ith_slash(h->list_dir_lower_limit, h->list_pattern_slashes + 1)))
+        h->list_dir_lower_limit[q - h->list_dir_lower_limit + 1] = '\0';
+
     /* For debugging */
     h->qm_list_queries = 0;
-
-    /* Store first file names in cache */
-    for(l = 0; l < METADBS; l++) {
-        h->list_cache[l].name[0] = '\0';
-        if(lookup_file_name(h, l, 0) != OK) {
-            WARN("Failed fetching file name from db %d", l);
+    h->list_nrows = 0;
+    gettimeofday(&h->list_start, NULL);
+
+    /* Prefetch the first batch from each cursor and merge from there */
+    for(l = 0; l < h->list_ncur; l++) {
+        if(list_fetch(h, l, 1) != OK) {
+            WARN("Failed fetching file name from db %u", l % h->metadbs);
+            h->list_heap_len = 0;
             return FAIL_EINTERNAL;
         }
+        if(h->list_cur[l].count)
+            h->list_heap[h->list_heap_len++] = l;
     }
+    for(l = h->list_heap_len / 2; l > 0; l--)
+        list_heap_down(h, l - 1);
 
     return sx_hashfs_list_next(h);
 }
 
 rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
-    int i, min_idx = -1;
+    const list_entry_t *e;
     const char *q = NULL;
+    int r;
 
     if(!h || !*h->list_pattern)
         return EINVAL;
 
-    for(i=0; i < METADBS; i++) {
-        int comp;
-        if(h->list_cache[i].name[0] == '\0')
-            continue; /* No more file names found in that db */
-
-        if(min_idx == -1)
-            min_idx = i;
-        else {
-            /* In case this db has stored file name that is equal (modulo directory name) to current name, lookup next one */
-            if(!(comp = pcmp(h, h->list_cache[i].name, h->list_cache[min_idx].name, sizeof(h->list_cache[i].name)))) {
-                if(lookup_file_name(h, i, 1)) {
-                    WARN("Could not lookup file name");
-                    return FAIL_EINTERNAL;
-                }
-                /* No more in that db */
-                if(h->list_cache[i].name[0] == '\0')
-                    continue;
-
-                comp = pcmp(h, h->list_cache[i].name, h->list_cache[min_idx].name, sizeof(h->list_cache[i].name));
-            }
-
-            if(comp < 0) /* Found smaller file name */
-                min_idx = i;
-        }
-    }
-
-    if(min_idx < 0) {
-        DEBUG("Queried %lld times", (long long)h->qm_list_queries);
+    if(!h->list_heap_len) {
+        struct timeval now;
+        double elapsed;
+        gettimeofday(&now, NULL);
+        elapsed = timediff(&h->list_start, &now);
+        DEBUG("Listed %llu entries with %llu queries in %.3fs (%.0f entries/s)", (unsigned long long)h->list_nrows,
+              (unsigned long long)h->qm_list_queries, elapsed, elapsed > 0 ? h->list_nrows / elapsed : 0);
         return ITER_NO_MORE;
     }
 
-    h->list_file.file_size = h->list_cache[min_idx].file_size;
-    h->list_file.nblocks = h->list_cache[min_idx].nblocks;
-    h->list_file.block_size = h->list_cache[min_idx].block_size;
+    e = list_head(h, h->list_heap[0]);
+    h->list_file.file_size = e->file_size;
+    h->list_file.nblocks = e->nblocks;
+    h->list_file.block_size = e->block_size;
 
-    strncpy(h->list_file.revision, h->list_cache[min_idx].revision, sizeof(h->list_file.revision));
+    strncpy(h->list_file.revision, e->revision, sizeof(h->list_file.revision));
     h->list_file.revision[sizeof(h->list_file.revision)-1] = '\0';
-    h->list_file.created_at = h->list_cache[min_idx].created_at;
+    h->list_file.created_at = e->created_at;
 
     h->list_file.name[0] = '/';
     /* Truncate dir file name */
-    if(!h->list_recurse && (q = ith_slash(h->list_cache[min_idx].name, h->list_pattern_slashes + 1))) {
+    if(!h->list_recurse && (q = ith_slash(e->name, h->list_pattern_slashes + 1))) {
         /* Truncate file name */
-        strncpy(h->list_file.name + 1, h->list_cache[min_idx].name, q - h->list_cache[min_idx].name + 1);
-        h->list_file.name[q - h->list_cache[min_idx].name + 2] = '\0';
+        strncpy(h->list_file.name + 1, e->name, q - e->name + 1);
+        h->list_file.name[q - e->name + 2] = '\0';
         /* This is a fake dir, all unrelated items are zeroed */
         h->list_file.file_size = 0;
         h->list_file.block_size = 0;
@@ -7646,35 +9489,42 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
         h->list_file.revision[0] = '\0';
         memset(h->list_file.revision_id.b, 0, sizeof(h->list_file.revision_id.b));
         /*
-          h->list_file.created_at = 0;
-
-          The created_at value here is not the fakedir mtime, but rather the mtime of
-          some random file inside it.
+          Without the directory index, the created_at value here is not the fakedir mtime,
+          but rather the mtime of some random file inside it.
           This value is not reported back to the client because it is incorrect
           (the correct dir mtime would be the max(mtime) of all the files inside the fakedir and all its children).
           This value is only used internally to adjust the Last-Modified header.
+          With the index, the file counts and mtimes of the dir in each metadb are merged below.
         */
+        h->list_file.dir_files = h->list_dirs ? 0 : -1;
     } else {
-        strncpy(h->list_file.name + 1, h->list_cache[min_idx].name, sizeof(h->list_file.name)-1);
-        h->list_file.name[sizeof(h->list_file.name)-1] = '\0';
-        memcpy(h->list_file.revision_id.b, h->list_cache[min_idx].revision_id.b, sizeof(h->list_file.revision_id.b));
-    }
-
-    /* Lookup next file name for this database */
-    if(lookup_file_name(h, min_idx, 1) != OK) {
-        WARN("Could not lookup next file name");
-        return FAIL_EINTERNAL;
-    }
-
-    /* If path comparison returned same string, query again, applicable only when not listing recursively */
-    if(h->list_cache[min_idx].name[0] != '\0' && !h->list_recurse &&
-       !pcmp(h, h->list_cache[min_idx].name, h->list_file.name + 1, sizeof(h->list_cache[min_idx].name))) {
-        if(lookup_file_name(h, min_idx, 1)) {
-            WARN("Could not lookup file name");
+        sxi_strlcpy(h->list_file.name + 1, e->name, sizeof(h->list_file.name) - 1);
+        memcpy(h->list_file.revision_id.b, e->revision_id.b, sizeof(h->list_file.revision_id.b));
+        h->list_file.dir_files = -1;
+    }
+    memcpy(h->list_last, e->name, sizeof(h->list_last));
+
+    /* Move every cursor sitting on the same name (or fake dir) past it: they
+     * all surface at the top of the heap in turn */
+    while(h->list_heap_len && !pcmp(h, list_head(h, h->list_heap[0])->name, h->list_last, sizeof(h->list_last))) {
+        if(q && h->list_dirs) {
+            e = list_head(h, h->list_heap[0]);
+            h->list_file.dir_files += e->dir_files;
+            if(e->created_at > h->list_file.created_at)
+                h->list_file.created_at = e->created_at;
+        }
+        r = list_advance(h, h->list_heap[0], h->list_last);
+        if(r < 0) {
+            WARN("Could not lookup next file name");
+            h->list_heap_len = 0;
             return FAIL_EINTERNAL;
         }
+        if(!r)
+            h->list_heap[0] = h->list_heap[--h->list_heap_len];
+        list_heap_down(h, 0);
     }
 
+    h->list_nrows++;
     return OK;
 }
 
@@ -7815,7 +9665,7 @@ static rc_ty get_volnodes_common(sx_hashfs_t *h, sx_hashfs_nl_t which, const sx_
     if(!*nodes)
 	return FAIL_EINTERNAL;
 
-    size_to_blocks(size, NULL, block_size);
+    upload_to_blocks(h, size, NULL, block_size);
     return OK;
 }
 
@@ -7939,6 +9789,7 @@ rc_ty sx_hashfs_create_user_finish(sx_hashfs_t *h, const char *user, const uint8
 	return EFAULT;
     }
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     q = h->q_createuser;
     qm = h->q_addumeta;
     /* Note: the path_check element has to be enforced before the sx_hashfs_create_user function is called.
@@ -8136,6 +9987,7 @@ rc_ty sx_hashfs_user_modify_finish(sx_hashfs_t *h, const char *username, const u
         goto sx_hashfs_user_modify_err;
     }
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(key) {
         q = h->q_user_newkey;
         sqlite3_reset(q);
@@ -8727,6 +10579,7 @@ rc_ty sx_hashfs_delete_user(sx_hashfs_t *h, const char *username, const char *ne
     sqlite3_reset(h->q_deleteuser);
     sqlite3_reset(h->q_chprivs);
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     /* First, change volume ownership to a new owner */
     if(qbind_int64(h->q_chownvol, ":new", new) || 
        qbind_int64(h->q_chownvol, ":old", old) ||
@@ -8944,6 +10797,7 @@ rc_ty sx_hashfs_volume_new_finish(sx_hashfs_t *h, const char *volume, const sx_h
         goto volume_new_err;
     ret = FAIL_EINTERNAL;
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(qbind_text(h->q_addvol, ":volume", volume) ||
        qbind_int(h->q_addvol, ":replica", replica) ||
        qbind_int(h->q_addvol, ":revs", revisions) ||
@@ -9022,6 +10876,7 @@ rc_ty sx_hashfs_volume_enable(sx_hashfs_t *h, const sx_hash_t *global_id) {
         NULLARG();
         return EINVAL;
     }
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(qbind_blob(h->q_onoffvol, ":global_id", global_id->b, sizeof(global_id->b)) ||
        qbind_int(h->q_onoffvol, ":enable", 1) ||
        qstep_noret(h->q_onoffvol))
@@ -9048,6 +10903,7 @@ rc_ty sx_hashfs_volume_disable(sx_hashfs_t *h, const sx_hash_t *global_id) {
 
     /* If not a volnode, then disable right away */
     if(!sx_hashfs_is_or_was_my_volume(h, vol, 0)) {
+	cluster_gen_touch(h, GEN_LOOKUP);
 	if(qbind_blob(h->q_onoffvol, ":global_id", global_id->b, sizeof(global_id->b)) ||
 	   qbind_int(h->q_onoffvol, ":enable", 0) ||
 	   qstep_noret(h->q_onoffvol))
@@ -9060,7 +10916,7 @@ rc_ty sx_hashfs_volume_disable(sx_hashfs_t *h, const sx_hash_t *global_id) {
 	ret = FAIL_EINTERNAL;
 	goto volume_disable_err;
     }
-    for(mdb=0; mdb<METADBS; mdb++) {
+    for(mdb=0; mdb<h->metadbs; mdb++) {
 	if(qbegin(h->metadb[mdb])) {
 	    ret = FAIL_EINTERNAL;
 	    goto volume_disable_err;
@@ -9076,6 +10932,7 @@ rc_ty sx_hashfs_volume_disable(sx_hashfs_t *h, const sx_hash_t *global_id) {
 	goto volume_disable_err;
     ret = OK;
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(qbind_blob(h->q_onoffvol, ":global_id", global_id->b, sizeof(global_id->b)) ||
        qbind_int(h->q_onoffvol, ":enable", 0) ||
        qstep_noret(h->q_onoffvol)) {
@@ -9133,6 +10990,7 @@ rc_ty sx_hashfs_volume_delete(sx_hashfs_t *h, const sx_hash_t *global_id, int fo
 	    goto volume_delete_err;
 	}
     }
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(qbind_blob(h->q_delvol, ":global_id", global_id->b, sizeof(global_id->b)) ||
        qstep_noret(h->q_delvol) ||
        qcommit(h->db))
@@ -9151,6 +11009,7 @@ rc_ty sx_hashfs_volume_delete(sx_hashfs_t *h, const sx_hash_t *global_id, int fo
 }
 
 rc_ty sx_hashfs_user_onoff(sx_hashfs_t *h, const char *user, int enable, int all_clones) {
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(!all_clones) {
         if(qbind_text(h->q_onoffuser, ":username", user) ||
            qbind_int(h->q_onoffuser, ":enable", enable) ||
@@ -9186,6 +11045,20 @@ rc_ty sx_hashfs_volume_first(sx_hashfs_t *h, const sx_hashfs_volume_t **volume,
 
     h->curvol.name[0] = '\0';
     h->curvoluser = uid;
+    h->curvolsince = -1;
+    *volume = &h->curvol;
+    return sx_hashfs_volume_next(h);
+}
+
+rc_ty sx_hashfs_volume_changed_first(sx_hashfs_t *h, const sx_hashfs_volume_t **volume, int64_t since) {
+    if(!h || !volume || since < 0) {
+	WARN("Called with invalid arguments");
+	return EINVAL;
+    }
+
+    h->curvol.id = 0;
+    h->curvoluser = NULL;
+    h->curvolsince = since;
     *volume = &h->curvol;
     return sx_hashfs_volume_next(h);
 }
@@ -9197,51 +11070,63 @@ static rc_ty volume_next_common(sx_hashfs_t *h) {
     unsigned int replica_loss;
     int r;
     const void *global_id;
+    sqlite3_stmt *q;
 
     if(!h) {
         WARN("Called with invalid arguments");
         return EINVAL;
     }
 
-    sqlite3_reset(h->q_nextvol);
-    if(qbind_text(h->q_nextvol, ":previous", h->curvol.name))
-        goto volume_next_common_err;
-    if(h->curvoluser) {
-        if(qbind_blob(h->q_nextvol, ":user_first", firstcid(h->curvoluser, cid), sizeof(cid)) ||
-	   qbind_blob(h->q_nextvol, ":user_last", lastcid(h->curvoluser, cid), sizeof(cid)))
-            goto volume_next_common_err;
+    if(h->curvolsince >= 0) {
+	/* Changed volumes are walked in rowid order so that the unchanged
+	 * ones are skipped in a single pass over the table */
+	q = h->q_nextchangedvol;
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":previous", h->curvol.id) ||
+	   qbind_int64(q, ":since", h->curvolsince))
+	    goto volume_next_common_err;
     } else {
-        if(qbind_null(h->q_nextvol, ":user_first") ||
-	   qbind_null(h->q_nextvol, ":user_last"))
-            goto volume_next_common_err;
+	q = h->q_nextvol;
+	sqlite3_reset(q);
+	if(qbind_text(q, ":previous", h->curvol.name))
+	    goto volume_next_common_err;
+	if(h->curvoluser) {
+	    if(qbind_blob(q, ":user_first", firstcid(h->curvoluser, cid), sizeof(cid)) ||
+	       qbind_blob(q, ":user_last", lastcid(h->curvoluser, cid), sizeof(cid)))
+		goto volume_next_common_err;
+	} else {
+	    if(qbind_null(q, ":user_first") ||
+	       qbind_null(q, ":user_last"))
+		goto volume_next_common_err;
+	}
     }
 
-    r = qstep(h->q_nextvol);
+    r = qstep(q);
     if(r == SQLITE_DONE)
         res = ITER_NO_MORE;
     if(r != SQLITE_ROW)
         goto volume_next_common_err;
 
-    name = (const char *)sqlite3_column_text(h->q_nextvol, 1);
+    name = (const char *)sqlite3_column_text(q, 1);
     if(!name)
         goto volume_next_common_err;
 
-    global_id = sqlite3_column_blob(h->q_nextvol, 10);
-    if(!global_id || sqlite3_column_bytes(h->q_nextvol, 10) != SXI_SHA1_BIN_LEN)
+    global_id = sqlite3_column_blob(q, 10);
+    if(!global_id || sqlite3_column_bytes(q, 10) != SXI_SHA1_BIN_LEN)
         goto volume_next_common_err;
 
     sxi_strlcpy(h->curvol.name, name, sizeof(h->curvol.name));
-    h->curvol.id = sqlite3_column_int64(h->q_nextvol, 0);
-    h->curvol.max_replica = sqlite3_column_int(h->q_nextvol, 2);
-    h->curvol.usage_total = sqlite3_column_int64(h->q_nextvol, 3);
-    h->curvol.size = sqlite3_column_int64(h->q_nextvol, 4);
-    h->curvol.owner = sqlite3_column_int64(h->q_nextvol, 5);
-    h->curvol.revisions = sqlite3_column_int(h->q_nextvol, 6);
-    h->curvol.changed = sqlite3_column_int64(h->q_nextvol, 7);
-    h->curvol.usage_files = sqlite3_column_int64(h->q_nextvol, 8);
-    h->curvol.nfiles = sqlite3_column_int64(h->q_nextvol, 9);
+    h->curvol.id = sqlite3_column_int64(q, 0);
+    h->curvol.max_replica = sqlite3_column_int(q, 2);
+    h->curvol.usage_total = sqlite3_column_int64(q, 3);
+    h->curvol.size = sqlite3_column_int64(q, 4);
+    h->curvol.owner = sqlite3_column_int64(q, 5);
+    h->curvol.revisions = sqlite3_column_int(q, 6);
+    h->curvol.changed = sqlite3_column_int64(q, 7);
+    h->curvol.usage_files = sqlite3_column_int64(q, 8);
+    h->curvol.nfiles = sqlite3_column_int64(q, 9);
     memcpy(h->curvol.global_id.b, global_id, sizeof(h->curvol.global_id.b));
-    h->curvol.prev_max_replica = sqlite3_column_int(h->q_nextvol, 11);
+    h->curvol.prev_max_replica = sqlite3_column_int(q, 11);
 
     replica_loss = (h->next_maxreplica - h->effective_maxreplica);
     if(h->curvol.max_replica > replica_loss)
@@ -9251,7 +11136,7 @@ static rc_ty volume_next_common(sx_hashfs_t *h) {
 
     res = OK;
 volume_next_common_err:
-    sqlite3_reset(h->q_nextvol);
+    sqlite3_reset(q);
     return res;
 }
 
@@ -9268,16 +11153,35 @@ rc_ty sx_hashfs_volume_next(sx_hashfs_t *h) {
 
 
 static rc_ty volume_get_common(sx_hashfs_t *h, const char *name, const sx_hash_t *global_vol_id, int64_t volid, const sx_hashfs_volume_t **volume) {
-    sqlite3_stmt *q;
+    sqlite3_stmt *q = NULL;
     rc_ty res = FAIL_EINTERNAL;
     int r;
     const void *global_id;
+    volume_cache_t *c;
+    uint64_t gen, usage_gen;
+    unsigned int i;
 
     if(!h || !volume) {
 	WARN("Called with invalid arguments");
 	return EINVAL;
     }
 
+    gen = lookup_cache_gen(h);
+    usage_gen = cluster_gen(h, GEN_COMMIT);
+    for(i = 0; gen && i < LOOKUP_CACHE_SIZE; i++) {
+	c = &h->volcache[i];
+	if(c->gen != gen)
+	    continue;
+	if(name ? !strcmp(c->vol.name, name) :
+	   global_vol_id ? !memcmp(c->vol.global_id.b, global_vol_id->b, sizeof(c->vol.global_id.b)) :
+	   c->vol.id == volid) {
+	    if(volume_cache_usage(h, c))
+		break;
+	    memcpy(&h->curvol, &c->vol, sizeof(h->curvol));
+	    goto volume_found;
+	}
+    }
+
     if(name) {
 	q = h->q_volbyname;
 	sqlite3_reset(q);
@@ -9322,6 +11226,17 @@ static rc_ty volume_get_common(sx_hashfs_t *h, const char *name, const sx_hash_t
     memcpy(h->curvol.global_id.b, global_id, sizeof(h->curvol.global_id.b));
     h->curvol.prev_max_replica = sqlite3_column_int(q, 11);
 
+    if(gen) {
+	c = &h->volcache[h->volcache_next];
+	h->volcache_next = (h->volcache_next + 1) % LOOKUP_CACHE_SIZE;
+	c->gen = gen;
+	c->usage_gen = usage_gen;
+	memcpy(&c->vol, &h->curvol, sizeof(c->vol));
+    }
+
+ volume_found:
+    /* Checked on every lookup: the distribution loaded in this process
+     * may change while the cached entry is still current */
     if(is_subreplica(h, h->curvol.max_replica)) {
 	res = ENOENT;
 	goto volume_err;
@@ -9382,6 +11297,7 @@ rc_ty sx_hashfs_grant(sx_hashfs_t *h, uint64_t uid, const sx_hash_t *global_vol_
 
     rc_ty rc = FAIL_EINTERNAL;
     sqlite3_stmt *q = h->q_grant;
+    cluster_gen_touch(h, GEN_LOOKUP);
     sqlite3_reset(q);
     const sx_hashfs_volume_t *vol = NULL;
     do {
@@ -9428,6 +11344,7 @@ rc_ty sx_hashfs_revoke(sx_hashfs_t *h, uint64_t uid, const sx_hash_t *global_vol
 	return EINVAL;
     rc_ty rc = FAIL_EINTERNAL;
     sqlite3_stmt *q = h->q_revoke;
+    cluster_gen_touch(h, GEN_LOOKUP);
     sqlite3_reset(q);
     const sx_hashfs_volume_t *vol = NULL;
     do {
@@ -9486,7 +11403,7 @@ rc_ty sx_hashfs_volume_by_global_id(sx_hashfs_t *h, const sx_hash_t *global_id,
 
 static void sx_hashfs_getfile_reset(sx_hashfs_t *h)
 {
-    if(h->get_ndb < METADBS) {
+    if(h->get_ndb < h->metadbs) {
 	sqlite3_reset(h->qm_get[h->get_ndb]);
 	sqlite3_reset(h->qm_getrev[h->get_ndb]);
     }
@@ -9512,7 +11429,7 @@ rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *fi
 	return EINVAL;
     }
 
-    h->get_ndb = getmetadb(filename);
+    h->get_ndb = getmetadb(filename, h->metadbs);
     if(h->get_ndb < 0)
 	return FAIL_EINTERNAL;
     /* reset current getfile queries */
@@ -9523,11 +11440,11 @@ rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *fi
 	    msg_set_reason("Invalid file name");
 	    return EINVAL;
 	}
-	q = h->qm_getrev[h->get_ndb];
+	q = qlazy(h, h->qm_getrev[h->get_ndb]);
 	if(qbind_text(q, ":revision", revision))
 	    return FAIL_EINTERNAL;
     } else
-	q = h->qm_get[h->get_ndb];
+	q = qlazy(h, h->qm_get[h->get_ndb]);
 
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename))
 	return FAIL_EINTERNAL;
@@ -9545,9 +11462,17 @@ rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *fi
 
     h->get_id = sqlite3_column_int64(q, 0);
     size = sqlite3_column_int64(q, 1);
-    h->get_nblocks = size_to_blocks(size, NULL, &bsize);
     h->get_content = sqlite3_column_blob(q, 2);
     content_len = sqlite3_column_bytes(q, 2);
+    h->get_nblocks = file_to_blocks(size, content_len / sizeof(sx_hash_t), NULL, &bsize);
+    /* The hashes of chunked files are loaded as they are iterated */
+    h->get_chunked = file_is_chunked(size, content_len);
+    h->get_pos = 0;
+    h->get_buffered = 0;
+    if(h->get_chunked) {
+	h->get_content = h->get_chunk;
+	content_len = sizeof(sx_hash_t) * h->get_nblocks;
+    }
 
     rev = (const char *)sqlite3_column_text(q, 3);
     if(!rev ||
@@ -9583,6 +11508,23 @@ uint64_t sx_hashfs_getfile_count(sx_hashfs_t *h)
     return h->get_nblocks;
 }
 
+/* Restricts the following sx_hashfs_getfile_block() calls to at most count
+ * blocks starting with block first; ranges past the end of the file yield
+ * no blocks */
+void sx_hashfs_getfile_range(sx_hashfs_t *h, uint64_t first, uint64_t count)
+{
+    if(first > h->get_nblocks)
+	first = h->get_nblocks;
+    if(h->get_chunked) {
+	h->get_pos += first;
+	h->get_buffered = 0;
+    } else if(h->get_content)
+	h->get_content += first;
+    h->get_nblocks -= first;
+    if(count < h->get_nblocks)
+	h->get_nblocks = count;
+}
+
 rc_ty sx_hashfs_getfile_block(sx_hashfs_t *h, const sx_hash_t **hash, sx_nodelist_t **nodes) {
     if(!h || !hash || !nodes || (h->get_nblocks && !h->get_content))
 	return EINVAL;
@@ -9590,6 +11532,16 @@ rc_ty sx_hashfs_getfile_block(sx_hashfs_t *h, const sx_hash_t **hash, sx_nodelis
     if(!h->get_nblocks)
 	return ITER_NO_MORE;
 
+    if(h->get_chunked && !h->get_buffered) {
+	unsigned int n = MIN(h->get_nblocks, FILE_CHUNK_BLOCKS);
+	if(file_chunks_read(h, h->get_ndb, h->get_id, h->get_pos, n, h->get_chunk)) {
+	    sx_hashfs_getfile_end(h);
+	    return FAIL_EINTERNAL;
+	}
+	h->get_content = h->get_chunk;
+	h->get_buffered = n;
+    }
+
     /* NEXTPREV would be more efficient
      * (because it's pointless to lookup new blocks in PREV)
      * but PREVNEXT is not prone to the following race condition:
@@ -9605,6 +11557,10 @@ rc_ty sx_hashfs_getfile_block(sx_hashfs_t *h, const sx_hash_t **hash, sx_nodelis
     *hash = h->get_content;
     h->get_content++;
     h->get_nblocks--;
+    if(h->get_chunked) {
+	h->get_pos++;
+	h->get_buffered--;
+    }
     return OK;
 }
 
@@ -9612,13 +11568,15 @@ void sx_hashfs_getfile_end(sx_hashfs_t *h) {
     sx_hashfs_getfile_reset(h);
     h->get_content = NULL;
     h->get_nblocks = 0;
-    h->get_ndb = METADBS;
+    h->get_chunked = 0;
+    h->get_ndb = h->metadbs;
 }
 
 rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, const uint8_t **block) {
-    unsigned int ndb = gethashdb(hash), hs;
-    uint64_t dboff;
-    int r;
+    unsigned int ndb = gethashdb(hash, h->hashdbs), hs, clen;
+    uint8_t *cbuf = NULL;
+    int64_t dboff;
+    rc_ty r;
 
     for(hs = 0; hs < SIZES; hs++)
 	if(bsz[hs] == bs)
@@ -9628,66 +11586,265 @@ rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash
 	return FAIL_BADBLOCKSIZE;
     }
 
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", hash, sizeof(*hash)))
-	return FAIL_EINTERNAL;
-
-    r = qstep(h->qb_get[hs][ndb]);
-    if(r == SQLITE_DONE) {
+    r = get_blockno(h, hs, ndb, hash, &dboff, &clen);
+    if(r == ENOENT) {
 	char thash[41];
 	DEBUG("Hash not in database");
-	sqlite3_reset(h->qb_get[hs][ndb]);
 	bin2hex(hash->b, 20, thash, 41);
 /*        WARN("{%s}: hash %s missing",
 	     sx_node_internal_addr(sx_nodelist_get(h->nodes, h->thisnode)), thash);*/
 	return ENOENT;
     }
-    if(r != SQLITE_ROW) {
-	sqlite3_reset(h->qb_get[hs][ndb]);
+    if(r != OK)
 	return FAIL_EINTERNAL;
-    }
-    if(!block) {
-	sqlite3_reset(h->qb_get[hs][ndb]);
+    if(!block)
 	return OK;
-    }
-    dboff = sqlite3_column_int64(h->qb_get[hs][ndb], 0);
-    sqlite3_reset(h->qb_get[hs][ndb]);
     dboff *= bs;
 
-    if(read_block(h->datafd[hs][ndb], h->blockbuf, dboff, bs))
-	return FAIL_EINTERNAL;
+    if(clen && !(cbuf = wrap_malloc(clen)))
+	return ENOMEM;
+    r = read_slot(h->datafd[hs][ndb], h->blockbuf, dboff, bs, clen, cbuf) ? FAIL_EINTERNAL : OK;
+    free(cbuf);
+    if(r != OK)
+	return r;
 
     *block = h->blockbuf;
     return OK;
 }
 
-static rc_ty sx_hashfs_hashop_ishash(sx_hashfs_t *h, unsigned hs, const sx_hash_t *hash)
-{
-    rc_ty ret;
-    unsigned ndb;
-    ndb = gethashdb(hash);
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", hash, sizeof(*hash)))
-        return FAIL_EINTERNAL;
-    switch (qstep(h->qb_get[hs][ndb])) {
-        case SQLITE_ROW:
-            ret = OK;
-            break;
-        case SQLITE_DONE:
-            ret = ENOENT;
-            break;
-        default:
-            ret = FAIL_EINTERNAL;
-            break;
+struct sort_blockloc_t {
+    const sx_hash_t *hashes;
+    const sx_hashfs_blockloc_t *locs;
+};
+
+/* Lookups are grouped by datadb and issued in key order within each of them */
+static int sort_by_shard_then_hash_func(const void *thunk, const void *a, const void *b) {
+    const struct sort_blockloc_t *support = (const struct sort_blockloc_t *)thunk;
+    unsigned int ia = *(const unsigned int *)a;
+    unsigned int ib = *(const unsigned int *)b;
+
+    if(support->locs[ia].ndb != support->locs[ib].ndb)
+	return support->locs[ia].ndb < support->locs[ib].ndb ? -1 : 1;
+    return cmphash(&support->hashes[ia], &support->hashes[ib]);
+}
+
+/* Reads are grouped by datafile and issued in on-disk order within each of them */
+static int sort_by_shard_then_blockno_func(const void *thunk, const void *a, const void *b) {
+    const struct sort_blockloc_t *support = (const struct sort_blockloc_t *)thunk;
+    const sx_hashfs_blockloc_t *la = &support->locs[*(const unsigned int *)a];
+    const sx_hashfs_blockloc_t *lb = &support->locs[*(const unsigned int *)b];
+
+    if(la->ndb != lb->ndb)
+	return la->ndb < lb->ndb ? -1 : 1;
+    if(la->blockno != lb->blockno)
+	return la->blockno < lb->blockno ? -1 : 1;
+    return 0;
+}
+
+rc_ty sx_hashfs_block_locate_many(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hashes, unsigned int nhashes, sx_hashfs_blockloc_t *locs, unsigned int *missing) {
+    struct sort_blockloc_t sortsupport;
+    unsigned int *idxs, i, hs;
+    rc_ty ret = OK;
+
+    if(!h || (nhashes && (!hashes || !locs))) {
+	NULLARG();
+	return EFAULT;
+    }
+
+    for(hs = 0; hs < SIZES; hs++)
+	if(bsz[hs] == bs)
+	    break;
+    if(hs == SIZES) {
+	WARN("bad blocksize: %d", bs);
+	return FAIL_BADBLOCKSIZE;
+    }
+
+    if(!nhashes)
+	return OK;
+    if(!(idxs = wrap_malloc(nhashes * sizeof(*idxs))))
+	return ENOMEM;
+    for(i=0; i<nhashes; i++) {
+	idxs[i] = i;
+	locs[i].ndb = gethashdb(&hashes[i], h->hashdbs);
+    }
+    sortsupport.hashes = hashes;
+    sortsupport.locs = locs;
+    sx_qsort(idxs, nhashes, sizeof(*idxs), &sortsupport, sort_by_shard_then_hash_func);
+
+    for(i=0; i<nhashes; i++) {
+	unsigned int idx = idxs[i];
+	int64_t blockno;
+
+	ret = get_blockno(h, hs, locs[idx].ndb, &hashes[idx], &blockno, &locs[idx].clen);
+	if(ret == OK) {
+	    locs[idx].blockno = blockno;
+	    continue;
+	}
+	if(ret == ENOENT) {
+	    DEBUGHASH("Hash not in database", &hashes[idx]);
+	    if(missing)
+		*missing = idx;
+	}
+	break;
+    }
+
+    free(idxs);
+    return ret;
+}
+
+#define READ_MANY_IOVS 64
+#define PUT_MANY_IOVS 64
+
+/* Returns the io_uring queue for batched block I/O or NULL if the I/O must be
+ * performed synchronously. The ring is set up on first use in each process:
+ * one inherited across fork() would be shared with the parent */
+static sx_blockio_t *get_blockio(sx_hashfs_t *h) {
+    pid_t pid = getpid();
+
+    if(h->blockio_pid == pid)
+	return h->blockio;
+    sx_blockio_free(h->blockio);
+    h->blockio = NULL;
+    h->blockio_pid = pid;
+    if(io_uring_depth > 0) {
+	h->blockio = sx_blockio_new(io_uring_depth, MAX(READ_MANY_IOVS, PUT_MANY_IOVS));
+	if(!h->blockio)
+	    DEBUG("io_uring is not available, using synchronous block I/O");
+    }
+    return h->blockio;
+}
+rc_ty sx_hashfs_block_read_many(sx_hashfs_t *h, unsigned int bs, const sx_hashfs_blockloc_t *locs, unsigned int nlocs, uint8_t *buf) {
+    struct iovec iov[READ_MANY_IOVS];
+    struct sort_blockloc_t sortsupport;
+    sx_blockio_t *io;
+    unsigned int *idxs, i, hs, runndb = 0, niov = 0, ncomp = 0;
+    uint64_t runstart = 0;
+    rc_ty ret = OK;
+
+    if(!h || (nlocs && (!locs || !buf))) {
+	NULLARG();
+	return EFAULT;
+    }
+
+    for(hs = 0; hs < SIZES; hs++)
+	if(bsz[hs] == bs)
+	    break;
+    if(hs == SIZES) {
+	WARN("bad blocksize: %d", bs);
+	return FAIL_BADBLOCKSIZE;
+    }
+
+    if(!nlocs)
+	return OK;
+    if(!(idxs = wrap_malloc(nlocs * sizeof(*idxs))))
+	return ENOMEM;
+    for(i=0; i<nlocs; i++) {
+	if(locs[i].ndb >= h->hashdbs || locs[i].clen >= bs) {
+	    WARN("bad block location %u", i);
+	    free(idxs);
+	    return EINVAL;
+	}
+	idxs[i] = i;
+    }
+    sortsupport.hashes = NULL;
+    sortsupport.locs = locs;
+    sx_qsort(idxs, nlocs, sizeof(*idxs), &sortsupport, sort_by_shard_then_blockno_func);
+
+    /* Blocks sitting in adjacent slots of the same datafile are fetched with
+     * a single vectored read; with io_uring all the reads are in flight at once */
+    io = get_blockio(h);
+    for(i=0; i<nlocs; i++) {
+	const sx_hashfs_blockloc_t *loc = &locs[idxs[i]];
+	uint8_t *dst = buf + (uint64_t)idxs[i] * bs;
+
+	if(niov && (niov == READ_MANY_IOVS || loc->ndb != runndb || loc->blockno != runstart + niov || loc->clen)) {
+	    if(io ? sx_blockio_readv(io, h->datafd[hs][runndb], iov, niov, runstart * bs) :
+	       read_blocks(h->datafd[hs][runndb], iov, niov, runstart * bs)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    niov = 0;
+	}
+	if(loc->clen) {
+	    /* Compressed blocks are fetched on their own into the end of
+	     * their buffer and expanded once all the reads are done */
+	    struct iovec ciov;
+	    ciov.iov_base = dst + bs - loc->clen;
+	    ciov.iov_len = loc->clen;
+	    if(io ? sx_blockio_readv(io, h->datafd[hs][loc->ndb], &ciov, 1, loc->blockno * bs) :
+	       read_blocks(h->datafd[hs][loc->ndb], &ciov, 1, loc->blockno * bs)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    ncomp++;
+	    continue;
+	}
+	if(!niov) {
+	    runndb = loc->ndb;
+	    runstart = loc->blockno;
+	}
+	iov[niov].iov_base = dst;
+	iov[niov].iov_len = bs;
+	niov++;
+    }
+    if(ret == OK && niov &&
+       (io ? sx_blockio_readv(io, h->datafd[hs][runndb], iov, niov, runstart * bs) :
+	read_blocks(h->datafd[hs][runndb], iov, niov, runstart * bs)))
+	ret = FAIL_EINTERNAL;
+    if(io && sx_blockio_wait(io))
+	ret = FAIL_EINTERNAL;
+    for(i=0; ret == OK && ncomp && i<nlocs; i++) {
+	uint8_t *dst = buf + (uint64_t)i * bs;
+	if(!locs[i].clen)
+	    continue;
+	if(block_uncompress(dst + bs - locs[i].clen, locs[i].clen, h->blockbuf, bs)) {
+	    WARN("Corrupt compressed block %llu on %s datafile #%u", (unsigned long long)locs[i].blockno, sizelongnames[hs], locs[i].ndb);
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	memcpy(dst, h->blockbuf, bs);
+	ncomp--;
     }
-    sqlite3_reset(h->qb_get[hs][ndb]);
+
+    free(idxs);
     return ret;
 }
 
+const char *sx_hashfs_block_datafile(sx_hashfs_t *h, unsigned int bs, unsigned int ndb) {
+    unsigned int hs;
+
+    for(hs = 0; hs < SIZES; hs++)
+	if(bsz[hs] == bs)
+	    break;
+    if(!h || hs == SIZES || ndb >= h->hashdbs)
+	return NULL;
+    return h->datapath[hs][ndb];
+}
+
+rc_ty sx_hashfs_block_get_many(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hashes, unsigned int nhashes, uint8_t *buf, unsigned int *missing) {
+    sx_hashfs_blockloc_t *locs;
+    rc_ty ret;
+
+    if(!nhashes)
+	return sx_hashfs_check_blocksize(bs);
+    if(!(locs = wrap_malloc(nhashes * sizeof(*locs))))
+	return ENOMEM;
+    ret = sx_hashfs_block_locate_many(h, bs, hashes, nhashes, locs, missing);
+    if(ret == OK && buf)
+	ret = sx_hashfs_block_read_many(h, bs, locs, nhashes, buf);
+    free(locs);
+    return ret;
+}
+
+static rc_ty sx_hashfs_hashop_ishash(sx_hashfs_t *h, unsigned hs, const sx_hash_t *hash)
+{
+    return get_blockno(h, hs, gethashdb(hash, h->hashdbs), hash, NULL, NULL);
+}
+
 static rc_ty sx_hashfs_revision_op_internal(sx_hashfs_t *h, unsigned int hs, const sx_hash_t *revision_id, int op, int64_t age)
 {
-    for (unsigned ndb=0;ndb<HASHDBS;ndb++) {
-        sqlite3_stmt *q = h->qb_addtoken[hs][ndb];
+    for (unsigned ndb=0;ndb<h->hashdbs;ndb++) {
+        sqlite3_stmt *q = qlazy(h, h->qb_addtoken[hs][ndb]);
         sqlite3_reset(q);
         if (qbind_blob(q, ":revision_id", revision_id->b, sizeof(revision_id->b)) ||
             qbind_int(q, ":op", op) ||
@@ -9747,24 +11904,29 @@ rc_ty sx_hashfs_revision_op(sx_hashfs_t *h, unsigned blocksize, const sx_hash_t
 
 static rc_ty sx_hashfs_hashop_moduse_internal(sx_hashfs_t *h, const sx_hash_t *global_vol_id, const sx_hash_t *revision_id, unsigned int hs, unsigned int ndb, const sx_hash_t *hash, unsigned replica, int64_t age)
 {
-    sqlite3_reset(h->qb_moduse[hs][ndb]);
+    sqlite3_stmt *q = qlazy(h, h->qb_moduse[hs][ndb]);
+
+    if(!q)
+        return FAIL_EINTERNAL;
+    sqlite3_reset(q);
     /* In some cases volume ID might not be available. */
-    if(!global_vol_id && qbind_null(h->qb_moduse[hs][ndb], ":global_vol_id"))
+    if(!global_vol_id && qbind_null(q, ":global_vol_id"))
         return FAIL_EINTERNAL;
-    else if(global_vol_id && qbind_blob(h->qb_moduse[hs][ndb], ":global_vol_id", global_vol_id, sizeof(*global_vol_id)))
+    else if(global_vol_id && qbind_blob(q, ":global_vol_id", global_vol_id, sizeof(*global_vol_id)))
         return FAIL_EINTERNAL;
-    if (qbind_blob(h->qb_moduse[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-            qbind_int(h->qb_moduse[hs][ndb], ":replica", replica) ||
-            qbind_int64(h->qb_moduse[hs][ndb], ":age", age) ||
-            qbind_blob(h->qb_moduse[hs][ndb], ":revision_id", revision_id, sizeof(*revision_id)) ||
-            qstep_noret(h->qb_moduse[hs][ndb]))
+    if (qbind_blob(q, ":hash", hash, sizeof(*hash)) ||
+            qbind_int(q, ":replica", replica) ||
+            qbind_int64(q, ":age", age) ||
+            qbind_blob(q, ":revision_id", revision_id, sizeof(*revision_id)) ||
+            qstep_noret(q))
         return FAIL_EINTERNAL;
-    sqlite3_reset(h->qb_moduse[hs][ndb]);
+    sqlite3_reset(q);
     return OK;
 }
 
 static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const sx_hash_t *global_vol_id, const sx_hash_t *reserve_id, const sx_hash_t *revision_id, unsigned int hs, const sx_hash_t *hash, unsigned replica, int64_t op, uint64_t op_expires_at)
 {
+    sqlite3_stmt *qaddtoken, *qreserve, *qdelreserve;
     unsigned ndb;
     int64_t age;
     rc_ty ret = FAIL_EINTERNAL;
@@ -9789,10 +11951,15 @@ static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const sx_hash_t *global_vol
         msg_set_reason("missing revision id");
         return EINVAL;
     }
-    ndb = gethashdb(hash);
+    ndb = gethashdb(hash, h->hashdbs);
 
-    sqlite3_reset(h->qb_addtoken[hs][ndb]);
-    sqlite3_reset(h->qb_reserve[hs][ndb]);
+    qaddtoken = qlazy(h, h->qb_addtoken[hs][ndb]);
+    qreserve = qlazy(h, h->qb_reserve[hs][ndb]);
+    qdelreserve = qlazy(h, h->qb_del_reserve[hs][ndb]);
+    if(!qaddtoken || !qreserve || !qdelreserve)
+        return FAIL_EINTERNAL;
+    sqlite3_reset(qaddtoken);
+    sqlite3_reset(qreserve);
     sqlite3_reset(h->qb_moduse[hs][ndb]);
     DEBUG("moduse %lld", (long long)op);
     if (reserve_id)
@@ -9804,8 +11971,8 @@ static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const sx_hash_t *global_vol
     do {
         if (op) { /* +N or -N */
             if (reserve_id) {
-                if (qbind_blob(h->qb_del_reserve[hs][ndb], ":reserve_id", reserve_id, sizeof(*reserve_id)) ||
-                    qstep_noret(h->qb_del_reserve[hs][ndb]))
+                if (qbind_blob(qdelreserve, ":reserve_id", reserve_id, sizeof(*reserve_id)) ||
+                    qstep_noret(qdelreserve))
                    break;
             }
         } else {
@@ -9814,21 +11981,21 @@ static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const sx_hash_t *global_vol
                 WARN("reserve without id!");
                 break;
             }
-            if (qbind_blob(h->qb_reserve[hs][ndb], ":revision_id", revision_id, sizeof(*revision_id)) ||
-                qbind_blob(h->qb_reserve[hs][ndb], ":reserve_id", reserve_id, sizeof(*reserve_id)) ||
-                qbind_int64(h->qb_reserve[hs][ndb], ":ttl", op_expires_at) ||
-                qstep_noret(h->qb_reserve[hs][ndb]))
+            if (qbind_blob(qreserve, ":revision_id", revision_id, sizeof(*revision_id)) ||
+                qbind_blob(qreserve, ":reserve_id", reserve_id, sizeof(*reserve_id)) ||
+                qbind_int64(qreserve, ":ttl", op_expires_at) ||
+                qstep_noret(qreserve))
                 break;
-            sqlite3_reset(h->qb_reserve[hs][ndb]);
+            sqlite3_reset(qreserve);
         }
 
         age = sxi_hdist_version(h->hd);
-        if (qbind_blob(h->qb_addtoken[hs][ndb], ":revision_id", revision_id, sizeof(*revision_id)) ||
-            qbind_int(h->qb_addtoken[hs][ndb], ":op", op) ||
-            qbind_int64(h->qb_addtoken[hs][ndb], ":age", age) ||
-            qstep_noret(h->qb_addtoken[hs][ndb]))
+        if (qbind_blob(qaddtoken, ":revision_id", revision_id, sizeof(*revision_id)) ||
+            qbind_int(qaddtoken, ":op", op) ||
+            qbind_int64(qaddtoken, ":age", age) ||
+            qstep_noret(qaddtoken))
             break;
-        sqlite3_reset(h->qb_addtoken[hs][ndb]);
+        sqlite3_reset(qaddtoken);
         DEBUGHASH("moduse on", hash);
         DEBUG("op: %ld, replica: %d, age: %lld", op, replica, (long long)age);
         if (sx_hashfs_hashop_moduse_internal(h, global_vol_id, revision_id, hs, ndb, hash, replica, age))
@@ -9914,23 +12081,376 @@ rc_ty sx_hashfs_hashop_mod(sx_hashfs_t *h, const sx_hash_t *hash, const sx_hash_
     return rc;
 }
 
+/* Marks the free slot map of a datadb as stale in this and in all the other
+ * processes: must be called within a transaction by anything freeing slots
+ * behind the back of the map (GC, compaction). Allocations don't need it */
+static void freemap_changed(sx_hashfs_t *h, unsigned int hs, unsigned int ndb) {
+    sqlite3_stmt *q = qlazy(h, h->qb_bumpallocgen[hs][ndb]);
+
+    h->freemap_gen[hs][ndb] = -1;
+    sqlite3_reset(q);
+    if(qstep_noret(q))
+	WARN("Failed to update generation of %s free slot map #%u", sizelongnames[hs], ndb);
+    sqlite3_reset(q);
+}
+
+/* Makes sure the free slot map of a datadb matches the avail table, loading
+ * it if needed: must be called within a transaction */
+static sx_freemap_t *freemap_load(sx_hashfs_t *h, unsigned int hs, unsigned int ndb) {
+    sqlite3_stmt *q = qlazy(h, h->qb_getallocgen[hs][ndb]);
+    int64_t gen = 0, nfree = 0;
+    int r;
+
+    sqlite3_reset(q);
+    r = qstep(q);
+    if(r == SQLITE_ROW)
+	gen = sqlite3_column_int64(q, 0);
+    sqlite3_reset(q);
+    if(r != SQLITE_ROW && r != SQLITE_DONE)
+	return NULL;
+    if(h->freemap[hs][ndb] && h->freemap_gen[hs][ndb] == gen)
+	return h->freemap[hs][ndb];
+
+    if(!h->freemap[hs][ndb] && !(h->freemap[hs][ndb] = sx_freemap_new()))
+	return NULL;
+    h->freemap_gen[hs][ndb] = -1;
+    sx_freemap_clear(h->freemap[hs][ndb]);
+
+    q = qlazy(h, h->qb_listavail[hs][ndb]);
+    sqlite3_reset(q);
+    while((r = qstep(q)) == SQLITE_ROW) {
+	if(sx_freemap_add(h->freemap[hs][ndb], sqlite3_column_int64(q, 0)))
+	    break;
+	nfree++;
+    }
+    sqlite3_reset(q);
+    if(r != SQLITE_DONE) {
+	WARN("Failed to load %s free slot map #%u", sizelongnames[hs], ndb);
+	return NULL;
+    }
+
+    q = qlazy(h, h->qb_nextalloc[hs][ndb]);
+    sqlite3_reset(q);
+    if(qstep_ret(q)) {
+	WARN("nextalloc failed");
+	return NULL;
+    }
+    h->freemap_next[hs][ndb] = sqlite3_column_int64(q, 0);
+    sqlite3_reset(q);
+
+    DEBUG("Loaded %s free slot map #%u: %lld free slots, next is %lld", sizelongnames[hs], ndb, (long long)nfree, (long long)h->freemap_next[hs][ndb]);
+    h->freemap_gen[hs][ndb] = gen;
+    return h->freemap[hs][ndb];
+}
+
+/* Reserves n slots in the datafile for the blocks listed in idxs, setting
+ * blocknos accordingly: must be called within a transaction.
+ * Runs of adjacent free slots are preferred, falling back to appending to the
+ * datafile. The map is only a cache: each run is validated against the db
+ * before it is taken, so a map made stale by the allocations of another
+ * process only causes a local reload and the generation is left alone */
+static rc_ty freemap_alloc(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const unsigned int *idxs, unsigned int n, int64_t *blocknos) {
+    sx_freemap_t *fm = freemap_load(h, hs, ndb);
+    unsigned int i = 0, j;
+    int reloaded = 0;
+
+    while(fm && i < n) {
+	int64_t start, got = sx_freemap_get(fm, n - i, &start);
+	int hole = got > 0, expect = hole ? got : 1;
+	sqlite3_stmt *q;
+
+	if(hole) {
+	    int64_t avail;
+	    q = qlazy(h, h->qb_countavail[hs][ndb]);
+	    sqlite3_reset(q);
+	    if(qbind_int64(q, ":start", start) || qbind_int64(q, ":end", start + got) || qstep_ret(q))
+		break;
+	    avail = sqlite3_column_int64(q, 0);
+	    sqlite3_reset(q);
+	    if(avail != got)
+		expect = -1; /* Part of the run is gone, take nothing */
+	    else {
+		q = qlazy(h, h->qb_takeavail[hs][ndb]);
+		sqlite3_reset(q);
+		if(qbind_int64(q, ":start", start) || qbind_int64(q, ":end", start + got) || qstep_noret(q))
+		    break;
+	    }
+	} else {
+	    start = h->freemap_next[hs][ndb];
+	    got = n - i;
+	    q = qlazy(h, h->qb_addalloc[hs][ndb]);
+	    sqlite3_reset(q);
+	    if(qbind_int64(q, ":n", got) || qbind_int64(q, ":next", start) || qstep_noret(q))
+		break;
+	}
+	sqlite3_reset(q);
+	if(expect < 0 || sqlite3_changes(h->datadb[hs][ndb]->handle) != expect) {
+	    /* Whatever was taken so far is already gone from the db and the map */
+	    if(reloaded) {
+		WARN("The %s free slot map #%u is out of sync", sizelongnames[hs], ndb);
+		break;
+	    }
+	    DEBUG("Reloading stale %s free slot map #%u", sizelongnames[hs], ndb);
+	    h->freemap_gen[hs][ndb] = -1;
+	    fm = freemap_load(h, hs, ndb);
+	    reloaded = 1;
+	    continue;
+	}
+	if(!hole)
+	    h->freemap_next[hs][ndb] += got;
+	for(j=0; j<got; j++)
+	    blocknos[idxs[i + j]] = start + j;
+	i += got;
+    }
+    if(i < n) {
+	WARN("Failed to allocate %u slots in %s datafile #%u", n, sizelongnames[hs], ndb);
+	h->freemap_gen[hs][ndb] = -1;
+	return FAIL_EINTERNAL;
+    }
+    return OK;
+}
+
+struct sort_putblock_t {
+    const sx_hash_t *hashes;
+    const unsigned int *ndbs;
+    const int64_t *blocknos;
+};
+
+static int sort_put_by_shard_then_hash_func(const void *thunk, const void *a, const void *b) {
+    const struct sort_putblock_t *support = (const struct sort_putblock_t *)thunk;
+    unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+
+    if(support->ndbs[ia] != support->ndbs[ib])
+	return support->ndbs[ia] < support->ndbs[ib] ? -1 : 1;
+    return cmphash(&support->hashes[ia], &support->hashes[ib]);
+}
+
+static int sort_put_by_index_func(const void *thunk, const void *a, const void *b) {
+    unsigned int ia = *(const unsigned int *)a, ib = *(const unsigned int *)b;
+
+    if(ia != ib)
+	return ia < ib ? -1 : 1;
+    return 0;
+}
+
+static int sort_put_by_blockno_func(const void *thunk, const void *a, const void *b) {
+    const struct sort_putblock_t *support = (const struct sort_putblock_t *)thunk;
+    int64_t ba = support->blocknos[*(const unsigned int *)a], bb = support->blocknos[*(const unsigned int *)b];
+
+    if(ba != bb)
+	return ba < bb ? -1 : 1;
+    return 0;
+}
+
+/* Stores the new blocks of a single shard: all the slots are allocated, the
+ * data is written and the blocks are inserted within one transaction.
+ * With block_compression set each block is compressed on its own and stored
+ * at the start of its slot when that saves space.
+ * On input blocknos[blocks[i]] is -1 for each block, on success it's set to
+ * the slot of each newly stored block and left at -1 for blocks already
+ * present; idxs is scratch space for nblocks items */
+static rc_ty block_put_shard(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const uint8_t *data, const sx_hash_t *hashes, const unsigned int *blocks, unsigned int nblocks, unsigned int *idxs, int64_t *blocknos) {
+    struct iovec iov[PUT_MANY_IOVS];
+    struct sort_putblock_t sortsupport;
+    unsigned int bs = bsz[hs], i, nnew = 0, niov = 0, ncomp = 0;
+    unsigned int *clens = NULL;
+    uint8_t *cdata = NULL;
+    sx_blockio_t *io = get_blockio(h);
+    int64_t runstart = 0, gen, lastcomp = -1;
+    int idxok, stale = 0;
+    rc_ty ret;
+
+    if(qbegin(h->datadb[hs][ndb])) {
+	WARN("begin failed");
+	return FAIL_EINTERNAL;
+    }
+
+    /* Under the write lock nobody else can store any of these blocks */
+    for(i=0; i<nblocks; i++) {
+	unsigned int idx = blocks[i];
+	ret = get_blockno(h, hs, ndb, &hashes[idx], NULL, NULL);
+	if(ret == OK)
+	    continue;
+	if(ret != ENOENT) {
+	    qrollback(h->datadb[hs][ndb]);
+	    return FAIL_EINTERNAL;
+	}
+	idxs[nnew++] = idx;
+    }
+    if(!nnew) {
+	qrollback(h->datadb[hs][ndb]);
+	return OK;
+    }
+    if(!(clens = wrap_calloc(nnew, sizeof(*clens))) ||
+       (block_compression && bs > BLOCK_COMPRESS_PAGE && !(cdata = wrap_malloc((uint64_t)nnew * (bs - BLOCK_COMPRESS_PAGE))))) {
+	ret = ENOMEM;
+	goto put_shard_err;
+    }
+
+    /* Slots are handed out in upload order so that consecutive blocks of a
+     * file end up in adjacent slots */
+    sx_qsort(idxs, nnew, sizeof(*idxs), NULL, sort_put_by_index_func);
+    if(freemap_alloc(h, hs, ndb, idxs, nnew, blocknos) != OK) {
+	ret = FAIL_EINTERNAL;
+	goto put_shard_err;
+    }
+    for(i=0; i<nnew; i++)
+	DEBUG("Block stored @%u/%u/%lld", hs, ndb, (long long)blocknos[idxs[i]] * bs);
+
+    /* Blocks landing in adjacent slots are written with a single vectored write */
+    sortsupport.hashes = hashes;
+    sortsupport.ndbs = NULL;
+    sortsupport.blocknos = blocknos;
+    sx_qsort(idxs, nnew, sizeof(*idxs), &sortsupport, sort_put_by_blockno_func);
+    ret = OK;
+    for(i=0; i<nnew; i++) {
+	int64_t blockno = blocknos[idxs[i]];
+	const uint8_t *src = data + (uint64_t)idxs[i] * bs;
+	if(cdata) {
+	    uint8_t *dst = cdata + (uint64_t)i * (bs - BLOCK_COMPRESS_PAGE);
+	    if((clens[i] = block_compress(src, bs, dst)))
+		src = dst;
+	}
+	if(niov && (niov == PUT_MANY_IOVS || blockno != runstart + niov || clens[i])) {
+	    if(io ? sx_blockio_writev(io, h->datafd[hs][ndb], iov, niov, runstart * bs) :
+	       write_blocks(h->datafd[hs][ndb], iov, niov, runstart * bs)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    niov = 0;
+	}
+	if(clens[i]) {
+	    /* Compressed blocks are written on their own */
+	    struct iovec ciov;
+	    ciov.iov_base = (void *)src;
+	    ciov.iov_len = clens[i];
+	    if(io ? sx_blockio_writev(io, h->datafd[hs][ndb], &ciov, 1, blockno * bs) :
+	       write_blocks(h->datafd[hs][ndb], &ciov, 1, blockno * bs)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    lastcomp = blockno;
+	    ncomp++;
+	    continue;
+	}
+	if(!niov)
+	    runstart = blockno;
+	iov[niov].iov_base = (void *)src;
+	iov[niov].iov_len = bs;
+	niov++;
+    }
+    if(ret == OK && niov &&
+       (io ? sx_blockio_writev(io, h->datafd[hs][ndb], iov, niov, runstart * bs) :
+	write_blocks(h->datafd[hs][ndb], iov, niov, runstart * bs)))
+	ret = FAIL_EINTERNAL;
+    /* The data must be in place before the blocks are inserted */
+    if(io && sx_blockio_wait(io))
+	ret = FAIL_EINTERNAL;
+    if(ret == OK && ncomp) {
+	/* Drop whatever a previous occupant left past the compressed data */
+	for(i=0; i<nnew; i++)
+	    if(clens[i])
+		punch_slot(h->datafd[hs][ndb], blocknos[idxs[i]] * bs, bs, clens[i]);
+	if(cover_slot(h->datafd[hs][ndb], (lastcomp + 1) * bs))
+	    ret = FAIL_EINTERNAL;
+    }
+    if(ret != OK) {
+	WARN("write failed");
+	goto put_shard_err;
+    }
+
+    /* The block index is brought up to date before the blocks table changes,
+     * then updated within the same transaction */
+    idxok = !blockidx_prepare(h, hs, ndb, nnew, &gen);
+    if(idxok)
+	blockidx_bump(h, hs, ndb, gen);
+    for(i=0; i<nnew; i++) {
+	unsigned int idx = idxs[i];
+	sqlite3_stmt *q = qlazy(h, h->qb_add[hs][ndb]);
+	sqlite3_reset(q);
+	if(qbind_blob(q, ":hash", &hashes[idx], sizeof(hashes[idx])) ||
+	   qbind_int64(q, ":now", time(NULL)) ||
+	   qbind_int64(q, ":next", blocknos[idx]) ||
+	   (clens[i] ? qbind_int(q, ":clen", clens[i]) : qbind_null(q, ":clen")) ||
+	   qstep_noret(q)) {
+	    WARN("add failed");
+	    ret = FAIL_EINTERNAL;
+	    goto put_shard_err;
+	}
+	sqlite3_reset(q);
+	if(!sqlite3_changes(h->datadb[hs][ndb]->handle)) {
+	    /* Only possible if the block index is out of sync: give the slot back */
+	    DEBUGHASH("Race in block_store, falling back", &hashes[idx]);
+	    q = qlazy(h, h->qb_setfree[hs][ndb]);
+	    sqlite3_reset(q);
+	    if(qbind_int64(q, ":blockno", blocknos[idx]) || qstep_noret(q)) {
+		WARN("setfree failed");
+		ret = FAIL_EINTERNAL;
+		goto put_shard_err;
+	    }
+	    sqlite3_reset(q);
+	    /* Put it back in our map only, others will find it when they reload */
+	    if(!h->freemap[hs][ndb] || sx_freemap_add(h->freemap[hs][ndb], blocknos[idx]))
+		h->freemap_gen[hs][ndb] = -1;
+	    blocknos[idx] = -1;
+	    stale = 1;
+	}
+    }
+
+    if(stale) {
+	sx_blockidx_invalidate(h->blockidx[hs][ndb]);
+	idxok = 0;
+    }
+    if(idxok) {
+	for(i=0; i<nnew; i++)
+	    sx_blockidx_add(h->blockidx[hs][ndb], &hashes[idxs[i]], blocknos[idxs[i]], clens[i]);
+    }
+    if(qcommit(h->datadb[hs][ndb])) {
+	WARN("commit failed");
+	if(idxok) {
+	    /* Still under lock: drop the entries and let the index be rebuilt */
+	    for(i=0; i<nnew; i++)
+		sx_blockidx_del(h->blockidx[hs][ndb], &hashes[idxs[i]]);
+	}
+	ret = FAIL_EINTERNAL;
+	goto put_shard_err;
+    }
+    free(clens);
+    free(cdata);
+    return OK;
+
+ put_shard_err:
+    qrollback(h->datadb[hs][ndb]);
+    h->freemap_gen[hs][ndb] = -1;
+    for(i=0; i<nnew; i++)
+	blocknos[idxs[i]] = -1;
+    free(clens);
+    free(cdata);
+    return ret;
+}
+
 /*
- * Saves the block in hashfs reusing an existing "hole" or appending to the datafile
+ * Saves nblocks consecutive blocks of size bs in hashfs, see sx_hashfs_block_put
  *
- * replica_count:
- * for client uploads, the value is retieved from the upload token in fcgi_save_blocks
- * if the block belongs in here, then we store it
- * if replica_count is higher than one, then we also set it up for propagation to all other hashnodes
- * if replica_count is 0, then it means that the block was sent from another node (so we just take it
- * and don't propagate it further)
+ * Blocks are grouped by shard and each group is committed at once, reusing
+ * existing "holes" or appending to the datafile.
+ * Returns ENOENT without storing anything if any of the blocks doesn't belong
+ * to this node.
  */
-rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, sx_uid_t uid) {
+rc_ty sx_hashfs_block_put_many(sx_hashfs_t *h, const uint8_t *data, unsigned int nblocks, unsigned int bs, unsigned int replica_count, sx_uid_t uid) {
+    struct sort_putblock_t sortsupport;
     sx_nodelist_t *belongsto;
-    unsigned int ndb, hs;
-    sx_hash_t hash;
+    sx_hash_t *hashes = NULL;
+    unsigned int *ndbs = NULL, *idxs = NULL, *scratch = NULL, i, j, nuniq, hs;
+    int64_t *blocknos = NULL;
     rc_ty ret = FAIL_EINTERNAL;
     int r;
 
+    if(!h || (nblocks && !data)) {
+	NULLARG();
+	return EFAULT;
+    }
+
     if(!h->have_hd) {
 	WARN("Called before initialization");
 	return FAIL_EINIT;
@@ -9940,122 +12460,95 @@ rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs,
 	if(bsz[hs] == bs)
 	    break;
     if(hs == SIZES)
-	return FAIL_BADBLOCKSIZE;
-
-    if(hash_buf(h->cluster_uuid.string, strlen(h->cluster_uuid.string), data, bs, &hash)) {
-	WARN("hashing failed");
-	return FAIL_EINTERNAL;
-    }
+	return FAIL_BADBLOCKSIZE;
 
-    DEBUGHASH("Block uploaded by user", &hash);
+    if(!nblocks)
+	return OK;
 
-    /* MODHDIST: lookup is strictly on bidx 0 */
-    belongsto = sx_hashfs_all_hashnodes(h, NL_NEXT, &hash, replica_count ? replica_count : h->next_maxreplica);
-    r = sx_nodelist_lookup(belongsto, &h->node_uuid) == NULL;
-    sx_nodelist_delete(belongsto);
-    if(r) {
-	DEBUGHASH("Block doesn't belong to this node", &hash);
-	return ENOENT;
+    hashes = wrap_malloc(nblocks * sizeof(*hashes));
+    ndbs = wrap_malloc(nblocks * sizeof(*ndbs));
+    idxs = wrap_malloc(nblocks * sizeof(*idxs));
+    scratch = wrap_malloc(nblocks * sizeof(*scratch));
+    blocknos = wrap_malloc(nblocks * sizeof(*blocknos));
+    if(!hashes || !ndbs || !idxs || !scratch || !blocknos) {
+	ret = ENOMEM;
+	goto put_many_out;
     }
 
-    ndb = gethashdb(&hash);
-
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", &hash, sizeof(hash))) {
-	WARN("binding hash failed");
-	return FAIL_EINTERNAL;
+    if(sx_hashfs_hash_bufs(h->cluster_uuid.string, strlen(h->cluster_uuid.string), data, nblocks, bs, hashes)) {
+	WARN("hashing failed");
+	goto put_many_out;
     }
 
-    r = qstep(h->qb_get[hs][ndb]);
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(r == SQLITE_DONE) {
-	int64_t dsto, next;
+    for(i=0; i<nblocks; i++) {
+	DEBUGHASH("Block uploaded by user", &hashes[i]);
 
-	if(qbegin(h->datadb[hs][ndb])) {
-	    WARN("begin failed");
-	    return FAIL_EINTERNAL;
+	/* MODHDIST: lookup is strictly on bidx 0 */
+	belongsto = sx_hashfs_all_hashnodes(h, NL_NEXT, &hashes[i], replica_count ? replica_count : h->next_maxreplica);
+	r = sx_nodelist_lookup(belongsto, &h->node_uuid) == NULL;
+	sx_nodelist_delete(belongsto);
+	if(r) {
+	    DEBUGHASH("Block doesn't belong to this node", &hashes[i]);
+	    ret = ENOENT;
+	    goto put_many_out;
 	}
 
-	sqlite3_reset(h->qb_nextavail[hs][ndb]);
-	sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-	sqlite3_reset(h->qb_bumpavail[hs][ndb]);
-	sqlite3_reset(h->qb_bumpalloc[hs][ndb]);
-	sqlite3_reset(h->qb_add[hs][ndb]);
-
-	r = qstep(h->qb_nextavail[hs][ndb]);
-	if(r == SQLITE_ROW) {
-	    next = sqlite3_column_int64(h->qb_nextavail[hs][ndb], 0);
-	    sqlite3_reset(h->qb_nextavail[hs][ndb]);
-
-	    if(qbind_int64(h->qb_bumpavail[hs][ndb], ":next", next) || qstep_noret(h->qb_bumpavail[hs][ndb])) {
-		qrollback(h->datadb[hs][ndb]);
-		WARN("bumpavail failed");
-		return FAIL_EINTERNAL;
-	    }
-	} else if(r == SQLITE_DONE) {
-	    r = qstep(h->qb_nextalloc[hs][ndb]);
-	    if(r == SQLITE_ROW) {
-		next = sqlite3_column_int64(h->qb_nextalloc[hs][ndb], 0);
-		sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-
-		if(qstep_noret(h->qb_bumpalloc[hs][ndb])) {
-		    qrollback(h->datadb[hs][ndb]);
-		    WARN("bumpalloc failed");
-		    return FAIL_EINTERNAL;
-		}
-	    }
-	}
+	ndbs[i] = gethashdb(&hashes[i], h->hashdbs);
+	blocknos[i] = -1;
+	idxs[i] = i;
+    }
 
-	if(r != SQLITE_ROW || qcommit(h->datadb[hs][ndb])) {
-	    qrollback(h->datadb[hs][ndb]);
-	    WARN("nextavail failed");
-	    return FAIL_EINTERNAL;
-	}
+    /* Group by shard, dropping duplicates */
+    sortsupport.hashes = hashes;
+    sortsupport.ndbs = ndbs;
+    sortsupport.blocknos = blocknos;
+    sx_qsort(idxs, nblocks, sizeof(*idxs), &sortsupport, sort_put_by_shard_then_hash_func);
+    for(i=1, nuniq=1; i<nblocks; i++) {
+	if(ndbs[idxs[i]] == ndbs[idxs[nuniq-1]] && !cmphash(&hashes[idxs[i]], &hashes[idxs[nuniq-1]]))
+	    continue;
+	idxs[nuniq++] = idxs[i];
+    }
 
-	dsto = next * bs;
-	DEBUG("Block stored @%d/%d/%ld", hs, ndb, dsto);
+    ret = OK;
+    for(i=0; i<nuniq; i=j) {
+	for(j=i+1; j<nuniq && ndbs[idxs[j]] == ndbs[idxs[i]]; j++);
+	ret = block_put_shard(h, hs, ndbs[idxs[i]], data, hashes, &idxs[i], j - i, scratch, blocknos);
+	if(ret != OK)
+	    goto put_many_out;
+    }
 
-	if(write_block(h->datafd[hs][ndb], data, dsto, bs)) {
-	    WARN("write failed");
-	    return FAIL_EINTERNAL;
+    if(replica_count > 1) {
+	for(i=0; i<nuniq; i++) {
+	    sx_hash_t *hash = &hashes[idxs[i]];
+	    sx_nodelist_t *targets = sx_hashfs_effective_hashnodes(h, NL_NEXT, hash, replica_count);
+	    ret = sx_hashfs_xfer_tonodes(h, hash, bs, targets, uid);
+	    sx_nodelist_delete(targets);
+	    if(ret != OK)
+		break;
 	}
+    }
 
-	/* insert it now */
-	if(qbind_blob(h->qb_add[hs][ndb], ":hash", &hash, sizeof(hash)) ||
-           qbind_int64(h->qb_add[hs][ndb], ":now", time(NULL)) ||
-	   qbind_int64(h->qb_add[hs][ndb], ":next", next)) {
-	    WARN("add failed");
-	    return FAIL_EINTERNAL;
-	}
-	r = qstep(h->qb_add[hs][ndb]);
-        DEBUG("r: %d, changes: %d", r, sqlite3_changes(h->datadb[hs][ndb]->handle));
-        if (r == SQLITE_DONE && !sqlite3_changes(h->datadb[hs][ndb]->handle)) {
-            DEBUG("checking for race condition");
-            /* race condition */
-            r = qstep(h->qb_get[hs][ndb]);
-            sqlite3_reset(h->qb_get[hs][ndb]);
-            if (r == SQLITE_ROW) {
-		DEBUG("Race in block_store, falling back");
-                ret = EAGAIN;
-            } else if (r == SQLITE_DONE) {
-                WARNHASH("Impossible: hash cannot be added but is not present either", &hash);
-                ret = FAIL_EINTERNAL;
-            } else
-                ret = FAIL_EINTERNAL;
-        } else
-            ret = OK;
-    } else if(r == SQLITE_ROW)
-        ret = EAGAIN;
-    if(ret != OK && ret != EAGAIN)
-	return FAIL_EINTERNAL;
+ put_many_out:
+    free(hashes);
+    free(ndbs);
+    free(idxs);
+    free(scratch);
+    free(blocknos);
+    return ret;
+}
 
-    if(replica_count > 1) {
-	sx_nodelist_t *targets = sx_hashfs_effective_hashnodes(h, NL_NEXT, &hash, replica_count);
-	rc_ty ret = sx_hashfs_xfer_tonodes(h, &hash, bs, targets, uid);
-	sx_nodelist_delete(targets);
-	return ret;
-    }
-    return OK;
+/*
+ * Saves the block in hashfs reusing an existing "hole" or appending to the datafile
+ *
+ * replica_count:
+ * for client uploads, the value is retieved from the upload token in fcgi_save_blocks
+ * if the block belongs in here, then we store it
+ * if replica_count is higher than one, then we also set it up for propagation to all other hashnodes
+ * if replica_count is 0, then it means that the block was sent from another node (so we just take it
+ * and don't propagate it further)
+ */
+rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, sx_uid_t uid) {
+    return sx_hashfs_block_put_many(h, data, 1, bs, replica_count, uid);
 }
 
 static void putfile_reinit(sx_hashfs_t *h) {
@@ -10165,7 +12658,7 @@ int sx_hashfs_is_volume_to_push(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
     return 0;
 }
 
-rc_ty sx_hashfs_update_node_push_time(sx_hashfs_t *h, const sx_node_t *n) {
+rc_ty sx_hashfs_update_node_push_time(sx_hashfs_t *h, const sx_node_t *n, int64_t push_time) {
     rc_ty ret = FAIL_EINTERNAL;
 
     if(!h || !n)
@@ -10173,7 +12666,7 @@ rc_ty sx_hashfs_update_node_push_time(sx_hashfs_t *h, const sx_node_t *n) {
 
     /* Update push time */
     sqlite3_reset(h->q_setnodepushtime);
-    if(qbind_int64(h->q_setnodepushtime, ":now", time(NULL))
+    if(qbind_int64(h->q_setnodepushtime, ":now", push_time)
        || qbind_blob(h->q_setnodepushtime, ":node", sx_node_uuid(n), UUID_BINARY_SIZE)
        || qstep_noret(h->q_setnodepushtime)) {
         WARN("Failed to update node push timestamp");
@@ -10190,6 +12683,38 @@ struct timeval* sx_hashfs_volsizes_timestamp(sx_hashfs_t *h) {
     return &h->volsizes_push_timestamp;
 }
 
+/* Volume sizes, node push times and the distribution all live in hashfs.db:
+ * if its generation did not move since the last checkpoint which left
+ * nothing to push, there is nothing to push now either */
+int sx_hashfs_volsizes_changed(sx_hashfs_t *h) {
+    h->volsizes_gen = cluster_gen(h, GEN_COMMIT);
+    return !h->volsizes_gen || h->volsizes_gen != h->volsizes_clean_gen;
+}
+
+void sx_hashfs_volsizes_clean(sx_hashfs_t *h) {
+    h->volsizes_clean_gen = h->volsizes_gen;
+}
+
+rc_ty sx_hashfs_volsizes_begin(sx_hashfs_t *h) {
+    if(qbegin(h->db)) {
+        msg_set_reason("Failed to lock database");
+        return FAIL_LOCKED;
+    }
+    return OK;
+}
+
+rc_ty sx_hashfs_volsizes_commit(sx_hashfs_t *h) {
+    if(qcommit(h->db)) {
+        msg_set_reason("Failed to commit volume sizes");
+        return FAIL_EINTERNAL;
+    }
+    return OK;
+}
+
+void sx_hashfs_volsizes_rollback(sx_hashfs_t *h) {
+    qrollback(h->db);
+}
+
 
 /*
  * FILE UPLOAD STEP 1
@@ -10521,7 +13046,9 @@ int sx_unique_fileid(sxc_client_t *sx, const char *revision, sx_hash_t *fileid)
 }
 
 static rc_ty is_tmp_newrev(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *fname, int64_t tmpfile_id, int64_t tmpfile_size, const void *tmpfile_d, unsigned int tmpfile_dsz, int partial) {
-    unsigned int i;
+    unsigned int i, content_len;
+    const void *content;
+    sx_hash_t *chunks;
     sxc_meta_t *fmeta;
     sqlite3_stmt *q;
     int64_t fid;
@@ -10533,11 +13060,11 @@ static rc_ty is_tmp_newrev(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, con
 	return EFAULT;
     }
 
-    ndb = getmetadb(fname);
+    ndb = getmetadb(fname, h->metadbs);
     if(ndb < 0)
 	return FAIL_EINTERNAL;
 
-    q = h->qm_get[ndb];
+    q = qlazy(h, h->qm_get[ndb]);
     sqlite3_reset(q);
     if(qbind_int64(q, ":volume", volume->id) || qbind_text(q, ":name", fname)) {
 	WARN("Failed to lookup latest revision for tmpfile %lld", (long long)tmpfile_id);
@@ -10556,20 +13083,31 @@ static rc_ty is_tmp_newrev(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, con
 	return FAIL_EINTERNAL;
     }
 
-    if(tmpfile_size != sqlite3_column_int64(q, 1) ||
-       (!partial && tmpfile_dsz != sqlite3_column_bytes(q, 2)) ||
-       (partial && tmpfile_dsz > sqlite3_column_bytes(q, 2)) ||
-       (tmpfile_dsz != 0 && memcmp(sqlite3_column_blob(q, 2), tmpfile_d, tmpfile_dsz)))	{
+    fid = sqlite3_column_int64(q, 0);
+    content = sqlite3_column_blob(q, 2);
+    content_len = sqlite3_column_bytes(q, 2);
+    if(tmpfile_size != sqlite3_column_int64(q, 1)) {
+	sqlite3_reset(q);
+	return OK; /* File has changed */
+    }
+    if((ret = file_content_load(h, ndb, fid, tmpfile_size, &content, &content_len, &chunks))) {
+	sqlite3_reset(q);
+	return ret;
+    }
+    if((!partial && tmpfile_dsz != content_len) ||
+       (partial && tmpfile_dsz > content_len) ||
+       (tmpfile_dsz != 0 && memcmp(content, tmpfile_d, tmpfile_dsz)))	{
+	free(chunks);
 	sqlite3_reset(q);
 	return OK; /* File has changed */
     }
+    free(chunks);
 
     if(partial) {
 	sqlite3_reset(q);
         return EEXIST;
     }
 
-    fid = sqlite3_column_int64(q, 0);
     sqlite3_reset(q);
 
     if((ret = fill_filemeta(h, ndb, fid)))
@@ -10679,7 +13217,7 @@ static rc_ty check_tmpfile_size(sx_hashfs_t *h, int64_t tmpfile_id, int strict,
 	return OK;
     }
 
-    mdb = getmetadb(filename);
+    mdb = getmetadb(filename, h->metadbs);
     if(mdb < 0) {
 	sqlite3_reset(h->qt_tmpdata);
         WARN("Failed to get meta db for file name: %s", filename);
@@ -10687,7 +13225,7 @@ static rc_ty check_tmpfile_size(sx_hashfs_t *h, int64_t tmpfile_id, int strict,
         return FAIL_EINTERNAL;
     }
 
-    q = h->qm_oldrevs[mdb];
+    q = qlazy(h, h->qm_oldrevs[mdb]);
     sqlite3_reset(q);
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename)) {
 	sqlite3_reset(h->qt_tmpdata);
@@ -10762,7 +13300,7 @@ rc_ty sx_hashfs_putfile_gettoken(sx_hashfs_t *h, const uint8_t *user, int64_t si
 	}
 	q = h->qt_update;
 	sqlite3_reset(q);
-	total_blocks = size_to_blocks(size, &h->put_hs, &blocksize);
+	total_blocks = upload_to_blocks(h, size, &h->put_hs, &blocksize);
 	/* calculate expiry time of token proportional to the amount of data
 	 * uploaded with _this_ token, i.e. we issue a new token for an extend.
 	 * */
@@ -10798,7 +13336,7 @@ rc_ty sx_hashfs_putfile_gettoken(sx_hashfs_t *h, const uint8_t *user, int64_t si
 	sqlite3_reset(q);
     }
 
-    total_blocks = size_to_blocks(size, &h->put_hs, &blocksize);
+    total_blocks = upload_to_blocks(h, size, &h->put_hs, &blocksize);
 
     if(h->put_putblock + h->put_extendfrom > total_blocks) {
 	msg_set_reason("Cannot obtain upload token: cannot extend beyond the file size");
@@ -10934,6 +13472,7 @@ rc_ty sx_hashfs_putfile_gettoken(sx_hashfs_t *h, const uint8_t *user, int64_t si
 }
 
 static rc_ty delete_old_revs_common(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *name, const char *revision, int make_place, unsigned int *deletes_scheduled) {
+    sqlite3_stmt *q;
     int r;
     int mdb;
     unsigned int scheduled = 0;
@@ -10943,27 +13482,30 @@ static rc_ty delete_old_revs_common(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
         return EINVAL;
     }
 
-    mdb = getmetadb(name);
-    if(mdb < 0 || mdb >= METADBS) {
+    mdb = getmetadb(name, h->metadbs);
+    if(mdb < 0 || mdb >= h->metadbs) {
         WARN("Failed to get meta db index");
         return FAIL_EINTERNAL;
     }
 
     /* Count old file revisions */
-    sqlite3_reset(h->qm_oldrevs[mdb]);
-    if(qbind_int64(h->qm_oldrevs[mdb], ":volume", volume->id) ||
-       qbind_text(h->qm_oldrevs[mdb], ":name", name))
+    q = qlazy(h, h->qm_oldrevs[mdb]);
+    if(!q)
+        return FAIL_EINTERNAL;
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", volume->id) ||
+       qbind_text(q, ":name", name))
         return FAIL_EINTERNAL;
 
-    r = qstep(h->qm_oldrevs[mdb]);
+    r = qstep(q);
     if(r == SQLITE_ROW) {
-        unsigned int nrevs = sqlite3_column_int(h->qm_oldrevs[mdb], 2);
+        unsigned int nrevs = sqlite3_column_int(q, 2);
         rc_ty rc = OK;
         job_t job = JOB_NOPARENT;
 
         /* There are some revs */
         while(nrevs >= volume->revisions + (make_place ? 0 : 1)) {
-            const char *tooold_rev = (const char *)sqlite3_column_text(h->qm_oldrevs[mdb], 0);
+            const char *tooold_rev = (const char *)sqlite3_column_text(q, 0);
 
             if(!tooold_rev) {
                 WARN("NULL old revision");
@@ -10972,7 +13514,7 @@ static rc_ty delete_old_revs_common(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
             }
 
             if(revision) { /* If revision is given, then check if it is not outdated */
-                if(strcmp(revision, (const char *)sqlite3_column_text(h->qm_oldrevs[mdb], 0)) < 0) {
+                if(strcmp(revision, (const char *)sqlite3_column_text(q, 0)) < 0) {
                     msg_set_reason("Newer copies of this file already exist");
                     rc = EEXIST;
                     break;
@@ -10992,7 +13534,7 @@ static rc_ty delete_old_revs_common(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
             if(!nrevs)
                 break;
 
-            r = qstep(h->qm_oldrevs[mdb]);
+            r = qstep(q);
             if(r != SQLITE_ROW) {
                 msg_set_reason("There was a problem enumerating current revisions of the file");
                 rc = FAIL_EINTERNAL;
@@ -11000,12 +13542,12 @@ static rc_ty delete_old_revs_common(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
             }
         }
 
-        sqlite3_reset(h->qm_oldrevs[mdb]);
+        sqlite3_reset(q);
         if(rc)
             return rc;
         /* Yay we have a slot now */
     } else {
-        sqlite3_reset(h->qm_oldrevs[mdb]);
+        sqlite3_reset(q);
         if(r != SQLITE_DONE) /* Something didn't quite work */
             return FAIL_EINTERNAL;
         /* There are no existing revs */
@@ -11020,10 +13562,167 @@ rc_ty sx_hashfs_delete_old_revs(sx_hashfs_t *h, const sx_hashfs_volume_t *volume
     return delete_old_revs_common(h, volume, name, NULL, 0, deletes_scheduled);
 }
 
+/* Adds delta to the file count of each directory above name using the
+ * qm_dirs_add, qm_dirs_upd and qm_dirs_prune statements (qprune is only
+ * needed for negative deltas), see dirs_update */
+static int dirs_walk(sqlite3_stmt *qadd, sqlite3_stmt *qupd, sqlite3_stmt *qprune, int64_t volid, const char *name, int delta, const char *revision) {
+    char dir[SXLIMIT_MAX_FILENAME_LEN+1];
+    unsigned int mtime = 0, depth = 0;
+    const char *sl = name;
+
+    if(revision && parse_revision(revision, &mtime)) {
+	WARN("Bad revision %s", revision);
+	return -1;
+    }
+
+    while((sl = strchr(sl, '/'))) {
+	unsigned int len = ++sl - name;
+	if(len >= sizeof(dir))
+	    break;
+	memcpy(dir, name, len);
+	dir[len] = '\0';
+	depth++;
+
+	if(delta > 0) {
+	    sqlite3_reset(qadd);
+	    if(qbind_int64(qadd, ":volume", volid) || qbind_text(qadd, ":name", dir) ||
+	       qbind_int(qadd, ":depth", depth) || qstep_noret(qadd))
+		goto dirs_update_fail;
+	}
+	sqlite3_reset(qupd);
+	if(qbind_int64(qupd, ":volume", volid) || qbind_text(qupd, ":name", dir) ||
+	   qbind_int(qupd, ":delta", delta) || qbind_int64(qupd, ":mtime", mtime) || qstep_noret(qupd))
+	    goto dirs_update_fail;
+	if(delta < 0) {
+	    sqlite3_reset(qprune);
+	    if(qbind_int64(qprune, ":volume", volid) || qbind_text(qprune, ":name", dir) || qstep_noret(qprune))
+		goto dirs_update_fail;
+	}
+    }
+    return 0;
+
+ dirs_update_fail:
+    WARN("Failed to update the directory index for %s", name);
+    sqlite3_reset(qadd);
+    sqlite3_reset(qupd);
+    if(qprune)
+	sqlite3_reset(qprune);
+    return -1;
+}
+
+/* Accounts for a live revision of name added (delta 1) or removed (delta -1)
+ * in the directory index of the metadb: the directories above name count the
+ * distinct file names, so their count only changes when the first revision
+ * appears or the last one goes, while their mtime is raised to that of any
+ * added revision; directories left with no files are dropped */
+static rc_ty dirs_update(sx_hashfs_t *h, unsigned int mdb, int64_t volid, const char *name, int delta, const char *revision) {
+    sqlite3_stmt *q;
+    int r;
+
+    if(!h->dir_index[mdb])
+	return OK;
+    q = qlazy(h, h->qm_dirs_others[mdb]);
+    if(!q)
+	return FAIL_EINTERNAL;
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", volid) || qbind_text(q, ":name", name) || qbind_text(q, ":rev", revision))
+	return FAIL_EINTERNAL;
+    r = qstep(q);
+    sqlite3_reset(q);
+    if(r == SQLITE_ROW) {
+	if(delta < 0)
+	    return OK;
+	delta = 0;
+    } else if(r != SQLITE_DONE)
+	return FAIL_EINTERNAL;
+    if(dirs_walk(qlazy(h, h->qm_dirs_add[mdb]), qlazy(h, h->qm_dirs_upd[mdb]), qlazy(h, h->qm_dirs_prune[mdb]), volid, name, delta, delta >= 0 ? revision : NULL))
+	return FAIL_EINTERNAL;
+    return OK;
+}
+
+/* Rebuilds the directory index of a metadb from its live files and flags it
+ * as maintained, the files must have their depth set */
+static int dirs_rebuild(sxi_db_t *db) {
+    sqlite3_stmt *qsel = NULL, *qadd = NULL, *qupd = NULL;
+    int r, ret = -1;
+
+    if(qprep(db, &qsel, "DELETE FROM dirs") || qstep_noret(qsel))
+	goto dirs_rebuild_fail;
+    qnullify(qsel);
+    if(qprep(db, &qsel, "SELECT volume_id, name, MAX(rev) FROM files WHERE age >= 0 GROUP BY volume_id, name") ||
+       qprep(db, &qadd, "INSERT OR IGNORE INTO dirs (volume_id, name, depth, nfiles, mtime) VALUES (:volume, :name, :depth, 0, 0)") ||
+       qprep(db, &qupd, "UPDATE dirs SET nfiles = nfiles + :delta, mtime = MAX(mtime, :mtime) WHERE volume_id = :volume AND name = :name"))
+	goto dirs_rebuild_fail;
+    while((r = qstep(qsel)) == SQLITE_ROW) {
+	const char *name = (const char *)sqlite3_column_text(qsel, 1);
+	const char *rev = (const char *)sqlite3_column_text(qsel, 2);
+	if(!name || !rev || dirs_walk(qadd, qupd, NULL, sqlite3_column_int64(qsel, 0), name, 1, rev))
+	    goto dirs_rebuild_fail;
+    }
+    if(r == SQLITE_DONE && !dirs_enable(db))
+	ret = 0;
+
+ dirs_rebuild_fail:
+    qnullify(qsel);
+    qnullify(qadd);
+    qnullify(qupd);
+    return ret;
+}
+
+/* Adds (delta 1) or removes (delta -1) a live file revision to the listing
+ * sums of its volume in the metadb */
+static rc_ty listsums_update(sx_hashfs_t *h, unsigned int mdb, int64_t volid, const char *name, const char *revision, int delta) {
+    sqlite3_stmt *qget = qlazy(h, h->qm_getsums[mdb]), *qset = qlazy(h, h->qm_setsums[mdb]);
+    uint8_t digest[SXI_SHA1_BIN_LEN], hash[SXI_SHA1_BIN_LEN];
+    int64_t nfiles = 0;
+    unsigned int i;
+    int r;
+
+    if(listsum_hash(name, revision, hash)) {
+	WARN("Failed to hash file %s", name);
+	return FAIL_EINTERNAL;
+    }
+    memset(digest, 0, sizeof(digest));
+    sqlite3_reset(qget);
+    if(qbind_int64(qget, ":volume", volid))
+	goto listsums_update_fail;
+    r = qstep(qget);
+    if(r == SQLITE_ROW) {
+	nfiles = sqlite3_column_int64(qget, 0);
+	if(sqlite3_column_bytes(qget, 1) == sizeof(digest))
+	    memcpy(digest, sqlite3_column_blob(qget, 1), sizeof(digest));
+    } else if(r != SQLITE_DONE)
+	goto listsums_update_fail;
+    sqlite3_reset(qget);
+
+    for(i=0; i<sizeof(digest); i++)
+	digest[i] ^= hash[i];
+    sqlite3_reset(qset);
+    if(qbind_int64(qset, ":volume", volid) || qbind_int64(qset, ":nfiles", nfiles + delta) ||
+       qbind_blob(qset, ":digest", digest, sizeof(digest)) || qstep_noret(qset))
+	goto listsums_update_fail;
+    return OK;
+
+ listsums_update_fail:
+    WARN("Failed to update the listing sums for %s", name);
+    sqlite3_reset(qget);
+    sqlite3_reset(qset);
+    return FAIL_EINTERNAL;
+}
+
+/* Accounts for a live file revision added to or removed from a metadb:
+ * to be called within the same transaction */
+static rc_ty file_changed(sx_hashfs_t *h, unsigned int mdb, int64_t volid, const char *name, const char *revision, int delta) {
+    if(listsums_update(h, mdb, volid, name, revision, delta))
+	return FAIL_EINTERNAL;
+    return dirs_update(h, mdb, volid, name, delta, revision);
+}
+
 /* WARNING: MUST BE CALLED WITHIN A TANSACTION ON META !!! */
 static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *name, const char *revision, const sx_hash_t *revision_id, sx_hash_t *blocks, unsigned int nblocks, int64_t size, int64_t totalsize, int64_t *file_id) {
     unsigned int nblocks2;
-    int r, mdb;
+    int r, mdb, chunked;
+    int64_t fid;
     sqlite3_stmt *q;
     rc_ty s;
     sx_hash_t revid;
@@ -11043,19 +13742,19 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
 	return EINVAL;
     }
 
-    nblocks2 = size_to_blocks(size, NULL, NULL);
+    nblocks2 = file_to_blocks(size, nblocks, NULL, NULL);
     if(nblocks != nblocks2) {
 	WARN("Inconsistent size: %u blocks given, %u expected", nblocks, nblocks2);
 	return EFAULT;
     }
 
-    mdb = getmetadb(name);
+    mdb = getmetadb(name, h->metadbs);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
     }
 
-    q = h->qm_getrev_or_tombstone[mdb];
+    q = qlazy(h, h->qm_getrev_or_tombstone[mdb]);
     sqlite3_reset(q);
     if(qbind_int64(q, ":volume", volume->id)
        || qbind_text(q, ":name", name)
@@ -11094,8 +13793,9 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
     }
 
     if (delete) {
-        if (qbind_int64(h->qm_del_tombstone[mdb], ":file", sqlite3_column_int64(q, 0)) ||
-            qstep_noret(h->qm_del_tombstone[mdb]))
+        sqlite3_stmt *qdel = qlazy(h, h->qm_del_tombstone[mdb]);
+        if (!qdel || qbind_int64(qdel, ":file", sqlite3_column_int64(q, 0)) ||
+            qstep_noret(qdel))
             return FAIL_EINTERNAL;
         return OK;
     }
@@ -11108,28 +13808,38 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
         return FAIL_EINTERNAL;
     }
 
-    sqlite3_reset(h->qm_ins[mdb]);
-    if(qbind_int64(h->qm_ins[mdb], ":volume", volume->id) ||
-       qbind_text(h->qm_ins[mdb], ":name", name) ||
-       qbind_text(h->qm_ins[mdb], ":revision", revision) ||
-       qbind_blob(h->qm_ins[mdb], ":revision_id", &revid, sizeof(revid)) ||
-       qbind_int64(h->qm_ins[mdb], ":size", size) ||
-       qbind_int64(h->qm_ins[mdb], ":age", sxi_hdist_version(h->hd)) ||
-       qbind_blob(h->qm_ins[mdb], ":hashes", nblocks ? (const void *)blocks : "", nblocks * sizeof(blocks[0]))) {
+    chunked = file_wants_chunks(size, nblocks);
+    q = qlazy(h, h->qm_ins[mdb]);
+    if(!q)
+	return FAIL_EINTERNAL;
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", volume->id) ||
+       qbind_text(q, ":name", name) ||
+       qbind_text(q, ":revision", revision) ||
+       qbind_blob(q, ":revision_id", &revid, sizeof(revid)) ||
+       qbind_int64(q, ":size", size) ||
+       qbind_int64(q, ":age", sxi_hdist_version(h->hd)) ||
+       qbind_blob(q, ":hashes", nblocks && !chunked ? (const void *)blocks : "", chunked ? 0 : nblocks * sizeof(blocks[0]))) {
 	WARN("Failed to create file '%s' on volume '%s'", name, volume->name);
-	sqlite3_reset(h->qm_ins[mdb]);
+	sqlite3_reset(q);
 	return FAIL_EINTERNAL;
     }
 
-    if (qstep_noret(h->qm_ins[mdb])) {
+    if (qstep_noret(q)) {
 	WARN("Failed to create file '%s' on volume '%s'", name, volume->name);
 	return FAIL_EINTERNAL;
     }
-    sqlite3_reset(h->qm_ins[mdb]);
+    sqlite3_reset(q);
     DEBUG("Inserted revision %s", revision);
 
+    fid = sqlite3_last_insert_rowid(sqlite3_db_handle(q));
     if(file_id)
-	*file_id = sqlite3_last_insert_rowid(sqlite3_db_handle(h->qm_ins[mdb]));
+	*file_id = fid;
+    if(chunked && file_chunks_store(h, mdb, fid, blocks, nblocks))
+	return FAIL_EINTERNAL;
+
+    if(file_changed(h, mdb, volume->id, name, revision, 1))
+	return FAIL_EINTERNAL;
 
     /* Update volume size counter only when size is positive and this node is not becoming a volnode */
     if(sx_hashfs_update_volume_cursize(h, volume->id, totalsize, size, 1)) {
@@ -11146,6 +13856,7 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
  *                     MAX(prev_replica, next_replica) in order to properly revert volume replica decrease changes.
  */
 rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *name, const char *revision, const sx_hash_t *revision_id, int64_t size, int allow_over_replica) {
+    sqlite3_stmt *q;
     unsigned int i, nblocks;
     int64_t file_id, totalsize;
     int mdb, flen;
@@ -11167,7 +13878,7 @@ rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const sx_hashfs_volume_t *vol,
 	return EINVAL;
     }
 
-    nblocks = size_to_blocks(size, NULL, NULL);
+    nblocks = file_to_blocks(size, h->put_putblock, NULL, NULL);
     if(h->put_putblock != nblocks) {
 	msg_set_reason("Blocks do not match the file size");
 	return EINVAL;
@@ -11178,7 +13889,7 @@ rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const sx_hashfs_volume_t *vol,
 	return ENOENT;
     }
 
-    mdb = getmetadb(name);
+    mdb = getmetadb(name, h->metadbs);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
@@ -11199,15 +13910,18 @@ rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const sx_hashfs_volume_t *vol,
 	goto cretatefile_rollback;
     }
 
+    q = qlazy(h, h->qm_metaset[mdb]);
+    if(!q)
+	goto cretatefile_rollback;
     for(i=0; i<h->nmeta; i++) {
-	sqlite3_reset(h->qm_metaset[mdb]);
-	if(qbind_int64(h->qm_metaset[mdb], ":file", file_id) ||
-	   qbind_text(h->qm_metaset[mdb], ":key", h->meta[i].key) ||
-	   qbind_blob(h->qm_metaset[mdb], ":value", h->meta[i].value, h->meta[i].value_len) ||
-	   qstep_noret(h->qm_metaset[mdb]))
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":file", file_id) ||
+	   qbind_text(q, ":key", h->meta[i].key) ||
+	   qbind_blob(q, ":value", h->meta[i].value, h->meta[i].value_len) ||
+	   qstep_noret(q))
 	    break;
     }
-    sqlite3_reset(h->qm_metaset[mdb]);
+    sqlite3_reset(q);
     if(i != h->nmeta)
 	goto cretatefile_rollback;
 
@@ -11268,18 +13982,10 @@ static rc_ty are_blocks_available(sx_hashfs_t *h, sx_hash_t *hashes,
     /* hash is local */
     if(sx_nodelist_lookup_index(nodes, &h->node_uuid, &thisnode) && prevnode == thisnode) {
 	sx_hash_t *hash = &hashes[hashnos[check_item]];
-	unsigned int ndb = gethashdb(hash);
-	int r;
-        rc_ty rc;
+	unsigned int ndb = gethashdb(hash, h->hashdbs);
+        rc_ty r, rc;
 
-	sqlite3_reset(h->qb_get[hash_size][ndb]);
-	if(qbind_blob(h->qb_get[hash_size][ndb], ":hash", hash, sizeof(*hash))) {
-	    WARN("qbind_blob failed");
-	    sqlite3_reset(h->qb_get[hash_size][ndb]);
-	    return FAIL_EINTERNAL;
-	}
-	r = qstep(h->qb_get[hash_size][ndb]);
-	sqlite3_reset(h->qb_get[hash_size][ndb]);
+	r = get_blockno(h, hash_size, ndb, hash, NULL, NULL);
 
 	*current = check_item+1;
         if (sxi_hashop_batch_flush(hdck))
@@ -11290,7 +13996,7 @@ static rc_ty are_blocks_available(sx_hashfs_t *h, sx_hash_t *hashes,
             return rc;
         }
 	if (hdck->cb) {
-	    int code = r == SQLITE_ROW ? 200 : 404;
+	    int code = r == OK ? 200 : 404;
 	    char thash[SXI_SHA1_TEXT_LEN + 1];
 	    if (bin2hex(hash->b, SXI_SHA1_BIN_LEN, thash, sizeof(thash))) {
 		WARN("bin2hex failed for hash");
@@ -11602,7 +14308,7 @@ rc_ty sx_hashfs_putfile_commitjob(sx_hashfs_t *h, const uint8_t *user, sx_uid_t
 	goto putfile_commitjob_err;
     }
     actual_blocks /= sizeof(sx_hash_t);
-    expected_blocks = size_to_blocks(expected_size, NULL, &blocksize);
+    expected_blocks = file_to_blocks(expected_size, actual_blocks, NULL, &blocksize);
     if(actual_blocks != expected_blocks) {
 	/* File was not extended enough to match its size */
 	msg_set_reason("Token not extended to its final size");
@@ -11702,60 +14408,220 @@ static int tmp_getmissing_cb(const char *hexhash, unsigned int index, int code,
               'a' +
               mis->nidxs[blockno * mis->replica_count + mis->current_replica - 1]);
     }
-    return 0;
+    return 0;
+}
+
+/*
+ * newmap must be allocated to the next_replica * nblocks size.
+ * oldmap can be NULL
+ * if oldmap is not NULL, its size must be a multiple of nblocks.
+ * oldmapsize / nblocks might (very unlikely) be different than the volume->prev_max_replica limit,
+ *      therefore it is computed from the old map size.
+ */
+static void remap_blocks_availability(sx_hashfs_t *h, unsigned int nblocks, unsigned int next_replica, const int8_t *oldmap, unsigned int oldmapsize, int8_t *newmap) {
+    unsigned int i;
+    unsigned prev_replica;
+
+    if(!newmap || (nblocks && oldmapsize % nblocks)) {
+        NULLARG();
+        return;
+    }
+
+    /* When old map size is equal to the nblocks * next_replica, it means the volume replica has not changed
+     * during the upload, therefore it is enough to just copy the old array to the new one. */
+    if(oldmap && oldmapsize == nblocks * next_replica) {
+        memcpy(newmap, oldmap, nblocks * next_replica);
+        return;
+    }
+
+    /* When of the maps are different, then always initialize the output array with zeroes before further changes. */
+    memset(newmap, 0, nblocks * next_replica);
+    if(!oldmap) /* Cover the case when the availability map is picked as NULL from the db */
+        return;
+
+    /* Calculate the previous replica of the map */
+    prev_replica = nblocks ? oldmapsize / nblocks : 0;
+
+    /* The next replica limit is differnt than the previous one */
+    DEBUG("Remapping the blocks availability map, prev replica: %u, next replica: %u, nblocks: %u", prev_replica, next_replica, nblocks);
+    for(i = 0; i < nblocks; i++)
+        memcpy(newmap + i * next_replica, oldmap + i * prev_replica, MIN(prev_replica, next_replica));
+}
+
+/* Temporary file block lists can be very large: rather than loading them at
+ * once, the columns are accessed in place via the incremental blob I/O */
+static sqlite3_blob *tmpfile_blob_open(sx_hashfs_t *h, int64_t tmpfile_id, const char *column, int writable) {
+    sqlite3_blob *blob = NULL;
+    int r = sqlite3_blob_open(h->tempdb->handle, "main", "tmpfiles", column, tmpfile_id, writable, &blob);
+
+    if(r != SQLITE_OK) {
+	WARN("Failed to open the %s of tmpfile %lld: %s", column, (long long)tmpfile_id, sqlite3_errmsg(h->tempdb->handle));
+	sqlite3_blob_close(blob);
+	return NULL;
+    }
+    return blob;
+}
+
+static int tmpfile_blob_read(sqlite3_blob *blob, void *buf, unsigned int len, unsigned int offset) {
+    if(sqlite3_blob_read(blob, buf, len, offset) != SQLITE_OK) {
+	WARN("Failed to read %u bytes at offset %u from the tmpfile", len, offset);
+	return -1;
+    }
+    return 0;
+}
+
+/* Converts the stored availability map to the current volume replica, which
+ * may have changed during the upload; presence checks restart from scratch */
+static int tmpfile_remap_avail(sx_hashfs_t *h, int64_t tmpfile_id, unsigned int nblocks, unsigned int replica_count, unsigned int old_navl) {
+    int8_t *oldmap = NULL, *newmap;
+    sqlite3_blob *blob;
+    int ret = -1;
+
+    newmap = wrap_malloc(nblocks * replica_count + 1);
+    if(!newmap) {
+	OOM();
+	return -1;
+    }
+    if(old_navl) {
+	oldmap = wrap_malloc(old_navl);
+	if(!oldmap) {
+	    OOM();
+	    goto remap_err;
+	}
+	if(!(blob = tmpfile_blob_open(h, tmpfile_id, "avail", 0)))
+	    goto remap_err;
+	ret = tmpfile_blob_read(blob, oldmap, old_navl, 0);
+	sqlite3_blob_close(blob);
+	if(ret)
+	    goto remap_err;
+	ret = -1;
+    }
+
+    remap_blocks_availability(h, nblocks, replica_count, oldmap, old_navl, newmap);
+
+    sqlite3_reset(h->qt_updateavail);
+    if(!qbind_int64(h->qt_updateavail, ":id", tmpfile_id) &&
+       !qbind_blob(h->qt_updateavail, ":avail", newmap, nblocks * replica_count) &&
+       !qstep_noret(h->qt_updateavail))
+	ret = 0;
+    sqlite3_reset(h->qt_updateavail);
+
+ remap_err:
+    free(oldmap);
+    free(newmap);
+    return ret;
+}
+
+/* Loads into tbd the next batch of up to DOWNLOAD_MAX_BLOCKS unique blocks
+ * which are not yet fully replicated, starting at *checkpos in the unique list.
+ * On return *checkpos points to the first unique entry not considered */
+static rc_ty tmpfile_load_window(sx_hashfs_t *h, sx_hashfs_tmpinfo_t *tbd, unsigned int nblocks, unsigned int nuniqs, unsigned int *checkpos, unsigned int *blocknos) {
+    sqlite3_blob *content = NULL, *uniqidx = NULL, *avail = NULL;
+    unsigned int uniqs[1024], rc = tbd->replica_count, pos = *checkpos;
+    rc_ty ret = FAIL_EINTERNAL;
+
+    tbd->nall = 0;
+    if(!(content = tmpfile_blob_open(h, tbd->tmpfile_id, "content", 0)) ||
+       !(uniqidx = tmpfile_blob_open(h, tbd->tmpfile_id, "uniqidx", 0)) ||
+       !(avail = tmpfile_blob_open(h, tbd->tmpfile_id, "avail", 0)))
+	goto window_err;
+
+    while(pos < nuniqs && tbd->nall < DOWNLOAD_MAX_BLOCKS) {
+	unsigned int i, n = MIN(nuniqs - pos, sizeof(uniqs) / sizeof(uniqs[0]));
+
+	if(tmpfile_blob_read(uniqidx, uniqs, n * sizeof(uniqs[0]), pos * sizeof(uniqs[0])))
+	    goto window_err;
+	for(i=0; i<n && tbd->nall < DOWNLOAD_MAX_BLOCKS; i++) {
+	    int8_t *avl = &tbd->avlblty[tbd->nall * rc];
+	    unsigned int j;
+
+	    if(uniqs[i] >= nblocks) {
+		WARN("Unique block index %u out of bounds", uniqs[i]);
+		msg_set_reason("Internal corruption detected (bad unique content)");
+		ret = EFAULT;
+		goto window_err;
+	    }
+	    if(tmpfile_blob_read(avail, avl, rc, uniqs[i] * rc))
+		goto window_err;
+	    for(j=0; j<rc; j++)
+		if(avl[j] != 1)
+		    break;
+	    if(j == rc)
+		continue; /* Already fully replicated */
+
+	    if(tmpfile_blob_read(content, &tbd->all_blocks[tbd->nall], sizeof(sx_hash_t), uniqs[i] * sizeof(sx_hash_t)))
+		goto window_err;
+	    /* MODHDIST: pick from _next, bidx=0 */
+	    if(hash_nidx_tobuf(h, &tbd->all_blocks[tbd->nall], rc, rc, &tbd->nidxs[tbd->nall * rc]) < 0) {
+		WARN("hash_nidx_tobuf failed");
+		goto window_err;
+	    }
+	    blocknos[tbd->nall] = uniqs[i];
+	    tbd->uniq_ids[tbd->nall] = tbd->nall;
+	    tbd->nall++;
+	}
+	pos += i;
+    }
+    *checkpos = pos;
+    ret = OK;
+
+ window_err:
+    sqlite3_blob_close(content);
+    sqlite3_blob_close(uniqidx);
+    sqlite3_blob_close(avail);
+    return ret;
 }
 
-/*
- * newmap must be allocated to the next_replica * nblocks size.
- * oldmap can be NULL
- * if oldmap is not NULL, its size must be a multiple of nblocks.
- * oldmapsize / nblocks might (very unlikely) be different than the volume->prev_max_replica limit,
- *      therefore it is computed from the old map size.
- */
-static void remap_blocks_availability(sx_hashfs_t *h, unsigned int nblocks, unsigned int next_replica, const int8_t *oldmap, unsigned int oldmapsize, int8_t *newmap) {
+/* Stores the presence check results of the current batch and the position to
+ * resume from, so the blocks won't be hashop'd again on the next run */
+static int tmpfile_save_window(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *tbd, const unsigned int *blocknos, unsigned int checkpos) {
+    sqlite3_blob *avail;
     unsigned int i;
-    unsigned prev_replica;
-
-    if(!newmap || (nblocks && oldmapsize % nblocks)) {
-        NULLARG();
-        return;
-    }
 
-    /* When old map size is equal to the nblocks * next_replica, it means the volume replica has not changed
-     * during the upload, therefore it is enough to just copy the old array to the new one. */
-    if(oldmap && oldmapsize == nblocks * next_replica) {
-        memcpy(newmap, oldmap, nblocks * next_replica);
-        return;
+    if(qbegin(h->tempdb))
+	return -1;
+    if(tbd->somestatechanged) {
+	if(!(avail = tmpfile_blob_open(h, tbd->tmpfile_id, "avail", 1)))
+	    goto save_err;
+	for(i=0; i<tbd->nall; i++) {
+	    if(sqlite3_blob_write(avail, &tbd->avlblty[i * tbd->replica_count], tbd->replica_count, blocknos[i] * tbd->replica_count) != SQLITE_OK) {
+		WARN("Failed to update the block availability of tmpfile %lld", (long long)tbd->tmpfile_id);
+		sqlite3_blob_close(avail);
+		goto save_err;
+	    }
+	}
+	/* Must be closed before the update below, which would invalidate it */
+	sqlite3_blob_close(avail);
     }
 
-    /* When of the maps are different, then always initialize the output array with zeroes before further changes. */
-    memset(newmap, 0, nblocks * next_replica);
-    if(!oldmap) /* Cover the case when the availability map is picked as NULL from the db */
-        return;
+    sqlite3_reset(h->qt_setcheckpos);
+    if(qbind_int64(h->qt_setcheckpos, ":id", tbd->tmpfile_id) ||
+       qbind_int(h->qt_setcheckpos, ":pos", checkpos) ||
+       qstep_noret(h->qt_setcheckpos))
+	goto save_err;
+    sqlite3_reset(h->qt_setcheckpos);
 
-    /* Calculate the previous replica of the map */
-    prev_replica = nblocks ? oldmapsize / nblocks : 0;
+    if(qcommit(h->tempdb))
+	goto save_err;
+    return 0;
 
-    /* The next replica limit is differnt than the previous one */
-    DEBUG("Remapping the blocks availability map, prev replica: %u, next replica: %u, nblocks: %u", prev_replica, next_replica, nblocks);
-    for(i = 0; i < nblocks; i++)
-        memcpy(newmap + i * next_replica, oldmap + i * prev_replica, MIN(prev_replica, next_replica));
+ save_err:
+    sqlite3_reset(h->qt_setcheckpos);
+    qrollback(h->tempdb);
+    return -1;
 }
 
-rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinfo_t **tmpinfo, int recheck_presence) {
-    unsigned int contentsz, nblocks, bs, nuniqs, i, hash_size, navl;
-    const unsigned int *uniqs;
+rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinfo_t **tmpinfo, sx_hashfs_tmpinfo_mode_t mode) {
+    unsigned int contentsz, nblocks, bs, nuniqs, i, hash_size, navl, old_navl, checkpos, startpos, rc;
+    unsigned int *blocknos = NULL;
     const sx_hashfs_volume_t *volume;
     rc_ty ret = FAIL_EINTERNAL, ret2;
-    const sx_hash_t *content;
     sx_hashfs_tmpinfo_t *tbd = NULL;
     const char *name, *revision;
-    const int8_t *avl;
     int64_t file_size;
+    size_t tbdsz;
     int r;
-    char token[TOKEN_RAND_BYTES*2 + 1];
     sqlite3_stmt *q;
-    unsigned int old_navl = 0;
 
     if(!h || !tmpinfo) {
 	NULLARG();
@@ -11763,8 +14629,8 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
     }
     DEBUG("tmp_getinfo for file %ld", tmpfile_id);
 
-    /* Get tmp data */
-    q = h->qt_tmpdata;
+    /* Get tmp data: the block lists are not loaded here */
+    q = h->qt_tmpinfo;
     sqlite3_reset(q);
     if(qbind_int64(q, ":id", tmpfile_id))
 	goto getmissing_err;
@@ -11779,7 +14645,7 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
 	goto getmissing_err;
     }
 
-    if(sqlite3_column_int(q, 6) == 0) {
+    if(sqlite3_column_int(q, 4) == 0) {
 	/* Not yet flushed, need to retry later */
 	msg_set_reason("Token not ready yet");
 	ret = EAGAIN;
@@ -11811,47 +14677,40 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
     }
 
     file_size = sqlite3_column_int64(q, 2);
-    nblocks = size_to_blocks(file_size, &hash_size, &bs);
-
-    content = sqlite3_column_blob(q, 4);
-    contentsz = sqlite3_column_bytes(q, 4);
-    if((!content && contentsz) || contentsz % sizeof(sx_hash_t) || contentsz / sizeof(*content) != nblocks) {
+    contentsz = sqlite3_column_int(q, 5);
+    nblocks = file_to_blocks(file_size, contentsz / sizeof(sx_hash_t), &hash_size, &bs);
+    if(contentsz % sizeof(sx_hash_t) || contentsz / sizeof(sx_hash_t) != nblocks) {
 	WARN("Tmpfile with bad content length");
 	msg_set_reason("Internal corruption detected (bad content)");
 	ret = EFAULT;
 	goto getmissing_err;
     }
 
-    uniqs = sqlite3_column_blob(q, 5);
-    contentsz = sqlite3_column_bytes(q, 5);
-    if(!uniqs && contentsz) {
-        WARN("Failed to load uniqs blob");
-        msg_set_reason("Internal corruption detected (bad content)");
-        ret = EFAULT;
-        goto getmissing_err;
-    }
-    nuniqs = contentsz / sizeof(*uniqs);
-    if(contentsz % sizeof(*uniqs) || nuniqs > nblocks)  {
+    contentsz = sqlite3_column_int(q, 6);
+    nuniqs = contentsz / sizeof(unsigned int);
+    if(contentsz % sizeof(unsigned int) || nuniqs > nblocks)  {
 	WARN("Tmpfile with bad unique length");
 	msg_set_reason("Internal corruption detected (bad unique content)");
 	ret = EFAULT;
 	goto getmissing_err;
     }
 
-    avl = sqlite3_column_blob(q, 7);
-    if(avl)
-	old_navl = sqlite3_column_bytes(q, 7);
-    /* old_navl is the size of the availability table stored in the db. It is possible that avl is NULL,
-     * then old_navl is 0. New availability array has the size of the new volume replica in case it is split.
-     *
-     * tbd->avlblty is zeroed and properly initialized later with remap_blocks_availability() function. */
-    navl = nblocks * volume->max_replica;
-
-    tbd = wrap_malloc(sizeof(*tbd) + /* The struct itself */
-		      nblocks * sizeof(sx_hash_t) + /* all_blocks */
-		      nuniqs * sizeof(tbd->uniq_ids[0]) + /* uniq_ids */
-		      nblocks * sizeof(tbd->nidxs[0]) * volume->max_replica + /* nidxs */
-		      navl); /* avlblty */
+    /* old_navl is the size of the availability table stored in the db, 0 if NULL.
+     * It is remapped to the current volume replica before checking presence */
+    old_navl = sqlite3_column_int(q, 7);
+    rc = volume->max_replica;
+    navl = nblocks * rc;
+    checkpos = sqlite3_column_int(q, 8);
+
+    tbdsz = sizeof(*tbd); /* The struct itself */
+    if(mode == TMPINFO_BLOCKS)
+	tbdsz += nblocks * sizeof(sx_hash_t); /* all_blocks */
+    else if(mode == TMPINFO_CHECK)
+	tbdsz += DOWNLOAD_MAX_BLOCKS * (sizeof(sx_hash_t) + /* all_blocks */
+					sizeof(tbd->uniq_ids[0]) + /* uniq_ids */
+					sizeof(tbd->nidxs[0]) * rc + /* nidxs */
+					rc); /* avlblty */
+    tbd = wrap_calloc(1, tbdsz);
     if(!tbd) {
 	OOM();
 	ret = ENOMEM;
@@ -11859,42 +14718,14 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
     }
 
     tbd->allnodes = sx_hashfs_all_nodes(h, NL_NEXT);
-
     tbd->volume_id = volume->id;
-    tbd->all_blocks = (sx_hash_t *)(tbd+1);
-    tbd->uniq_ids = (unsigned int *)&tbd->all_blocks[nblocks];
-    tbd->nidxs = &tbd->uniq_ids[nuniqs];
-    tbd->avlblty = (int8_t *)&tbd->nidxs[nblocks * volume->max_replica];
-    if(nblocks)
-        memcpy(tbd->all_blocks, content, nblocks * sizeof(sx_hash_t));
-    if(nuniqs)
-        memcpy(tbd->uniq_ids, uniqs, nuniqs * sizeof(tbd->uniq_ids[0]));
-    memset(tbd->nidxs, -1, nblocks * sizeof(tbd->nidxs[0]) * volume->max_replica);
-    for(i=0; i<nuniqs; i++) {
-	/* MODHDIST: pick from _next, bidx=0 */
-	if(hash_nidx_tobuf(h, &tbd->all_blocks[tbd->uniq_ids[i]], volume->max_replica, volume->max_replica, &tbd->nidxs[tbd->uniq_ids[i]*volume->max_replica]) < 0) {
-	    WARN("hash_nidx_tobuf failed");
-	    goto getmissing_err;
-	}
-    }
-
-    /* Remap the blocks availability array to fit into the recent volume replica, it might have changed during the upload */
-    remap_blocks_availability(h, nblocks, volume->max_replica, avl, old_navl, tbd->avlblty);
-    /* It is required to update the tempfile entry when we need to remap the blocks availability array */
-    if(old_navl != navl)
-        tbd->somestatechanged = 1;
-
-    tbd->nall = nblocks;
-    tbd->nuniq = nuniqs;
-    tbd->replica_count = volume->max_replica;
+    tbd->replica_count = rc;
     tbd->block_size = bs;
     sxi_strlcpy(tbd->revision, revision, sizeof(tbd->revision));
     sxi_strlcpy(tbd->name, name, sizeof(tbd->name));
     tbd->file_size = file_size;
     tbd->tmpfile_id = tmpfile_id;
-    tbd->somestatechanged = 0;
 
-    sxi_strlcpy(token, (const char*)sqlite3_column_text(q, 8), sizeof(token));
     sqlite3_reset(q); /* Do not deadlock if we need to update this very entry */
 
     /* revision_id when deleting the file must match
@@ -11902,11 +14733,52 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
     if (sx_unique_fileid(h->sx, tbd->revision, &tbd->revision_id))
         goto getmissing_err;
 
-    if(nuniqs && recheck_presence) {
-	unsigned int r, l, nchecks = MIN(DOWNLOAD_MAX_BLOCKS, tbd->nuniq);
+    if(mode == TMPINFO_BLOCKS && nblocks) {
+	sqlite3_blob *content = tmpfile_blob_open(h, tmpfile_id, "content", 0);
+	if(!content)
+	    goto getmissing_err;
+	tbd->all_blocks = (sx_hash_t *)(tbd+1);
+	r = tmpfile_blob_read(content, tbd->all_blocks, nblocks * sizeof(sx_hash_t), 0);
+	sqlite3_blob_close(content);
+	if(r)
+	    goto getmissing_err;
+	tbd->nall = nblocks;
+    }
+
+    if(mode == TMPINFO_CHECK && nuniqs) {
+	unsigned int k, l;
+
+	tbd->all_blocks = (sx_hash_t *)(tbd+1);
+	tbd->uniq_ids = (unsigned int *)&tbd->all_blocks[DOWNLOAD_MAX_BLOCKS];
+	tbd->nidxs = &tbd->uniq_ids[DOWNLOAD_MAX_BLOCKS];
+	tbd->avlblty = (int8_t *)&tbd->nidxs[DOWNLOAD_MAX_BLOCKS * rc];
+	memset(tbd->nidxs, -1, DOWNLOAD_MAX_BLOCKS * sizeof(tbd->nidxs[0]) * rc);
+	blocknos = wrap_malloc(DOWNLOAD_MAX_BLOCKS * sizeof(*blocknos));
+	if(!blocknos) {
+	    OOM();
+	    ret = ENOMEM;
+	    goto getmissing_err;
+	}
+
+	if(old_navl != navl) {
+	    if(tmpfile_remap_avail(h, tmpfile_id, nblocks, rc, old_navl))
+		goto getmissing_err;
+	    checkpos = 0;
+	}
+
+	/* Only check a small number of blocks per run, resuming where the
+	 * previous run left off; blocks already fully replicated are skipped */
+	if(checkpos >= nuniqs)
+	    checkpos = 0;
+	startpos = checkpos;
+	if((ret2 = tmpfile_load_window(h, tbd, nblocks, nuniqs, &checkpos, blocknos)) != OK) {
+	    ret = ret2;
+	    goto getmissing_err;
+	}
+	tbd->nuniq = tbd->nall;
 
 	/* For each replica set populate tbd->avlblty via hash_presence callback */
-	for(i=1; i<=tbd->replica_count; i++) {
+	for(i=1; tbd->nuniq && i<=tbd->replica_count; i++) {
             sx_hash_t reserve_id;
 	    unsigned int cur_item = 0;
 	    sort_by_absence_then_node(tbd->all_blocks, tbd->uniq_ids, tbd->nidxs, tbd->avlblty, tbd->nuniq, i, tbd->replica_count);
@@ -11928,11 +14800,11 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
 					       tbd->uniq_ids,
 					       tbd->nidxs,
 					       &cur_item,
-					       nchecks,
+					       tbd->nuniq,
 					       hash_size,
 					       i,
 					       tbd->replica_count)) == OK) {
-		if(cur_item >= nchecks)
+		if(cur_item >= tbd->nuniq)
 		    break;
 	    }
 	    if(ret2 != OK)
@@ -11946,46 +14818,34 @@ rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinf
             DEBUG("end queries for replica #%d", i);
 	}
 
+	if(tmpfile_save_window(h, tbd, blocknos, checkpos < nuniqs ? checkpos : 0))
+	    goto getmissing_err;
+
 	/* Drop all hashes which are already fully replicated */
-	for(r=0, l=0; r < tbd->nuniq; r++) {
+	for(k=0, l=0; k < tbd->nuniq; k++) {
 	    for(i=0; i<tbd->replica_count; i++) {
-		if(tbd->avlblty[tbd->uniq_ids[r] * tbd->replica_count + i] != 1)
+		if(tbd->avlblty[tbd->uniq_ids[k] * tbd->replica_count + i] != 1)
 		    break;
 	    }
-	    if(i == tbd->replica_count) {
-		tbd->somestatechanged = 1; /* Should be implied but explicitly setting this won't harm */
-		nuniqs--;
+	    if(i == tbd->replica_count)
 		continue;
-	    }
-	    if(l != r)
-		tbd->uniq_ids[l] = tbd->uniq_ids[r];
+	    if(l != k)
+		tbd->uniq_ids[l] = tbd->uniq_ids[k];
 	    l++;
 	}
+	tbd->nuniq = l;
 
 	/* Optimize unique list for the subsequent .pushto (in replicateblocks_commit) */
-	sort_for_pushto(tbd->uniq_ids, tbd->avlblty, nuniqs, tbd->replica_count);
+	sort_for_pushto(tbd->uniq_ids, tbd->avlblty, tbd->nuniq, tbd->replica_count);
 
-	/* Only check a small number of blocks
-	 * Return OK if all blocks were presence checked
+	/* Return OK if all blocks were presence checked in this run
 	 * Return EINPROGRESS otherwise */
-	ret = (nchecks == tbd->nuniq) ? OK : EINPROGRESS;
+	ret = (startpos == 0 && checkpos >= nuniqs) ? OK : EINPROGRESS;
     } else
 	ret = OK;
 
  getmissing_err:
-    if(tbd && tbd->somestatechanged) {
-        /* If we've harvested some hash bring the counter down */
-        tbd->nuniq = nuniqs;
-
-        /* and update the db so they won't be hashop'd again on the next run */
-        sqlite3_reset(h->qt_updateuniq);
-        if(!qbind_int64(h->qt_updateuniq, ":id", tmpfile_id) &&
-           !qbind_blob(h->qt_updateuniq, ":uniq", tbd->uniq_ids, sizeof(*tbd->uniq_ids) * tbd->nuniq) &&
-           !qbind_blob(h->qt_updateuniq, ":avail", tbd->avlblty, navl))
-            qstep_noret(h->qt_updateuniq);
-        sqlite3_reset(h->qt_updateuniq);
-    }
-
+    free(blocknos);
     if(ret != OK && ret != EINPROGRESS) {
         (void)sxi_hashop_end(&h->hc);
 	free(tbd);
@@ -12011,10 +14871,10 @@ rc_ty sx_hashfs_getinfo_by_revision(sx_hashfs_t *h, const char *revision, sx_has
 	return EINVAL;
     }
 
-    for(ndb=0;ndb<METADBS;ndb++) {
+    for(ndb=0;ndb<h->metadbs;ndb++) {
         const void *revid;
 
-        sqlite3_stmt *q = h->qm_findrev[ndb];
+        sqlite3_stmt *q = qlazy(h, h->qm_findrev[ndb]);
         if(qbind_text(q, ":revision", revision))
             return FAIL_EINTERNAL;
 
@@ -12036,7 +14896,7 @@ rc_ty sx_hashfs_getinfo_by_revision(sx_hashfs_t *h, const char *revision, sx_has
             sqlite3_reset(q);
             return FAIL_EINTERNAL;
         }
-        size_to_blocks(filerev->file_size, NULL, &filerev->block_size);
+        file_to_blocks(filerev->file_size, sqlite3_column_int(q, 4) / sizeof(sx_hash_t), NULL, &filerev->block_size);
         strncpy(filerev->name, (const char*)name, sizeof(filerev->name));
         filerev->name[sizeof(filerev->name)-1] = '\0';
         strncpy(filerev->revision, revision, sizeof(filerev->revision));
@@ -12065,6 +14925,7 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
     rc_ty ret = FAIL_EINTERNAL, ret2;
     const sx_hashfs_volume_t *volume;
     int64_t file_id, totalsize = 0;
+    sqlite3_stmt *qmset;
     int mdb;
     sxc_meta_t *meta;
     unsigned int i;
@@ -12074,7 +14935,7 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
 	return EFAULT;
     }
 
-    mdb = getmetadb(missing->name);
+    mdb = getmetadb(missing->name, h->metadbs);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
@@ -12123,6 +14984,9 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
     }
 
     /* Set new file meta */
+    qmset = qlazy(h, h->qm_metaset[mdb]);
+    if(!qmset)
+	goto tmp2file_rollback;
     for(i = 0; i < sxc_meta_count(meta); i++) {
         const void *value;
         const char *key;
@@ -12133,17 +14997,17 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
             goto tmp2file_rollback;
         }
 
-        sqlite3_reset(h->qm_metaset[mdb]);
-        if(qbind_int64(h->qm_metaset[mdb], ":file", file_id) ||
-           qbind_text(h->qm_metaset[mdb], ":key", key) ||
-           qbind_blob(h->qm_metaset[mdb], ":value", value, value_len) ||
-           qstep_noret(h->qm_metaset[mdb])) {
-            sqlite3_reset(h->qm_metaset[mdb]);
+        sqlite3_reset(qmset);
+        if(qbind_int64(qmset, ":file", file_id) ||
+           qbind_text(qmset, ":key", key) ||
+           qbind_blob(qmset, ":value", value, value_len) ||
+           qstep_noret(qmset)) {
+            sqlite3_reset(qmset);
             goto tmp2file_rollback;
         }
     }
 
-    sqlite3_reset(h->qm_metaset[mdb]);
+    sqlite3_reset(qmset);
     if(qcommit(h->metadb[mdb]))
 	goto tmp2file_rollback;
 
@@ -12916,7 +15780,7 @@ static rc_ty get_file_id(sx_hashfs_t *h, const char *volume, const char *filenam
     if(res)
 	return res;
 
-    ndb = getmetadb(filename);
+    ndb = getmetadb(filename, h->metadbs);
     if(ndb < 0)
 	return FAIL_EINTERNAL;
     *database_number = ndb;
@@ -12926,11 +15790,11 @@ static rc_ty get_file_id(sx_hashfs_t *h, const char *volume, const char *filenam
 	    msg_set_reason("Invalid revision");
 	    return EINVAL;
 	}
-	q = h->qm_getrev[ndb];
+	q = qlazy(h, h->qm_getrev[ndb]);
 	if(qbind_text(q, ":revision", revision))
 	    return FAIL_EINTERNAL;
     } else
-	q = h->qm_get[ndb];
+	q = qlazy(h, h->qm_get[ndb]);
 
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename))
 	return FAIL_EINTERNAL;
@@ -12972,28 +15836,20 @@ int sx_hashfs_timeval2str(const struct timeval *tv, char *buff) {
     return 0;
 }
 
-/* Rename files with database switch */
-static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *oldname, const char *revision, unsigned int mdb1, const char *newname, const char *newrev, unsigned int mdb2) {
+/* Moves a file revision from metadb mdb1 to metadb mdb2 under its new name
+ * Both the metadbs must be locked by the caller */
+static rc_ty rename_move_row(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *oldname, const char *revision, unsigned int mdb1, const char *newname, const char *newrev, unsigned int mdb2) {
     rc_ty ret = FAIL_EINTERNAL;
-    sqlite3_stmt *qget = h->qm_getrev[mdb1], *qins = h->qm_ins[mdb2], *qdel = h->qm_delfile[mdb1];
-    sqlite3_stmt *qmget = h->qm_metaget[mdb1], *qmset = h->qm_metaset[mdb2];
-    int r, db2_locked;
+    sqlite3_stmt *qget = qlazy(h, h->qm_getrev[mdb1]), *qins = qlazy(h, h->qm_ins[mdb2]), *qdel = qlazy(h, h->qm_delfile[mdb1]);
+    sqlite3_stmt *qmget = qlazy(h, h->qm_metaget[mdb1]), *qmset = qlazy(h, h->qm_metaset[mdb2]);
+    int r;
     int64_t oldid, newid, size, age;
     const void *content, *revision_id;
     unsigned int content_len, revision_id_len, nmeta;
 
-    if(qbegin(h->metadb[mdb1])) {
-        msg_set_reason("Failed to lock database");
-        return FAIL_EINTERNAL;
-    }
-
-    if(qbegin(h->metadb[mdb2])) {
-        msg_set_reason("Failed to lock database");
-        qrollback(h->metadb[mdb1]);
+    if(!qget || !qins || !qdel || !qmget || !qmset)
         return FAIL_EINTERNAL;
-    }
 
-    db2_locked = 1;
     sqlite3_reset(qget);
     sqlite3_reset(qins);
     sqlite3_reset(qdel);
@@ -13003,18 +15859,18 @@ static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, co
     if(qbind_int64(qget, ":volume", vol->id) || qbind_text(qget, ":name", oldname) ||
        qbind_text(qget, ":revision", revision)) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
     r = qstep(qget);
     if(r == SQLITE_DONE) {
         msg_set_reason("No such file: %s", oldname);
         ret = ENOENT;
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
     if(r != SQLITE_ROW) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
     /* Get existing file data */
@@ -13032,25 +15888,38 @@ static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, co
        qbind_text(qins, ":revision", newrev) || qbind_blob(qins, ":revision_id", revision_id, revision_id_len) ||
        qbind_int64(qins, ":age", age)) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
     r = qstep(qins);
     if(r == SQLITE_CONSTRAINT) {
         msg_set_reason("File %s already exists in new database: %s", newname, sqlite3_errmsg(sqlite3_db_handle(qins)));
         ret = EEXIST;
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     } else if(r != SQLITE_DONE) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
     /* Get new file entry row id */
     newid = sqlite3_last_insert_rowid(sqlite3_db_handle(qins));
 
+    /* Chunked block lists follow the new row id */
+    if(file_is_chunked(size, content_len)) {
+	unsigned int nblocks = size_to_blocks(size, NULL, NULL);
+	sx_hash_t *blocks = wrap_malloc(nblocks * sizeof(*blocks));
+	if(!blocks || file_chunks_read(h, mdb1, oldid, 0, nblocks, blocks) ||
+	   file_chunks_store(h, mdb2, newid, blocks, nblocks)) {
+	    free(blocks);
+	    msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
+	    goto rename_move_row_err;
+	}
+	free(blocks);
+    }
+
     /* Now move file meta */
     if(qbind_int64(qmget, ":file", oldid)) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
     /* Iterate over existing file meta */
@@ -13075,7 +15944,7 @@ static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, co
         if(qbind_int64(qmset, ":file", newid) || qbind_text(qmset, ":key", key) ||
            qbind_blob(qmset, ":value", value, value_len) || qstep_noret(qmset)) {
             msg_set_reason("Failed to change new file meta");
-            goto rename_switch_dbs_err;
+            goto rename_move_row_err;
         }
 
         nmeta++;
@@ -13083,29 +15952,22 @@ static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, co
 
     if(r != SQLITE_DONE) {
         msg_set_reason("Failed to move file meta");
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
     /* Drop old file entry */
     if(qbind_int64(qdel, ":file", oldid) || qstep_noret(qdel)) {
         msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-        goto rename_switch_dbs_err;
+        goto rename_move_row_err;
     }
 
-    if(qcommit(h->metadb[mdb2]))
-        goto rename_switch_dbs_err;
-    db2_locked = 0;
+    if(file_changed(h, mdb1, vol->id, oldname, revision, -1) || file_changed(h, mdb2, vol->id, newname, newrev, 1)) {
+        msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
+        goto rename_move_row_err;
+    }
 
-    if(qcommit(h->metadb[mdb1]))
-        goto rename_switch_dbs_err;
-    
     ret = OK;
-rename_switch_dbs_err:
-    if(ret != OK) {
-        qrollback(h->metadb[mdb1]);
-        if(db2_locked)
-            qrollback(h->metadb[mdb2]);
-    }
+rename_move_row_err:
     sqlite3_reset(qget);
     sqlite3_reset(qins);
     sqlite3_reset(qdel);
@@ -13114,35 +15976,70 @@ rename_switch_dbs_err:
     return ret;
 }
 
-/* Change name for a file. If new file name belongs to a different meta db, all its entries will have to be moved to the destination database. 
- * Otherwise simple rename is sufficient. */
-rc_ty sx_hashfs_file_rename(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const struct timeval *tv, const char *oldname, const char *revision, const char *newname) {
-    int mdb1, mdb2;
-    int64_t ndiff;
-    rc_ty s;
-    char newrev[REV_LEN+1];
-    uint8_t hash[SXI_SHA1_BIN_LEN];
+/* Renames a file revision within metadb mdb, which must be locked by the caller */
+static rc_ty rename_in_db(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *oldname, const char *revision, unsigned int mdb, const char *newname, const char *newrev) {
+    sqlite3_stmt *q = qlazy(h, h->qm_mvfile[mdb]);
 
-    if(!h || !volume || !oldname || !newname) {
-        NULLARG();
-        return EFAULT;
+    if(!q)
+        return FAIL_EINTERNAL;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":oldname", oldname) ||
+       qbind_text(q, ":rev", revision) ||
+       qbind_text(q, ":newname", newname) ||
+       qbind_text(q, ":newrev", newrev) ||
+       qstep_noret(q) ||
+       (sqlite3_changes(h->metadb[mdb]->handle) &&
+        (file_changed(h, mdb, vol->id, oldname, revision, -1) || file_changed(h, mdb, vol->id, newname, newrev, 1)))) {
+        msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
+        return FAIL_EINTERNAL;
+    }
+    return OK;
+}
+
+/* Rename files with database switch */
+static rc_ty rename_switch_dbs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *oldname, const char *revision, unsigned int mdb1, const char *newname, const char *newrev, unsigned int mdb2) {
+    rc_ty ret;
+
+    if(qbegin(h->metadb[mdb1])) {
+        msg_set_reason("Failed to lock database");
+        return FAIL_EINTERNAL;
     }
 
-    if(!h->have_hd) {
-        WARN("Called before initialization");
-        return FAIL_EINIT;
+    if(qbegin(h->metadb[mdb2])) {
+        msg_set_reason("Failed to lock database");
+        qrollback(h->metadb[mdb1]);
+        return FAIL_EINTERNAL;
     }
 
+    if((ret = rename_move_row(h, vol, oldname, revision, mdb1, newname, newrev, mdb2)) != OK) {
+        qrollback(h->metadb[mdb2]);
+        qrollback(h->metadb[mdb1]);
+        return ret;
+    }
+
+    if(qcommit(h->metadb[mdb2])) {
+        qrollback(h->metadb[mdb2]);
+        qrollback(h->metadb[mdb1]);
+        return FAIL_EINTERNAL;
+    }
+
+    if(qcommit(h->metadb[mdb1])) {
+        qrollback(h->metadb[mdb1]);
+        return FAIL_EINTERNAL;
+    }
+
+    return OK;
+}
+
+/* Checks a rename and computes the metadbs and the new revision of the file */
+static rc_ty rename_prepare(sx_hashfs_t *h, const struct timeval *tv, const char *oldname, const char *revision, const char *newname, int *mdb1, int *mdb2, char *newrev) {
+    uint8_t hash[SXI_SHA1_BIN_LEN];
+
     if(!strcmp(oldname, newname)) {
         WARN("Source and destination filenames are equal");
         return EINVAL;
     }
 
-    if(!sx_hashfs_is_or_was_my_volume(h, volume, 0)) {
-        msg_set_reason("Wrong node for volume '%s': ...", volume->name);
-        return ENOENT;
-    }
-
     if(check_file_name(oldname) < 0 || check_file_name(newname) < 0) {
         msg_set_reason("Invalid file name");
         return EINVAL;
@@ -13153,14 +16050,14 @@ rc_ty sx_hashfs_file_rename(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
         return EINVAL;
     }
 
-    mdb1 = getmetadb(oldname);
-    if(mdb1 < 0) {
+    *mdb1 = getmetadb(oldname, h->metadbs);
+    if(*mdb1 < 0) {
         DEBUG("Invalid meta db for source file");
         return FAIL_EINTERNAL;
     }
 
-    mdb2 = getmetadb(newname);
-    if(mdb2 < 0) {
+    *mdb2 = getmetadb(newname, h->metadbs);
+    if(*mdb2 < 0) {
         DEBUG("Invalid meta db for destination file");
         return FAIL_EINTERNAL;
     }
@@ -13177,48 +16074,219 @@ rc_ty sx_hashfs_file_rename(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
         return FAIL_EINTERNAL;
     }
 
-    newrev[REV_TIME_LEN] = ':';
-    /* Generate revision random part using hash of the old revision */
-    sxi_bin2hex(hash, TOKEN_RAND_BYTES, newrev + REV_TIME_LEN + 1); /* Notice: previously calculated hash is truncated here */
-    newrev[REV_LEN] = '\0';
+    newrev[REV_TIME_LEN] = ':';
+    /* Generate revision random part using hash of the old revision */
+    sxi_bin2hex(hash, TOKEN_RAND_BYTES, newrev + REV_TIME_LEN + 1); /* Notice: previously calculated hash is truncated here */
+    newrev[REV_LEN] = '\0';
+
+    /* Check newly created revision string, just in case */
+    if(check_revision(newrev)) {
+        msg_set_reason("Invalid file revision");
+        return EINVAL;
+    }
+
+    return OK;
+}
+
+/* Change name for a file. If new file name belongs to a different meta db, all its entries will have to be moved to the destination database. 
+ * Otherwise simple rename is sufficient. */
+rc_ty sx_hashfs_file_rename(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const struct timeval *tv, const char *oldname, const char *revision, const char *newname) {
+    int mdb1, mdb2;
+    int64_t ndiff;
+    rc_ty s;
+    char newrev[REV_LEN+1];
+
+    if(!h || !volume || !oldname || !newname) {
+        NULLARG();
+        return EFAULT;
+    }
+
+    if(!h->have_hd) {
+        WARN("Called before initialization");
+        return FAIL_EINIT;
+    }
+
+    if(!sx_hashfs_is_or_was_my_volume(h, volume, 0)) {
+        msg_set_reason("Wrong node for volume '%s': ...", volume->name);
+        return ENOENT;
+    }
+
+    if((s = rename_prepare(h, tv, oldname, revision, newname, &mdb1, &mdb2, newrev)) != OK)
+        return s;
+
+    if(mdb1 == mdb2) {
+        /* File stays in the same database, task is to only update its name */
+        if(qbegin(h->metadb[mdb1])) {
+            msg_set_reason("Failed to lock database");
+            return FAIL_EINTERNAL;
+        }
+        if(rename_in_db(h, volume, oldname, revision, mdb1, newname, newrev) || qcommit(h->metadb[mdb1])) {
+            qrollback(h->metadb[mdb1]);
+            msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
+            return FAIL_EINTERNAL;
+        }
+    } else if((s = rename_switch_dbs(h, volume, oldname, revision, mdb1, newname, newrev, mdb2)) != OK)
+        return s;
+
+    /* Compute name sizes difference */
+    ndiff = strlen(newname);
+    ndiff -= strlen(oldname);
+    if(ndiff && sx_hashfs_update_volume_cursize(h, volume->id, ndiff, 0, 0)) {
+        WARN("Failed to update volume size");
+        return FAIL_EINTERNAL;
+    }
+
+    if((s = delete_old_revs_common(h, volume, newname, NULL, 0, NULL)) != OK) {
+        WARN("Failed to delete old revisions of file '%s'", newname);
+        return s;
+    }
+
+    return OK;
+}
+
+/* Same as sx_hashfs_file_rename() for a batch of files, as used by mass
+ * renames: the files leaving each metadb are renamed in a single transaction
+ * on it and on the metadbs they move to, and the volume size is updated once */
+rc_ty sx_hashfs_file_rename_batch(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const struct timeval *tv, const sx_hashfs_rename_t *renames, unsigned int count) {
+    int *mdbs = NULL;
+    char (*newrevs)[REV_LEN+1] = NULL, *locked = NULL;
+    unsigned int i, j, src;
+    int64_t ndiff = 0;
+    rc_ty s, ret = FAIL_EINTERNAL;
+
+    if(!h || !volume || (count && !renames)) {
+        NULLARG();
+        return EFAULT;
+    }
+
+    if(!h->have_hd) {
+        WARN("Called before initialization");
+        return FAIL_EINIT;
+    }
+
+    if(!sx_hashfs_is_or_was_my_volume(h, volume, 0)) {
+        msg_set_reason("Wrong node for volume '%s': ...", volume->name);
+        return ENOENT;
+    }
+
+    if(!count)
+        return OK;
+
+    mdbs = wrap_malloc(count * 2 * sizeof(*mdbs));
+    newrevs = wrap_malloc(count * sizeof(*newrevs));
+    locked = wrap_calloc(h->metadbs, sizeof(*locked));
+    if(!mdbs || !newrevs || !locked) {
+        msg_set_reason("Out of memory");
+        ret = ENOMEM;
+        goto rename_batch_err;
+    }
+
+    for(i = 0; i < count; i++) {
+        if(!renames[i].oldname || !renames[i].revision || !renames[i].newname) {
+            NULLARG();
+            ret = EFAULT;
+            goto rename_batch_err;
+        }
+        if((s = rename_prepare(h, tv, renames[i].oldname, renames[i].revision, renames[i].newname, &mdbs[i*2], &mdbs[i*2+1], newrevs[i])) != OK) {
+            ret = s;
+            goto rename_batch_err;
+        }
+    }
+
+    for(src = 0; src < h->metadbs; src++) {
+        for(i = 0; i < count; i++)
+            if(mdbs[i*2] == src)
+                break;
+        if(i == count)
+            continue;
 
-    /* Check newly created revision string, just in case */
-    if(check_revision(newrev)) {
-        msg_set_reason("Invalid file revision");
-        return EINVAL;
-    }
+        if(qbegin(h->metadb[src])) {
+            msg_set_reason("Failed to lock database");
+            goto rename_batch_err;
+        }
+        locked[src] = 1;
 
-    if(mdb1 == mdb2) {
-        /* File stays in the same database, task is to only update its name */
-        if(qbind_text(h->qm_mvfile[mdb1], ":oldname", oldname) ||
-           qbind_text(h->qm_mvfile[mdb1], ":rev", revision) ||
-           qbind_text(h->qm_mvfile[mdb1], ":newname", newname) ||
-           qbind_text(h->qm_mvfile[mdb1], ":newrev", newrev) ||
-           qstep_noret(h->qm_mvfile[mdb1])) {
-            msg_set_reason("Failed to rename file '%s' to '%s'", oldname, newname);
-            return FAIL_EINTERNAL;
+        for(; i < count; i++) {
+            unsigned int dst = mdbs[i*2+1];
+
+            if(mdbs[i*2] != src)
+                continue;
+            if(dst == src)
+                s = rename_in_db(h, volume, renames[i].oldname, renames[i].revision, src, renames[i].newname, newrevs[i]);
+            else {
+                if(!locked[dst]) {
+                    if(qbegin(h->metadb[dst])) {
+                        msg_set_reason("Failed to lock database");
+                        goto rename_batch_err;
+                    }
+                    locked[dst] = 1;
+                }
+                s = rename_move_row(h, volume, renames[i].oldname, renames[i].revision, src, renames[i].newname, newrevs[i], dst);
+            }
+            if(s != OK) {
+                ret = s;
+                goto rename_batch_err;
+            }
         }
-    } else if((s = rename_switch_dbs(h, volume, oldname, revision, mdb1, newname, newrev, mdb2)) != OK)
-        return s;
 
-    /* Compute name sizes difference */
-    ndiff = strlen(newname);
-    ndiff -= strlen(oldname);
-    if(ndiff && sx_hashfs_update_volume_cursize(h, volume->id, ndiff, 0, 0)) {
+        /* As in rename_switch_dbs() the destinations are committed first */
+        for(j = 0; j < h->metadbs; j++) {
+            if(j == src || !locked[j])
+                continue;
+            if(qcommit(h->metadb[j])) {
+                msg_set_reason("Failed to rename files");
+                goto rename_batch_err;
+            }
+            locked[j] = 0;
+        }
+        if(qcommit(h->metadb[src])) {
+            msg_set_reason("Failed to rename files");
+            goto rename_batch_err;
+        }
+        locked[src] = 0;
+
+        for(i = 0; i < count; i++) {
+            if(mdbs[i*2] != src)
+                continue;
+            ndiff += strlen(renames[i].newname);
+            ndiff -= strlen(renames[i].oldname);
+        }
+    }
+
+    s = ndiff ? sx_hashfs_update_volume_cursize(h, volume->id, ndiff, 0, 0) : OK;
+    ndiff = 0;
+    if(s != OK) {
         WARN("Failed to update volume size");
-        return FAIL_EINTERNAL;
+        goto rename_batch_err;
     }
 
-    if((s = delete_old_revs_common(h, volume, newname, NULL, 0, NULL)) != OK) {
-        WARN("Failed to delete old revisions of file '%s'", newname);
-        return s;
+    for(i = 0; i < count; i++) {
+        if((s = delete_old_revs_common(h, volume, renames[i].newname, NULL, 0, NULL)) != OK) {
+            WARN("Failed to delete old revisions of file '%s'", renames[i].newname);
+            ret = s;
+            goto rename_batch_err;
+        }
     }
 
-    return OK;
+    ret = OK;
+rename_batch_err:
+    if(locked) {
+        for(j = 0; j < h->metadbs; j++)
+            if(locked[j])
+                qrollback(h->metadb[j]);
+    }
+    /* Account for the metadbs committed before the failure */
+    if(ndiff && sx_hashfs_update_volume_cursize(h, volume->id, ndiff, 0, 0))
+        WARN("Failed to update volume size");
+    free(mdbs);
+    free(newrevs);
+    free(locked);
+    return ret;
 }
 
 rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *file, const char *revision) {
     int64_t file_id, totalsize = 0, size = 0;
+    sqlite3_stmt *q;
     int mdb, deleted;
     rc_ty ret;
 
@@ -13255,20 +16323,23 @@ rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
             /* precondition: add should have arrived, add in the db a marker that we are waiting for the add,
              and perform the delete once it has arrived*/
             DEBUG("Out of order delete"); /* delete reached this node before create */
-	    mdb = getmetadb(file); /* file already checked in get_file_id */
+	    mdb = getmetadb(file, h->metadbs); /* file already checked in get_file_id */
 	    if(mdb < 0)
 		return FAIL_EINTERNAL;
-            sqlite3_reset(h->qm_ins[mdb]);
+            q = qlazy(h, h->qm_ins[mdb]);
+            if(!q)
+                return FAIL_EINTERNAL;
+            sqlite3_reset(q);
             sx_hash_t revision_id;
-            if (qbind_int64(h->qm_ins[mdb], ":volume", volume->id) ||
-                qbind_text(h->qm_ins[mdb], ":name", file) ||
-                qbind_text(h->qm_ins[mdb], ":revision", revision) ||
+            if (qbind_int64(q, ":volume", volume->id) ||
+                qbind_text(q, ":name", file) ||
+                qbind_text(q, ":revision", revision) ||
                 sx_unique_fileid(sx_hashfs_client(h), revision, &revision_id) ||
-                qbind_blob(h->qm_ins[mdb], ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
-                qbind_int64(h->qm_ins[mdb], ":size", -1) ||
-                qbind_int64(h->qm_ins[mdb], ":age", -1) ||
-                qbind_blob(h->qm_ins[mdb], ":hashes", "", 0) ||
-                qstep_noret(h->qm_ins[mdb])) {
+                qbind_blob(q, ":revision_id", revision_id.b, sizeof(revision_id.b)) ||
+                qbind_int64(q, ":size", -1) ||
+                qbind_int64(q, ":age", -1) ||
+                qbind_blob(q, ":hashes", "", 0) ||
+                qstep_noret(q)) {
                 WARN("Failed to insert tombstone");
                 ret = FAIL_EINTERNAL;
             }
@@ -13276,13 +16347,25 @@ rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
         return ret;
     }
 
-    if(qbind_int64(h->qm_delfile[mdb], ":file", file_id) ||
-       qstep_noret(h->qm_delfile[mdb])) {
+    /* The file row and the accounting of the metadb change together */
+    if(qbegin(h->metadb[mdb])) {
+	msg_set_reason("Failed to lock database");
+	return FAIL_EINTERNAL;
+    }
+
+    q = qlazy(h, h->qm_delfile[mdb]);
+    if(!q || qbind_int64(q, ":file", file_id) || qstep_noret(q)) {
+	qrollback(h->metadb[mdb]);
 	msg_set_reason("Failed to delete file from database");
 	return FAIL_EINTERNAL;
     }
 
     deleted = sqlite3_changes(h->metadb[mdb]->handle);
+    if((deleted && file_changed(h, mdb, volume->id, file, revision, -1)) || qcommit(h->metadb[mdb])) {
+	qrollback(h->metadb[mdb]);
+	msg_set_reason("Failed to delete file from database");
+	return FAIL_EINTERNAL;
+    }
 
     /* Update counters only when file deletion succeeded and this node is not becoming a volnode */
     if(ret == OK && deleted && sx_hashfs_update_volume_cursize(h, volume->id, -totalsize, -size, -1)) {
@@ -13293,8 +16376,171 @@ rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
     return OK;
 }
 
+/* Number of rows deleted in each metadb transaction by sx_hashfs_file_delete_range() */
+#define DELRANGE_BATCH 128
+
+typedef struct {
+    int64_t fid, size, totalsize;
+    sx_hash_t revision_id;
+    unsigned int block_size;
+    char name[SXLIMIT_MAX_FILENAME_LEN+1];
+    char revision[REV_LEN+1];
+} delrange_row_t;
+
+/* Deletes all the revisions created up to maxtime of the files matching the
+ * recursive listing pattern. Instead of walking the listing file by file the
+ * matching rows are selected by name range on each metadb and deleted in
+ * batches of DELRANGE_BATCH rows per transaction; the revisions of a batch
+ * are queued for unbumping after it is committed and the volume size is
+ * updated once per batch.
+ * At most limit revisions are deleted per call: returns OK if more may be
+ * left, ITER_NO_MORE once the range is empty */
+rc_ty sx_hashfs_file_delete_range(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *pattern, const char *maxtime, unsigned int limit, unsigned int *deleted) {
+    char lower[sizeof(h->list_pattern)], upper[sizeof(h->list_pattern)];
+    delrange_row_t *rows;
+    unsigned int mdb = 0, n, i;
+    rc_ty ret = FAIL_EINTERNAL;
+    int r;
+
+    if(!h || !volume || !maxtime || !deleted) {
+	NULLARG();
+	return EFAULT;
+    }
+    *deleted = 0;
+
+    if(!h->have_hd) {
+        WARN("Called before initialization");
+        return FAIL_EINIT;
+    }
+
+    if(!sx_hashfs_is_or_was_my_volume(h, volume, 0)) {
+	msg_set_reason("Wrong node for volume '%s': ...", volume->name);
+	return ENOENT;
+    }
+
+    if(parse_pattern(h, pattern, 0))
+	return EINVAL;
+    sxi_strlcpy(lower, h->list_pattern, h->list_limit_len + 1);
+    sxi_strlcpy(upper, lower, sizeof(upper));
+    if(h->list_limit_len > 0)
+	upper[h->list_limit_len - 1]++;
+
+    rows = wrap_malloc(DELRANGE_BATCH * sizeof(*rows));
+    if(!rows) {
+	msg_set_reason("Out of memory");
+	return ENOMEM;
+    }
+
+    while(mdb < h->metadbs && *deleted < limit) {
+	sqlite3_stmt *q = qlazy(h, h->qm_delrange[mdb]), *qdel = qlazy(h, h->qm_delfile[mdb]);
+	unsigned int batch = MIN(DELRANGE_BATCH, limit - *deleted), ndel = 0;
+	int64_t totalsize = 0, size = 0;
+
+	if(qbegin(h->metadb[mdb])) {
+	    msg_set_reason("Failed to lock database");
+	    goto delete_range_err;
+	}
+
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":volume", volume->id) ||
+	   qbind_text(q, ":lower", lower) ||
+	   (h->list_limit_len ? qbind_text(q, ":limit", upper) : qbind_null(q, ":limit")) ||
+	   qbind_text(q, ":pattern", h->list_pattern) ||
+	   qbind_int(q, ":pattern_slashes", h->list_pattern_slashes) ||
+	   qbind_int(q, ":slash_ending", h->list_pattern_end_with_slash) ||
+	   qbind_text(q, ":maxtime", maxtime) ||
+	   qbind_int(q, ":batch", batch)) {
+	    qrollback(h->metadb[mdb]);
+	    goto delete_range_err;
+	}
+
+	for(n = 0; n < batch && (r = qstep(q)) == SQLITE_ROW; n++) {
+	    delrange_row_t *row = &rows[n];
+	    const char *name = (const char *)sqlite3_column_text(q, 1), *rev = (const char *)sqlite3_column_text(q, 2);
+	    const void *revid = sqlite3_column_blob(q, 3);
+
+	    if(!name || !rev || !revid || sqlite3_column_bytes(q, 3) != sizeof(row->revision_id.b)) {
+		WARN("Bad file entry found on meta database %u", mdb);
+		r = SQLITE_ERROR;
+		break;
+	    }
+	    row->fid = sqlite3_column_int64(q, 0);
+	    sxi_strlcpy(row->name, name, sizeof(row->name));
+	    sxi_strlcpy(row->revision, rev, sizeof(row->revision));
+	    memcpy(row->revision_id.b, revid, sizeof(row->revision_id.b));
+	    row->size = sqlite3_column_int64(q, 4);
+	    file_to_blocks(row->size, sqlite3_column_int(q, 5) / sizeof(sx_hash_t), NULL, &row->block_size);
+	    row->totalsize = sqlite3_column_int64(q, 6);
+	}
+	sqlite3_reset(q);
+	if(n < batch && r != SQLITE_DONE) {
+	    msg_set_reason("Failed to list the files to delete");
+	    qrollback(h->metadb[mdb]);
+	    goto delete_range_err;
+	}
+
+	for(i = 0; i < n; i++) {
+	    sqlite3_reset(qdel);
+	    if(qbind_int64(qdel, ":file", rows[i].fid) || qstep_noret(qdel))
+		break;
+	    if(!sqlite3_changes(h->metadb[mdb]->handle)) {
+		rows[i].fid = -1;
+		continue;
+	    }
+	    if(file_changed(h, mdb, volume->id, rows[i].name, rows[i].revision, -1))
+		break;
+	    totalsize += rows[i].totalsize;
+	    size += rows[i].size;
+	    ndel++;
+	}
+	if(i < n) {
+	    msg_set_reason("Failed to delete file from database");
+	    qrollback(h->metadb[mdb]);
+	    goto delete_range_err;
+	}
+
+	if(qcommit(h->metadb[mdb])) {
+	    msg_set_reason("Failed to delete file from database");
+	    qrollback(h->metadb[mdb]);
+	    goto delete_range_err;
+	}
+
+	/* Queue all the deleted revisions for unbumping at once, only after
+	 * the deletion is committed: as for single file deletions a failure
+	 * here merely leaks the blocks, while unbumping revisions which are
+	 * still live would let the GC free their blocks */
+	if(ndel) {
+	    if(qbegin(h->xferdb))
+		WARN("Failed to queue the deleted revisions for unbumping");
+	    else {
+		for(i = 0; i < n; i++)
+		    if(rows[i].fid >= 0 && sx_hashfs_revunbump(h, &rows[i].revision_id, rows[i].block_size))
+			break;
+		if(i < n || qcommit(h->xferdb)) {
+		    WARN("Failed to queue the deleted revisions for unbumping");
+		    qrollback(h->xferdb);
+		}
+	    }
+	}
+	if(ndel && sx_hashfs_update_volume_cursize(h, volume->id, -totalsize, -size, -(int64_t)ndel)) {
+	    WARN("Failed to update volume size");
+	    goto delete_range_err;
+	}
+
+	*deleted += ndel;
+	if(n < batch)
+	    mdb++; /* No more matches on this metadb */
+    }
+
+    ret = mdb < h->metadbs ? OK : ITER_NO_MORE;
+
+ delete_range_err:
+    free(rows);
+    return ret;
+}
+
 static rc_ty fill_filemeta(sx_hashfs_t *h, unsigned int metadb, int64_t file_id) {
-    sqlite3_stmt *q = h->qm_metaget[metadb];
+    sqlite3_stmt *q = qlazy(h, h->qm_metaget[metadb]);
     rc_ty ret = FAIL_EINTERNAL;
     int r;
 
@@ -14269,6 +17515,9 @@ rc_ty sx_hashfs_get_user_info(sx_hashfs_t *h, const uint8_t *user, sx_uid_t *uid
     const uint8_t *kcol;
     rc_ty ret = FAIL_EINTERNAL;
     sx_priv_t userpriv;
+    user_cache_t *c;
+    uint64_t gen;
+    unsigned int i;
     int r;
 
     if(!h || !user)
@@ -14276,6 +17525,23 @@ rc_ty sx_hashfs_get_user_info(sx_hashfs_t *h, const uint8_t *user, sx_uid_t *uid
     if (desc)
         *desc = NULL;
 
+    /* The description is not cached */
+    gen = desc ? 0 : lookup_cache_gen(h);
+    for(i = 0; gen && i < LOOKUP_CACHE_SIZE; i++) {
+	c = &h->usercache[i];
+	if(c->gen != gen || memcmp(c->user, user, AUTH_UID_LEN))
+	    continue;
+	if(basepriv)
+	    *basepriv = c->basepriv;
+	if(key)
+	    memcpy(key, c->key, AUTH_KEY_LEN);
+	if(uid)
+	    *uid = c->uid;
+	if(quota)
+	    *quota = c->quota;
+	return OK;
+    }
+
     sqlite3_reset(h->q_getuser);
     if(qbind_blob(h->q_getuser, ":user", user, AUTH_UID_LEN))
 	goto get_user_info_err;
@@ -14324,6 +17590,16 @@ rc_ty sx_hashfs_get_user_info(sx_hashfs_t *h, const uint8_t *user, sx_uid_t *uid
     }
     if(quota)
         *quota = sqlite3_column_int64(h->q_getuser, 4);
+    if(gen) {
+	c = &h->usercache[h->usercache_next];
+	h->usercache_next = (h->usercache_next + 1) % LOOKUP_CACHE_SIZE;
+	c->gen = gen;
+	memcpy(c->user, user, AUTH_UID_LEN);
+	memcpy(c->key, kcol, AUTH_KEY_LEN);
+	c->uid = sqlite3_column_int64(h->q_getuser, 0);
+	c->basepriv = userpriv;
+	c->quota = sqlite3_column_int64(h->q_getuser, 4);
+    }
     ret = OK;
 
 get_user_info_err:
@@ -14413,20 +17689,24 @@ rc_ty sx_hashfs_generate_uid(sx_hashfs_t *h, uint8_t *uid) {
     return OK;
 }
 
-rc_ty sx_hashfs_get_access(sx_hashfs_t *h, const uint8_t *user, const char *volume, sx_priv_t *access) {
-    const sx_hashfs_volume_t *vol;
+static rc_ty volume_access(sx_hashfs_t *h, const uint8_t *user, const sx_hashfs_volume_t *vol, sx_priv_t *access) {
     uint8_t cid[AUTH_UID_LEN];
-    rc_ty ret, rc;
+    rc_ty ret = FAIL_EINTERNAL, rc;
     int r;
     int64_t owner_id;
     uint8_t owner_uid[AUTH_UID_LEN];
+    access_cache_t *c;
+    uint64_t gen;
+    unsigned int i;
 
-    if(!h || !user || !volume || !access)
-	return EINVAL;
-
-    ret = sx_hashfs_volume_by_name(h, volume, &vol);
-    if(ret)
-	return ret;
+    gen = lookup_cache_gen(h);
+    for(i = 0; gen && i < LOOKUP_CACHE_SIZE; i++) {
+	c = &h->accesscache[i];
+	if(c->gen == gen && c->volid == vol->id && !memcmp(c->user, user, AUTH_UID_LEN)) {
+	    *access = c->access;
+	    return OK;
+	}
+    }
 
     sqlite3_reset(h->q_getaccess);
     if(qbind_int64(h->q_getaccess, ":volume", vol->id) ||
@@ -14437,7 +17717,8 @@ rc_ty sx_hashfs_get_access(sx_hashfs_t *h, const uint8_t *user, const char *volu
     r = qstep(h->q_getaccess);
     if(r == SQLITE_DONE) {
 	*access = PRIV_NONE;
-	return OK;
+	ret = OK;
+	goto volume_access_done;
     }
     if(r != SQLITE_ROW)
 	return FAIL_EINTERNAL;
@@ -14454,26 +17735,46 @@ rc_ty sx_hashfs_get_access(sx_hashfs_t *h, const uint8_t *user, const char *volu
     }
 
     owner_id = sqlite3_column_int64(h->q_getaccess, 1);
+    sqlite3_reset(h->q_getaccess);
     if((rc = sx_hashfs_get_user_by_uid(h, owner_id, owner_uid, 0)) != OK) {
-        WARN("Failed to get volume %s owner by ID", volume);
+        WARN("Failed to get volume %s owner by ID", vol->name);
         return rc;
     }
 
     /* Compare common ID part of UIDs */
-    if(!memcmp(owner_uid, user, AUTH_CID_LEN))
+    if(ret == OK && !memcmp(owner_uid, user, AUTH_CID_LEN))
         *access |= PRIV_MANAGER | PRIV_OWNER;
 
+ volume_access_done:
     sqlite3_reset(h->q_getaccess);
+    if(ret == OK && gen) {
+	c = &h->accesscache[h->accesscache_next];
+	h->accesscache_next = (h->accesscache_next + 1) % LOOKUP_CACHE_SIZE;
+	c->gen = gen;
+	memcpy(c->user, user, AUTH_UID_LEN);
+	c->volid = vol->id;
+	c->access = *access;
+    }
     return ret;
 }
 
+rc_ty sx_hashfs_get_access(sx_hashfs_t *h, const uint8_t *user, const char *volume, sx_priv_t *access) {
+    const sx_hashfs_volume_t *vol;
+    rc_ty ret;
+
+    if(!h || !user || !volume || !access)
+	return EINVAL;
+
+    ret = sx_hashfs_volume_by_name(h, volume, &vol);
+    if(ret)
+	return ret;
+
+    return volume_access(h, user, vol, access);
+}
+
 rc_ty sx_hashfs_get_access_by_global_id(sx_hashfs_t *h, const uint8_t *user, const sx_hash_t *global_vol_id, sx_priv_t *access) {
     const sx_hashfs_volume_t *vol;
-    uint8_t cid[AUTH_UID_LEN];
-    rc_ty ret, rc;
-    int r;
-    int64_t owner_id;
-    uint8_t owner_uid[AUTH_UID_LEN];
+    rc_ty ret;
 
     if(!h || !user || !global_vol_id || !access)
         return EINVAL;
@@ -14482,43 +17783,7 @@ rc_ty sx_hashfs_get_access_by_global_id(sx_hashfs_t *h, const uint8_t *user, con
     if(ret)
         return ret;
 
-    sqlite3_reset(h->q_getaccess);
-    if(qbind_int64(h->q_getaccess, ":volume", vol->id) ||
-       qbind_blob(h->q_getaccess, ":user_first", firstcid(user, cid), sizeof(cid)) ||
-       qbind_blob(h->q_getaccess, ":user_last", lastcid(user, cid), sizeof(cid)))
-        return FAIL_EINTERNAL;
-
-    r = qstep(h->q_getaccess);
-    if(r == SQLITE_DONE) {
-        *access = PRIV_NONE;
-        return OK;
-    }
-    if(r != SQLITE_ROW)
-        return FAIL_EINTERNAL;
-
-    r = sqlite3_column_int(h->q_getaccess, 0);
-    if(!(r & ~(PRIV_READ | PRIV_WRITE | PRIV_MANAGER))) {
-        ret = OK;
-        *access = r;
-    } else {
-        char hex[AUTH_UID_LEN*2+1];
-
-        bin2hex(user, AUTH_UID_LEN, hex, AUTH_UID_LEN*2+1);
-        WARN("Found invalid priv for user %s on volume %lld: %d", hex, (long long int)vol->id, r);
-    }
-
-    owner_id = sqlite3_column_int64(h->q_getaccess, 1);
-    if((rc = sx_hashfs_get_user_by_uid(h, owner_id, owner_uid, 0)) != OK) {
-        WARN("Failed to get volume %s owner by ID", vol->name);
-        return rc;
-    }
-
-    /* Compare common ID part of UIDs */
-    if(!memcmp(owner_uid, user, AUTH_CID_LEN))
-        *access |= PRIV_MANAGER | PRIV_OWNER;
-
-    sqlite3_reset(h->q_getaccess);
-    return ret;
+    return volume_access(h, user, vol, access);
 }
 
 sxi_db_t *sx_hashfs_eventdb(sx_hashfs_t *h) {
@@ -14564,9 +17829,15 @@ rc_ty sx_hashfs_job_result(sx_hashfs_t *h, job_t job, sx_uid_t uid, job_status_t
 	return FAIL_EINTERNAL;
 
     if(!sqlite3_column_int(h->qe_getjob, 0)) {
-	/* Pending job */
+	/* Pending job: report the progress set when it was last delayed, if any */
+	const char *reason = (const char *)sqlite3_column_text(h->qe_getjob, 2);
 	*status = JOB_PENDING;
-	*message = "Job status pending";
+	if(!reason || !*reason)
+	    *message = "Job status pending";
+	else {
+	    sxi_strlcpy(h->job_message, reason, sizeof(h->job_message));
+	    *message = h->job_message;
+	}
     } else {
 	/* Completed */
 	int result = sqlite3_column_int(h->qe_getjob, 1);
@@ -15115,9 +18386,10 @@ static rc_ty hash_of_blob_result(sx_hash_t *hash, sqlite3_stmt *stmt, int col)
 static rc_ty gc_block(sx_hashfs_t *h, unsigned j, unsigned i, sqlite3_stmt *q, int col_id, int col_hash)
 {
     sx_hash_t hash;
-    sqlite3_stmt *q_setfree = h->qb_setfree[j][i];
-    sqlite3_stmt *q_gc = h->qb_gc1[j][i];
-    int64_t last = sqlite3_column_int64(q, col_id);
+    sqlite3_stmt *q_deferfree = qlazy(h, h->qb_deferfree[j][i]);
+    sqlite3_stmt *q_gc = qlazy(h, h->qb_gc1[j][i]);
+    int64_t last = sqlite3_column_int64(q, col_id), gen;
+    int idxok;
 
     if (hash_of_blob_result(&hash, q, col_hash) == OK) {
         if (sx_hashfs_blkrb_can_gc(h, &hash, bsz[j]) != OK) {
@@ -15128,9 +18400,15 @@ static rc_ty gc_block(sx_hashfs_t *h, unsigned j, unsigned i, sqlite3_stmt *q, i
         DEBUGHASH("freeing block with hash", &hash);
         int64_t blockno = sqlite3_column_int64(q, 1);
         DEBUG("freeing blockno %ld, @%d/%d/%ld", blockno, j, i, blockno * bsz[j]);
-        sqlite3_reset(q_setfree);
-        if (qbind_int64(q_setfree, ":blockno", blockno) ||
-            qstep_noret(q_setfree)) {
+        idxok = !blockidx_prepare(h, j, i, 0, &gen);
+        if (idxok)
+            blockidx_bump(h, j, i, gen);
+        /* The slot is not reused right away: a download may still be
+         * reading it (e.g. through the sxblocks filter) */
+        sqlite3_reset(q_deferfree);
+        if (qbind_int64(q_deferfree, ":blockno", blockno) ||
+            qbind_int64(q_deferfree, ":now", time(NULL)) ||
+            qstep_noret(q_deferfree)) {
 	    gc_log(&hash, "gc_block", 0, "Failed to set block free");
             return FAIL_EINTERNAL;
 	}
@@ -15140,6 +18418,8 @@ static rc_ty gc_block(sx_hashfs_t *h, unsigned j, unsigned i, sqlite3_stmt *q, i
 	    gc_log(&hash, "gc_block", 0, "Failed to set delete block");
             return FAIL_EINTERNAL;
 	}
+        if (idxok)
+            sx_blockidx_del(h->blockidx[j][i], &hash);
 
 	gc_log(&hash, "gc_block", 1, NULL);
     }
@@ -15148,7 +18428,7 @@ static rc_ty gc_block(sx_hashfs_t *h, unsigned j, unsigned i, sqlite3_stmt *q, i
 }
 
 static rc_ty foreach_hdb_blob(sx_hashfs_t *h, int *terminate,
-                              sqlite3_stmt *loop[][HASHDBS], const char *loopvar, int col, uint64_t *count)
+                              sqlite3_stmt *loop[][HASHDBS_MAX], const char *loopvar, int col, uint64_t *count)
 {
     unsigned i,j;
     int64_t gc_blocks = 0;
@@ -15158,14 +18438,14 @@ static rc_ty foreach_hdb_blob(sx_hashfs_t *h, int *terminate,
     }
     *count = 0;
     for (j=0;j<SIZES && !*terminate;j++) {
-        for (i=0;i<HASHDBS && !*terminate;i++) {
+        for (i=0;i<h->hashdbs && !*terminate;i++) {
             int ret;
-            sqlite3_stmt *q = loop[j][i];
+            sqlite3_stmt *q = qlazy(h, loop[j][i]);
             DEBUG("Running %s", sqlite3_sql(q));
-            sqlite3_stmt *q_gc1 = h->qb_gc_revision_blocks[j][i];
-            sqlite3_stmt *q_gc2 = h->qb_gc_revision[j][i];
-            sqlite3_stmt *q_gc3 = h->qb_gc_reserve[j][i];
-            sqlite3_stmt *q_gc_blocks = h->qb_find_gc_block[j][i];
+            sqlite3_stmt *q_gc1 = qlazy(h, h->qb_gc_revision_blocks[j][i]);
+            sqlite3_stmt *q_gc2 = qlazy(h, h->qb_gc_revision[j][i]);
+            sqlite3_stmt *q_gc3 = qlazy(h, h->qb_gc_reserve[j][i]);
+            sqlite3_stmt *q_gc_blocks = qlazy(h, h->qb_find_gc_block[j][i]);
             sqlite3_reset(q);
             if (loopvar && qbind_blob(q, loopvar, "", 0))
                 return FAIL_EINTERNAL;
@@ -15250,7 +18530,7 @@ static rc_ty foreach_hdb_blob(sx_hashfs_t *h, int *terminate,
     return OK;
 }
 
-static rc_ty bindall(sqlite3_stmt *stmt[][HASHDBS], const char *var, int64_t val)
+static rc_ty bindall(sx_hashfs_t *h, sqlite3_stmt *stmt[][HASHDBS_MAX], const char *var, int64_t val)
 {
     unsigned j, i;
     if (!stmt) {
@@ -15258,9 +18538,9 @@ static rc_ty bindall(sqlite3_stmt *stmt[][HASHDBS], const char *var, int64_t val
         return EFAULT;
     }
     for (j=0;j<SIZES;j++) {
-        for (i=0;i<HASHDBS;i++) {
+        for (i=0;i<h->hashdbs;i++) {
             sqlite3_reset(stmt[j][i]);
-            if (qbind_int64(stmt[j][i], var, val))
+            if (qbind_int64(qlazy(h, stmt[j][i]), var, val))
                 return FAIL_EINTERNAL;
         }
     }
@@ -15286,8 +18566,8 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
         return FAIL_EINTERNAL;
     INFO("Deleted %d tokens", sqlite3_changes(h->tempdb->handle));
     DEBUG("find_expired, expires: %lld", (long long)expires);
-    if (bindall(h->qb_find_expired_reservation, ":expires", expires) ||
-        bindall(h->qb_find_expired_reservation2, ":now", now) ||
+    if (bindall(h, h->qb_find_expired_reservation, ":expires", expires) ||
+        bindall(h, h->qb_find_expired_reservation2, ":now", now) ||
         foreach_hdb_blob(h, terminate,
                          h->qb_find_expired_reservation, ":lastreserve_id",
                          1, &gc_noactivity) ||
@@ -15310,7 +18590,7 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
     sx_hashfs_incore(h, NULL, NULL);
     int64_t age = sxi_hdist_version(h->hd);
     DEBUG("age is %lld", (long long)age);
-    if (bindall(h->qb_find_unused_revision, ":age", age) ||
+    if (bindall(h, h->qb_find_unused_revision, ":age", age) ||
         foreach_hdb_blob(h, terminate,
                          h->qb_find_unused_revision, ":last_revision_id",
                          0, &gc_unused_tokens))
@@ -15319,9 +18599,9 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
         return ret;
     INFO("Running slow check");
     for (j=0;j<SIZES && !ret && !*terminate ;j++) {
-        for (i=0;i<HASHDBS && !ret && !*terminate;i++) {
+        for (i=0;i<h->hashdbs && !ret && !*terminate;i++) {
             int64_t last = 0;
-            sqlite3_stmt *q = h->qb_find_unused_block[j][i];
+            sqlite3_stmt *q = qlazy(h, h->qb_find_unused_block[j][i]);
             int first = 1;
             qreadahead(h->datadb[j][i]);
             do {
@@ -15779,6 +19059,7 @@ rc_ty sx_hashfs_hdist_change_add(sx_hashfs_t *h, const void *cfg, unsigned int c
 	sxi_hdist_free(newmod);
 	return FAIL_EINTERNAL;
     }
+    cluster_gen_touch(h, GEN_CLUSTER);
 
     nodes = sxi_hdist_nodelist(newmod, 0);
     if(!nodes || !(nnodes = sx_nodelist_count(nodes))) {
@@ -15939,6 +19220,7 @@ rc_ty sx_hashfs_hdist_replace_add(sx_hashfs_t *h, const void *cfg, unsigned int
 	sxi_hdist_free(newmod);
 	return FAIL_EINTERNAL;
     }
+    cluster_gen_touch(h, GEN_CLUSTER);
 
     newnodes = sxi_hdist_nodelist(newmod, 0);
     if(!newnodes || !(nnodes = sx_nodelist_count(newnodes))) {
@@ -16112,6 +19394,7 @@ rc_ty sx_hashfs_hdist_change_revoke(sx_hashfs_t *h) {
 
     if(qbegin(h->db))
 	return FAIL_EINTERNAL;
+    cluster_gen_touch(h, GEN_CLUSTER);
 
     if(h->have_hd) {
 	/* Revert to previous distribution (if any exists) */
@@ -16245,6 +19528,7 @@ rc_ty sx_hashfs_hdist_set_rebalanced(sx_hashfs_t *h) {
 	sxi_hdist_free(rebalanced);
 	return FAIL_EINTERNAL;
     }
+    cluster_gen_touch(h, GEN_CLUSTER);
 
     if(qprep(h->db, &q, "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k , :v)")) {
 	msg_set_reason("Failed to save the rebalanced distribution model");
@@ -16343,6 +19627,7 @@ rc_ty sx_hashfs_hdist_change_commit(sx_hashfs_t *h, int nodes_replaced) {
     rc_ty s = OK;
 
     DEBUG("IN %s", __func__);
+    cluster_gen_touch(h, GEN_CLUSTER);
     if(qprep(h->db, &q, "DELETE FROM hashfs WHERE key IN ('current_dist', 'current_dist_rev')") ||
        qstep_noret(q)) {
 	msg_set_reason("Failed to enable new distribution model");
@@ -16584,7 +19869,8 @@ void sx_storage_usage(sx_hashfs_t *h, int64_t *allocated, int64_t *committed) {
 
     /* The allocated size is the amount of space taken on disk.
      * - for the DB files this it the size of the .db files
-     * - for the DATA files this is the size of the .bin files
+     * - for the DATA files this is the size of the .bin files, minus the
+     *   space released by compressed blocks
      *
      * The committed size is the amount of space actually used.
      * - for the DB files it's the same as for allocated (*)
@@ -16602,13 +19888,13 @@ void sx_storage_usage(sx_hashfs_t *h, int64_t *allocated, int64_t *committed) {
     al += dbfilesize(h->xferdb);
     al += dbfilesize(h->hbeatdb);
 
-    for(i=0; i<METADBS; i++)
+    for(i=0; i<h->metadbs; i++)
 	al += dbfilesize(h->metadb[i]);
 
     ci = al;
 
     for(j=0; j<SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<h->hashdbs; i++) {
 	    int64_t rows = get_count(h->datadb[j][i], "blocks");
 	    int64_t dbsize = dbfilesize(h->datadb[j][i]);
 	    struct stat st;
@@ -16616,7 +19902,7 @@ void sx_storage_usage(sx_hashfs_t *h, int64_t *allocated, int64_t *committed) {
 	    al += dbsize;
 	    ci += dbsize + rows * bsz[j];
 	    if(!fstat(h->datafd[j][i], &st))
-		al += st.st_size;
+		al += MIN(st.st_size, (int64_t)st.st_blocks * 512);
 	}
     }
     if(allocated)
@@ -16648,23 +19934,23 @@ static rc_ty sx_hashfs_blocks_restart(sx_hashfs_t *h, unsigned rebalance_version
     DEBUG("iteration reset with rebalance_version: %d", rebalance_version);
     unsigned i,j;
     for(j=0;j<SIZES;j++) {
-        for(i=0;i<HASHDBS;i++) {
+        for(i=0;i<h->hashdbs;i++) {
             sqlite3_reset(h->rit.q[j][i]);
             sqlite3_reset(h->rit.q_num[j][i]);
             sqlite3_reset(h->qb_get_meta[j][i]);
             sqlite3_reset(h->qb_deleteold[j][i]);
-            sqlite3_clear_bindings(h->rit.q[j][i]);
-            sqlite3_clear_bindings(h->qb_get_meta[j][i]);
-            sqlite3_clear_bindings(h->qb_deleteold[j][i]);
+            sqlite3_clear_bindings(qlazy(h, h->rit.q[j][i]));
+            sqlite3_clear_bindings(qlazy(h, h->qb_get_meta[j][i]));
+            sqlite3_clear_bindings(qlazy(h, h->qb_deleteold[j][i]));
         }
     }
     for(j=0;j<SIZES;j++) {
-        for(i=0;i<HASHDBS;i++) {
-            if (qbind_blob(h->rit.q[j][i], ":prevhash", "", 0))
+        for(i=0;i<h->hashdbs;i++) {
+            if (qbind_blob(qlazy(h, h->rit.q[j][i]), ":prevhash", "", 0))
                 return FAIL_EINTERNAL;
-            if (qbind_int64(h->qb_get_meta[j][i], ":current_age", rebalance_version))
+            if (qbind_int64(qlazy(h, h->qb_get_meta[j][i]), ":current_age", rebalance_version))
                 return FAIL_EINTERNAL;
-            if (qbind_int64(h->qb_deleteold[j][i], ":current_age", rebalance_version))
+            if (qbind_int64(qlazy(h, h->qb_deleteold[j][i]), ":current_age", rebalance_version))
                 return FAIL_EINTERNAL;
         }
     }
@@ -16807,8 +20093,8 @@ static rc_ty sx_hashfs_blocks_retry_next(sx_hashfs_t *h, block_meta_t *blockmeta
             if (!hash)
                 return EFAULT;
             DEBUGHASH("retry_next", hash);
-            unsigned int ndb = gethashdb(hash);
-            ret = sx_hashfs_blockmeta_get(h, ret, q, h->qb_get_meta[hs][ndb], bs, blockmeta);
+            unsigned int ndb = gethashdb(hash, h->hashdbs);
+            ret = sx_hashfs_blockmeta_get(h, ret, q, qlazy(h, h->qb_get_meta[hs][ndb]), bs, blockmeta);
             if (ret != SQLITE_ROW)
                 return ret;
         }
@@ -16823,9 +20109,9 @@ static rc_ty sx_hashfs_blocks_next(sx_hashfs_t *h, block_meta_t *blockmeta)
     int ret;
     memset(blockmeta, 0, sizeof(*blockmeta));
     for (;h->rit.sizeidx < SIZES; h->rit.sizeidx++) {
-        for (;h->rit.ndbidx < HASHDBS; h->rit.ndbidx++) {
-            sqlite3_stmt *q = h->rit.q[h->rit.sizeidx][h->rit.ndbidx];
-            sqlite3_stmt *qmeta = h->qb_get_meta[h->rit.sizeidx][h->rit.ndbidx];
+        for (;h->rit.ndbidx < h->hashdbs; h->rit.ndbidx++) {
+            sqlite3_stmt *q = qlazy(h, h->rit.q[h->rit.sizeidx][h->rit.ndbidx]);
+            sqlite3_stmt *qmeta = qlazy(h, h->qb_get_meta[h->rit.sizeidx][h->rit.ndbidx]);
             sqlite3_reset(q);
             sqlite3_reset(qmeta);
             do {
@@ -16863,15 +20149,15 @@ static rc_ty br_init(sx_hashfs_t *h)
     sqlite3_reset(h->rit.q_reset);
     h->rit.blocks_all = 0;
     for(j=0; j<SIZES && ret == OK; j++) {
-	for(i=0; i<HASHDBS; i++) {
-            sqlite3_reset(h->rit.q_num[j][i]);
-            if (qstep_ret(h->rit.q_num[j][i])) {
+	for(i=0; i<h->hashdbs; i++) {
+            sqlite3_stmt *q = qlazy(h, h->rit.q_num[j][i]);
+            if (!q || qstep_ret(q)) {
                 WARN("Failed to count blocks");
                 ret = FAIL_EINTERNAL;
                 break;
             }
-            h->rit.blocks_all += sqlite3_column_int64(h->rit.q_num[j][i], 0);
-            sqlite3_reset(h->rit.q_num[j][i]);
+            h->rit.blocks_all += sqlite3_column_int64(q, 0);
+            sqlite3_reset(q);
         }
     }
     return ret;
@@ -17002,7 +20288,7 @@ rc_ty sx_hashfs_br_delete(sx_hashfs_t *h, const block_meta_t *blockmeta)
     }
     if ((ret = sx_hashfs_br_done(h, blockmeta)))
         return ret;
-    ndb = gethashdb(&blockmeta->hash);
+    ndb = gethashdb(&blockmeta->hash, h->hashdbs);
     for(hs = 0; hs < SIZES; hs++)
 	if(bsz[hs] == blockmeta->blocksize)
 	    break;
@@ -17010,7 +20296,7 @@ rc_ty sx_hashfs_br_delete(sx_hashfs_t *h, const block_meta_t *blockmeta)
 	WARN("bad blocksize: %d", blockmeta->blocksize);
 	return FAIL_BADBLOCKSIZE;
     }
-    sqlite3_stmt *q = h->qb_deleteold[hs][ndb];
+    sqlite3_stmt *q = qlazy(h, h->qb_deleteold[hs][ndb]);
     sqlite3_reset(q);
     if (qbind_blob(q, ":hash", blockmeta->hash.b, sizeof(blockmeta->hash.b)))
         return FAIL_EINTERNAL; 
@@ -17117,9 +20403,9 @@ rc_ty sx_hashfs_relocs_populate(sx_hashfs_t *h) {
     unsigned int i;
     rc_ty r;
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	sqlite3_reset(h->qm_wiperelocs[i]);
-	if(qstep_noret(h->qm_wiperelocs[i])) {
+	if(qstep_noret(qlazy(h, h->qm_wiperelocs[i]))) {
 	    WARN("Failed to wipe relocation queue on db %u", i);
 	    return FAIL_EINTERNAL;
 	}
@@ -17156,11 +20442,12 @@ rc_ty sx_hashfs_relocs_populate(sx_hashfs_t *h) {
 		INFO("Setting files in volume %s to be relocated from here to %s(%s) for replica %u", vol->name, sx_node_uuid_str(next), sx_node_addr(next), i);
 		/* The upcoming i-th owner of this volume wans't already an owner:
 		 * all volume files are setup for relocation */
-		for(i=0; i<METADBS; i++) {
-		    sqlite3_reset(h->qm_addrelocs[i]);
-		    if(qbind_blob(h->qm_addrelocs[i], ":node", uuid->binary, sizeof(uuid->binary)) ||
-		       qbind_int64(h->qm_addrelocs[i], ":volid", vol->id) ||
-		       qstep_noret(h->qm_addrelocs[i])) {
+		for(i=0; i<h->metadbs; i++) {
+		    sqlite3_stmt *q = qlazy(h, h->qm_addrelocs[i]);
+		    sqlite3_reset(q);
+		    if(!q || qbind_blob(q, ":node", uuid->binary, sizeof(uuid->binary)) ||
+		       qbind_int64(q, ":volid", vol->id) ||
+		       qstep_noret(q)) {
 			WARN("Failed to add relocation queue on db %u for volume %llu", i, (long long)vol->id);
 			sx_nodelist_delete(prevnodes);
 			sx_nodelist_delete(nextnodes);
@@ -17183,19 +20470,20 @@ rc_ty sx_hashfs_relocs_begin(sx_hashfs_t *h, int64_t *todo) {
     int64_t nrelocs = 0;
     unsigned int i;
 
-    for(i=0; i<METADBS; i++) {
-	if(qstep_ret(h->qm_countrelocs[i])) {
+    for(i=0; i<h->metadbs; i++) {
+	sqlite3_stmt *q = qlazy(h, h->qm_countrelocs[i]);
+	if(!q || qstep_ret(q)) {
 	    WARN("Failed to count pending relocation on db %u", i);
 	    return FAIL_EINTERNAL;
 	}
-	nrelocs += sqlite3_column_int64(h->qm_countrelocs[i], 0);
-	sqlite3_reset(h->qm_countrelocs[i]);
+	nrelocs += sqlite3_column_int64(q, 0);
+	sqlite3_reset(q);
     }
 
     if(!nrelocs)
 	return ITER_NO_MORE;
 
-    h->relocdb_start = h->relocdb_cur = sxi_rand() % METADBS;
+    h->relocdb_start = h->relocdb_cur = sxi_rand() % h->metadbs;
     h->relocid = 0;
     if(todo)
 	*todo = nrelocs;
@@ -17203,9 +20491,10 @@ rc_ty sx_hashfs_relocs_begin(sx_hashfs_t *h, int64_t *todo) {
 }
 
 static rc_ty relocs_delete(sx_hashfs_t *h, unsigned int relocdb, int64_t relocid) {
-    sqlite3_reset(h->qm_delreloc[relocdb]);
-    if(qbind_int64(h->qm_delreloc[relocdb], ":fileid", relocid) ||
-       qstep_noret(h->qm_delreloc[relocdb]))
+    sqlite3_stmt *q = qlazy(h, h->qm_delreloc[relocdb]);
+
+    sqlite3_reset(q);
+    if(!q || qbind_int64(q, ":fileid", relocid) || qstep_noret(q))
 	return FAIL_EINTERNAL;
     return OK;
 }
@@ -17230,7 +20519,7 @@ rc_ty sx_hashfs_relocs_next(sx_hashfs_t *h, const sx_reloc_t **reloc) {
     *reloc = NULL;
     while(1) {
 	unsigned int ndb = h->relocdb_cur;
-	sqlite3_stmt *q = h->qm_getreloc[ndb];
+	sqlite3_stmt *q = qlazy(h, h->qm_getreloc[ndb]);
 	const sx_hashfs_volume_t *volume;
     	const char *name, *rev;
 	const void *content;
@@ -17249,7 +20538,7 @@ rc_ty sx_hashfs_relocs_next(sx_hashfs_t *h, const sx_reloc_t **reloc) {
 	r = qstep(q);
 	if(r == SQLITE_DONE) {
 	    h->relocid = 0;
-	    h->relocdb_cur = (ndb + 1) % METADBS;
+	    h->relocdb_cur = (ndb + 1) % h->metadbs;
 	    if(h->relocdb_cur == h->relocdb_start)
 		return ITER_NO_MORE;
 	    continue;
@@ -17324,8 +20613,20 @@ rc_ty sx_hashfs_relocs_next(sx_hashfs_t *h, const sx_reloc_t **reloc) {
 
 	sxi_strlcpy(rlc->file.name, name, sizeof(rlc->file.name));
 	sxi_strlcpy(rlc->file.revision, rev, sizeof(rlc->file.revision));
-	rlc->file.nblocks = size_to_blocks(rlc->file.file_size, NULL, &rlc->file.block_size);
-	if(content_len)
+	rlc->file.nblocks = file_to_blocks(rlc->file.file_size, content_len / sizeof(sx_hash_t), NULL, &rlc->file.block_size);
+	if(file_is_chunked(rlc->file.file_size, content_len)) {
+	    rlc->blocks = wrap_malloc(rlc->file.nblocks * sizeof(sx_hash_t));
+	    if(!rlc->blocks) {
+		sqlite3_reset(q);
+		sx_hashfs_reloc_free(rlc);
+		return ENOMEM;
+	    }
+	    if(file_chunks_read(h, ndb, h->relocid, 0, rlc->file.nblocks, rlc->blocks)) {
+		sqlite3_reset(q);
+		sx_hashfs_reloc_free(rlc);
+		return FAIL_EINTERNAL;
+	    }
+	} else if(content_len)
 	    memcpy(rlc->blocks, content, content_len);
         memcpy(rlc->file.revision_id.b, revid->b, sizeof(rlc->file.revision_id.b));
 	ret = sx_hashfs_volume_by_id(h, volid, &volume);
@@ -17429,9 +20730,9 @@ rc_ty sx_hashfs_rb_cleanup(sx_hashfs_t *h) {
 	return FAIL_EINTERNAL;
     }
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	sqlite3_reset(h->qm_wiperelocs[i]);
-	if(qstep_noret(h->qm_wiperelocs[i])) {
+	if(qstep_noret(qlazy(h, h->qm_wiperelocs[i]))) {
 	    WARN("Failed to wipe relocation queue on db %u", i);
 	    return FAIL_EINTERNAL;
 	}
@@ -17509,13 +20810,25 @@ rc_ty sx_hashfs_volume_clean(sx_hashfs_t *h, const sx_hashfs_volume_t *vol) {
         return EINVAL;
     }
 
-    for(i=0; i<METADBS; i++) {
-        sqlite3_reset(h->qm_delbyvol[i]);
-        if(qbind_int64(h->qm_delbyvol[i], ":volid", vol->id) ||
-           qstep_noret(h->qm_delbyvol[i])) {
+    for(i=0; i<h->metadbs; i++) {
+        sqlite3_stmt *q = qlazy(h, h->qm_delbyvol[i]);
+        sqlite3_reset(q);
+        if(!q || qbind_int64(q, ":volid", vol->id) || qstep_noret(q)) {
             WARN("Failed to delete files on %u for volume %llu", i, (long long)vol->id);
             return FAIL_EINTERNAL;
         }
+        q = qlazy(h, h->qm_dirs_delbyvol[i]);
+        sqlite3_reset(q);
+        if(!q || qbind_int64(q, ":volid", vol->id) || qstep_noret(q)) {
+            WARN("Failed to delete directories on %u for volume %llu", i, (long long)vol->id);
+            return FAIL_EINTERNAL;
+        }
+        q = qlazy(h, h->qm_delsums[i]);
+        sqlite3_reset(q);
+        if(!q || qbind_int64(q, ":volid", vol->id) || qstep_noret(q)) {
+            WARN("Failed to delete listing sums on %u for volume %llu", i, (long long)vol->id);
+            return FAIL_EINTERNAL;
+        }
     }
 
     if(sx_hashfs_reset_volume_cursize(h, vol->id, 0, 0, 0))
@@ -17618,13 +20931,13 @@ rc_ty sx_hashfs_set_progress_info(sx_hashfs_t *h, sx_inprogress_t state, const c
 }
 
 rc_ty sx_hashfs_compute_volume_size(sx_hashfs_t *h, const sx_hashfs_volume_t *vol) {
-    int locks[METADBS+1];
+    int locks[METADBS_MAX+1];
     unsigned int i;
     sqlite3_stmt *q = NULL;
     int64_t size = 0, totalsize = 0, nfiles = 0;
     rc_ty ret = FAIL_EINTERNAL;
 
-    memset(locks, 0, sizeof(int) * (METADBS+1));
+    memset(locks, 0, sizeof(int) * (METADBS_MAX+1));
 
     if(!h)
         return EINVAL;
@@ -17635,17 +20948,17 @@ rc_ty sx_hashfs_compute_volume_size(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
 
     if(qbegin(h->db))
         goto sx_hashfs_compute_volume_size_err;
-    locks[METADBS] = 1;
+    locks[METADBS_MAX] = 1;
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
         if(qbegin(h->metadb[i]))
             goto sx_hashfs_compute_volume_size_err;
         locks[i] = 1;
     }
 
     /* Iterate over all meta databases */
-    for(i = 0; i < METADBS; i++) {
-        q = h->qm_sumfilesizes[i];
+    for(i = 0; i < h->metadbs; i++) {
+        q = qlazy(h, h->qm_sumfilesizes[i]);
         int r;
 
         sqlite3_reset(q);
@@ -17676,16 +20989,16 @@ rc_ty sx_hashfs_compute_volume_size(sx_hashfs_t *h, const sx_hashfs_volume_t *vo
     if(qcommit(h->db))
         goto sx_hashfs_compute_volume_size_err;
     else
-        locks[METADBS] = 0;
+        locks[METADBS_MAX] = 0;
 
     ret = OK;
 sx_hashfs_compute_volume_size_err:
 
-    if(ret != OK && locks[METADBS])
+    if(ret != OK && locks[METADBS_MAX])
         qrollback(h->db);
 
     /* Unlock meta dbs */
-    for(i = 0; i < METADBS; i++)
+    for(i = 0; i < h->metadbs; i++)
         if(locks[i])
             qrollback(h->metadb[i]);
 
@@ -17756,6 +21069,7 @@ static rc_ty volume_chown_privs(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, i
     }
 
     /* Grant privs for new volume owner */
+    cluster_gen_touch(h, GEN_LOOKUP);
     sqlite3_reset(h->q_grant);
     if(qbind_int64(h->q_grant, ":volid", vol->id) || qbind_int64(h->q_grant, ":uid", newid) ||
        qbind_int(h->q_grant, ":priv", PRIV_READ | PRIV_WRITE) || qstep_noret(h->q_grant)) {
@@ -17786,6 +21100,7 @@ static rc_ty volume_mod_common(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, co
         return EINVAL;
     }
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     sqlite3_reset(h->q_modvol);
     if(qbind_text(h->q_modvol, ":name", newname)
        || qbind_int64(h->q_modvol, ":size", size)
@@ -18086,6 +21401,23 @@ static rc_ty should_heal_replica(sx_hashfs_t *h, const sx_hashfs_volume_t *vol,
     return ret;
 }
 
+/* Hands the block list of the current row of q over to the find callback */
+static rc_ty file_find_cb(sx_hashfs_t *h, unsigned int mdb, sqlite3_stmt *q, int fidcol, const sx_hashfs_volume_t *volume, const sx_hashfs_file_t *file, sx_find_cb_t cb, void *ctx)
+{
+    const void *content = sqlite3_column_blob(q, 2);
+    unsigned int content_len = sqlite3_column_bytes(q, 2);
+    sx_hash_t *chunks;
+    rc_ty rc;
+
+    if (!cb)
+        return OK;
+    if ((rc = file_content_load(h, mdb, sqlite3_column_int64(q, fidcol), file->file_size, &content, &content_len, &chunks)))
+        return rc;
+    rc = cb(volume, file, content, content_len / SXI_SHA1_BIN_LEN, ctx) ? OK : FAIL_ETOOMANY;
+    free(chunks);
+    return rc;
+}
+
 static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *maxrev, sx_hashfs_file_t *file, sx_find_cb_t cb, void *ctx)
 {
     int fdb;
@@ -18096,11 +21428,11 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
         NULLARG();
         return EFAULT;
     }
-    fdb = file->name[0] ? getmetadb(file->name) : 0;
+    fdb = file->name[0] ? getmetadb(file->name, h->metadbs) : 0;
     if(fdb < 0)
 	return FAIL_EINTERNAL;
     if (file->revision[0]) {
-        q = h->qm_list_rev_dec[fdb];
+        q = qlazy(h, h->qm_list_rev_dec[fdb]);
         sqlite3_reset(q);
         if (qbind_int64(q, ":volid", volume->id) ||
             qbind_text(q, ":name", file->name) ||
@@ -18112,10 +21444,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
             sxi_strlcpy(file->revision, (const char*)sqlite3_column_text(q, 1), sizeof(file->revision));
             memcpy(file->revision_id.b, sqlite3_column_blob(q, 3), sizeof(file->revision_id.b));
             DEBUG("found: name=%s, revision=%s", file->name, file->revision);
-            if (cb && !cb(volume, file, sqlite3_column_blob(q, 2), sqlite3_column_bytes(q, 2) / SXI_SHA1_BIN_LEN, ctx))
-                rc = FAIL_ETOOMANY;
-            else
-                rc = OK;
+            rc = file_find_cb(h, fdb, q, 4, volume, file, cb, ctx);
         } else if (ret == SQLITE_DONE) {
             DEBUG("no more revisions for %s", file->name);
             file->revision[0] = '\0';
@@ -18128,7 +21457,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
     }
 
     do {
-        q = h->qm_list_file[fdb];
+        q = qlazy(h, h->qm_list_file[fdb]);
         DEBUG("previous:%s, maxrev:%s", file->name, maxrev);
         if (qbind_int64(q, ":volid", volume->id) ||
             qbind_text(q, ":previous", file->name) ||
@@ -18143,10 +21472,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
             sxi_strlcpy(file->name, (const char*)sqlite3_column_text(q, 3), sizeof(file->name));
             memcpy(file->revision_id.b, sqlite3_column_blob(q, 4), sizeof(file->revision_id.b));
             DEBUG("found new: name=%s, revision=%s", file->name, file->revision);
-            if (cb && !cb(volume, file, sqlite3_column_blob(q, 2), sqlite3_column_bytes(q, 2) / SXI_SHA1_BIN_LEN, ctx))
-                rc = FAIL_ETOOMANY;
-            else
-                rc = OK;
+            rc = file_find_cb(h, fdb, q, 5, volume, file, cb, ctx);
         } else if (ret == SQLITE_DONE) {
             DEBUG("no more files in fdb %d", fdb);
             file->name[0] = '\0';
@@ -18158,7 +21484,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
         sqlite3_reset(q);
         if (rc != OK && rc != ITER_NO_MORE)
             return rc;
-        if (fdb >= METADBS)
+        if (fdb >= h->metadbs)
             return ITER_NO_MORE;
     } while (ret == SQLITE_DONE);
     return rc;
@@ -18209,7 +21535,7 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
     }
     *blockmetaptr = NULL;
     const sx_hash_t *hash = previous ? (const sx_hash_t*)&previous->b[1] : NULL;
-    unsigned int ndb = hash ? gethashdb(hash) : 0;
+    unsigned int ndb = hash ? gethashdb(hash, h->hashdbs) : 0;
     unsigned int sizeidx = previous ? previous->b[0] : 0;
     if (sizeidx >= SIZES) {
         WARN("bad size: %d", sizeidx);
@@ -18221,8 +21547,8 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
     DEBUG("rebalance_ver: %d", rebalance_ver);
     do {
         DEBUG("ndb: %d, sizeidx: %d", ndb, sizeidx);
-        sqlite3_stmt *q = h->rit.q[sizeidx][ndb];
-        sqlite3_stmt *qmeta = h->qb_get_meta[sizeidx][ndb];
+        sqlite3_stmt *q = qlazy(h, h->rit.q[sizeidx][ndb]);
+        sqlite3_stmt *qmeta = qlazy(h, h->qb_get_meta[sizeidx][ndb]);
         sqlite3_reset(q);
         sqlite3_reset(qmeta);
         sqlite3_clear_bindings(q);
@@ -18256,7 +21582,7 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
             }
         } while (ret == OK || ret == SQLITE_ROW);
         if (rc == ITER_NO_MORE) {
-            if (++ndb >= HASHDBS) {
+            if (++ndb >= h->hashdbs) {
                 ndb = 0;
                 if (++sizeidx >= SIZES) {
                     sx_hashfs_blockmeta_free(blockmetaptr);
@@ -18551,6 +21877,7 @@ rc_ty sx_hashfs_init_replacement(sx_hashfs_t *h) {
      * by pretending the faulty nodes are ignored in the current model */
     replica_loss = h->next_maxreplica - sxi_hdist_maxreplica(h->hd, 0, h->faulty_nodes);
     if(replica_loss) {
+	cluster_gen_touch(h, GEN_LOOKUP);
 	if(qprep(h->db, &q, "UPDATE volumes SET volume = '.BAD' || volume, enabled = 0, changed = 0 WHERE volume NOT LIKE '.BAD%' AND replica <= :replica") || /* SLOWQ */
 	   qbind_int(q, ":replica", replica_loss) ||
 	   qstep_noret(q))
@@ -18613,7 +21940,7 @@ rc_ty sx_hashfs_volrep_find(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const
 
     *blockmetaptr = NULL;
     const sx_hash_t *hash = previous ? (const sx_hash_t*)&previous->b[1] : NULL;
-    unsigned int ndb = hash ? gethashdb(hash) : 0;
+    unsigned int ndb = hash ? gethashdb(hash, h->hashdbs) : 0;
     unsigned int sizeidx = previous ? previous->b[0] : 0;
     if (sizeidx >= SIZES) {
         WARN("bad size: %d", sizeidx);
@@ -18624,8 +21951,8 @@ rc_ty sx_hashfs_volrep_find(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const
         return ENOMEM;
     do {
         DEBUG("ndb: %d, sizeidx: %d", ndb, sizeidx);
-        sqlite3_stmt *q = h->qb_volrep_block_by_global_vol_id[sizeidx][ndb];
-        sqlite3_stmt *qmeta = h->qb_get_meta_volrep[sizeidx][ndb];
+        sqlite3_stmt *q = qlazy(h, h->qb_volrep_block_by_global_vol_id[sizeidx][ndb]);
+        sqlite3_stmt *qmeta = qlazy(h, h->qb_get_meta_volrep[sizeidx][ndb]);
         sqlite3_reset(q);
         sqlite3_reset(qmeta);
         sqlite3_clear_bindings(q);
@@ -18658,7 +21985,7 @@ rc_ty sx_hashfs_volrep_find(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const
             }
         } while (ret == OK || ret == SQLITE_ROW);
         if (rc == ITER_NO_MORE) {
-            if (++ndb >= HASHDBS) {
+            if (++ndb >= h->hashdbs) {
                 ndb = 0;
                 if (++sizeidx >= SIZES) {
                     sx_hashfs_blockmeta_free(blockmetaptr);
@@ -18703,13 +22030,13 @@ rc_ty sx_hashfs_volrep_release_blocks(sx_hashfs_t *h, const sx_hashfs_volume_t *
 
     /* Initialize iteration with provided cursor */
     memcpy(hash.b, previous->b+1, sizeof(hash.b));
-    ndb = first ? 0 : gethashdb(&hash);
+    ndb = first ? 0 : gethashdb(&hash, h->hashdbs);
     sizeidx = first ? 0 : previous->b[0];
 
     me = sx_hashfs_self(h);
     for(; sizeidx < SIZES; sizeidx++) {
-        for(; ndb < HASHDBS; ndb++) {
-            sqlite3_stmt *qget = h->qb_volrep_block_by_global_vol_id[sizeidx][ndb];
+        for(; ndb < h->hashdbs; ndb++) {
+            sqlite3_stmt *qget = qlazy(h, h->qb_volrep_block_by_global_vol_id[sizeidx][ndb]);
             int r;
             rc_ty s = FAIL_EINTERNAL;
 
@@ -18748,7 +22075,7 @@ rc_ty sx_hashfs_volrep_release_blocks(sx_hashfs_t *h, const sx_hashfs_volume_t *
 
                 /* Check if the node is an over-replica node */
                 if(!sx_nodelist_lookup_index(nodes, sx_node_uuid(me), &node_idx) || node_idx + 1 > next_replica) {
-                    sqlite3_stmt *qdel = h->qb_volrep_release_revid_blocks[sizeidx][ndb];
+                    sqlite3_stmt *qdel = qlazy(h, h->qb_volrep_release_revid_blocks[sizeidx][ndb]);
 
                     /* This node is no longer a hashnode for the block */
                     sx_nodelist_delete(nodes);
@@ -18819,8 +22146,8 @@ rc_ty sx_hashfs_volrep_update_revid_replica(sx_hashfs_t *h, const sx_hashfs_volu
     }
 
     for(sizeidx = 0; sizeidx < SIZES; sizeidx++) {
-        for(ndb = 0; ndb < HASHDBS; ndb++) {
-            sqlite3_stmt *q = h->qb_volrep_update_replica[sizeidx][ndb];
+        for(ndb = 0; ndb < h->hashdbs; ndb++) {
+            sqlite3_stmt *q = qlazy(h, h->qb_volrep_update_replica[sizeidx][ndb]);
 
             if(qbind_blob(q, ":global_vol_id", vol->global_id.b, sizeof(vol->global_id.b)) || qbind_int(q, ":prev_replica", prev_replica) ||
                qbind_int(q, ":next_replica", next_replica) || qstep_noret(q)) {
@@ -18950,6 +22277,7 @@ static rc_ty bump_hdist_version_only(sx_hashfs_t *h, int inactive_dist, int64_t
 	return FAIL_EINTERNAL;
     }
 
+    cluster_gen_touch(h, GEN_CLUSTER);
     if(inactive_dist) {
 	if(qbind_text(h->q_setval, ":k", "current_dist") ||
 	   qbind_blob(h->q_setval, ":v", cur_cfg, cur_cfg_len) ||
@@ -19278,14 +22606,50 @@ rc_ty sx_hashfs_stats_jobq(sx_hashfs_t *h, int64_t *sysjobs, int64_t *userjobs)
     scnt = sqlite3_column_int64(h->qe_jstats, 1) - ucnt;
     sqlite3_reset(h->qe_jstats);
 
-    if(sysjobs)
-	*sysjobs = scnt;
-    if(userjobs)
-	*userjobs = ucnt;
+    if(sysjobs)
+	*sysjobs = scnt;
+    if(userjobs)
+	*userjobs = ucnt;
+
+    return OK;
+}
+
+rc_ty sx_hashfs_stats_blockidx(sx_hashfs_t *h, int64_t *bloom_neg, int64_t *bloom_fp) {
+    uint64_t neg = 0, fp = 0;
+    unsigned int i, j;
+
+    if(!h) {
+	NULLARG();
+        return EINVAL;
+    }
+
+    for(j = 0; j < SIZES; j++)
+	for(i = 0; i < h->hashdbs; i++)
+	    if(h->blockidx[j][i])
+		sx_blockidx_stats(h->blockidx[j][i], &neg, &fp);
+
+    if(bloom_neg)
+	*bloom_neg = neg;
+    if(bloom_fp)
+	*bloom_fp = fp;
 
     return OK;
 }
 
+rc_ty sx_hashfs_stats_startup(sx_hashfs_t *h, double *open_time, int64_t *prepared, int64_t *lazy) {
+    if(!h) {
+	NULLARG();
+	return EINVAL;
+    }
+    if(open_time)
+	*open_time = h->open_time;
+    if(prepared)
+	*prepared = h->nprepared;
+    if(lazy)
+	*lazy = LAZY_DATADB_COUNT * SIZES * h->hashdbs + LAZY_METADB_COUNT * h->metadbs;
+    return OK;
+}
+
 rc_ty sx_hashfs_stats_blockq(sx_hashfs_t *h, const sx_uuid_t *dest, int64_t *ready, int64_t *held, int64_t *unbumps) {
     sqlite3_stmt *q = NULL;
     rc_ty ret = FAIL_EINTERNAL;
@@ -19463,6 +22827,7 @@ rc_ty sx_hashfs_cluster_set_mode(sx_hashfs_t *h, int readonly) {
         return EINVAL;
     }
 
+    cluster_gen_touch(h, GEN_CLUSTER);
     if(qbind_text(h->q_setval, ":k", "mode") || qbind_text(h->q_setval, ":v", readonly ? "ro" : "rw") || qstep_noret(h->q_setval)) {
         WARN("Failed to set cluster operating mode");
         return FAIL_EINTERNAL;
@@ -19474,6 +22839,7 @@ rc_ty sx_hashfs_cluster_set_mode(sx_hashfs_t *h, int readonly) {
 
 rc_ty sx_hashfs_cluster_get_mode(sx_hashfs_t *h, int *mode) {
     const char *mode_str;
+    uint64_t gen;
     int r;
     rc_ty ret = FAIL_EINTERNAL;
 
@@ -19482,6 +22848,12 @@ rc_ty sx_hashfs_cluster_get_mode(sx_hashfs_t *h, int *mode) {
         return EINVAL;
     }
 
+    gen = cluster_gen(h, GEN_CLUSTER);
+    if(gen && gen == h->mode_gen) {
+	*mode = h->readonly;
+	return OK;
+    }
+
     sqlite3_reset(h->q_getval);
     if(qbind_text(h->q_getval, ":k", "mode")) {
         WARN("Failed to get cluster operating mode");
@@ -19515,9 +22887,10 @@ rc_ty sx_hashfs_cluster_get_mode(sx_hashfs_t *h, int *mode) {
 
     ret = OK;
 sx_hashfs_cluster_get_mode_err:
-    if(ret == OK)
+    if(ret == OK) {
         h->readonly = *mode;
-    else
+        h->mode_gen = gen;
+    } else
         h->readonly = 0;
     sqlite3_reset(h->q_getval);
     return ret;
@@ -19533,12 +22906,12 @@ rc_ty sx_hashfs_list_revision_blocks(sx_hashfs_t *h, const sx_hashfs_volume_t *v
         NULLARG();
         return rc;
     }
-    if (i >= METADBS) {
+    if (i >= h->metadbs) {
         msg_set_reason("Invalid metadb");
         return rc;
     }
     sqlite3_reset(h->qm_needs_upgrade[i]);
-    int r = qstep(h->qm_needs_upgrade[i]);
+    int r = qstep(qlazy(h, h->qm_needs_upgrade[i]));
     sqlite3_reset(h->qm_needs_upgrade[i]);
     if (r != SQLITE_DONE) {
         msg_set_reason("Upgrade not yet completed");
@@ -19546,7 +22919,7 @@ rc_ty sx_hashfs_list_revision_blocks(sx_hashfs_t *h, const sx_hashfs_volume_t *v
     }
     do {
         sx_hash_t id;
-        sqlite3_stmt *qcount = h->qm_count_rb[i], *q = h->qm_get_rb[i];
+        sqlite3_stmt *qcount = qlazy(h, h->qm_count_rb[i]), *q = qlazy(h, h->qm_get_rb[i]);
         sqlite3_reset(qcount);
         sqlite3_reset(q);
         int ret, k=0;
@@ -19582,21 +22955,30 @@ rc_ty sx_hashfs_list_revision_blocks(sx_hashfs_t *h, const sx_hashfs_volume_t *v
                 ret = -1;
                 break;
             }
-            const sx_hash_t *contents = sqlite3_column_blob(q, 2);
-            unsigned int block_size;
-            int64_t nblocks = size_to_blocks(size, NULL, &block_size);
+            const void *contents = sqlite3_column_blob(q, 2);
+            unsigned int block_size, content_len = sqlite3_column_bytes(q, 2);
+            sx_hash_t *chunks;
+            int64_t nblocks = file_to_blocks(size, content_len / sizeof(sx_hash_t), NULL, &block_size);
             DEBUG("volume: %s, metadb: %d, file: %s", vol->name, i, sqlite3_column_text(q, 3));
             DEBUGHASH("row revision", &revision_id);
-            if (nblocks * sizeof(*contents) != sqlite3_column_bytes(q, 2)) {
-                msg_set_reason("corrupt file blob: %ld * %lu != %d", nblocks, sizeof(*contents), sqlite3_column_bytes(q, 2));
+            if (file_content_load(h, i, sqlite3_column_int64(q, 4), size, &contents, &content_len, &chunks)) {
+                msg_set_reason("failed to load file chunks");
+                ret = -1;
+                break;
+            }
+            if (nblocks * sizeof(sx_hash_t) != content_len) {
+                msg_set_reason("corrupt file blob: %ld * %lu != %d", nblocks, sizeof(sx_hash_t), content_len);
+                free(chunks);
                 ret = -1;
                 break;
             }
             if (cb(vol, target, &revision_id, contents, nblocks, block_size)) {
                 msg_set_reason("block revision list callback failed");
+                free(chunks);
                 ret = -1;
                 break;
             }
+            free(chunks);
             if (!min_revision_id)
                 min_revision_id = &id;
             memcpy(min_revision_id->b, revision_id.b, sizeof(revision_id.b));
@@ -19620,13 +23002,13 @@ rc_ty sx_hashfs_heal_update(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const
         NULLARG();
         return EFAULT;
     }
-    if (metadb >= METADBS) {
+    if (metadb >= h->metadbs) {
         WARN("Invalid metadb: %u", metadb);
         return EINVAL;
     }
     if (min_revision_id) {
         DEBUGHASH("Updating min_revision_id to", min_revision_id);
-        sqlite3_stmt *qupd = h->qm_upd_heal_volume[metadb];
+        sqlite3_stmt *qupd = qlazy(h, h->qm_upd_heal_volume[metadb]);
         sqlite3_reset(qupd);
         if (qbind_blob(qupd,":min_revision_id",min_revision_id->b,sizeof(min_revision_id->b)) ||
             qbind_text(qupd,":name",vol->name) ||
@@ -19634,7 +23016,7 @@ rc_ty sx_hashfs_heal_update(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const
             return FAIL_EINTERNAL;
     } else {
         DEBUG("Finished volume heal for %s", vol->name);
-        sqlite3_stmt *qdel = h->qm_del_heal_volume[metadb];
+        sqlite3_stmt *qdel = qlazy(h, h->qm_del_heal_volume[metadb]);
         sqlite3_reset(qdel);
         if (qbind_text(qdel,":name",vol->name) ||
             qstep_noret(qdel))
@@ -19649,12 +23031,12 @@ rc_ty sx_hashfs_remote_heal(sx_hashfs_t *h, heal_cb_t cb)
     unsigned i;
     unsigned has_heal = 0;
     DEBUG("IN");
-    for (i=0;i<METADBS;i++) {
+    for (i=0;i<h->metadbs;i++) {
         char prev[SXLIMIT_MAX_VOLNAME_LEN+1];
         int ret;
         prev[0] = 0;
-        sqlite3_stmt *qsel = h->qm_sel_heal_volume[i];
-        sqlite3_stmt *qupd = h->qm_upd_heal_volume[i];
+        sqlite3_stmt *qsel = qlazy(h, h->qm_sel_heal_volume[i]);
+        sqlite3_stmt *qupd = qlazy(h, h->qm_upd_heal_volume[i]);
         sqlite3_reset(qsel);
         sqlite3_reset(qupd);
         if(qbind_text(qsel, ":prev", prev))
@@ -19688,7 +23070,7 @@ rc_ty sx_hashfs_remote_heal(sx_hashfs_t *h, heal_cb_t cb)
         if (ret != SQLITE_DONE)
             break;
     }
-    if (i == METADBS)
+    if (i == h->metadbs)
         return has_heal ? OK : ITER_NO_MORE;
     return rc;
 }
@@ -19722,8 +23104,8 @@ const char *sx_hashfs_heal_status_remote(sx_hashfs_t *h)
 {
     if (sx_hashfs_has_upgrade_job(h))
         return "Waiting on local heal";
-    for (unsigned i=0;i<METADBS;i++) {
-        sqlite3_stmt *qsel = h->qm_sel_heal_volume[i];
+    for (unsigned i=0;i<h->metadbs;i++) {
+        sqlite3_stmt *qsel = qlazy(h, h->qm_sel_heal_volume[i]);
         sqlite3_reset(qsel);
         if(qbind_text(qsel, ":prev", ""))
             break;
@@ -19769,9 +23151,327 @@ rc_ty sx_hashfs_syncglobs_end(sx_hashfs_t *h) {
 }
 
 
+/* Online compaction
+ *
+ * Blocks at the tail of a datafile are copied into the lowest holes in small
+ * transactions while the node keeps serving requests. A reader which resolved
+ * the old position of a block right before it was moved still finds valid
+ * data there, so the vacated slots are kept out of the freelist for
+ * gc_compact_grace seconds: like the slots freed by the GC, they are recorded
+ * in the pending_free table and only released (and truncated away) by a later
+ * pass. */
+#define COMPACT_MAX_BYTES (64 * 1024 * 1024) /* Per shard and pass */
+#define COMPACT_BATCH_BYTES (1024 * 1024) /* Per transaction */
+
+struct compact_q {
+    sqlite3_stmt *qrelease, *qunpend, *qholes, *qtail, *qmove, *qtrail, *qtrim, *qsetnext;
+};
+
+struct compact_blk {
+    sx_hash_t hash;
+    int64_t blockno;
+    unsigned int clen;
+};
+
+static void compact_q_free(struct compact_q *q) {
+    qnullify(q->qrelease);
+    qnullify(q->qunpend);
+    qnullify(q->qholes);
+    qnullify(q->qtail);
+    qnullify(q->qmove);
+    qnullify(q->qtrail);
+    qnullify(q->qtrim);
+    qnullify(q->qsetnext);
+}
+
+static int compact_q_prep(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, struct compact_q *q) {
+    sxi_db_t *db = h->datadb[hs][ndb];
+
+    memset(q, 0, sizeof(*q));
+    if(qprep(db, &q->qrelease, "INSERT OR IGNORE INTO avail SELECT blocknumber FROM pending_free WHERE freed_at <= :cutoff") ||
+       qprep(db, &q->qunpend, "DELETE FROM pending_free WHERE freed_at <= :cutoff") ||
+       qprep(db, &q->qholes, "SELECT blocknumber FROM avail ORDER BY blocknumber ASC LIMIT :n") ||
+       qprep(db, &q->qtail, "SELECT hash, blockno, clen FROM blocks WHERE blockno > :min ORDER BY blockno DESC LIMIT :n") ||
+       qprep(db, &q->qmove, "UPDATE blocks SET blockno = :to WHERE hash = :hash AND blockno = :from") ||
+       qprep(db, &q->qtrail, "SELECT blocknumber FROM avail WHERE blocknumber < :next ORDER BY blocknumber DESC") ||
+       qprep(db, &q->qtrim, "DELETE FROM avail WHERE blocknumber >= :next") ||
+       qprep(db, &q->qsetnext, "UPDATE hashfs SET value = :next WHERE key = 'next_blockno'")) {
+	WARN("Cannot prepare compaction queries on %s db #%u", sizelongnames[hs], ndb);
+	compact_q_free(q);
+	return -1;
+    }
+    return 0;
+}
+
+/* Returns the slots freed or vacated more than grace seconds ago to the
+ * freelist, then trims the trailing holes off the datafile */
+static rc_ty compact_release(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, struct compact_q *q, int64_t grace, int64_t *freed) {
+    sxi_db_t *db = h->datadb[hs][ndb];
+    sqlite3_stmt *qnext = qlazy(h, h->qb_nextalloc[hs][ndb]);
+    int64_t next, newnext, cutoff = time(NULL) - grace;
+    struct stat st;
+    int r, changed = 0;
+
+    if(!qnext || qbegin(db)) {
+	WARN("Cannot lock %s db #%u", sizelongnames[hs], ndb);
+	return FAIL_EINTERNAL;
+    }
+
+    sqlite3_reset(q->qrelease);
+    if(qbind_int64(q->qrelease, ":cutoff", cutoff) || qstep_noret(q->qrelease))
+	goto release_err;
+    if(sqlite3_changes(db->handle)) {
+	DEBUG("Released %d pending slots on %s db #%u", sqlite3_changes(db->handle), sizelongnames[hs], ndb);
+	changed = 1;
+    }
+    sqlite3_reset(q->qunpend);
+    if(qbind_int64(q->qunpend, ":cutoff", cutoff) || qstep_noret(q->qunpend))
+	goto release_err;
+
+    sqlite3_reset(qnext);
+    if(qstep_ret(qnext))
+	goto release_err;
+    next = sqlite3_column_int64(qnext, 0);
+    sqlite3_reset(qnext);
+
+    /* Drop the trailing run of free slots */
+    newnext = next;
+    sqlite3_reset(q->qtrail);
+    if(qbind_int64(q->qtrail, ":next", next))
+	goto release_err;
+    while((r = qstep(q->qtrail)) == SQLITE_ROW && sqlite3_column_int64(q->qtrail, 0) == newnext - 1)
+	newnext--;
+    sqlite3_reset(q->qtrail);
+    if(r != SQLITE_ROW && r != SQLITE_DONE)
+	goto release_err;
+    if(newnext < next) {
+	DEBUG("Trailing hole starting at %lld on %s db #%u", (long long)newnext, sizelongnames[hs], ndb);
+	if(qbind_int64(q->qtrim, ":next", newnext) || qstep_noret(q->qtrim) ||
+	   qbind_int64(q->qsetnext, ":next", newnext) || qstep_noret(q->qsetnext))
+	    goto release_err;
+	changed = 1;
+    }
+    if(changed)
+	freemap_changed(h, hs, ndb);
+
+    /* Still under lock: nobody can append past newnext */
+    if(fstat(h->datafd[hs][ndb], &st)) {
+	msg_set_errno_reason("Failed to stat datafile");
+	goto release_err;
+    }
+    if(st.st_size > newnext * bsz[hs]) {
+	if(ftruncate(h->datafd[hs][ndb], newnext * bsz[hs])) {
+	    WARN("Cannot truncate %s datafile #%u", sizelongnames[hs], ndb);
+	    msg_set_errno_reason("Failed to truncate datafile");
+	    goto release_err;
+	}
+	INFO("Size of %s datafile #%u reduced from %lld to %lld", sizelongnames[hs], ndb, (long long)st.st_size, (long long)newnext * bsz[hs]);
+	*freed += st.st_size - newnext * bsz[hs];
+    }
+
+    if(qcommit(db))
+	goto release_err;
+    return OK;
+
+ release_err:
+    WARN("Failed to release free space on %s db #%u", sizelongnames[hs], ndb);
+    qrollback(db);
+    return FAIL_EINTERNAL;
+}
+
+static rc_ty compact_relocate(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, struct compact_q *q, int *terminate, int64_t *moved) {
+    sxi_db_t *db = h->datadb[hs][ndb];
+    sqlite3_stmt *qbump = qlazy(h, h->qb_bumpavail[hs][ndb]), *qfree = qlazy(h, h->qb_setfree[hs][ndb]);
+    unsigned int bs = bsz[hs], maxblocks = COMPACT_MAX_BYTES / bs, batchblocks = MAX(1, COMPACT_BATCH_BYTES / bs);
+    unsigned int nholes = 0, ntail = 0, npairs, i;
+    struct compact_blk *tail = NULL;
+    int64_t *holes = NULL, *vac = NULL;
+    rc_ty ret = FAIL_EINTERNAL;
+    int r;
+
+    if(!qbump || !qfree)
+	return FAIL_EINTERNAL;
+    if(!(holes = wrap_malloc(maxblocks * sizeof(*holes))) ||
+       !(tail = wrap_malloc(maxblocks * sizeof(*tail))) ||
+       !(vac = wrap_malloc(batchblocks * sizeof(*vac)))) {
+	ret = ENOMEM;
+	goto relocate_out;
+    }
+
+    /* Pick the lowest holes and as many of the highest blocks */
+    sqlite3_reset(q->qholes);
+    if(qbind_int(q->qholes, ":n", maxblocks))
+	goto relocate_out;
+    while((r = qstep(q->qholes)) == SQLITE_ROW)
+	holes[nholes++] = sqlite3_column_int64(q->qholes, 0);
+    sqlite3_reset(q->qholes);
+    if(r != SQLITE_DONE)
+	goto relocate_out;
+    if(!nholes) {
+	ret = OK;
+	goto relocate_out;
+    }
+
+    /* Walks the blocks_blockno index backwards */
+    sqlite3_reset(q->qtail);
+    if(qbind_int64(q->qtail, ":min", holes[0]) || qbind_int(q->qtail, ":n", nholes))
+	goto relocate_out;
+    while((r = qstep(q->qtail)) == SQLITE_ROW) {
+	const void *hash = sqlite3_column_blob(q->qtail, 0);
+	struct compact_blk *b = &tail[ntail];
+	if(!hash || sqlite3_column_bytes(q->qtail, 0) != sizeof(b->hash))
+	    continue;
+	memcpy(&b->hash, hash, sizeof(b->hash));
+	b->blockno = sqlite3_column_int64(q->qtail, 1);
+	b->clen = sqlite3_column_int(q->qtail, 2);
+	ntail++;
+    }
+    sqlite3_reset(q->qtail);
+    if(r != SQLITE_DONE)
+	goto relocate_out;
+    for(npairs = 0; npairs < ntail && holes[npairs] < tail[npairs].blockno; npairs++);
+    DEBUG("Relocating up to %u blocks on %s db #%u", npairs, sizelongnames[hs], ndb);
+
+    ret = OK;
+    for(i = 0; i < npairs && !*terminate; ) {
+	unsigned int nvac = 0;
+	struct timeval tv1, tv2;
+	int64_t gen;
+	int idxok;
+
+	gettimeofday(&tv1, NULL);
+	if(qbegin(db)) {
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	idxok = !blockidx_prepare(h, hs, ndb, 0, &gen);
+	if(idxok)
+	    blockidx_bump(h, hs, ndb, gen);
+	for(; i < npairs && nvac < batchblocks && ret == OK; i++) {
+	    int64_t to = holes[i], from = tail[i].blockno;
+
+	    /* Both the hole and the block may have changed since the scan */
+	    sqlite3_reset(qbump);
+	    if(qbind_int64(qbump, ":next", to) || qstep_noret(qbump)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    sqlite3_reset(qbump);
+	    if(!sqlite3_changes(db->handle))
+		continue;
+	    sqlite3_reset(q->qmove);
+	    if(qbind_int64(q->qmove, ":to", to) ||
+	       qbind_blob(q->qmove, ":hash", &tail[i].hash, sizeof(tail[i].hash)) ||
+	       qbind_int64(q->qmove, ":from", from) ||
+	       qstep_noret(q->qmove)) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    sqlite3_reset(q->qmove);
+	    if(!sqlite3_changes(db->handle)) {
+		sqlite3_reset(qfree);
+		if(qbind_int64(qfree, ":blockno", to) || qstep_noret(qfree))
+		    ret = FAIL_EINTERNAL;
+		sqlite3_reset(qfree);
+		continue;
+	    }
+
+	    DEBUG("Relocating full block %lld onto free block %lld on %s db #%u", (long long)from, (long long)to, sizelongnames[hs], ndb);
+	    if(copy_slot(h->datafd[hs][ndb], from * bs, h->datafd[hs][ndb], to * bs, bs, tail[i].clen, h->blockbuf)) {
+		WARN("Error relocating block %lld on %s datafile #%u", (long long)from, sizelongnames[hs], ndb);
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	    if(idxok)
+		sx_blockidx_add(h->blockidx[hs][ndb], &tail[i].hash, to, tail[i].clen);
+	    vac[nvac++] = from;
+	}
+	if(ret == OK && nvac) {
+	    if(fdatasync(h->datafd[hs][ndb])) {
+		WARN("Failed to flush %s datafile #%u to disk", sizelongnames[hs], ndb);
+		msg_set_errno_reason("Failed to flush datafile to disk");
+		ret = FAIL_EINTERNAL;
+	    } else {
+		sqlite3_stmt *qdefer = qlazy(h, h->qb_deferfree[hs][ndb]);
+		unsigned int k;
+		for(k = 0; k < nvac && ret == OK; k++) {
+		    sqlite3_reset(qdefer);
+		    if(qbind_int64(qdefer, ":blockno", vac[k]) ||
+		       qbind_int64(qdefer, ":now", time(NULL)) ||
+		       qstep_noret(qdefer)) {
+			WARN("Failed to record vacated slots on %s db #%u", sizelongnames[hs], ndb);
+			ret = FAIL_EINTERNAL;
+		    }
+		}
+		sqlite3_reset(qdefer);
+	    }
+	}
+	if(ret == OK)
+	    freemap_changed(h, hs, ndb);
+	if(ret != OK || qcommit(db)) {
+	    /* The index may already point to the new positions */
+	    if(idxok)
+		sx_blockidx_invalidate(h->blockidx[hs][ndb]);
+	    qrollback(db);
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	*moved += nvac;
+
+	/* Each relocated block is read and written once */
+	gettimeofday(&tv2, NULL);
+	if(gc_compact_rate > 0) {
+	    double dt = (double)nvac * bs * 2 / (gc_compact_rate * 1024.0 * 1024.0) - timediff(&tv1, &tv2);
+	    if(dt > 0 && !*terminate)
+		usleep((useconds_t)(dt * 1000000));
+	}
+    }
+
+ relocate_out:
+    if(ret != OK)
+	WARN("Failed to relocate blocks on %s db #%u", sizelongnames[hs], ndb);
+    free(holes);
+    free(tail);
+    free(vac);
+    return ret;
+}
+
+rc_ty sx_hashfs_compact_online(sx_hashfs_t *h, int *terminate) {
+    int64_t freed = 0, moved = 0;
+    unsigned int ndb, hs;
+    struct compact_q q;
+    rc_ty ret = OK;
+
+    if(!h || !terminate) {
+	NULLARG();
+	return EINVAL;
+    }
+
+    for(hs = 0; hs < SIZES && !*terminate; hs++) {
+	for(ndb = 0; ndb < h->hashdbs && !*terminate; ndb++) {
+	    rc_ty s;
+
+	    if(compact_q_prep(h, hs, ndb, &q)) {
+		ret = FAIL_EINTERNAL;
+		continue;
+	    }
+	    s = compact_release(h, hs, ndb, &q, gc_compact_grace, &freed);
+	    if(s == OK && gc_compact_rate > 0)
+		s = compact_relocate(h, hs, ndb, &q, terminate, &moved);
+	    if(s != OK)
+		ret = s;
+	    compact_q_free(&q);
+	}
+    }
+
+    INFO("Online compaction relocated %lld blocks and freed %lld bytes", (long long)moved, (long long)freed);
+    return ret;
+}
+
 rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
-    sqlite3_stmt *qsyn = NULL, *qnys = NULL, *qget = NULL, *qdel = NULL, *qupa = NULL, *qupb = NULL, *qset = NULL, *qvac = NULL;
+    sqlite3_stmt *qsyn = NULL, *qnys = NULL, *qget = NULL, *qdel = NULL, *qupa = NULL, *qupb = NULL, *qset = NULL, *qvac = NULL, *qclen = NULL;
     unsigned int ndb, hs, rollback = 0;
+    struct compact_q cq;
     int64_t freed = 0;
     rc_ty ret = FAIL_EINTERNAL;
     struct flock fl;
@@ -19789,7 +23489,7 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
     }
 
     for(hs = 0; hs < SIZES; hs++) {
-	for(ndb=0; ndb<HASHDBS; ndb++) {
+	for(ndb=0; ndb<h->hashdbs; ndb++) {
 	    int r;
 
 	    DEBUG("Examining %s db #%u", sizelongnames[hs], ndb);
@@ -19800,6 +23500,7 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 	       qprep(h->datadb[hs][ndb], &qupa, "UPDATE avail SET blocknumber = :wasfull WHERE blocknumber = :wasempty") ||
 	       qprep(h->datadb[hs][ndb], &qupb, "UPDATE blocks SET blockno = :wasempty WHERE blockno = :wasfull") || /* SLOWQ */
 	       qprep(h->datadb[hs][ndb], &qset, "UPDATE hashfs SET value = :next WHERE key = 'next_blockno'") ||
+	       qprep(h->datadb[hs][ndb], &qclen, "SELECT clen FROM blocks WHERE blockno = :blockno") ||
 	       qprep(h->datadb[hs][ndb], &qvac, "VACUUM")) {
 		WARN("Cannot prepare defrag queries on %s db #%u", sizelongnames[hs], ndb);
 		goto defrag_err;
@@ -19810,9 +23511,23 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 		goto defrag_err;
 	    }
 
+	    /* Reclaim what the online compaction left behind: nobody is reading */
+	    if(compact_q_prep(h, hs, ndb, &cq))
+		goto defrag_err;
+	    r = compact_release(h, hs, ndb, &cq, 0, &freed);
+	    compact_q_free(&cq);
+	    if(r != OK)
+		goto defrag_err;
+
+	    /* Blocks are relocated: the index gets rebuilt on the next open
+	     * and the free slot map on the next allocation */
+	    sx_blockidx_invalidate(h->blockidx[hs][ndb]);
+	    freemap_changed(h, hs, ndb);
+
 	    while(1) { /* Foreach block in freelist */
+		sqlite3_stmt *qnext = qlazy(h, h->qb_nextalloc[hs][ndb]);
 		int64_t empty, next_empty, full, nextblq;
-		if(qbegin(h->datadb[hs][ndb])) {
+		if(!qnext || qbegin(h->datadb[hs][ndb])) {
 		    WARN("Cannot lock %s db #%u", sizelongnames[hs], ndb);
 		    goto defrag_err;
 		}
@@ -19831,13 +23546,13 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 			msg_set_errno_reason("Failed to stat datafile");
 			goto defrag_err;
 		    }
-		    sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-		    if(qstep_ret(h->qb_nextalloc[hs][ndb])) {
+		    sqlite3_reset(qnext);
+		    if(qstep_ret(qnext)) {
 			WARN("Failed to lookup next block on %s db #%u", sizelongnames[hs], ndb);
 			goto defrag_err;
 		    }
-		    nextblq = sqlite3_column_int64(h->qb_nextalloc[hs][ndb], 0);
-		    sqlite3_reset(h->qb_nextalloc[hs][ndb]);
+		    nextblq = sqlite3_column_int64(qnext, 0);
+		    sqlite3_reset(qnext);
 
 		    nextblq *= bsz[hs];
 		    if(st.st_size > nextblq) {
@@ -19886,13 +23601,13 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 
 		sqlite3_reset(qget); /* Don't deadlock on later updates */
 
-		sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-		if(qstep_ret(h->qb_nextalloc[hs][ndb])) {
+		sqlite3_reset(qnext);
+		if(qstep_ret(qnext)) {
 		    WARN("Error retrieving next block for %s db #%u", sizelongnames[hs], ndb);
 		    goto defrag_err;
 		}
-		nextblq = sqlite3_column_int64(h->qb_nextalloc[hs][ndb], 0);
-		sqlite3_reset(h->qb_nextalloc[hs][ndb]);
+		nextblq = sqlite3_column_int64(qnext, 0);
+		sqlite3_reset(qnext);
 
 		DEBUG("On %s db #%u: first empty %lld, last empty %lld, next %lld",
 		       sizelongnames[hs], ndb, (long long)empty, (long long)(full - 1), (long long)nextblq);
@@ -19912,15 +23627,25 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 			next_empty = nextblq;
 
 		    relocblqs = MIN(next_empty - full, full - empty);
+		    /* Compressed blocks are moved as stored, keeping the
+		     * unused tail of their slots punched */
 		    for(nblq = 0; nblq < relocblqs; nblq++) {
+			unsigned int clen = 0;
 
 			DEBUG("Relocating full block %lld onto free block %lld on %s db #%u", (long long)(full+nblq), (long long)(empty+nblq), sizelongnames[hs], ndb);
-			if(read_block(h->datafd[hs][ndb], h->blockbuf, (full+nblq) * bsz[hs], bsz[hs])) {
-			    WARN("Error reading block %lld on %s datafile #%u", (long long)(full+nblq), sizelongnames[hs], ndb);
+			sqlite3_reset(qclen);
+			if(qbind_int64(qclen, ":blockno", full+nblq))
+			    goto defrag_err;
+			r = qstep(qclen);
+			if(r == SQLITE_ROW)
+			    clen = sqlite3_column_int(qclen, 0);
+			else if(r != SQLITE_DONE) {
+			    WARN("Error looking up block %lld on %s db #%u", (long long)(full+nblq), sizelongnames[hs], ndb);
 			    goto defrag_err;
 			}
-			if(write_block(h->datafd[hs][ndb], h->blockbuf, (empty+nblq) * bsz[hs], bsz[hs])) {
-			    WARN("Error writing block %lld on %s datafile #%u", (long long)(empty+nblq), sizelongnames[hs], ndb);
+			sqlite3_reset(qclen);
+			if(copy_slot(h->datafd[hs][ndb], (full+nblq) * bsz[hs], h->datafd[hs][ndb], (empty+nblq) * bsz[hs], bsz[hs], clen, h->blockbuf)) {
+			    WARN("Error relocating block %lld onto %lld on %s datafile #%u", (long long)(full+nblq), (long long)(empty+nblq), sizelongnames[hs], ndb);
 			    goto defrag_err;
 			}
 			if(qbind_int64(qupa, ":wasfull", full+nblq) ||
@@ -19959,11 +23684,12 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 	    qnullify(qupa);
 	    qnullify(qupb);
 	    qnullify(qset);
+	    qnullify(qclen);
 	    qnullify(qvac);
 	}
     }
 
-    for(ndb=0; ndb<METADBS; ndb++) {
+    for(ndb=0; ndb<h->metadbs; ndb++) {
 	DEBUG("Examining file db #%u", ndb);
 	if(qprep(h->metadb[ndb], &qvac, "VACUUM") || qstep_noret(qvac))
 	    WARN("Failed to run VACUUM on file db #%u", ndb);
@@ -20006,6 +23732,7 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
     sqlite3_finalize(qupa);
     sqlite3_finalize(qupb);
     sqlite3_finalize(qset);
+    sqlite3_finalize(qclen);
     sqlite3_finalize(qvac);
     if(rollback)
 	qrollback(h->datadb[hs][ndb]);
@@ -20019,6 +23746,522 @@ rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed) {
 }
 
 
+/* Resharding: the new databases and datafiles are built next to the existing
+ * ones under names carrying the new shard count, then the hashfs keys are
+ * switched over in a single transaction and the old files removed */
+
+static void reshard_remove_new(sx_hashfs_t *h, unsigned int shards, unsigned int pathlen) {
+    char *path = wrap_malloc(pathlen);
+    unsigned int i, j;
+
+    if(!path)
+	return;
+    for(i=0; i<shards; i++) {
+	sprintf(path, "%s/f%08x-%u.db", h->dir, i, shards);
+	reshard_unlink(path);
+	for(j=0; j<SIZES; j++) {
+	    sprintf(path, "%s/h%c%08x-%u.db", h->dir, sizedirs[j], i, shards);
+	    reshard_unlink(path);
+	    sprintf(path, "%s/h%c%08x-%u.bin", datafile_dir(h, j), sizedirs[j], i, shards);
+	    unlink(path);
+	    sprintf(path, "%s/h%c%08x-%u.idx", datafile_dir(h, j), sizedirs[j], i, shards);
+	    unlink(path);
+	}
+    }
+    free(path);
+}
+
+static sxi_db_t *reshard_create_db(sx_hashfs_t *h, sxi_db_t *src, const char *path, const char *dbtype, sqlite3_stmt **insq) {
+    sxi_db_t *db;
+
+    reshard_unlink(path); /* Leftover of an interrupted run */
+    if(!(db = create_db_like(src, path, dbtype, &h->cluster_uuid, HASHFS_VERSION_CURRENT, insq)))
+	return NULL;
+    if(qbegin(db)) {
+	if(insq)
+	    qnullify(*insq);
+	qclose(&db);
+	return NULL;
+    }
+    return db;
+}
+
+/* Copies all the rows of table from src to the dst databases; each row goes
+ * either to the shard its hash in column hashcol maps to or, if hashcol is
+ * negative, to the shards first, first + step, ... */
+static int reshard_copy(sxi_db_t *src, const char *table, sxi_db_t **dst, unsigned int ndst, int hashcol, unsigned int first, unsigned int step) {
+    sqlite3_stmt *qsel = NULL, **qins;
+    char query[256];
+    unsigned int i, k, ncols;
+    int r, ret = -1;
+
+    if(!(qins = wrap_calloc(ndst, sizeof(*qins))))
+	return -1;
+    snprintf(query, sizeof(query), "SELECT * FROM %s", table);
+    if(qprep(src, &qsel, query))
+	goto reshard_copy_fail;
+    ncols = sqlite3_column_count(qsel);
+    snprintf(query, sizeof(query), "INSERT OR IGNORE INTO %s VALUES (", table);
+    for(i=0; i<ncols && strlen(query) < sizeof(query) - 4; i++)
+	strcat(query, i ? ",?" : "?");
+    strcat(query, ")");
+
+    while((r = qstep(qsel)) == SQLITE_ROW) {
+	for(k = first; k < ndst; k += step) {
+	    if(hashcol >= 0) {
+		if(sqlite3_column_bytes(qsel, hashcol) != sizeof(sx_hash_t)) {
+		    WARN("Bad hash in table %s", table);
+		    goto reshard_copy_fail;
+		}
+		k = gethashdb(sqlite3_column_blob(qsel, hashcol), ndst);
+	    }
+	    if(!qins[k] && qprep(dst[k], &qins[k], query))
+		goto reshard_copy_fail;
+	    sqlite3_reset(qins[k]);
+	    for(i=0; i<ncols; i++)
+		if(sqlite3_bind_value(qins[k], i + 1, sqlite3_column_value(qsel, i)))
+		    goto reshard_copy_fail;
+	    if(qstep_noret(qins[k]))
+		goto reshard_copy_fail;
+	    if(hashcol >= 0)
+		break;
+	}
+    }
+    if(r == SQLITE_DONE)
+	ret = 0;
+
+ reshard_copy_fail:
+    if(ret)
+	WARN("Failed to copy table %s", table);
+    sqlite3_finalize(qsel);
+    for(k=0; k<ndst; k++)
+	sqlite3_finalize(qins[k]);
+    free(qins);
+    return ret;
+}
+
+static rc_ty reshard_meta(sx_hashfs_t *h, unsigned int shards, char *path) {
+    sqlite3_stmt *qsel = NULL, *qselmeta = NULL, *qselreloc = NULL, *qselchunk = NULL, *qdedup = NULL;
+    sqlite3_stmt *qins[METADBS_MAX], *qinsmeta[METADBS_MAX], *qinsreloc[METADBS_MAX], *qinschunk[METADBS_MAX];
+    sxi_db_t *db[METADBS_MAX];
+    unsigned int i, k, common = MIN(shards, h->metadbs);
+    char dbitem[64];
+    rc_ty ret = FAIL_EINTERNAL;
+    int r;
+
+    memset(qins, 0, sizeof(qins));
+    memset(qinsmeta, 0, sizeof(qinsmeta));
+    memset(qinsreloc, 0, sizeof(qinsreloc));
+    memset(qinschunk, 0, sizeof(qinschunk));
+    memset(db, 0, sizeof(db));
+    for(k=0; k<shards; k++) {
+	sprintf(path, "%s/f%08x-%u.db", h->dir, k, shards);
+	sprintf(dbitem, "metadb_%08x", k);
+	if(!(db[k] = reshard_create_db(h, h->metadb[0], path, dbitem, NULL)) ||
+	   qprep(db[k], &qins[k], "INSERT INTO files (volume_id, name, size, rev, content, revision_id, age, depth) VALUES (?, ?, ?, ?, ?, ?, ?, ?)") ||
+	   qprep(db[k], &qinsmeta[k], "INSERT INTO fmeta (file_id, key, value) VALUES (:file, :key, :value)") ||
+	   qprep(db[k], &qinsreloc[k], "INSERT INTO relocs (file_id, dest) VALUES (:file, :dest)") ||
+	   qprep(db[k], &qinschunk[k], "INSERT INTO file_chunks (file_id, chunk, hashes) VALUES (:file, :chunk, :hashes)"))
+	    goto reshard_meta_fail;
+    }
+
+    for(i=0; i<h->metadbs; i++) {
+	INFO("Redistributing file db #%u", i);
+	if(qprep(h->metadb[i], &qsel, "SELECT fid, volume_id, name, size, rev, content, revision_id, age, depth FROM files") ||
+	   qprep(h->metadb[i], &qselmeta, "SELECT key, value FROM fmeta WHERE file_id = :file") ||
+	   qprep(h->metadb[i], &qselreloc, "SELECT dest FROM relocs WHERE file_id = :file") ||
+	   qprep(h->metadb[i], &qselchunk, "SELECT chunk, hashes FROM file_chunks WHERE file_id = :file"))
+	    goto reshard_meta_fail;
+
+	/* File ids are per db: the metadata, the relocations and the chunks
+	 * follow the id assigned in the new db */
+	while((r = qstep(qsel)) == SQLITE_ROW) {
+	    int64_t fid = sqlite3_column_int64(qsel, 0), newfid;
+	    const char *name = (const char *)sqlite3_column_text(qsel, 2);
+	    int c;
+
+	    if(!name || (c = getmetadb(name, shards)) < 0)
+		goto reshard_meta_fail;
+	    k = c;
+	    sqlite3_reset(qins[k]);
+	    for(c=1; c<9; c++)
+		if(sqlite3_bind_value(qins[k], c, sqlite3_column_value(qsel, c)))
+		    goto reshard_meta_fail;
+	    if(qstep_noret(qins[k]))
+		goto reshard_meta_fail;
+	    newfid = sqlite3_last_insert_rowid(sqlite3_db_handle(qins[k]));
+
+	    sqlite3_reset(qselmeta);
+	    if(qbind_int64(qselmeta, ":file", fid))
+		goto reshard_meta_fail;
+	    while((r = qstep(qselmeta)) == SQLITE_ROW) {
+		sqlite3_reset(qinsmeta[k]);
+		if(qbind_int64(qinsmeta[k], ":file", newfid) ||
+		   sqlite3_bind_value(qinsmeta[k], 2, sqlite3_column_value(qselmeta, 0)) ||
+		   sqlite3_bind_value(qinsmeta[k], 3, sqlite3_column_value(qselmeta, 1)) ||
+		   qstep_noret(qinsmeta[k]))
+		    goto reshard_meta_fail;
+	    }
+	    if(r != SQLITE_DONE)
+		goto reshard_meta_fail;
+
+	    sqlite3_reset(qselreloc);
+	    if(qbind_int64(qselreloc, ":file", fid))
+		goto reshard_meta_fail;
+	    r = qstep(qselreloc);
+	    if(r == SQLITE_ROW) {
+		sqlite3_reset(qinsreloc[k]);
+		if(qbind_int64(qinsreloc[k], ":file", newfid) ||
+		   sqlite3_bind_value(qinsreloc[k], 2, sqlite3_column_value(qselreloc, 0)) ||
+		   qstep_noret(qinsreloc[k]))
+		    goto reshard_meta_fail;
+	    } else if(r != SQLITE_DONE)
+		goto reshard_meta_fail;
+	    sqlite3_reset(qselreloc);
+
+	    sqlite3_reset(qselchunk);
+	    if(qbind_int64(qselchunk, ":file", fid))
+		goto reshard_meta_fail;
+	    while((r = qstep(qselchunk)) == SQLITE_ROW) {
+		sqlite3_reset(qinschunk[k]);
+		if(qbind_int64(qinschunk[k], ":file", newfid) ||
+		   sqlite3_bind_value(qinschunk[k], 2, sqlite3_column_value(qselchunk, 0)) ||
+		   sqlite3_bind_value(qinschunk[k], 3, sqlite3_column_value(qselchunk, 1)) ||
+		   qstep_noret(qinschunk[k]))
+		    goto reshard_meta_fail;
+	    }
+	    if(r != SQLITE_DONE)
+		goto reshard_meta_fail;
+	}
+	if(r != SQLITE_DONE)
+	    goto reshard_meta_fail;
+	qnullify(qsel);
+	qnullify(qselmeta);
+	qnullify(qselreloc);
+	qnullify(qselchunk);
+
+	/* The heal queue is consumed from every db, the volume heal cursors
+	 * are kept in each of them */
+	if(reshard_copy(h->metadb[i], "heal", db, shards, -1, i % shards, shards) ||
+	   reshard_copy(h->metadb[i], "hash_retry", db, shards, -1, i % shards, shards) ||
+	   reshard_copy(h->metadb[i], "heal_volume", db, shards, -1, i % common, common))
+	    goto reshard_meta_fail;
+    }
+
+    for(k=0; k<shards; k++) {
+	if(shards < h->metadbs) {
+	    /* Merged cursors: keep the least advanced one */
+	    if(qprep(db[k], &qdedup, "DELETE FROM heal_volume WHERE rowid NOT IN (SELECT rowid FROM heal_volume AS a WHERE min_revision = (SELECT MIN(min_revision) FROM heal_volume AS b WHERE b.name = a.name) GROUP BY name)") ||
+	       qstep_noret(qdedup))
+		goto reshard_meta_fail;
+	    qnullify(qdedup);
+	}
+	qnullify(qins[k]);
+	qnullify(qinsmeta[k]);
+	qnullify(qinsreloc[k]);
+	qnullify(qinschunk[k]);
+	if(listsums_rebuild(db[k]))
+	    goto reshard_meta_fail;
+	/* The directory index is per db: it is rebuilt if it was complete,
+	 * otherwise 'sxadm node --dir-index' is still needed */
+	if(h->dir_index_all && dirs_rebuild(db[k]))
+	    goto reshard_meta_fail;
+	if(qcommit(db[k]))
+	    goto reshard_meta_fail;
+	qclose(&db[k]);
+    }
+    ret = OK;
+
+ reshard_meta_fail:
+    sqlite3_finalize(qsel);
+    sqlite3_finalize(qselmeta);
+    sqlite3_finalize(qselreloc);
+    sqlite3_finalize(qselchunk);
+    sqlite3_finalize(qdedup);
+    for(k=0; k<shards; k++) {
+	sqlite3_finalize(qins[k]);
+	sqlite3_finalize(qinsmeta[k]);
+	sqlite3_finalize(qinsreloc[k]);
+	sqlite3_finalize(qinschunk[k]);
+	if(db[k]) {
+	    qrollback(db[k]);
+	    qclose(&db[k]);
+	}
+    }
+    return ret;
+}
+
+static rc_ty reshard_hash(sx_hashfs_t *h, unsigned int hs, unsigned int shards, char *path) {
+    sqlite3_stmt *qsel = NULL, *qins[HASHDBS_MAX], *qset[HASHDBS_MAX];
+    unsigned int i, k, common = MIN(shards, h->hashdbs);
+    int64_t next[HASHDBS_MAX];
+    sxi_db_t *db[HASHDBS_MAX];
+    int fd[HASHDBS_MAX], r;
+    char dbitem[64];
+    rc_ty ret = FAIL_EINTERNAL;
+
+    memset(qins, 0, sizeof(qins));
+    memset(qset, 0, sizeof(qset));
+    memset(db, 0, sizeof(db));
+    for(k=0; k<shards; k++)
+	fd[k] = -1;
+    for(k=0; k<shards; k++) {
+	sprintf(path, "%s/h%c%08x-%u.db", h->dir, sizedirs[hs], k, shards);
+	sprintf(dbitem, "hashdb_%c_%08x", sizedirs[hs], k);
+	if(!(db[k] = reshard_create_db(h, h->datadb[hs][0], path, dbitem, &qset[k])) ||
+	   qbind_text(qset[k], ":k", "block_size") || qbind_int(qset[k], ":v", bsz[hs]) || qstep_noret(qset[k]) ||
+	   qprep(db[k], &qins[k], "INSERT INTO blocks (hash, blockno, clen, created_at) VALUES (:hash, :blockno, :clen, :created_at)"))
+	    goto reshard_hash_fail;
+	next[k] = 1;
+
+	sprintf(path, "%s/h%c%08x-%u.bin", datafile_dir(h, hs), sizedirs[hs], k, shards);
+	fd[k] = creat(path, 0666);
+	if(fd[k] < 0) {
+	    PCRIT("Cannot create data file %s", path);
+	    goto reshard_hash_fail;
+	}
+	memset(h->blockbuf, 0, bsz[hs]);
+	sprintf((char *)h->blockbuf, "%-16sdatafile_%c_%08x             %08x", HASHFS_VERSION_CURRENT, sizedirs[hs], k, bsz[hs]);
+	memcpy(h->blockbuf + 64, h->cluster_uuid.binary, sizeof(h->cluster_uuid.binary));
+	if(write_block(fd[k], h->blockbuf, 0, bsz[hs]))
+	    goto reshard_hash_fail;
+    }
+
+    for(i=0; i<h->hashdbs; i++) {
+	INFO("Redistributing %s db #%u", sizelongnames[hs], i);
+	/* Blocks are appended in the order they appear in the source
+	 * datafile, which leaves the new datafiles without holes */
+	if(qprep(h->datadb[hs][i], &qsel, "SELECT hash, blockno, created_at, clen FROM blocks ORDER BY blockno"))
+	    goto reshard_hash_fail;
+	while((r = qstep(qsel)) == SQLITE_ROW) {
+	    const void *hash = sqlite3_column_blob(qsel, 0);
+	    int64_t blockno = sqlite3_column_int64(qsel, 1);
+	    unsigned int clen = sqlite3_column_int(qsel, 3);
+
+	    if(!hash || sqlite3_column_bytes(qsel, 0) != sizeof(sx_hash_t)) {
+		WARN("Bad hash in %s db #%u", sizelongnames[hs], i);
+		goto reshard_hash_fail;
+	    }
+	    k = gethashdb(hash, shards);
+	    if(copy_slot(h->datafd[hs][i], blockno * bsz[hs], fd[k], next[k] * bsz[hs], bsz[hs], clen, h->blockbuf))
+		goto reshard_hash_fail;
+	    sqlite3_reset(qins[k]);
+	    if(qbind_blob(qins[k], ":hash", hash, sizeof(sx_hash_t)) ||
+	       qbind_int64(qins[k], ":blockno", next[k]) ||
+	       sqlite3_bind_value(qins[k], sqlite3_bind_parameter_index(qins[k], ":clen"), sqlite3_column_value(qsel, 3)) ||
+	       sqlite3_bind_value(qins[k], sqlite3_bind_parameter_index(qins[k], ":created_at"), sqlite3_column_value(qsel, 2)) ||
+	       qstep_noret(qins[k]))
+		goto reshard_hash_fail;
+	    next[k]++;
+	}
+	if(r != SQLITE_DONE)
+	    goto reshard_hash_fail;
+	qnullify(qsel);
+
+	/* Revision ops and reservations are not tied to a specific block:
+	 * they are carried over to every shard the source one overlaps */
+	if(reshard_copy(h->datadb[hs][i], "revision_blocks", db, shards, 1, 0, 1) ||
+	   reshard_copy(h->datadb[hs][i], "revision_ops", db, shards, -1, i % common, common) ||
+	   reshard_copy(h->datadb[hs][i], "reservations", db, shards, -1, i % common, common))
+	    goto reshard_hash_fail;
+    }
+
+    for(k=0; k<shards; k++) {
+	sqlite3_reset(qset[k]);
+	if(qbind_text(qset[k], ":k", "next_blockno") || qbind_int64(qset[k], ":v", next[k]) || qstep_noret(qset[k]))
+	    goto reshard_hash_fail;
+	qnullify(qset[k]);
+	qnullify(qins[k]);
+	if(fdatasync(fd[k]) || close(fd[k])) {
+	    fd[k] = -1;
+	    PCRIT("Failed to flush %s datafile #%u to disk", sizelongnames[hs], k);
+	    goto reshard_hash_fail;
+	}
+	fd[k] = -1;
+	if(qcommit(db[k]))
+	    goto reshard_hash_fail;
+	qclose(&db[k]);
+    }
+    ret = OK;
+
+ reshard_hash_fail:
+    sqlite3_finalize(qsel);
+    for(k=0; k<shards; k++) {
+	sqlite3_finalize(qins[k]);
+	sqlite3_finalize(qset[k]);
+	if(fd[k] >= 0)
+	    close(fd[k]);
+	if(db[k]) {
+	    qrollback(db[k]);
+	    qclose(&db[k]);
+	}
+    }
+    return ret;
+}
+
+rc_ty sx_hashfs_reshard(sx_hashfs_t *h, unsigned int shards) {
+    unsigned int i, j, nold = 0, oldmeta, oldhash, dirlen;
+    sqlite3_stmt *qset = NULL, *qdel = NULL;
+    char **oldfiles = NULL, *path = NULL, dbitem[64];
+    rc_ty ret = FAIL_EINTERNAL;
+    int built = 0, intrans = 0;
+    struct flock fl;
+
+    if(!h) {
+	NULLARG();
+	return EFAULT;
+    }
+    if(!sx_storage_valid_shards(shards)) {
+	msg_set_reason("Invalid number of shards %u", shards);
+	return EINVAL;
+    }
+
+    fl.l_start = 0;
+    fl.l_len = 0;
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if(fcntl(h->lockfd, F_SETLK, &fl) == -1) { /* Upgrade to write lock */
+	if(errno == EAGAIN || errno == EACCES)
+	    CHECK_FATAL("In order to reshard the databases the storage must not be used. Please stop this node and try again.");
+	else
+	    CHECK_FATAL("Failed to lock HashFS storage: %s", strerror(errno));
+	return FAIL_EINTERNAL;
+    }
+
+    oldmeta = h->metadbs;
+    oldhash = h->hashdbs;
+    if(oldmeta == shards && oldhash == shards) {
+	INFO("The storage already has %u shards", shards);
+	ret = OK;
+	goto reshard_fail;
+    }
+
+    /* Long enough for the paths of all the new files */
+    dirlen = strlen(h->dir);
+    for(j=0; j<SIZES; j++)
+	if(h->datadir[j] && strlen(h->datadir[j]) > dirlen)
+	    dirlen = strlen(h->datadir[j]);
+    if(!(path = wrap_malloc(dirlen + 64)) ||
+       !(oldfiles = wrap_calloc(oldmeta + oldhash * SIZES * 3, sizeof(*oldfiles))))
+	goto reshard_fail;
+
+    /* Collect the files to drop once the new ones are in place */
+    for(i=0; i<oldmeta + oldhash * SIZES; i++) {
+	const char *str;
+
+	if(i < oldmeta)
+	    sprintf(dbitem, "metadb_%08x", i);
+	else
+	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[(i - oldmeta) / oldhash], (i - oldmeta) % oldhash);
+	sqlite3_reset(h->q_getval);
+	if(qbind_text(h->q_getval, ":k", dbitem) || qstep_ret(h->q_getval))
+	    goto reshard_fail;
+	str = (const char *)sqlite3_column_text(h->q_getval, 0);
+	if(!str || !*str)
+	    goto reshard_fail;
+	if(!(oldfiles[nold] = wrap_malloc(dirlen + strlen(str) + 2)))
+	    goto reshard_fail;
+	if(*str == '/')
+	    strcpy(oldfiles[nold], str);
+	else
+	    sprintf(oldfiles[nold], "%s/%s", h->dir, str);
+	nold++;
+	sqlite3_reset(h->q_getval);
+    }
+    for(j=0; j<SIZES; j++) {
+	for(i=0; i<oldhash; i++) {
+	    unsigned int len = strlen(h->datapath[j][i]);
+	    if(!(oldfiles[nold++] = wrap_strdup(h->datapath[j][i])) ||
+	       !(oldfiles[nold] = wrap_malloc(len + sizeof(".idx"))))
+		goto reshard_fail;
+	    memcpy(oldfiles[nold], h->datapath[j][i], len + 1);
+	    if(len > 4 && !strcmp(oldfiles[nold] + len - 4, ".bin"))
+		len -= 4;
+	    strcpy(oldfiles[nold++] + len, ".idx");
+	}
+    }
+
+    INFO("Redistributing %u file and %u block databases over %u shards each", oldmeta, oldhash, shards);
+    built = 1;
+    if(reshard_meta(h, shards, path) != OK)
+	goto reshard_fail;
+    for(j=0; j<SIZES; j++)
+	if(reshard_hash(h, j, shards, path) != OK)
+	    goto reshard_fail;
+    sync();
+
+    /* Switch over */
+    if(qprep(h->db, &qset, "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k, :v)") ||
+       qprep(h->db, &qdel, "DELETE FROM hashfs WHERE key = :k") ||
+       qbegin(h->db))
+	goto reshard_fail;
+    intrans = 1;
+    for(i=0; i<MAX(shards, MAX(oldmeta, oldhash)); i++) {
+	sqlite3_stmt *q = i < shards ? qset : qdel;
+
+	sprintf(dbitem, "metadb_%08x", i);
+	sprintf(path, "f%08x-%u.db", i, shards);
+	sqlite3_reset(q);
+	if(qbind_text(q, ":k", dbitem) || (q == qset && qbind_text(q, ":v", path)) || qstep_noret(q))
+	    goto reshard_fail;
+	for(j=0; j<SIZES; j++) {
+	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
+	    sprintf(path, "h%c%08x-%u.db", sizedirs[j], i, shards);
+	    sqlite3_reset(q);
+	    if(qbind_text(q, ":k", dbitem) || (q == qset && qbind_text(q, ":v", path)) || qstep_noret(q))
+		goto reshard_fail;
+	    sprintf(dbitem, "datafile_%c_%08x", sizedirs[j], i);
+	    if(h->datadir[j])
+		sprintf(path, "%s/h%c%08x-%u.bin", h->datadir[j], sizedirs[j], i, shards);
+	    else
+		sprintf(path, "h%c%08x-%u.bin", sizedirs[j], i, shards);
+	    sqlite3_reset(q);
+	    if(qbind_text(q, ":k", dbitem) || (q == qset && qbind_text(q, ":v", path)) || qstep_noret(q))
+		goto reshard_fail;
+	}
+    }
+    sqlite3_reset(qset);
+    if(qbind_text(qset, ":k", "metadbs") || qbind_int(qset, ":v", shards) || qstep_noret(qset))
+	goto reshard_fail;
+    sqlite3_reset(qset);
+    if(qbind_text(qset, ":k", "hashdbs") || qbind_int(qset, ":v", shards) || qstep_noret(qset))
+	goto reshard_fail;
+    intrans = 0;
+    if(qcommit(h->db))
+	goto reshard_fail;
+    built = 0;
+
+    /* The old databases are still open: they are removed when the handle,
+     * which must not be used any further, is closed */
+    h->dropfiles = oldfiles;
+    h->ndropfiles = nold;
+    oldfiles = NULL;
+    INFO("The storage now has %u file and block databases", shards);
+    ret = OK;
+
+ reshard_fail:
+    if(intrans)
+	qrollback(h->db);
+    sqlite3_finalize(qset);
+    sqlite3_finalize(qdel);
+    if(built)
+	reshard_remove_new(h, shards, dirlen + 64);
+    if(oldfiles) {
+	for(i=0; i<oldmeta + oldhash * SIZES * 3; i++)
+	    free(oldfiles[i]);
+	free(oldfiles);
+    }
+    free(path);
+
+    fl.l_type = F_RDLCK; /* Downgrade to read lock */
+    if(fcntl(h->lockfd, F_SETLK, &fl) == -1) {
+	CHECK_FATAL("Failed to release HashFS lock: %s", strerror(errno));
+	ret = FAIL_EINTERNAL;
+    }
+    return ret;
+}
+
+
 // ACAB: think of a less retarded name
 rc_ty sx_hashfs_new_home_for_old_block(sx_hashfs_t *h, const sx_hash_t *block, const sx_node_t **target) {
     const sx_node_t *self;
@@ -20428,7 +24671,7 @@ int sx_hashfs_incore(sx_hashfs_t *h, float *data_resident, float *other_resident
         return 1;
     int64_t data_incore = 0, data_pages = 0;
     for(j=0; j<SIZES; j++) {
-        for(i=0; i<HASHDBS; i++)
+        for(i=0; i<h->hashdbs; i++)
             if (qincore(h->datadb[j][i], &data_incore, &data_pages))
                 return 1;
     }
@@ -20437,7 +24680,7 @@ int sx_hashfs_incore(sx_hashfs_t *h, float *data_resident, float *other_resident
         qincore(h->tempdb, &other_incore, &other_pages) ||
         qincore(h->xferdb, &other_incore, &other_pages))
         return 1;
-    for(j=0; j<METADBS;j++) {
+    for(j=0; j<h->metadbs;j++) {
         if (qincore(h->metadb[j], &other_incore, &other_pages))
             return 1;
     }
@@ -20464,13 +24707,13 @@ void sx_hashfs_warm_cache(sx_hashfs_t *h)
         return;
     sx_hashfs_incore(h, NULL, NULL);
     for(j=0; j<SIZES; j++) {
-        for(i=0; i<HASHDBS; i++)
+        for(i=0; i<h->hashdbs; i++)
             qreadahead(h->datadb[j][i]);
     }
     qreadahead(h->eventdb);
     qreadahead(h->tempdb);
     qreadahead(h->xferdb);
-    for(j=0; j<METADBS;j++) {
+    for(j=0; j<h->metadbs;j++) {
         qreadahead(h->metadb[j]);
     }
     qreadahead(h->hbeatdb);
@@ -20483,7 +24726,7 @@ int sx_hashfs_vacuum(sx_hashfs_t *h)
     unsigned i,j;
     sx_hashfs_incore(h, NULL, NULL);
     for(j=0; j<SIZES; j++) {
-        for(i=0; i<HASHDBS; i++) {
+        for(i=0; i<h->hashdbs; i++) {
             if (qvacuum(h->datadb[j][i]))
                 return 1;
         }
@@ -20492,7 +24735,7 @@ int sx_hashfs_vacuum(sx_hashfs_t *h)
         qvacuum(h->tempdb) ||
         qvacuum(h->xferdb))
         return 1;
-    for(j=0; j<METADBS;j++) {
+    for(j=0; j<h->metadbs;j++) {
         if (qvacuum(h->metadb[j]))
             return 1;
     }
@@ -20502,6 +24745,47 @@ int sx_hashfs_vacuum(sx_hashfs_t *h)
     return 0;
 }
 
+rc_ty sx_hashfs_dir_index_build(sx_hashfs_t *h) {
+    sqlite3_stmt *q = NULL;
+    unsigned int i;
+    int r;
+
+    for(i=0; i<h->metadbs; i++) {
+	INFO("Building the directory index of file db #%u", i);
+	if(qbegin(h->metadb[i]))
+	    return FAIL_EINTERNAL;
+	h->dir_index[i] = 1;
+	if(qprep(h->metadb[i], &q, "UPDATE files SET depth = length(name) - length(replace(name, '/', '')) WHERE depth IS NULL") || qstep_noret(q))
+	    goto dir_index_build_fail;
+	qnullify(q);
+	if(qprep(h->metadb[i], &q, "DELETE FROM dirs") || qstep_noret(q))
+	    goto dir_index_build_fail;
+	qnullify(q);
+	if(qprep(h->metadb[i], &q, "SELECT volume_id, name, MAX(rev) FROM files WHERE age >= 0 GROUP BY volume_id, name")) /* SLOWQ */
+	    goto dir_index_build_fail;
+	while((r = qstep(q)) == SQLITE_ROW) {
+	    const char *name = (const char *)sqlite3_column_text(q, 1);
+	    const char *rev = (const char *)sqlite3_column_text(q, 2);
+	    if(!name || !rev || dirs_walk(qlazy(h, h->qm_dirs_add[i]), qlazy(h, h->qm_dirs_upd[i]), NULL, sqlite3_column_int64(q, 0), name, 1, rev))
+		goto dir_index_build_fail;
+	}
+	if(r != SQLITE_DONE)
+	    goto dir_index_build_fail;
+	qnullify(q);
+	if(dirs_enable(h->metadb[i]) || qcommit(h->metadb[i]))
+	    goto dir_index_build_fail;
+    }
+    h->dir_index_all = 1;
+    return OK;
+
+ dir_index_build_fail:
+    WARN("Failed to build the directory index of file db #%u", i);
+    qnullify(q);
+    qrollback(h->metadb[i]);
+    h->dir_index[i] = 0;
+    return FAIL_EINTERNAL;
+}
+
 int sx_hashfs_blob_to_sxc_meta(sxc_client_t *sx, sx_blob_t *b, sxc_meta_t **meta, int skip) {
     int nmeta, i, ret = -1;
     if(!b || !meta)
@@ -20600,6 +24884,7 @@ rc_ty sx_hashfs_modify_volume_replica(sx_hashfs_t *h, const sx_hashfs_volume_t *
         return EINVAL;
     }
 
+    cluster_gen_touch(h, GEN_LOOKUP);
     q = h->q_modreplica;
     sqlite3_reset(q);
 
@@ -20698,6 +24983,7 @@ rc_ty sx_hashfs_force_volumes_replica_unlock(sx_hashfs_t* h) {
     sqlite3_stmt *q;
 
     DEBUG("Forcibly unlocking volume replica limits");
+    cluster_gen_touch(h, GEN_LOOKUP);
     if(qprep(h->db, &q, "UPDATE volumes SET prev_replica = MIN(prev_replica,replica), replica = MIN(prev_replica,replica) WHERE prev_replica <> replica") || /* SLOWQ */
        qstep_noret(q)) {
         qnullify(q);
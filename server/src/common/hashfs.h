@@ -41,8 +41,12 @@
 #define REV_TIME_LEN lenof("YYYY-MM-DD hh:mm:ss.sss")
 #define REV_LEN (REV_TIME_LEN + 1 + TOKEN_RAND_BYTES * 2)
 
-/* Number of fds required to open the databases */
-#define MAX_FDS 1024
+/* Number of fds required to open the databases with the largest shard count */
+#define MAX_FDS 8192
+
+/* Number of metadata and block databases, chosen when the storage is created */
+#define SX_DB_SHARDS_DEFAULT 16
+#define SX_DB_SHARDS_MAX 256
 
 /* various constants, see bug #335, all times in seconds */
 /* FIXME: find a better place, make admin settable */
@@ -77,7 +81,9 @@ typedef enum {
 typedef int64_t sx_uid_t;
 
 /* HashFS main actions */
-rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size);
+int sx_storage_valid_shards(unsigned int shards);
+/* layout is NULL or "CLASS:DIR[,CLASS:DIR]...", see sx_hashfs_size_name() */
+rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size, unsigned int shards, const char *layout);
 rc_ty sx_storage_upgrade(const char *dir);
 typedef struct _sx_hashfs_t sx_hashfs_t;
 int sx_hashfs_is_upgrading(sx_hashfs_t *h);
@@ -109,6 +115,14 @@ sx_nodelist_t *sx_hashfs_all_hashnodes(sx_hashfs_t *h, sx_hashfs_nl_t which, con
 sx_nodelist_t *sx_hashfs_putfile_hashnodes(sx_hashfs_t *h, const sx_hash_t *hash);
 rc_ty sx_hashfs_check_blocksize(unsigned int bs);
 int64_t sx_hashfs_growable_filesize(void);
+/* The block size new files of the given size are stored with */
+unsigned int sx_hashfs_blocksize(int64_t size);
+/* The block size classes, ordered by block size */
+unsigned int sx_hashfs_nsizes(void);
+unsigned int sx_hashfs_size_blocksize(unsigned int hs);
+const char *sx_hashfs_size_name(unsigned int hs);
+/* Directory holding the datafiles of a size class */
+const char *sx_hashfs_size_datadir(sx_hashfs_t *h, unsigned int hs);
 int sx_hashfs_distcheck(sx_hashfs_t *h);
 time_t sx_hashfs_disttime(sx_hashfs_t *h);
 sxi_db_t *sx_hashfs_eventdb(sx_hashfs_t *h);
@@ -117,6 +131,8 @@ sxi_db_t *sx_hashfs_hbeatdb(sx_hashfs_t *h);
 sxc_client_t *sx_hashfs_client(sx_hashfs_t *h);
 sxi_conns_t *sx_hashfs_conns(sx_hashfs_t *h);
 int sx_hashfs_hash_buf(const void *salt, unsigned int salt_len, const void *buf, unsigned int buf_len, sx_hash_t *hash);
+/* Hashes nbufs buffers of buf_len bytes stored back to back at data */
+int sx_hashfs_hash_bufs(const void *salt, unsigned int salt_len, const uint8_t *data, unsigned int nbufs, unsigned int buf_len, sx_hash_t *hashes);
 
 typedef struct _sx_hash_challenge_t {
     uint8_t challenge[TOKEN_RAND_BYTES];
@@ -253,6 +269,8 @@ rc_ty sx_hashfs_list_clones_next(sx_hashfs_t *h);
 
 rc_ty sx_hashfs_volume_first(sx_hashfs_t *h, const sx_hashfs_volume_t **volume, const uint8_t *uid);
 rc_ty sx_hashfs_volume_next(sx_hashfs_t *h);
+/* Iterate the volumes whose size changed at or after since, use sx_hashfs_volume_next() for the next ones */
+rc_ty sx_hashfs_volume_changed_first(sx_hashfs_t *h, const sx_hashfs_volume_t **volume, int64_t since);
 rc_ty sx_hashfs_volume_by_name(sx_hashfs_t *h, const char *name, const sx_hashfs_volume_t **volume);
 rc_ty sx_hashfs_volume_by_id(sx_hashfs_t *h, int64_t id, const sx_hashfs_volume_t **volume);
 rc_ty sx_hashfs_volume_by_global_id(sx_hashfs_t *h, const sx_hash_t *global_id, const sx_hashfs_volume_t **volume);
@@ -275,8 +293,17 @@ rc_ty sx_hashfs_modify_volume_replica_job(sx_hashfs_t *h, sx_uid_t uid, const sx
 
 /* Retrieve timestamp used to compute intervals of volumes pushing */
 struct timeval* sx_hashfs_volsizes_timestamp(sx_hashfs_t *h);
-/* Update push time for particular node */
-rc_ty sx_hashfs_update_node_push_time(sx_hashfs_t *h, const sx_node_t *n);
+/* Return 0 if nothing changed since the last call to sx_hashfs_volsizes_clean() */
+int sx_hashfs_volsizes_changed(sx_hashfs_t *h);
+/* Mark the state seen by the last sx_hashfs_volsizes_changed() call as fully pushed */
+void sx_hashfs_volsizes_clean(sx_hashfs_t *h);
+/* Wrap several sx_hashfs_reset_volume_cursize() calls in a single transaction */
+rc_ty sx_hashfs_volsizes_begin(sx_hashfs_t *h);
+rc_ty sx_hashfs_volsizes_commit(sx_hashfs_t *h);
+void sx_hashfs_volsizes_rollback(sx_hashfs_t *h);
+/* Update push time for particular node: volumes changed at or after push_time
+ * will be pushed to it again */
+rc_ty sx_hashfs_update_node_push_time(sx_hashfs_t *h, const sx_node_t *n, int64_t push_time);
 /* Check if given volume is not owned by given node and it is not owned by this node */
 int sx_hashfs_is_volume_to_push(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const sx_node_t *node);
 /* Return time of last push performed to given node */
@@ -306,6 +333,7 @@ typedef struct _sx_hashfs_file_t {
     char name[SXLIMIT_MAX_FILENAME_LEN+2];
     char revision[REV_LEN+1];
     sx_hash_t revision_id;
+    int64_t dir_files; /* Files below a fake dir, -1 if unknown */
 } sx_hashfs_file_t;
 rc_ty sx_hashfs_list_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *pattern, const sx_hashfs_file_t **file, int recurse, const char *after, int escape);
 rc_ty sx_hashfs_list_next(sx_hashfs_t *h);
@@ -323,6 +351,7 @@ rc_ty sx_hashfs_file_find(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
 /* File get */
 rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *filename, const char *revision, sx_hashfs_file_t *filedata, sx_hash_t *etag);
 uint64_t sx_hashfs_getfile_count(sx_hashfs_t *h);
+void sx_hashfs_getfile_range(sx_hashfs_t *h, uint64_t first, uint64_t count);
 rc_ty sx_hashfs_getfile_block(sx_hashfs_t *h, const sx_hash_t **hash, sx_nodelist_t **nodes);
 void sx_hashfs_getfile_end(sx_hashfs_t *h);
 
@@ -332,6 +361,21 @@ rc_ty sx_hashfs_getfilemeta_next(sx_hashfs_t *h, const char **key, const void **
 /* Block xfer */
 rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, const uint8_t **block);
 rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, sx_uid_t uid);
+/* Stores nblocks consecutive blocks with a single commit per datadb shard */
+rc_ty sx_hashfs_block_put_many(sx_hashfs_t *h, const uint8_t *data, unsigned int nblocks, unsigned int bs, unsigned int replica_count, sx_uid_t uid);
+
+/* Batched block xfer: hashes are resolved once, shard by shard, and the blocks
+ * are then read in datafile order into buf (block i at offset i * bs) */
+typedef struct _sx_hashfs_blockloc_t {
+    unsigned int ndb;
+    unsigned int clen; /* Stored length if compressed, 0 if raw */
+    uint64_t blockno;
+} sx_hashfs_blockloc_t;
+rc_ty sx_hashfs_block_locate_many(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hashes, unsigned int nhashes, sx_hashfs_blockloc_t *locs, unsigned int *missing);
+rc_ty sx_hashfs_block_read_many(sx_hashfs_t *h, unsigned int bs, const sx_hashfs_blockloc_t *locs, unsigned int nlocs, uint8_t *buf);
+rc_ty sx_hashfs_block_get_many(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hashes, unsigned int nhashes, uint8_t *buf, unsigned int *missing);
+/* Absolute path of the datafile holding blocks of size bs in shard ndb */
+const char *sx_hashfs_block_datafile(sx_hashfs_t *h, unsigned int bs, unsigned int ndb);
 
 /* hash batch ops for GC */
 rc_ty sx_hashfs_hashop_perform(sx_hashfs_t *h, unsigned int block_size, unsigned replica_count, enum sxi_hashop_kind kind, const sx_hash_t *hash, const sx_hash_t *global_vol_id, const sx_hash_t *reserve_id, const sx_hash_t *revision_id, uint64_t op_expires_at, int *present);
@@ -374,11 +418,11 @@ typedef struct _sx_hashfs_tmpinfo_t {
     int64_t file_size;
     int64_t tmpfile_id;
     const sx_nodelist_t *allnodes; /* The ordered list of nodes to which the nidx's refer to */
-    sx_hash_t *all_blocks; /* All unsorted blocks - nblocks items */
+    sx_hash_t *all_blocks; /* All unsorted blocks (TMPINFO_BLOCKS) or the blocks being checked (TMPINFO_CHECK) - nall items */
     unsigned int *uniq_ids; /* Unique block index (from all_blocks) - nuniq items */
-    unsigned int *nidxs; /* Unique block node index (parallel to all_blocks) - nblocks * replica_count items */
-    int8_t *avlblty; /* Block availablity (-1 = unavail, 0 = unchecked, 1 = avail, 2 = xferd) flag index (parallel to all_blocks) - nblocks * replica_count items */
-    unsigned int nall; /* Number of blocks */
+    unsigned int *nidxs; /* Unique block node index (parallel to all_blocks) - nall * replica_count items */
+    int8_t *avlblty; /* Block availablity (-1 = unavail, 0 = unchecked, 1 = avail, 2 = xferd) flag index (parallel to all_blocks) - nall * replica_count items */
+    unsigned int nall; /* Number of blocks in all_blocks */
     unsigned int nuniq; /* Number of unique blocks */
     unsigned int block_size; /* Block size */
     unsigned int replica_count; /* Replica count */
@@ -389,7 +433,13 @@ typedef struct _sx_hashfs_tmpinfo_t {
     int somestatechanged;
 } sx_hashfs_tmpinfo_t;
 rc_ty sx_hashfs_tmp_getmeta(sx_hashfs_t *h, int64_t tmpfile_id, sxc_meta_t *metadata);
-rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinfo_t **tmpinfo, int recheck_presence);
+typedef enum {
+    TMPINFO_HEAD, /* File details only, no blocks are loaded */
+    TMPINFO_BLOCKS, /* Also load the full list of blocks */
+    TMPINFO_CHECK /* Presence check the next batch of incomplete unique blocks;
+		   * returns EINPROGRESS until a batch covers all of them */
+} sx_hashfs_tmpinfo_mode_t;
+rc_ty sx_hashfs_tmp_getinfo(sx_hashfs_t *h, int64_t tmpfile_id, sx_hashfs_tmpinfo_t **tmpinfo, sx_hashfs_tmpinfo_mode_t mode);
 
 rc_ty sx_hashfs_getinfo_by_revision(sx_hashfs_t *h, const char *revision, sx_hashfs_file_t *filerev);
 rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing);
@@ -399,10 +449,15 @@ rc_ty sx_hashfs_revunbump(sx_hashfs_t *h, const sx_hash_t *revid, unsigned int b
 
 /* File delete */
 rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *file, const char *revision);
+rc_ty sx_hashfs_file_delete_range(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *pattern, const char *maxtime, unsigned int limit, unsigned int *deleted);
 rc_ty sx_hashfs_filedelete_job(sx_hashfs_t *h, sx_uid_t user_id, const sx_hashfs_volume_t *vol, const char *name, const char *revision, job_t *job_id);
 
 /* File rename */
 rc_ty sx_hashfs_file_rename(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const struct timeval *tv, const char *oldname, const char *revision, const char *newname);
+typedef struct {
+    const char *oldname, *revision, *newname;
+} sx_hashfs_rename_t;
+rc_ty sx_hashfs_file_rename_batch(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const struct timeval *tv, const sx_hashfs_rename_t *renames, unsigned int count);
 
 /* Create and schedule mass jobs */
 rc_ty sx_hashfs_mass_job_new(sx_hashfs_t *h, sx_uid_t user_id, job_t *job_id, jobtype_t slave_job_type, unsigned int slave_job_timeout, const char *slave_job_lockname, const void *slave_job_data, unsigned int slave_job_data_len, const sx_nodelist_t *targets);
@@ -622,6 +677,13 @@ void sx_hashfs_syncglobs_abort(sx_hashfs_t *h);
 rc_ty sx_hashfs_syncglobs_end(sx_hashfs_t *h);
 
 rc_ty sx_hashfs_compact(sx_hashfs_t *h, int64_t *bytes_freed);
+/* Returns the datafile slots freed by the GC to the freelist after their grace
+ * period and, unless disabled, runs an incremental datafile compaction; safe
+ * to run while the node is serving */
+rc_ty sx_hashfs_compact_online(sx_hashfs_t *h, int *terminate);
+/* Offline redistribution of the file and block databases over a new number
+ * of shards; the handle must be closed right after */
+rc_ty sx_hashfs_reshard(sx_hashfs_t *h, unsigned int shards);
 rc_ty sx_hashfs_new_home_for_old_block(sx_hashfs_t *h, const sx_hash_t *block, const sx_node_t **target);
 
 /* RAFT implementation ops */
@@ -718,9 +780,15 @@ void sx_hashfs_raft_state_empty(sx_hashfs_t *h, sx_raft_state_t *state);
 
 void sx_hashfs_warm_cache(sx_hashfs_t *h);
 int sx_hashfs_vacuum(sx_hashfs_t *h);
+/* Rebuilds the directory index used by non recursive listings from the
+ * files table, to be run with the node stopped */
+rc_ty sx_hashfs_dir_index_build(sx_hashfs_t *h);
 int sx_hashfs_incore(sx_hashfs_t *h, float *data_incore, float *other_incore);
 
 rc_ty sx_hashfs_stats_jobq(sx_hashfs_t *h, int64_t *sysjobs, int64_t *userjobs);
 rc_ty sx_hashfs_stats_blockq(sx_hashfs_t *h, const sx_uuid_t *dest, int64_t *ready, int64_t *held, int64_t *unbumps);
+rc_ty sx_hashfs_stats_blockidx(sx_hashfs_t *h, int64_t *bloom_neg, int64_t *bloom_fp);
+/* Time taken by sx_hashfs_open() and number of lazy statements prepared out of the total */
+rc_ty sx_hashfs_stats_startup(sx_hashfs_t *h, double *open_time, int64_t *prepared, int64_t *lazy);
 
 #endif
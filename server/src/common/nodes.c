@@ -30,6 +30,7 @@
 #include <stdlib.h>
 
 #include "nodes.h"
+#include "arena.h"
 #include "log.h"
 #include "../libsxclient/src/hostlist.h"
 
@@ -38,10 +39,12 @@ struct _sx_node_t {
     char *addr;
     char *int_addr;
     int64_t capacity;
+    int in_arena;
 };
 
 sx_node_t *sx_node_new(const sx_uuid_t *id, const char *addr, const char *internal_addr, int64_t capacity) {
     unsigned int addrlen, iaddrlen;
+    sx_arena_t *arena = sx_arena_current();
     sx_node_t *node;
 
     if(capacity <= 0) {
@@ -70,15 +73,20 @@ sx_node_t *sx_node_new(const sx_uuid_t *id, const char *addr, const char *intern
     } else
 	iaddrlen = 0;
 
-    if(!(node = wrap_malloc(sizeof(*node) + addrlen + iaddrlen))) {
+    if(arena)
+	node = sx_arena_alloc(arena, sizeof(*node) + addrlen + iaddrlen);
+    else
+	node = wrap_malloc(sizeof(*node) + addrlen + iaddrlen);
+    if(!node) {
 	PWARN("Failed to create new node");
 	return NULL;
     }
+    node->in_arena = arena != NULL;
 
     if(id)
 	memcpy(&node->id, id, sizeof(*id));
     else if (uuid_generate(&node->id)) {
-        free(node);
+        sx_node_delete(node);
         return NULL;
     }
     node->addr = (char *)(node+1);
@@ -102,7 +110,8 @@ sx_node_t *sx_node_dup(const sx_node_t *node) {
 }
 
 void sx_node_delete(sx_node_t *node) {
-    free(node);
+    if(node && !node->in_arena)
+	free(node);
 }
 
 const sx_uuid_t *sx_node_uuid(const sx_node_t *node) {
@@ -157,14 +166,17 @@ struct _sx_nodelist_t {
     sx_node_t **nodes;
     unsigned int capacity;
     unsigned int items;
+    sx_arena_t *arena; /* Owns the list, its nodes array and its nodes */
 };
 
 sx_nodelist_t *sx_nodelist_new(void) {
-    sx_nodelist_t *list = wrap_malloc(sizeof(*list));
+    sx_arena_t *arena = sx_arena_current();
+    sx_nodelist_t *list = arena ? sx_arena_alloc(arena, sizeof(*list)) : wrap_malloc(sizeof(*list));
     if(!list) {
 	PWARN("Cannot create new node list");
 	return NULL;
     }
+    list->arena = arena;
     list->nodes = NULL;
     list->capacity = 0;
     list->items = 0;
@@ -289,7 +301,9 @@ rc_ty sx_nodelist_add(sx_nodelist_t *list, sx_node_t *node) {
     }
 
     if(list->capacity == list->items) {
-	sx_node_t **newnodes = wrap_realloc(list->nodes, sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS));
+	sx_node_t **newnodes = list->arena ?
+	    sx_arena_realloc(list->arena, list->nodes, sizeof(sx_node_t *) * list->capacity, sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS)) :
+	    wrap_realloc(list->nodes, sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS));
 	if(!newnodes) {
 	    PWARN("Failed to grow nodelist to %u entries", (list->capacity + NODELIST_ALLOC_ITEMS));
 	    sx_node_delete(node);
@@ -336,7 +350,9 @@ rc_ty sx_nodelist_prepend(sx_nodelist_t *list, sx_node_t *node) {
     }
 
     if(list->capacity == list->items) {
-	sx_node_t **newnodes = wrap_malloc(sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS));
+	sx_node_t **newnodes = list->arena ?
+	    sx_arena_alloc(list->arena, sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS)) :
+	    wrap_malloc(sizeof(sx_node_t *) * (list->capacity + NODELIST_ALLOC_ITEMS));
 	if(!newnodes) {
 	    PWARN("Failed to grow nodelist to %u entries", (list->capacity + NODELIST_ALLOC_ITEMS));
 	    sx_node_delete(node);
@@ -344,7 +360,8 @@ rc_ty sx_nodelist_prepend(sx_nodelist_t *list, sx_node_t *node) {
 	}
 	if(list->nodes) {
 	    memcpy(&newnodes[1], list->nodes, sizeof(sx_node_t *) * list->items);
-	    free(list->nodes);
+	    if(!list->arena)
+		free(list->nodes);
 	}
 	list->nodes = newnodes;
 	list->capacity += NODELIST_ALLOC_ITEMS;
@@ -361,7 +378,8 @@ void sx_nodelist_delete(sx_nodelist_t *list) {
     if(!list)
 	return;
     sx_nodelist_empty(list);
-    free(list);
+    if(!list->arena)
+	free(list);
 }
 
 
@@ -387,7 +405,8 @@ void sx_nodelist_empty(sx_nodelist_t *list) {
 	return;
     for(i=0; i<list->items; i++)
 	sx_node_delete(list->nodes[i]);
-    free(list->nodes);
+    if(!list->arena)
+	free(list->nodes);
     list->items = 0;
     list->nodes = NULL;
     list->capacity = 0;
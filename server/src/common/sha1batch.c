@@ -0,0 +1,360 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+#include <string.h>
+
+#include "sha1batch.h"
+#include "../libsxclient/src/vcrypto.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SHA1BATCH_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define MAX_WAYS 16
+
+/* The padded message of a single buffer: salt || buffer || 0x80 || 0... || bitlen */
+struct sha1msg {
+    const uint8_t *salt;
+    unsigned int salt_len;
+    unsigned int len;
+    uint64_t tot;
+    unsigned int nchunks;
+};
+
+static void msg_init(struct sha1msg *m, const void *salt, unsigned int salt_len, unsigned int len) {
+    m->salt = salt;
+    m->salt_len = salt ? salt_len : 0;
+    m->len = len;
+    m->tot = (uint64_t)m->salt_len + len;
+    m->nchunks = (m->tot + 8) / 64 + 1;
+}
+
+/* Returns the c-th 64 byte chunk of the padded message: chunks entirely
+ * within the buffer are returned in place, the others are assembled in tmp */
+static const uint8_t *msg_chunk(const struct sha1msg *m, const uint8_t *buf, unsigned int c, uint8_t *tmp) {
+    uint64_t start = (uint64_t)c * 64, bits;
+    unsigned int i;
+
+    if(start >= m->salt_len && start + 64 <= m->tot)
+	return buf + (start - m->salt_len);
+
+    for(i=0; i<64; i++) {
+	uint64_t o = start + i;
+	if(o < m->salt_len)
+	    tmp[i] = m->salt[o];
+	else if(o < m->tot)
+	    tmp[i] = buf[o - m->salt_len];
+	else
+	    tmp[i] = o == m->tot ? 0x80 : 0;
+    }
+    if(c == m->nchunks - 1) {
+	bits = m->tot * 8;
+	for(i=0; i<8; i++)
+	    tmp[56 + i] = bits >> (56 - i * 8);
+    }
+    return tmp;
+}
+
+static void store_digest(sx_hash_t *hash, const uint32_t *st) {
+    unsigned int i;
+    for(i=0; i<5; i++) {
+	hash->b[i*4] = st[i] >> 24;
+	hash->b[i*4+1] = st[i] >> 16;
+	hash->b[i*4+2] = st[i] >> 8;
+	hash->b[i*4+3] = st[i];
+    }
+}
+
+static const uint32_t sha1_iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+static int hash_one(const struct sha1msg *m, const uint8_t *buf, sx_hash_t *hash) {
+    return sxi_sha1_calc(m->salt, m->salt_len, buf, m->len, hash->b);
+}
+
+#ifdef SHA1BATCH_X86
+
+/* SHA extensions: SHANI_WAYS messages are interleaved to hide the latency
+ * of the round instructions */
+#define SHANI_WAYS 2
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define SHANI_UNROLL _Pragma("GCC unroll 2")
+#else
+#define SHANI_UNROLL
+#endif
+
+#define SHANI_GROUP(g) do {						\
+	SHANI_UNROLL							\
+	for(s=0; s<ways; s++) {						\
+	    __m128i *M = msg[s];					\
+	    if((g) == 0)						\
+		e[s][0] = _mm_add_epi32(e[s][0], M[0]);			\
+	    else							\
+		e[s][(g) & 1] = _mm_sha1nexte_epu32(e[s][(g) & 1], M[(g) & 3]); \
+	    e[s][((g) + 1) & 1] = abcd[s];				\
+	    if((g) >= 3 && (g) <= 18)					\
+		M[((g) + 1) & 3] = _mm_sha1msg2_epu32(M[((g) + 1) & 3], M[(g) & 3]); \
+	    abcd[s] = _mm_sha1rnds4_epu32(abcd[s], e[s][(g) & 1], (g) / 5); \
+	    if((g) >= 1 && (g) <= 16)					\
+		M[((g) + 3) & 3] = _mm_sha1msg1_epu32(M[((g) + 3) & 3], M[(g) & 3]); \
+	    if((g) >= 2 && (g) <= 17)					\
+		M[((g) + 2) & 3] = _mm_xor_si128(M[((g) + 2) & 3], M[(g) & 3]); \
+	}								\
+    } while(0)
+
+static inline __attribute__((always_inline, target("sha,sse4.1,ssse3"))) void shani_hash(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes, unsigned int ways) {
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd[SHANI_WAYS], e[SHANI_WAYS][2], abcd_save[SHANI_WAYS], e_save[SHANI_WAYS], msg[SHANI_WAYS][4];
+    uint8_t tmp[SHANI_WAYS][64];
+    uint32_t st[5];
+    unsigned int c, s, i;
+
+    for(s=0; s<ways; s++) {
+	abcd[s] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)sha1_iv), 0x1b);
+	e[s][0] = _mm_set_epi32(sha1_iv[4], 0, 0, 0);
+    }
+
+    for(c=0; c<m->nchunks; c++) {
+	for(s=0; s<ways; s++) {
+	    const uint8_t *p = msg_chunk(m, bufs[s], c, tmp[s]);
+	    for(i=0; i<4; i++)
+		msg[s][i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i * 16)), bswap);
+	    abcd_save[s] = abcd[s];
+	    e_save[s] = e[s][0];
+	}
+
+	SHANI_GROUP(0); SHANI_GROUP(1); SHANI_GROUP(2); SHANI_GROUP(3);
+	SHANI_GROUP(4); SHANI_GROUP(5); SHANI_GROUP(6); SHANI_GROUP(7);
+	SHANI_GROUP(8); SHANI_GROUP(9); SHANI_GROUP(10); SHANI_GROUP(11);
+	SHANI_GROUP(12); SHANI_GROUP(13); SHANI_GROUP(14); SHANI_GROUP(15);
+	SHANI_GROUP(16); SHANI_GROUP(17); SHANI_GROUP(18); SHANI_GROUP(19);
+
+	for(s=0; s<ways; s++) {
+	    e[s][0] = _mm_sha1nexte_epu32(e[s][0], e_save[s]);
+	    abcd[s] = _mm_add_epi32(abcd[s], abcd_save[s]);
+	}
+    }
+
+    for(s=0; s<ways; s++) {
+	_mm_storeu_si128((__m128i *)st, _mm_shuffle_epi32(abcd[s], 0x1b));
+	st[4] = _mm_extract_epi32(e[s][0], 3);
+	store_digest(hashes[s], st);
+    }
+}
+
+static void __attribute__((target("sha,sse4.1,ssse3"))) shani_hash_x2(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes) {
+    shani_hash(m, bufs, hashes, 2);
+}
+
+static void __attribute__((target("sha,sse4.1,ssse3"))) shani_hash_x1(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes) {
+    shani_hash(m, bufs, hashes, 1);
+}
+
+/* Multi buffer: each of the MB_LANES messages is hashed in its own 32 bit
+ * lane of a vector; the vector width is left to the compiler and maps
+ * to one AVX-512 register or to a pair of AVX2 registers */
+#define MB_LANES 16
+
+typedef uint32_t sha1v __attribute__((vector_size(MB_LANES * 4)));
+
+#define MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MB_W(t) w[(t) & 15]
+#define MB_X(t) ((t) < 16 ? MB_W(t) : (MB_W(t) = MB_ROL(MB_W((t) - 3) ^ MB_W((t) - 8) ^ MB_W((t) - 14) ^ MB_W(t), 1)))
+#define MB_R(a, b, c, d, e, t) do {					\
+	sha1v x_ = MB_X(t);						\
+	if((t) < 20)							\
+	    e += MB_ROL(a, 5) + (d ^ (b & (c ^ d))) + 0x5a827999 + x_;	\
+	else if((t) < 40)						\
+	    e += MB_ROL(a, 5) + (b ^ c ^ d) + 0x6ed9eba1 + x_;		\
+	else if((t) < 60)						\
+	    e += MB_ROL(a, 5) + ((b & c) | (d & (b | c))) + 0x8f1bbcdc + x_; \
+	else								\
+	    e += MB_ROL(a, 5) + (b ^ c ^ d) + 0xca62c1d6 + x_;		\
+	b = MB_ROL(b, 30);						\
+    } while(0)
+#define MB_R5(t) do {							\
+	MB_R(a, b, c, d, e, (t));					\
+	MB_R(e, a, b, c, d, (t) + 1);					\
+	MB_R(d, e, a, b, c, (t) + 2);					\
+	MB_R(c, d, e, a, b, (t) + 3);					\
+	MB_R(b, c, d, e, a, (t) + 4);					\
+    } while(0)
+
+static inline __attribute__((always_inline)) void mb_hash(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes) {
+    uint32_t words[16][MB_LANES] __attribute__((aligned(64)));
+    uint8_t tmp[MB_LANES][64];
+    sha1v st[5], w[16], a, b, c, d, e;
+    uint32_t dg[5];
+    unsigned int ch, i, l;
+
+    for(i=0; i<5; i++)
+	st[i] = (sha1v){ 0 } + sha1_iv[i];
+
+    for(ch=0; ch<m->nchunks; ch++) {
+	for(l=0; l<MB_LANES; l++) {
+	    const uint8_t *p = msg_chunk(m, bufs[l], ch, tmp[l]);
+	    for(i=0; i<16; i++) {
+		uint32_t v;
+		memcpy(&v, p + i * 4, sizeof(v));
+		words[i][l] = __builtin_bswap32(v);
+	    }
+	}
+	for(i=0; i<16; i++)
+	    memcpy(&w[i], words[i], sizeof(w[i]));
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+	MB_R5(0); MB_R5(5); MB_R5(10); MB_R5(15);
+	MB_R5(20); MB_R5(25); MB_R5(30); MB_R5(35);
+	MB_R5(40); MB_R5(45); MB_R5(50); MB_R5(55);
+	MB_R5(60); MB_R5(65); MB_R5(70); MB_R5(75);
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e;
+    }
+
+    for(l=0; l<MB_LANES; l++) {
+	for(i=0; i<5; i++)
+	    dg[i] = st[i][l];
+	store_digest(hashes[l], dg);
+    }
+}
+
+static void __attribute__((target("avx512f"))) mb_hash_avx512(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes) {
+    mb_hash(m, bufs, hashes);
+}
+
+static void __attribute__((target("avx2"))) mb_hash_avx2(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes) {
+    mb_hash(m, bufs, hashes);
+}
+
+static uint64_t xgetbv0(void) {
+    uint32_t lo, hi;
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#endif /* SHA1BATCH_X86 */
+
+typedef void (*hash_group_fn)(const struct sha1msg *m, const uint8_t *const *bufs, sx_hash_t *const *hashes);
+
+static struct {
+    const char *name;
+    hash_group_fn group; /* hashes ways messages at once */
+    unsigned int ways;
+    hash_group_fn single; /* hashes a single message, NULL for sxi_sha1_calc */
+} impl;
+static int impl_ready;
+
+static void pick_impl(void) {
+    impl.name = "generic";
+    impl.group = NULL;
+    impl.ways = 1;
+    impl.single = NULL;
+#ifdef SHA1BATCH_X86
+    {
+	unsigned int eax, ebx, ecx, edx, has_sha = 0, has_avx2 = 0, has_avx512 = 0;
+	uint64_t xcr0 = 0;
+
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+	    int has_sse41 = (ecx & (1 << 19)) != 0, has_ssse3 = (ecx & (1 << 9)) != 0;
+	    if(ecx & (1 << 27)) /* OSXSAVE */
+		xcr0 = xgetbv0();
+	    if(__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		has_sha = has_sse41 && has_ssse3 && (ebx & (1 << 29));
+		has_avx2 = (ebx & (1 << 5)) && (xcr0 & 0x6) == 0x6;
+		has_avx512 = (ebx & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;
+	    }
+	}
+
+	/* 16 AVX-512 lanes outrun the SHA extensions, which in turn outrun
+	 * the AVX2 lanes */
+	if(has_sha)
+	    impl.single = shani_hash_x1;
+	if(has_avx512) {
+	    impl.name = "avx512";
+	    impl.group = mb_hash_avx512;
+	    impl.ways = MB_LANES;
+	} else if(has_sha) {
+	    impl.name = "sha-ni";
+	    impl.group = shani_hash_x2;
+	    impl.ways = SHANI_WAYS;
+	} else if(has_avx2) {
+	    impl.name = "avx2";
+	    impl.group = mb_hash_avx2;
+	    impl.ways = MB_LANES;
+	}
+    }
+#endif
+    impl_ready = 1;
+}
+
+const char *sx_sha1batch_impl(void) {
+    if(!impl_ready)
+	pick_impl();
+    return impl.name;
+}
+
+int sx_sha1batch(const void *salt, unsigned int salt_len, const uint8_t *data, unsigned int n, unsigned int len, sx_hash_t *hashes) {
+    const uint8_t *bufs[MAX_WAYS];
+    sx_hash_t *outs[MAX_WAYS], pad[MAX_WAYS];
+    struct sha1msg m;
+    unsigned int i, j, w;
+
+    if(!impl_ready)
+	pick_impl();
+
+    msg_init(&m, salt, salt_len, len);
+    w = impl.ways;
+    for(i=0; impl.group && i<n; i+=w) {
+	/* A partial group is padded with copies of its first buffer as long
+	 * as that is cheaper than hashing the leftovers one by one */
+	if(n - i < w && (n - i) * 2 < w)
+	    break;
+	for(j=0; j<w; j++) {
+	    if(i + j < n) {
+		bufs[j] = data + (uint64_t)(i + j) * len;
+		outs[j] = &hashes[i + j];
+	    } else {
+		bufs[j] = data + (uint64_t)i * len;
+		outs[j] = &pad[j];
+	    }
+	}
+	impl.group(&m, bufs, outs);
+    }
+
+    for(; i<n; i++) {
+	bufs[0] = data + (uint64_t)i * len;
+	outs[0] = &hashes[i];
+	if(impl.single)
+	    impl.single(&m, bufs, outs);
+	else if(hash_one(&m, bufs[0], &hashes[i]))
+	    return -1;
+    }
+    return 0;
+}
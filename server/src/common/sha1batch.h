@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2012-2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef SHA1BATCH_H
+#define SHA1BATCH_H
+
+#include "default.h"
+#include <stdint.h>
+#include "../libsxclient/src/sxproto.h"
+
+/* Batch salted SHA1 of equally sized buffers
+ *
+ * Several buffers are hashed at once, either interleaved through the SHA
+ * extensions or in parallel SIMD lanes (AVX2 or AVX-512), whichever the CPU
+ * supports; the implementation is picked at runtime. Elsewhere the buffers
+ * are hashed one by one via sxi_sha1_calc(). The digests are identical
+ * in all cases. */
+
+/* Computes SHA1(salt || buffer) of each of the n buffers of len bytes
+ * stored back to back at data into hashes; returns 0 on success */
+int sx_sha1batch(const void *salt, unsigned int salt_len, const uint8_t *data, unsigned int n, unsigned int len, sx_hash_t *hashes);
+
+/* Returns the name of the implementation in use */
+const char *sx_sha1batch_impl(void);
+
+#endif
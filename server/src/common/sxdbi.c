@@ -66,6 +66,9 @@ static void qclose_db(sqlite3 **dbp)
 static int qwal_hook(void *ctx, sqlite3 *handle, const char *name, int pages)
 {
     sxi_db_t *db = ctx;
+    /* The hook is invoked once the commit is complete and the write lock released */
+    if (db && db->commit_cb)
+        db->commit_cb(db->commit_ctx);
     if (db) {
         /* count idle time since first commit after checkpoint,
            otherwise it would immediately checkpoint after a commit if a long time has passed
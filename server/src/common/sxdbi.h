@@ -38,6 +38,8 @@ typedef struct {
     struct timeval tv_last;
     struct timeval tv_begin;
     int has_begin_time;
+    void (*commit_cb)(void *ctx); /* Called after each commit which changed the db */
+    void *commit_ctx;
 } sxi_db_t;
 
 sxi_db_t* qnew(sqlite3 *handle);
@@ -639,6 +639,8 @@ int gc_interval;
 double gc_max_batch_time;
 double gc_yield_time;
 int gc_slow_check=1;
+int gc_compact_rate;
+int gc_compact_grace;
 float blockmgr_delay;
 int max_pending_user_jobs = 128;
 /* used outside of fcgi */
@@ -649,5 +651,8 @@ int db_idle_restart=600;
 int db_busy_timeout=20;
 int db_max_mmapsize=2147418112;
 int db_custom_vfs=1;
+int db_no_block_index=0;
+int io_uring_depth=64;
+int block_compression=0;
 int worker_max_wait;
 int worker_max_requests;
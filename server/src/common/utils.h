@@ -128,6 +128,8 @@ extern int gc_interval;
 extern double gc_max_batch_time;
 extern double gc_yield_time;
 extern int gc_slow_check;
+extern int gc_compact_rate;
+extern int gc_compact_grace;
 extern float blockmgr_delay;
 extern int db_min_passive_wal_pages;
 extern int db_max_passive_wal_pages;
@@ -136,6 +138,9 @@ extern int db_idle_restart;
 extern int db_busy_timeout;
 extern int db_max_mmapsize;
 extern int db_custom_vfs;
+extern int db_no_block_index;
+extern int io_uring_depth;
+extern int block_compression;
 extern int worker_max_wait;
 extern int worker_max_requests;
 extern int max_pending_user_jobs;
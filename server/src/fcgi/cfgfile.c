@@ -67,6 +67,11 @@ const char *gengetopt_args_info_full_help[] = {
   "      --verbose-rebalance       Generate HUGE rebalance logs  (default=off)",
   "      --verbose-gc              Generate HUGE garbage collector logs\n                                  (default=off)",
   "      --max-pending-user-jobs=N Maximum number of concurrent jobs a single user\n                                  can start  (default=`128')",
+  "      --db-no-block-index       Do not use the block index for hash lookups\n                                  (default=off)",
+  "      --gc-compact-rate=MB/s    I/O rate limit for the online datafile\n                                  compaction, 0 disables it  (default=`16')",
+  "      --gc-compact-grace=sec    Time before datafile slots freed by the GC or\n                                  the online compaction are reused\n                                  (default=`600')",
+  "      --io-uring-depth=N        Number of block reads and writes queued at once\n                                  through io_uring, 0 disables it\n                                  (default=`64')",
+  "      --block-compression       Compress each newly stored block on its own\n                                  when it saves space on disk  (default=off)",
     0
 };
 
@@ -176,6 +181,11 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->verbose_rebalance_given = 0 ;
   args_info->verbose_gc_given = 0 ;
   args_info->max_pending_user_jobs_given = 0 ;
+  args_info->db_no_block_index_given = 0 ;
+  args_info->gc_compact_rate_given = 0 ;
+  args_info->gc_compact_grace_given = 0 ;
+  args_info->io_uring_depth_given = 0 ;
+  args_info->block_compression_given = 0 ;
 }
 
 static
@@ -235,6 +245,14 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->verbose_gc_flag = 0;
   args_info->max_pending_user_jobs_arg = 128;
   args_info->max_pending_user_jobs_orig = NULL;
+  args_info->db_no_block_index_flag = 0;
+  args_info->gc_compact_rate_arg = 16;
+  args_info->gc_compact_rate_orig = NULL;
+  args_info->gc_compact_grace_arg = 600;
+  args_info->gc_compact_grace_orig = NULL;
+  args_info->io_uring_depth_arg = 64;
+  args_info->io_uring_depth_orig = NULL;
+  args_info->block_compression_flag = 0;
   
 }
 
@@ -276,6 +294,11 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->verbose_rebalance_help = gengetopt_args_info_full_help[30] ;
   args_info->verbose_gc_help = gengetopt_args_info_full_help[31] ;
   args_info->max_pending_user_jobs_help = gengetopt_args_info_full_help[32] ;
+  args_info->db_no_block_index_help = gengetopt_args_info_full_help[33] ;
+  args_info->gc_compact_rate_help = gengetopt_args_info_full_help[34] ;
+  args_info->gc_compact_grace_help = gengetopt_args_info_full_help[35] ;
+  args_info->io_uring_depth_help = gengetopt_args_info_full_help[36] ;
+  args_info->block_compression_help = gengetopt_args_info_full_help[37] ;
   
 }
 
@@ -399,6 +422,9 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->worker_max_wait_orig));
   free_string_field (&(args_info->worker_max_requests_orig));
   free_string_field (&(args_info->max_pending_user_jobs_orig));
+  free_string_field (&(args_info->gc_compact_rate_orig));
+  free_string_field (&(args_info->gc_compact_grace_orig));
+  free_string_field (&(args_info->io_uring_depth_orig));
   
   
 
@@ -495,6 +521,16 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "verbose-gc", 0, 0 );
   if (args_info->max_pending_user_jobs_given)
     write_into_file(outfile, "max-pending-user-jobs", args_info->max_pending_user_jobs_orig, 0);
+  if (args_info->db_no_block_index_given)
+    write_into_file(outfile, "db-no-block-index", 0, 0 );
+  if (args_info->gc_compact_rate_given)
+    write_into_file(outfile, "gc-compact-rate", args_info->gc_compact_rate_orig, 0);
+  if (args_info->gc_compact_grace_given)
+    write_into_file(outfile, "gc-compact-grace", args_info->gc_compact_grace_orig, 0);
+  if (args_info->io_uring_depth_given)
+    write_into_file(outfile, "io-uring-depth", args_info->io_uring_depth_orig, 0);
+  if (args_info->block_compression_given)
+    write_into_file(outfile, "block-compression", 0, 0 );
   
 
   i = EXIT_SUCCESS;
@@ -813,6 +849,11 @@ cmdline_parser_internal (
         { "verbose-rebalance",	0, NULL, 0 },
         { "verbose-gc",	0, NULL, 0 },
         { "max-pending-user-jobs",	1, NULL, 0 },
+        { "db-no-block-index",	0, NULL, 0 },
+        { "gc-compact-rate",	1, NULL, 0 },
+        { "gc-compact-grace",	1, NULL, 0 },
+        { "io-uring-depth",	1, NULL, 0 },
+        { "block-compression",	0, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1256,6 +1297,72 @@ cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Do not use the block index for hash lookups.  */
+          else if (strcmp (long_options[option_index].name, "db-no-block-index") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->db_no_block_index_flag), 0, &(args_info->db_no_block_index_given),
+                &(local_args_info.db_no_block_index_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "db-no-block-index", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* I/O rate limit for the online datafile compaction, 0 disables it.  */
+          else if (strcmp (long_options[option_index].name, "gc-compact-rate") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->gc_compact_rate_arg), 
+                 &(args_info->gc_compact_rate_orig), &(args_info->gc_compact_rate_given),
+                &(local_args_info.gc_compact_rate_given), optarg, 0, "16", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "gc-compact-rate", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Time before datafile slots freed by the GC or the online compaction are reused.  */
+          else if (strcmp (long_options[option_index].name, "gc-compact-grace") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->gc_compact_grace_arg), 
+                 &(args_info->gc_compact_grace_orig), &(args_info->gc_compact_grace_given),
+                &(local_args_info.gc_compact_grace_given), optarg, 0, "600", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "gc-compact-grace", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Number of block reads and writes queued at once through io_uring, 0 disables it.  */
+          else if (strcmp (long_options[option_index].name, "io-uring-depth") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->io_uring_depth_arg), 
+                 &(args_info->io_uring_depth_orig), &(args_info->io_uring_depth_given),
+                &(local_args_info.io_uring_depth_given), optarg, 0, "64", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "io-uring-depth", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Compress each newly stored block on its own when it saves space on disk.  */
+          else if (strcmp (long_options[option_index].name, "block-compression") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->block_compression_flag), 0, &(args_info->block_compression_given),
+                &(local_args_info.block_compression_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "block-compression", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
@@ -124,6 +124,19 @@ struct gengetopt_args_info
   int max_pending_user_jobs_arg;	/**< @brief Maximum number of concurrent jobs a single user can start (default='128').  */
   char * max_pending_user_jobs_orig;	/**< @brief Maximum number of concurrent jobs a single user can start original value given at command line.  */
   const char *max_pending_user_jobs_help; /**< @brief Maximum number of concurrent jobs a single user can start help description.  */
+  int db_no_block_index_flag;	/**< @brief Do not use the block index for hash lookups (default=off).  */
+  const char *db_no_block_index_help; /**< @brief Do not use the block index for hash lookups help description.  */
+  int gc_compact_rate_arg;	/**< @brief I/O rate limit for the online datafile compaction, 0 disables it (default='16').  */
+  char * gc_compact_rate_orig;	/**< @brief I/O rate limit for the online datafile compaction, 0 disables it original value given at command line.  */
+  const char *gc_compact_rate_help; /**< @brief I/O rate limit for the online datafile compaction, 0 disables it help description.  */
+  int gc_compact_grace_arg;	/**< @brief Time before datafile slots freed by the GC or the online compaction are reused (default='600').  */
+  char * gc_compact_grace_orig;	/**< @brief Time before datafile slots freed by the GC or the online compaction are reused original value given at command line.  */
+  const char *gc_compact_grace_help; /**< @brief Time before datafile slots freed by the GC or the online compaction are reused help description.  */
+  int io_uring_depth_arg;	/**< @brief Number of block reads and writes queued at once through io_uring, 0 disables it (default='64').  */
+  char * io_uring_depth_orig;	/**< @brief Number of block reads and writes queued at once through io_uring, 0 disables it original value given at command line.  */
+  const char *io_uring_depth_help; /**< @brief Number of block reads and writes queued at once through io_uring, 0 disables it help description.  */
+  int block_compression_flag;	/**< @brief Compress each newly stored block on its own when it saves space on disk (default=off).  */
+  const char *block_compression_help; /**< @brief Compress each newly stored block on its own when it saves space on disk help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int full_help_given ;	/**< @brief Whether full-help was given.  */
@@ -158,6 +171,11 @@ struct gengetopt_args_info
   unsigned int verbose_rebalance_given ;	/**< @brief Whether verbose-rebalance was given.  */
   unsigned int verbose_gc_given ;	/**< @brief Whether verbose-gc was given.  */
   unsigned int max_pending_user_jobs_given ;	/**< @brief Whether max-pending-user-jobs was given.  */
+  unsigned int db_no_block_index_given ;	/**< @brief Whether db-no-block-index was given.  */
+  unsigned int gc_compact_rate_given ;	/**< @brief Whether gc-compact-rate was given.  */
+  unsigned int gc_compact_grace_given ;	/**< @brief Whether gc-compact-grace was given.  */
+  unsigned int io_uring_depth_given ;	/**< @brief Whether io-uring-depth was given.  */
+  unsigned int block_compression_given ;	/**< @brief Whether block-compression was given.  */
 
 } ;
 
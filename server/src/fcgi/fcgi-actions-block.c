@@ -36,11 +36,49 @@
 #include "fcgi-actions-block.h"
 #include "job_common.h"
 #include "libsxclient/src/jparse.h"
+#include "libsxclient/src/misc.h"
+
+/* Renders the located blocks as "offset,length,datafile;..." ranges for the
+ * sxblocks filter in sxhttpd, merging adjacent slots of the same datafile.
+ * Returns NULL if the ranges can't be produced, don't fit in a header or
+ * include compressed blocks, which must be expanded here */
+#define SENDFILE_MAX_HDR 2048
+static char *sendfile_ranges(unsigned int blocksize, const sx_hashfs_blockloc_t *locs, unsigned int nlocs) {
+    unsigned int i, j, len = 0;
+    char *ret, *encpath;
+    const char *datafile;
+    int l;
+
+    for(i=0; i<nlocs; i++)
+	if(locs[i].clen)
+	    return NULL;
+    if(!(ret = wrap_malloc(SENDFILE_MAX_HDR)))
+	return NULL;
+    for(i=0; i<nlocs; i=j) {
+	for(j=i+1; j<nlocs; j++)
+	    if(locs[j].ndb != locs[i].ndb || locs[j].blockno != locs[i].blockno + (j - i))
+		break;
+	datafile = sx_hashfs_block_datafile(hashfs, blocksize, locs[i].ndb);
+	if(!datafile || !(encpath = sxi_urlencode(sx_hashfs_client(hashfs), datafile, 1))) {
+	    free(ret);
+	    return NULL;
+	}
+	l = snprintf(ret + len, SENDFILE_MAX_HDR - len, "%s%llu,%llu,%s", len ? ";" : "",
+		     (unsigned long long)locs[i].blockno * blocksize, (unsigned long long)(j - i) * blocksize, encpath);
+	free(encpath);
+	if(l < 0 || l >= SENDFILE_MAX_HDR - len) {
+	    free(ret);
+	    return NULL;
+	}
+	len += l;
+    }
+    return ret;
+}
 
 void fcgi_send_blocks(void) {
-    unsigned int blocksize;
-    const uint8_t *data;
-    sx_hash_t reqhash;
+    sx_hashfs_blockloc_t locs[DOWNLOAD_MAX_BLOCKS];
+    sx_hash_t reqhashes[DOWNLOAD_MAX_BLOCKS];
+    unsigned int blocksize, missing, perchunk;
     const char *hpath;
     const char *cond;
     int i, urlen;
@@ -64,17 +102,19 @@ void fcgi_send_blocks(void) {
 
     urlen /= SXI_SHA1_TEXT_LEN;
     for(i=0; i<urlen; i++) {
-	if(hex2bin(hpath + SXI_SHA1_TEXT_LEN*i, SXI_SHA1_TEXT_LEN, reqhash.b, SXI_SHA1_BIN_LEN)) {
+	if(hex2bin(hpath + SXI_SHA1_TEXT_LEN*i, SXI_SHA1_TEXT_LEN, reqhashes[i].b, SXI_SHA1_BIN_LEN)) {
             msg_set_reason("Invalid hash %*.s", SXI_SHA1_TEXT_LEN, hpath + SXI_SHA1_TEXT_LEN * i);
             quit_errmsg(400,"invalid hash");
         }
-	s = sx_hashfs_block_get(hashfs, blocksize, &reqhash, NULL);
-	if(s == ENOENT || s == FAIL_BADBLOCKSIZE)
-	    quit_errmsg(404, "Block not found");
-        else if(s != OK) {
-            msg_set_reason("Failed to read block with hash %.*s", SXI_SHA1_TEXT_LEN, hpath + SXI_SHA1_TEXT_LEN*i);
-	    quit_errmsg(500, msg_get_reason());
-        }
+    }
+
+    /* All the hashes are resolved in a single pass before any header is sent */
+    s = sx_hashfs_block_locate_many(hashfs, blocksize, reqhashes, urlen, locs, &missing);
+    if(s == ENOENT || s == FAIL_BADBLOCKSIZE)
+	quit_errmsg(404, "Block not found");
+    else if(s != OK) {
+	msg_set_reason("Failed to locate the requested blocks");
+	quit_errmsg(500, msg_get_reason());
     }
 
     /* Marking the block resources as freely shareable by caches without revalidation
@@ -93,17 +133,32 @@ void fcgi_send_blocks(void) {
 	}
     }
 
-    CGI_PRINTF("\r\nContent-type: application/octet-stream\r\nContent-Length: %u\r\n\r\n", blocksize*urlen);
+    CGI_PRINTF("\r\nContent-type: application/octet-stream\r\nContent-Length: %u\r\n", blocksize*urlen);
 
-    if(verb == VERB_HEAD)
+    if(verb == VERB_HEAD) {
+	CGI_PUTS("\r\n");
 	return;
+    }
 
-    for(i=0; i<urlen; i++) {
-	if(hex2bin(hpath + SXI_SHA1_TEXT_LEN*i, SXI_SHA1_TEXT_LEN, reqhash.b, SXI_SHA1_BIN_LEN))
-	    break;
-	if(sx_hashfs_block_get(hashfs, blocksize, &reqhash, &data) != OK)
+    /* When sxhttpd carries the sxblocks filter, the payload is streamed by
+     * the httpd straight out of the datafiles and this worker is released */
+    if(FCGX_GetParam("SX_BLOCKS_SENDFILE", envp)) {
+	char *ranges = sendfile_ranges(blocksize, locs, urlen);
+	if(ranges) {
+	    CGI_PRINTF("X-SX-Blocks: %s\r\n\r\n", ranges);
+	    free(ranges);
+	    return;
+	}
+    }
+    CGI_PUTS("\r\n");
+
+    /* Blocks are read in datafile order, as many at a time as hashbuf holds */
+    perchunk = sizeof(hashbuf) / blocksize;
+    for(i=0; i<urlen; i+=perchunk) {
+	unsigned int n = MIN(perchunk, (unsigned int)(urlen - i));
+	if(sx_hashfs_block_read_many(hashfs, blocksize, &locs[i], n, hashbuf) != OK)
 	    break;
-	CGI_PUTD(data, blocksize);
+	CGI_PUTD(hashbuf, n * blocksize);
     }
 }
 
@@ -207,15 +262,25 @@ void fcgi_hashop_blocks(enum sxi_hashop_kind kind) {
     DEBUG("hashop: missing %d, n: %d", missing, n);
 }
 
+/* The parsed entries live in the request arena: the arrays are doubled
+ * whenever their size reaches a power of two */
+static void *arena_grow(void *ptr, unsigned long n, size_t size)
+{
+    if (n & (n - 1))
+        return ptr;
+    return sx_arena_realloc(reqarena, ptr, n * size, (n ? n * 2 : 1) * size);
+}
+
 static int meta_add(block_meta_t *meta, const sx_hash_t *global_vol_id, unsigned int replica, const sx_hash_t *revision_id)
 {
     block_meta_entry_t *e;
 
     if (!meta || !revision_id)
         return -1;
-    meta->entries = wrap_realloc_or_free(meta->entries, ++meta->count * sizeof(*meta->entries));
+    meta->entries = arena_grow(meta->entries, meta->count, sizeof(*meta->entries));
     if (!meta->entries)
         return -1;
+    meta->count++;
     e = &meta->entries[meta->count - 1];
     if(global_vol_id) {
         memcpy(&e->global_vol_id, global_vol_id, sizeof(e->global_vol_id));
@@ -232,10 +297,10 @@ static int all_add(blocks_t *all, const block_meta_t *m)
 {
     if (!all)
         return -1;
-    all->all = wrap_realloc_or_free(all->all, ++all->n * sizeof(*all->all));
+    all->all = arena_grow(all->all, all->n, sizeof(*all->all));
     if (!all->all)
         return -1;
-    memcpy(&all->all[all->n - 1], m, sizeof(*m));
+    memcpy(&all->all[all->n++], m, sizeof(*m));
     return 0;
 }
 
@@ -340,7 +405,6 @@ static void cb_inuse_bsend(jparse_t *J, void *ctx) {
     struct inuse_ctx *yactx = (struct inuse_ctx*)ctx;
 
     if (all_add(&yactx->all, &yactx->meta)) {
-	free(yactx->meta.entries);
 	sxi_jparse_cancel(J, "add_all failed");
 	yactx->error = ENOMEM;
 	return;
@@ -348,15 +412,6 @@ static void cb_inuse_bsend(jparse_t *J, void *ctx) {
     memset(&yactx->meta, 0, sizeof(yactx->meta));
 }
 
-static void blocks_free(blocks_t *blocks)
-{
-    unsigned i;
-    for (i=0;i<blocks->n;i++)
-        free(blocks->all[i].entries);
-    free(blocks->all);
-    blocks->all = NULL;
-}
-
 void fcgi_hashop_inuse(void) {
     const struct jparse_actions acts = {
 	JPACTS_STRING(
@@ -415,19 +470,14 @@ void fcgi_hashop_inuse(void) {
 
     if(len || sxi_jparse_done(J)) {
 	WARN("Parsing failed: %s", sxi_jparse_geterr(J));
-        free(yctx.meta.entries);
-        blocks_free(&yctx.all);
 	send_error(rc2http(yctx.error), sxi_jparse_geterr(J));
 	sxi_jparse_destroy(J);
 	return;
     }
     sxi_jparse_destroy(J);
-    free(yctx.meta.entries);
-    yctx.meta.entries = NULL;
 
     auth_complete();
     if(!is_authed()) {
-        blocks_free(&yctx.all);
 	send_authreq();
 	return;
     }
@@ -460,7 +510,6 @@ void fcgi_hashop_inuse(void) {
         }
         idx++;
     }
-    blocks_free(&yctx.all);
     if (rc != OK) {
         WARN("hashop: %s", rc2str(rc));
         CGI_PUTC(']');
@@ -501,15 +550,15 @@ void fcgi_save_blocks(void) {
     if(!is_authed())
 	quit_errmsg(403, "Bad signature");
 
-    const uint8_t *end = hashbuf + len;
-    for(const uint8_t *src = hashbuf;src < end; src += blocksize) {
-        rc_ty rc;
-	/* Maximum replica used here;
-	 * block_put internally skips ignored nodes and only propagates to effective nodes */
-        if ((rc = sx_hashfs_block_put(hashfs, src, blocksize, replica_count, uid))) {
-            WARN("Cannot store block: %s", rc2str(rc));
-	    quit_errmsg(500, "Cannot store block");
-        }
+    /* Maximum replica used here;
+     * block_put internally skips ignored nodes and only propagates to effective nodes
+     * The node lists looked up for each block are allocated from the request arena */
+    sx_arena_t *prev_arena = sx_arena_enter(reqarena);
+    rc_ty rc = sx_hashfs_block_put_many(hashfs, hashbuf, len / blocksize, blocksize, replica_count, uid);
+    sx_arena_leave(prev_arena);
+    if(rc) {
+	WARN("Cannot store blocks: %s", rc2str(rc));
+	quit_errmsg(500, "Cannot store block");
     }
     if(replica_count > 1)
 	sx_hashfs_xfer_trigger(hashfs);
@@ -102,22 +102,77 @@ void fcgi_send_file(void) {
     sx_hashfs_file_t filedata;
     const sx_hash_t *hash;
     sx_nodelist_t *nodes;
+    sx_arena_t *prev_arena;
+    sx_arena_mark_t mark;
     sx_hash_t etag;
+    int64_t offset = -1, length = -1;
+    uint64_t first = 0;
     int comma = 0;
-    rc_ty s = sx_hashfs_getfile_begin(hashfs, volume, path, get_arg("rev"), &filedata, &etag);
+    rc_ty s;
+
+    /* Optional byte range: only the blocks overlapping it are returned */
+    if(has_arg("offset")) {
+	char *eon;
+	offset = strtoll(get_arg("offset"), &eon, 10);
+	if(*eon || offset < 0)
+	    quit_errmsg(400, "Invalid offset");
+    }
+    if(has_arg("length")) {
+	char *eon;
+	length = strtoll(get_arg("length"), &eon, 10);
+	if(*eon || length < 0)
+	    quit_errmsg(400, "Invalid length");
+    }
 
+    s = sx_hashfs_getfile_begin(hashfs, volume, path, get_arg("rev"), &filedata, &etag);
     if(s != OK)
 	quit_errnum(s == ENOENT ? 404 : 500);
 
-    if(is_object_fresh(&etag, 'F', filedata.created_at)) {
+    if(offset >= 0 || length >= 0) {
+	uint64_t count = filedata.nblocks, range[2];
+	sx_hash_t fileetag = etag;
+	if(offset < 0)
+	    offset = 0;
+	if(offset > filedata.file_size)
+	    offset = filedata.file_size;
+	if(length > filedata.file_size - offset)
+	    length = filedata.file_size - offset;
+	first = offset / filedata.block_size;
+	/* An empty range overlaps no block */
+	if(!length)
+	    count = 0;
+	else if(length > 0)
+	    count = (offset + length + filedata.block_size - 1) / filedata.block_size - first;
+	sx_hashfs_getfile_range(hashfs, first, count);
+
+	/* A partial reply gets its own tag, bound to the blocks it lists */
+	range[0] = first;
+	range[1] = count;
+	if(sx_hashfs_hash_buf(&fileetag, sizeof(fileetag), range, sizeof(range), &etag)) {
+	    sx_hashfs_getfile_end(hashfs);
+	    quit_errmsg(500, "Failed to compute the range etag");
+	}
+    }
+
+    if(is_object_fresh(&etag, offset >= 0 || length >= 0 ? 'R' : 'F', filedata.created_at)) {
 	sx_hashfs_getfile_end(hashfs);
 	return;
     }
 
     CGI_PRINTF("Content-type: application/json\r\n\r\n{\"blockSize\":%d,\"fileSize\":", filedata.block_size);
     CGI_PUTLL(filedata.file_size);
-    CGI_PRINTF(",\"createdAt\":%u,\"fileRevision\":\"%s\",\"fileData\":[", filedata.created_at, filedata.revision);
+    CGI_PRINTF(",\"createdAt\":%u,\"fileRevision\":\"%s\",", filedata.created_at, filedata.revision);
+    if(offset >= 0 || length >= 0) {
+	CGI_PUTS("\"fileDataStart\":");
+	CGI_PUTLL(first);
+	CGI_PUTC(',');
+    }
+    CGI_PUTS("\"fileData\":[");
 
+    /* The per block node lists are carved out of the request arena and
+     * released in bulk after each block */
+    prev_arena = sx_arena_enter(reqarena);
+    sx_arena_mark(reqarena, &mark);
     while((s = sx_hashfs_getfile_block(hashfs, &hash, &nodes)) == OK) {
 	if(comma)
 	    CGI_PUTC(',');
@@ -132,7 +187,9 @@ void fcgi_send_file(void) {
 	CGI_PUTC('}');
 
 	sx_nodelist_delete(nodes);
+	sx_arena_release(reqarena, &mark);
     }
+    sx_arena_leave(prev_arena);
 
     sx_hashfs_getfile_end(hashfs);
     CGI_PUTS("]");
@@ -153,6 +210,8 @@ static int hash_presence_callback(const char *hexhash, unsigned int index, int c
     hash_presence_ctx_t *ctx = (hash_presence_ctx_t*)context;
     sx_hashfs_t *h = ctx->h;
     sx_nodelist_t *nodes;
+    sx_arena_t *prev_arena;
+    sx_arena_mark_t mark;
     sx_hash_t hash;
     if (code != 200) {
 	if (code < 0)
@@ -161,8 +220,12 @@ static int hash_presence_callback(const char *hexhash, unsigned int index, int c
 	    WARN("hex2bin failed on %.*s", 40, hexhash);
 	    return -1;
 	}
+	prev_arena = sx_arena_enter(reqarena);
+	sx_arena_mark(reqarena, &mark);
 	nodes = sx_hashfs_putfile_hashnodes(h, &hash);
 	if (!nodes) {
+	    sx_arena_release(reqarena, &mark);
+	    sx_arena_leave(prev_arena);
 	    WARN("hashnodes failed");
 	    return -1;
 	}
@@ -177,6 +240,8 @@ static int hash_presence_callback(const char *hexhash, unsigned int index, int c
 	 * hdist already does a pretty good job here */
 	send_nodes(nodes);
 	sx_nodelist_delete(nodes);
+	sx_arena_release(reqarena, &mark);
+	sx_arena_leave(prev_arena);
     }
     send_keepalive();
     return 0;
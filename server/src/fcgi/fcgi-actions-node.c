@@ -28,6 +28,7 @@
 #include "default.h"
 #include <string.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include "fcgi-utils.h"
 #include "utils.h"
 #include "fcgi-actions-node.h"
@@ -1549,7 +1550,9 @@ void fcgi_node_repaired(void) {
 }
 
 void fcgi_node_status(void) {
-    int64_t sysjobs, usrjobs;
+    int64_t sysjobs, usrjobs, bloom_neg, bloom_fp, prepared, lazy;
+    struct rusage ru;
+    double open_time;
     const sx_nodelist_t *nodes;
     sxi_node_status_t status;
     int comma;
@@ -1629,6 +1632,20 @@ void fcgi_node_status(void) {
     if(status.network_traffic_json && status.network_traffic_json_size)
         CGI_PRINTF(",\"traffic\":%.*s", (unsigned)status.network_traffic_json_size, status.network_traffic_json);
     CGI_PRINTF("},\"heal\":\"%s\",", status.heal_status);
+    if(sx_hashfs_stats_blockidx(hashfs, &bloom_neg, &bloom_fp) == OK) {
+	CGI_PUTS("\"blockIndex\":{\"bloomNegatives\":"); CGI_PUTLL(bloom_neg);
+	CGI_PUTS(",\"bloomFalsePositives\":"); CGI_PUTLL(bloom_fp); CGI_PUTS("},");
+    }
+    if(sx_hashfs_stats_startup(hashfs, &open_time, &prepared, &lazy) == OK) {
+	/* Of the worker serving this request */
+	CGI_PUTS("\"worker\":{\"openTimeUsec\":"); CGI_PUTLL((int64_t)(open_time * 1000000.0));
+	CGI_PUTS(",\"preparedStatements\":"); CGI_PUTLL(prepared);
+	CGI_PUTS(",\"lazyStatements\":"); CGI_PUTLL(lazy);
+	if(!getrusage(RUSAGE_SELF, &ru)) {
+	    CGI_PUTS(",\"maxRSS\":"); CGI_PUTLL((int64_t)ru.ru_maxrss * 1024);
+	}
+	CGI_PUTS("},");
+    }
     CGI_PUTS("\"queueStatus\":{");
     if(sx_hashfs_stats_jobq(hashfs, &sysjobs, &usrjobs) == OK) {
 	CGI_PUTS("\"eventQueue\":{\"systemJobs\":"); CGI_PUTLL(sysjobs);
@@ -329,6 +329,13 @@ void fcgi_list_volume(const sx_hashfs_volume_t *vol) {
                     break;
             }
             CGI_PUTC('}');
+	} else if(file->dir_files >= 0) {
+	    /* A Fakedir from the directory index */
+            CGI_PUTS(":{\"createdAt\":");
+            CGI_PUTT(file->created_at);
+            CGI_PUTS(",\"fileCount\":");
+            CGI_PUTLL(file->dir_files);
+            CGI_PUTC('}');
 	} else {
 	    /* A Fakedir */
             CGI_PUTS(":{}");
@@ -1216,6 +1223,7 @@ void fcgi_volsizes(void) {
     jparse_t *J;
     int len;
     unsigned int i;
+    rc_ty rc;
 
     /* Assign begin state */
     yctx.nvols = 0;
@@ -1245,17 +1253,28 @@ void fcgi_volsizes(void) {
         return;
     }
 
-    for(i = 0; i < yctx.nvols; i++) {
-        rc_ty rc;
+    /* Apply the whole batch in a single transaction */
+    if((rc = sx_hashfs_volsizes_begin(hashfs)) != OK) {
+        free(yctx.vols);
+        quit_errmsg(rc2http(rc), rc2str(rc));
+    }
 
+    for(i = 0; i < yctx.nvols; i++) {
         /* Set volume size */
         if((rc = sx_hashfs_reset_volume_cursize(hashfs, yctx.vols[i].id, yctx.vols[i].used_size, yctx.vols[i].files_size, yctx.vols[i].nfiles)) != OK) {
             WARN("Failed to set volume id %llu size to %lld", (long long)yctx.vols[i].id, (long long)yctx.vols[i].used_size);
+            sx_hashfs_volsizes_rollback(hashfs);
             free(yctx.vols);
             quit_errmsg(rc2http(rc), rc2str(rc));
         }
     }
 
+    if((rc = sx_hashfs_volsizes_commit(hashfs)) != OK) {
+        sx_hashfs_volsizes_rollback(hashfs);
+        free(yctx.vols);
+        quit_errmsg(rc2http(rc), rc2str(rc));
+    }
+
     CGI_PUTS("\r\n");
     free(yctx.vols);
 }
@@ -58,9 +58,12 @@
 FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
 FCGX_ParamArray envp;
 sx_hashfs_t *hashfs;
+sx_arena_t *reqarena; /* Released at the end of each request */
 
 static pid_t ownpid;
 
+#define REQARENA_CHUNK (64*1024)
+
 #define MAX_CHILDREN 256
 #define JOBMGR MAX_CHILDREN
 #define BLKMGR MAX_CHILDREN+1
@@ -250,6 +253,14 @@ static int accept_loop(sxc_client_t *sx, const char *dir, int socket, worker_typ
     }
     sx_hashfs_set_triggers(hashfs, trig_worker(TRIG_JOB), trig_worker(TRIG_BLOCK), trig_worker(TRIG_GC), trig_worker(TRIG_EGC), trig_worker(TRIG_HBEAT));
 
+    reqarena = sx_arena_new(REQARENA_CHUNK);
+    if(!reqarena) {
+	CRIT("Failed to allocate the request arena");
+	sx_hashfs_close(hashfs);
+        rc = EXIT_FAILURE;
+	goto accept_loop_end;
+    }
+
     ownpid = getpid();
     FCGX_Init();
     FCGX_InitRequest(&req, FCGI_LISTENSOCK_FILENO, FCGI_FAIL_ACCEPT_ON_INTR);
@@ -271,8 +282,13 @@ static int accept_loop(sxc_client_t *sx, const char *dir, int socket, worker_typ
 	send_server_info();
 	handle_request(wtype);
         in_request = 0;
+	/* Early returns from the handlers may skip sx_arena_leave() */
+	sx_arena_leave(NULL);
+	sx_arena_reset(reqarena);
     }
     FCGX_Finish_r(&req);
+    sx_arena_free(reqarena);
+    reqarena = NULL;
     sx_hashfs_close(hashfs);
 
     if(i!=worker_max_requests)
@@ -609,12 +625,17 @@ int main(int argc, char **argv) {
     gc_max_batch_time = args.gc_max_batch_time_arg;
     gc_yield_time = args.gc_yield_time_arg;
     gc_slow_check = !args.gc_no_slow_check_flag;
+    gc_compact_rate = args.gc_compact_rate_arg;
+    gc_compact_grace = args.gc_compact_grace_arg;
     blockmgr_delay = args.blockmgr_delay_arg;
     db_min_passive_wal_pages = args.db_min_passive_wal_pages_arg;
     db_max_passive_wal_pages = args.db_max_passive_wal_pages_arg;
     db_max_restart_wal_pages = args.db_max_wal_restart_pages_arg;
     db_max_mmapsize = args.db_max_mmapsize_arg;
     db_custom_vfs = !args.db_no_custom_vfs_flag;
+    db_no_block_index = args.db_no_block_index_flag;
+    io_uring_depth = args.io_uring_depth_arg;
+    block_compression = args.block_compression_flag;
     db_idle_restart = args.db_idle_restart_arg;
     db_busy_timeout = args.db_busy_timeout_arg;
     worker_max_wait = args.worker_max_wait_arg;
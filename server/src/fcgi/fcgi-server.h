@@ -30,9 +30,11 @@
 
 #include <fcgiapp.h>
 #include "hashfs.h"
+#include "arena.h"
 
 extern FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
 extern FCGX_ParamArray envp;
 extern sx_hashfs_t *hashfs;
+extern sx_arena_t *reqarena;
 
 #endif
@@ -387,6 +387,8 @@ int gc(sxc_client_t *sx, sx_hashfs_t *hashfs, int pipe, int pipe_expire) {
                 INFO("Starting GC");
                 sx_hashfs_gc_periodic(hashfs, &terminate, GC_GRACE_PERIOD);
                 sx_hashfs_gc_run(hashfs, &terminate);
+                if (!terminate)
+                    sx_hashfs_compact_online(hashfs, &terminate);
                 gettimeofday(&tv2, NULL);
                 INFO("GC run completed in %.1f sec", timediff(&tv1, &tv2));
                 sx_hashfs_checkpoint_idle(hashfs);
@@ -914,7 +914,7 @@ static rc_ty filerev_from_jobdata_tmpfileid(sx_hashfs_t *hashfs, job_data_t *job
     }
     sx_hashfs_tmpinfo_t *tmpinfo;
     memcpy(&tmpfile_id, job_data->ptr, sizeof(tmpfile_id));
-    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &tmpinfo, 0);
+    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &tmpinfo, TMPINFO_HEAD);
     if (s) {
         WARN("Failed to lookup tmpfileid: %s", rc2str(s));
         return s;
@@ -1009,7 +1009,7 @@ static act_result_t replicateblocks_commit(sx_hashfs_t *hashfs, job_t job_id, jo
 
     memcpy(&tmpfile_id, job_data->ptr, sizeof(tmpfile_id));
     DEBUG("replocateblocks_request for file %lld", (long long)tmpfile_id);
-    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, 1);
+    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, TMPINFO_CHECK);
     if(s == EFAULT || s == EINVAL) {
 	CRIT("Error getting tmpinfo: %s", msg_get_reason());
 	action_error(ACT_RESULT_PERMFAIL, 500, msg_get_reason());
@@ -1307,7 +1307,7 @@ static act_result_t fileflush_remote(sx_hashfs_t *hashfs, job_t job_id, job_data
     }
     memcpy(&tmpfile_id, job_data->ptr, sizeof(tmpfile_id));
     DEBUG("fileflush_remote for file %lld", (long long)tmpfile_id);
-    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, 0);
+    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, TMPINFO_BLOCKS);
     if(s == EFAULT || s == EINVAL) {
 	CRIT("Error getting tmpinfo: %s", msg_get_reason());
 	action_error(ACT_RESULT_PERMFAIL, 500, msg_get_reason());
@@ -1427,7 +1427,7 @@ static act_result_t fileflush_local(sx_hashfs_t *hashfs, job_t job_id, job_data_
     memcpy(&tmpfile_id, job_data->ptr, sizeof(tmpfile_id));
 
     DEBUG("fileflush_local for file %lld", (long long)tmpfile_id);
-    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, 0);
+    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &mis, TMPINFO_BLOCKS);
     if(s == EFAULT || s == EINVAL) {
 	CRIT("Error getting tmpinfo: %s", msg_get_reason());
 	action_error(ACT_RESULT_PERMFAIL, 500, msg_get_reason());
@@ -1486,7 +1486,7 @@ static act_result_t fileflush_remote_undo(sx_hashfs_t *hashfs, job_t job_id, job
     memcpy(&tmpfile_id, job_data->ptr, sizeof(tmpfile_id));
     DEBUG("fileflush_remote for file %lld", (long long)tmpfile_id);
 
-    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &tmp, 0);
+    s = sx_hashfs_tmp_getinfo(hashfs, tmpfile_id, &tmp, TMPINFO_HEAD);
     if(s == ENOENT)
 	return force_phase_success(hashfs, job_id, job_data, nodes, succeeded, fail_code, fail_msg, adjust_ttl);
     if(s != OK) {
@@ -4517,14 +4517,19 @@ finalize_query_err:
 }
 
 #define VOLSIZES_PUSH_INTERVAL 10.0
-#define VOLSIZES_VOLS_PER_QUERY 128
+#define VOLSIZES_VOLS_PER_QUERY 1024
 
+/* Each node has a push time: volumes changed since then are sent to it in as
+ * few queries as possible. The push time only advances, to the time the
+ * queries were prepared, once the node has acknowledged all of them, so a
+ * lost push is simply retried with the same volumes at the next interval */
 static rc_ty checkpoint_volume_sizes(sx_hashfs_t *h) {
     rc_ty ret = FAIL_EINTERNAL;
     const sx_nodelist_t *nodes;
     unsigned int i;
     const sx_node_t *me;
     struct timeval now;
+    int64_t push_time;
     sxc_client_t *sx = sx_hashfs_client(h);
     curlev_context_t **cbdata = NULL;
     unsigned int ncbdata = 0;
@@ -4547,6 +4552,11 @@ static rc_ty checkpoint_volume_sizes(sx_hashfs_t *h) {
         return OK;
     memcpy(sx_hashfs_volsizes_timestamp(h), &now, sizeof(now));
 
+    /* Skip the whole round if nothing changed since the last complete one */
+    if(!sx_hashfs_volsizes_changed(h))
+        return OK;
+    push_time = now.tv_sec;
+
     nodes = sx_hashfs_effective_nodes(h, NL_PREVNEXT);
     if(!nodes) {
         WARN("Failed to get node list");
@@ -4580,37 +4590,34 @@ static rc_ty checkpoint_volume_sizes(sx_hashfs_t *h) {
             goto checkpoint_volume_sizes_err;
         }
 
-        for(s = sx_hashfs_volume_first(h, &vol, 0); s == OK; s = sx_hashfs_volume_next(h)) {
+        for(s = sx_hashfs_volume_changed_first(h, &vol, last_push_time); s == OK; s = sx_hashfs_volume_next(h)) {
             /* Check if node n is not a volnode for volume and it is this node's volume */
             if(sx_hashfs_is_volume_to_push(h, vol, n)) {
-                /* Check if its about time to push current volume size */
-                if((!last_push_time && vol->changed) || last_push_time <= vol->changed) {
-                    char volid_hex[SXI_SHA1_TEXT_LEN+1];
-                    bin2hex(vol->global_id.b, sizeof(vol->global_id.b), volid_hex, sizeof(volid_hex));
+                char volid_hex[SXI_SHA1_TEXT_LEN+1];
+                bin2hex(vol->global_id.b, sizeof(vol->global_id.b), volid_hex, sizeof(volid_hex));
+                if(!query) {
+                    query = sxi_volsizes_proto_begin(sx);
                     if(!query) {
-                        query = sxi_volsizes_proto_begin(sx);
-                        if(!query) {
-                            WARN("Failed to prepare query for pushing volume size");
-                            goto checkpoint_volume_sizes_err;
-                        }
-                    }
-
-                    if(!(query = sxi_volsizes_proto_add_volume(sx, query, volid_hex, vol->usage_total, vol->usage_files, vol->nfiles))) {
-                        WARN("Failed to append volume to the query string");
+                        WARN("Failed to prepare query for pushing volume size");
                         goto checkpoint_volume_sizes_err;
                     }
+                }
+
+                if(!(query = sxi_volsizes_proto_add_volume(sx, query, volid_hex, vol->usage_total, vol->usage_files, vol->nfiles))) {
+                    WARN("Failed to append volume to the query string");
+                    goto checkpoint_volume_sizes_err;
+                }
 
-                    /* Increase number of required volumes */
-                    required++;
-                    /* Check if number of volumes is not too big, we should avoid too long json */
-                    if(required >= VOLSIZES_VOLS_PER_QUERY) {
-                        /* On successful call query variable will be nullified and stored in the ctx */
-                        if(finalize_query(h, &cbdata, &ncbdata, n, i, &query)) {
-                            WARN("Failed to finalize and send query");
-                            goto checkpoint_volume_sizes_err;
-                        }
-                        required = 0;
+                /* Increase number of required volumes */
+                required++;
+                /* Check if number of volumes is not too big, we should avoid too long json */
+                if(required >= VOLSIZES_VOLS_PER_QUERY) {
+                    /* On successful call query variable will be nullified and stored in the ctx */
+                    if(finalize_query(h, &cbdata, &ncbdata, n, i, &query)) {
+                        WARN("Failed to finalize and send query");
+                        goto checkpoint_volume_sizes_err;
                     }
+                    required = 0;
                 }
             }
         }
@@ -4670,7 +4677,7 @@ checkpoint_volume_sizes_err:
             if(ctx->idx != prevctx->idx) { /* Node has changed, check for fail and update push time */
                 const sx_node_t *n = sx_nodelist_get(nodes, prevctx->idx);
 
-                if(n && !fail && sx_hashfs_update_node_push_time(h, n)) {
+                if(n && !fail && sx_hashfs_update_node_push_time(h, n, push_time)) {
                     WARN("Failed to update node push time");
                     ret = FAIL_EINTERNAL;
                     break;
@@ -4688,12 +4695,16 @@ checkpoint_volume_sizes_err:
         struct volsizes_push_ctx *ctx = sxi_cbdata_get_context(cbdata[ncbdata-1]);
         const sx_node_t *n = sx_nodelist_get(nodes, ctx->idx);
 
-        if(sx_hashfs_update_node_push_time(h, n)) {
+        if(sx_hashfs_update_node_push_time(h, n, push_time)) {
             WARN("Failed to update node push time");
             ret = FAIL_EINTERNAL;
         }
     }
 
+    /* Everything was acknowledged, nothing to do until the next change */
+    if(ret == OK)
+        sx_hashfs_volsizes_clean(h);
+
     /* Third, cleanup */
     for(i = 0; i < ncbdata; i++) {
         struct volsizes_push_ctx *ctx = sxi_cbdata_get_context(cbdata[i]);
@@ -5528,6 +5539,8 @@ static act_result_t jobpoll_undo(sx_hashfs_t *hashfs, job_t job_id, job_data_t *
 }
 
 #define MAX_BATCH_ITER  2048
+/* Recursive deletions are set based and much cheaper per file */
+#define MAX_BATCH_RANGE (MAX_BATCH_ITER * 8)
 static act_result_t massdelete_commit(sx_hashfs_t *hashfs, job_t job_id, job_data_t *job_data, const sx_nodelist_t *nodes, int *succeeded, int *fail_code, char *fail_msg, int *adjust_ttl) {
     act_result_t ret = ACT_RESULT_OK;
     rc_ty s;
@@ -5541,6 +5554,7 @@ static act_result_t massdelete_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
     const sx_hash_t *global_vol_id;
     unsigned int global_id_len;
     char timestamp_str[REV_TIME_LEN+1];
+    char progress[64];
 
     b = sx_blob_from_data(job_data->ptr, job_data->len);
     if(!b) {
@@ -5567,6 +5581,22 @@ static act_result_t massdelete_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
         action_error(rc2actres(s), rc2http(s), msg_get_reason());
     }
 
+    if(recursive) {
+        /* Everything below the pattern goes: delete by name ranges */
+        s = sx_hashfs_file_delete_range(hashfs, vol, pattern, timestamp_str, MAX_BATCH_RANGE, &i);
+        if(s == OK) {
+            DEBUG("Sleeping job after deleting %u files", i);
+            snprintf(progress, sizeof(progress), "Deletion in progress: %u files deleted in the last run", i);
+            action_error(ACT_RESULT_NOTFAILED, 503, progress);
+        }
+        if(s != ITER_NO_MORE) {
+            WARN("Failed to finish batch job: %s", rc2str(s));
+            action_error(rc2actres(s), rc2http(s), rc2str(s));
+        }
+        ret = ACT_RESULT_OK;
+        goto action_failed;
+    }
+
     /* Perform operations */
     for(s = sx_hashfs_list_first(hashfs, vol, pattern, &file, recursive, NULL, 0); s == OK && i < MAX_BATCH_ITER; s = sx_hashfs_list_next(hashfs)) {
         rc_ty t;
@@ -5603,7 +5633,8 @@ static act_result_t massdelete_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
     if(s != ITER_NO_MORE) {
         if(i >= MAX_BATCH_ITER) {
             DEBUG("Sleeping job due to exceeded deletions limit");
-            action_error(ACT_RESULT_NOTFAILED, 503, "Exceeded limit");
+            snprintf(progress, sizeof(progress), "Deletion in progress: %u files deleted in the last run", i);
+            action_error(ACT_RESULT_NOTFAILED, 503, progress);
         } else {
             WARN("Failed to finish batch job: %s", rc2str(s));
             action_error(rc2actres(s), rc2http(s), rc2str(s));
@@ -5665,6 +5696,41 @@ massrename_drop_old_src_revs_err:
     return ret;
 }
 
+/* Number of files renamed in each sx_hashfs_file_rename_batch() call */
+#define RENAME_BATCH 128
+
+typedef struct {
+    char name[SXLIMIT_MAX_FILENAME_LEN+1];
+    char revision[REV_LEN+1];
+    char newname[SXLIMIT_MAX_FILENAME_LEN+1];
+} massrename_entry_t;
+
+/* Renames the queued files, then drops their older source revisions
+ * Sets *drop_failed if the renames succeeded but dropping failed */
+static rc_ty massrename_flush(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const struct timeval *tv, const massrename_entry_t *entries, sx_hashfs_rename_t *renames, unsigned int count, int *drop_failed) {
+    unsigned int i;
+    rc_ty s;
+
+    *drop_failed = 0;
+    for(i = 0; i < count; i++) {
+        renames[i].oldname = entries[i].name;
+        renames[i].revision = entries[i].revision;
+        renames[i].newname = entries[i].newname;
+    }
+    if((s = sx_hashfs_file_rename_batch(h, vol, tv, renames, count)) != OK) {
+        WARN("Failed to rename %u files: %s", count, msg_get_reason());
+        return s;
+    }
+    for(i = 0; i < count; i++) {
+        if((s = massrename_drop_old_src_revs(h, vol, entries[i].name)) != OK) {
+            WARN("Failed to drop old %s revisions: %s", entries[i].name, msg_get_reason());
+            *drop_failed = 1;
+            return s;
+        }
+    }
+    return OK;
+}
+
 static act_result_t massrename_commit(sx_hashfs_t *hashfs, job_t job_id, job_data_t *job_data, const sx_nodelist_t *nodes, int *succeeded, int *fail_code, char *fail_msg, int *adjust_ttl) {
     act_result_t ret = ACT_RESULT_OK;
     rc_ty s;
@@ -5683,9 +5749,16 @@ static act_result_t massrename_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
     long http_code = 0;
     const sx_hash_t *global_vol_id;
     unsigned int global_id_len;
+    char progress[64];
+    massrename_entry_t *entries = NULL;
+    sx_hashfs_rename_t *renames = NULL;
+    unsigned int nqueued = 0;
+    int drop_failed = 0;
 
     b = sx_blob_from_data(job_data->ptr, job_data->len);
-    if(!b) {
+    entries = wrap_malloc(RENAME_BATCH * sizeof(*entries));
+    renames = wrap_malloc(RENAME_BATCH * sizeof(*renames));
+    if(!b || !entries || !renames) {
         WARN("Cannot allocate blob for job %lld", (long long)job_id);
         action_error(ACT_RESULT_TEMPFAIL, 503, "Not enough memory to perform the requested action");
     }
@@ -5799,31 +5872,41 @@ static act_result_t massrename_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
             continue;
         }
 
-        /* Rename the youngest revision */
-        if((t = sx_hashfs_file_rename(hashfs, vol, &timestamp, name, file->revision, newname)) != OK) {
-            WARN("Failed to rename file revision %s: %s", file->revision, msg_get_reason());
-            s = t;
-            break;
+        /* Queue the youngest revision for renaming */
+        sxi_strlcpy(entries[nqueued].name, name, sizeof(entries[nqueued].name));
+        sxi_strlcpy(entries[nqueued].revision, file->revision, sizeof(entries[nqueued].revision));
+        sxi_strlcpy(entries[nqueued].newname, newname, sizeof(entries[nqueued].newname));
+        nqueued++;
+        i++;
+        if(nqueued == RENAME_BATCH) {
+            t = massrename_flush(hashfs, vol, &timestamp, entries, renames, nqueued, &drop_failed);
+            nqueued = 0;
+            if(t != OK) {
+                s = t;
+                break;
+            }
         }
-
-        if((t = massrename_drop_old_src_revs(hashfs, vol, name)) != OK) {
-            WARN("Failed to drop old %s revisions: %s", name, msg_get_reason());
-            if(t == ENOMEM || t == EAGAIN)
+    }
+    if(nqueued && (s == OK || s == ITER_NO_MORE)) {
+        rc_ty t = massrename_flush(hashfs, vol, &timestamp, entries, renames, nqueued, &drop_failed);
+        if(t != OK)
+            s = t;
+    }
+    if(s != OK && s != ITER_NO_MORE) {
+        if(drop_failed) {
+            if(s == ENOMEM || s == EAGAIN)
                 action_error(ACT_RESULT_TEMPFAIL, 503, msg_get_reason());
             else
-                action_error(rc2actres(t), rc2http(t), "Failed to remove old source revisions");
+                action_error(rc2actres(s), rc2http(s), "Failed to remove old source revisions");
         }
-        i++;
+        INFO("Failed to finish mass job: %s", rc2str(s));
+        action_error(rc2actres(s), rc2http(s), rc2str(s));
     }
 
     if(s != ITER_NO_MORE) {
-        if(i >= MAX_BATCH_ITER) {
-            DEBUG("Sleeping job due to exceeded deletions limit");
-            action_error(ACT_RESULT_NOTFAILED, 503, "Exceeded limit");
-        } else {
-            INFO("Failed to finish mass job: %s", rc2str(s));
-            action_error(rc2actres(s), rc2http(s), rc2str(s));
-        }
+        DEBUG("Sleeping job due to exceeded deletions limit");
+        snprintf(progress, sizeof(progress), "Rename in progress: %u files renamed in the last run", i);
+        action_error(ACT_RESULT_NOTFAILED, 503, progress);
     } else if(http_code) {
         /* If we reached the end of the list and http_code is set, then we should fail the job. */
         action_error(ACT_RESULT_PERMFAIL, http_code, "Some files could not be renamed");
@@ -5833,6 +5916,8 @@ static act_result_t massrename_commit(sx_hashfs_t *hashfs, job_t job_id, job_dat
     ret = ACT_RESULT_OK;
 action_failed:
     sx_blob_free(b);
+    free(entries);
+    free(renames);
 
     if(ret == ACT_RESULT_OK)
         succeeded[0] = 1;
@@ -7274,7 +7359,7 @@ static rc_ty get_failed_job_expiration_ttl(struct jobmgr_data_t *q) {
         memcpy(&tmpfile_id, q->job_data->ptr, q->job_data->len);
 
         /* JOBTYPE_REPLICATE_BLOCKS contains tempfile ID as job data. Use it to get tempfile entry. */
-        if((s = sx_hashfs_tmp_getinfo(q->hashfs, tmpfile_id, &tmpinfo, 0)) != OK)
+        if((s = sx_hashfs_tmp_getinfo(q->hashfs, tmpfile_id, &tmpinfo, TMPINFO_HEAD)) != OK)
             return s;
 	fsize = tmpinfo->file_size;
         free(tmpinfo);
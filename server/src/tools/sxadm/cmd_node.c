@@ -46,14 +46,19 @@ const char *node_args_info_full_help[] = {
   "      --upgrade              Upgrade a node to new SX version",
   "      --upgrade-job          Run the upgrade job directly",
   "      --compact              Compact the node data freeing up any allocated but\n                               unused storage space",
+  "      --reshard=SHARDS       Redistribute the metadata and block databases of\n                               the node over SHARDS databases each (16, 64 or\n                               256)",
+  "      --measure-blocks       Measure deduplication and space overhead of each\n                               block size on the sample files in STORAGE_PATH",
   "      --gc                   Run GC on node immediately",
   "      --gc-expire            Run GC on node and expire its reservations\n                               immediately",
   "      --warm-cache           Warm DB caches",
   "      --vacuum               Vacuum",
   "      --get-definition       Print node definition in 'cluster --mod' format",
+  "      --dir-index            Build the directory index used by non recursive\n                               listings",
   "\nNew node options:",
   "  -k, --cluster-key=FILE     File containing a pre-generated cluster\n                               authentication token or stdin if \"-\" is given\n                               (default autogenerate token).",
   "  -u, --cluster-uuid=UUID    The SX cluster UUID (default autogenerate UUID).",
+  "      --db-shards=SHARDS     Number of metadata and block databases (16, 64 or\n                               256)  (default=`16')",
+  "      --data-layout=LAYOUT   Place the datafiles of some block size classes\n                               in other directories, as comma separated\n                               CLASS:DIR items (classes: small, medium, 64k,\n                               256k, large)",
   "\nCommon options:",
   "  -b, --batch-mode           Turn off interactive confirmations, progress\n                               notifications and assume yes for all questions",
   "  -H, --human-readable       Print human readable sizes  (default=off)",
@@ -74,23 +79,29 @@ init_help_array(void)
   node_args_info_help[6] = node_args_info_full_help[6];
   node_args_info_help[7] = node_args_info_full_help[9];
   node_args_info_help[8] = node_args_info_full_help[11];
-  node_args_info_help[9] = node_args_info_full_help[16];
-  node_args_info_help[10] = node_args_info_full_help[17];
+  node_args_info_help[9] = node_args_info_full_help[12];
+  node_args_info_help[10] = node_args_info_full_help[13];
   node_args_info_help[11] = node_args_info_full_help[18];
-  node_args_info_help[12] = node_args_info_full_help[20];
-  node_args_info_help[13] = node_args_info_full_help[21];
-  node_args_info_help[14] = node_args_info_full_help[22];
+  node_args_info_help[12] = node_args_info_full_help[19];
+  node_args_info_help[13] = node_args_info_full_help[20];
+  node_args_info_help[14] = node_args_info_full_help[21];
   node_args_info_help[15] = node_args_info_full_help[23];
   node_args_info_help[16] = node_args_info_full_help[24];
-  node_args_info_help[17] = 0; 
+  node_args_info_help[17] = node_args_info_full_help[25];
+  node_args_info_help[18] = node_args_info_full_help[26];
+  node_args_info_help[19] = node_args_info_full_help[27];
+  node_args_info_help[20] = node_args_info_full_help[28];
+  node_args_info_help[21] = node_args_info_full_help[29];
+  node_args_info_help[22] = 0; 
   
 }
 
-const char *node_args_info_help[18];
+const char *node_args_info_help[23];
 
 typedef enum {ARG_NO
   , ARG_FLAG
   , ARG_STRING
+  , ARG_INT
 } node_cmdline_parser_arg_type;
 
 static
@@ -122,13 +133,18 @@ void clear_given (struct node_args_info *args_info)
   args_info->upgrade_given = 0 ;
   args_info->upgrade_job_given = 0 ;
   args_info->compact_given = 0 ;
+  args_info->reshard_given = 0 ;
+  args_info->measure_blocks_given = 0 ;
   args_info->gc_given = 0 ;
   args_info->gc_expire_given = 0 ;
   args_info->warm_cache_given = 0 ;
   args_info->vacuum_given = 0 ;
   args_info->get_definition_given = 0 ;
+  args_info->dir_index_given = 0 ;
   args_info->cluster_key_given = 0 ;
   args_info->cluster_uuid_given = 0 ;
+  args_info->db_shards_given = 0 ;
+  args_info->data_layout_given = 0 ;
   args_info->batch_mode_given = 0 ;
   args_info->human_readable_given = 0 ;
   args_info->debug_given = 0 ;
@@ -144,10 +160,15 @@ void clear_args (struct node_args_info *args_info)
   args_info->extract_orig = NULL;
   args_info->rename_cluster_arg = NULL;
   args_info->rename_cluster_orig = NULL;
+  args_info->reshard_orig = NULL;
   args_info->cluster_key_arg = NULL;
   args_info->cluster_key_orig = NULL;
   args_info->cluster_uuid_arg = NULL;
   args_info->cluster_uuid_orig = NULL;
+  args_info->db_shards_arg = 16;
+  args_info->db_shards_orig = NULL;
+  args_info->data_layout_arg = NULL;
+  args_info->data_layout_orig = NULL;
   args_info->human_readable_flag = 0;
   args_info->debug_flag = 0;
   args_info->owner_arg = NULL;
@@ -171,17 +192,22 @@ void init_args_info(struct node_args_info *args_info)
   args_info->upgrade_help = node_args_info_full_help[9] ;
   args_info->upgrade_job_help = node_args_info_full_help[10] ;
   args_info->compact_help = node_args_info_full_help[11] ;
-  args_info->gc_help = node_args_info_full_help[12] ;
-  args_info->gc_expire_help = node_args_info_full_help[13] ;
-  args_info->warm_cache_help = node_args_info_full_help[14] ;
-  args_info->vacuum_help = node_args_info_full_help[15] ;
-  args_info->get_definition_help = node_args_info_full_help[16] ;
-  args_info->cluster_key_help = node_args_info_full_help[18] ;
-  args_info->cluster_uuid_help = node_args_info_full_help[19] ;
-  args_info->batch_mode_help = node_args_info_full_help[21] ;
-  args_info->human_readable_help = node_args_info_full_help[22] ;
-  args_info->debug_help = node_args_info_full_help[23] ;
-  args_info->owner_help = node_args_info_full_help[24] ;
+  args_info->reshard_help = node_args_info_full_help[12] ;
+  args_info->measure_blocks_help = node_args_info_full_help[13] ;
+  args_info->gc_help = node_args_info_full_help[14] ;
+  args_info->gc_expire_help = node_args_info_full_help[15] ;
+  args_info->warm_cache_help = node_args_info_full_help[16] ;
+  args_info->vacuum_help = node_args_info_full_help[17] ;
+  args_info->get_definition_help = node_args_info_full_help[18] ;
+  args_info->dir_index_help = node_args_info_full_help[19] ;
+  args_info->cluster_key_help = node_args_info_full_help[21] ;
+  args_info->cluster_uuid_help = node_args_info_full_help[22] ;
+  args_info->db_shards_help = node_args_info_full_help[23] ;
+  args_info->data_layout_help = node_args_info_full_help[24] ;
+  args_info->batch_mode_help = node_args_info_full_help[26] ;
+  args_info->human_readable_help = node_args_info_full_help[27] ;
+  args_info->debug_help = node_args_info_full_help[28] ;
+  args_info->owner_help = node_args_info_full_help[29] ;
   
 }
 
@@ -281,10 +307,14 @@ node_cmdline_parser_release (struct node_args_info *args_info)
   free_string_field (&(args_info->extract_orig));
   free_string_field (&(args_info->rename_cluster_arg));
   free_string_field (&(args_info->rename_cluster_orig));
+  free_string_field (&(args_info->reshard_orig));
   free_string_field (&(args_info->cluster_key_arg));
   free_string_field (&(args_info->cluster_key_orig));
   free_string_field (&(args_info->cluster_uuid_arg));
   free_string_field (&(args_info->cluster_uuid_orig));
+  free_string_field (&(args_info->db_shards_orig));
+  free_string_field (&(args_info->data_layout_arg));
+  free_string_field (&(args_info->data_layout_orig));
   free_string_field (&(args_info->owner_arg));
   free_string_field (&(args_info->owner_orig));
   
@@ -344,6 +374,10 @@ node_cmdline_parser_dump(FILE *outfile, struct node_args_info *args_info)
     write_into_file(outfile, "upgrade-job", 0, 0 );
   if (args_info->compact_given)
     write_into_file(outfile, "compact", 0, 0 );
+  if (args_info->reshard_given)
+    write_into_file(outfile, "reshard", args_info->reshard_orig, 0);
+  if (args_info->measure_blocks_given)
+    write_into_file(outfile, "measure-blocks", 0, 0 );
   if (args_info->gc_given)
     write_into_file(outfile, "gc", 0, 0 );
   if (args_info->gc_expire_given)
@@ -354,10 +388,16 @@ node_cmdline_parser_dump(FILE *outfile, struct node_args_info *args_info)
     write_into_file(outfile, "vacuum", 0, 0 );
   if (args_info->get_definition_given)
     write_into_file(outfile, "get-definition", 0, 0 );
+  if (args_info->dir_index_given)
+    write_into_file(outfile, "dir-index", 0, 0 );
   if (args_info->cluster_key_given)
     write_into_file(outfile, "cluster-key", args_info->cluster_key_orig, 0);
   if (args_info->cluster_uuid_given)
     write_into_file(outfile, "cluster-uuid", args_info->cluster_uuid_orig, 0);
+  if (args_info->db_shards_given)
+    write_into_file(outfile, "db-shards", args_info->db_shards_orig, 0);
+  if (args_info->data_layout_given)
+    write_into_file(outfile, "data-layout", args_info->data_layout_orig, 0);
   if (args_info->batch_mode_given)
     write_into_file(outfile, "batch-mode", 0, 0 );
   if (args_info->human_readable_given)
@@ -431,11 +471,15 @@ reset_group_MODE(struct node_args_info *args_info)
   args_info->upgrade_given = 0 ;
   args_info->upgrade_job_given = 0 ;
   args_info->compact_given = 0 ;
+  args_info->reshard_given = 0 ;
+  free_string_field (&(args_info->reshard_orig));
+  args_info->measure_blocks_given = 0 ;
   args_info->gc_given = 0 ;
   args_info->gc_expire_given = 0 ;
   args_info->warm_cache_given = 0 ;
   args_info->vacuum_given = 0 ;
   args_info->get_definition_given = 0 ;
+  args_info->dir_index_given = 0 ;
 
   args_info->MODE_group_counter = 0;
 }
@@ -509,6 +553,16 @@ node_cmdline_parser_required2 (struct node_args_info *args_info, const char *pro
       fprintf (stderr, "%s: '--cluster-uuid' ('-u') option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
       error_occurred = 1;
     }
+  if (args_info->db_shards_given && ! args_info->new_given)
+    {
+      fprintf (stderr, "%s: '--db-shards' option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
+  if (args_info->data_layout_given && ! args_info->new_given)
+    {
+      fprintf (stderr, "%s: '--data-layout' option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
 
   return error_occurred;
 }
@@ -582,6 +636,9 @@ int update_arg(void *field, char **orig_field,
   case ARG_FLAG:
     *((int *)field) = !*((int *)field);
     break;
+  case ARG_INT:
+    if (val) *((int *)field) = strtol (val, &stop_char, 0);
+    break;
   case ARG_STRING:
     if (val) {
       string_field = (char **)field;
@@ -594,6 +651,17 @@ int update_arg(void *field, char **orig_field,
     break;
   };
 
+  /* check numeric conversion */
+  switch(arg_type) {
+  case ARG_INT:
+    if (val && !(stop_char && *stop_char == '\0')) {
+      fprintf(stderr, "%s: invalid numeric value: %s\n", package_name, val);
+      return 1; /* failure */
+    }
+    break;
+  default:
+    ;
+  };
 
   /* store the original value */
   switch(arg_type) {
@@ -664,13 +732,18 @@ node_cmdline_parser_internal (
         { "upgrade",	0, NULL, 0 },
         { "upgrade-job",	0, NULL, 0 },
         { "compact",	0, NULL, 0 },
+        { "reshard",	1, NULL, 0 },
+        { "measure-blocks",	0, NULL, 0 },
         { "gc",	0, NULL, 0 },
         { "gc-expire",	0, NULL, 0 },
         { "warm-cache",	0, NULL, 0 },
         { "vacuum",	0, NULL, 0 },
         { "get-definition",	0, NULL, 0 },
+        { "dir-index",	0, NULL, 0 },
         { "cluster-key",	1, NULL, 'k' },
         { "cluster-uuid",	1, NULL, 'u' },
+        { "db-shards",	1, NULL, 0 },
+        { "data-layout",	1, NULL, 0 },
         { "batch-mode",	0, NULL, 'b' },
         { "human-readable",	0, NULL, 'H' },
         { "debug",	0, NULL, 'D' },
@@ -894,6 +967,40 @@ node_cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Redistribute the metadata and block databases of the node over SHARDS databases each (16, 64 or 256).  */
+          else if (strcmp (long_options[option_index].name, "reshard") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( (void *)&(args_info->reshard_arg), 
+                 &(args_info->reshard_orig), &(args_info->reshard_given),
+                &(local_args_info.reshard_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "reshard", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Measure deduplication and space overhead of each block size on the sample files in STORAGE_PATH.  */
+          else if (strcmp (long_options[option_index].name, "measure-blocks") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->measure_blocks_given),
+                &(local_args_info.measure_blocks_given), optarg, 0, 0, ARG_NO,
+                check_ambiguity, override, 0, 0,
+                "measure-blocks", '-',
+                additional_error))
+              goto failure;
+          
           }
           /* Run GC on node immediately.  */
           else if (strcmp (long_options[option_index].name, "gc") == 0)
@@ -979,6 +1086,51 @@ node_cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Build the directory index used by non recursive listings.  */
+          else if (strcmp (long_options[option_index].name, "dir-index") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->dir_index_given),
+                &(local_args_info.dir_index_given), optarg, 0, 0, ARG_NO,
+                check_ambiguity, override, 0, 0,
+                "dir-index", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Number of metadata and block databases (16, 64 or 256).  */
+          else if (strcmp (long_options[option_index].name, "db-shards") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->db_shards_arg), 
+                 &(args_info->db_shards_orig), &(args_info->db_shards_given),
+                &(local_args_info.db_shards_given), optarg, 0, "16", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "db-shards", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Place the datafiles of some block size classes in other directories, as comma separated CLASS:DIR items (classes: small, medium, 64k, 256k, large).  */
+          else if (strcmp (long_options[option_index].name, "data-layout") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->data_layout_arg), 
+                 &(args_info->data_layout_orig), &(args_info->data_layout_given),
+                &(local_args_info.data_layout_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "data-layout", '-',
+                additional_error))
+              goto failure;
+          
           }
           /* Set ownership of storage to user[:group].  */
           else if (strcmp (long_options[option_index].name, "owner") == 0)
@@ -52,17 +52,28 @@ struct node_args_info
   const char *upgrade_help; /**< @brief Upgrade a node to new SX version help description.  */
   const char *upgrade_job_help; /**< @brief Run the upgrade job directly help description.  */
   const char *compact_help; /**< @brief Compact the node data freeing up any allocated but unused storage space help description.  */
+  int reshard_arg;	/**< @brief Redistribute the metadata and block databases of the node over SHARDS databases each (16, 64 or 256).  */
+  char * reshard_orig;	/**< @brief Redistribute the metadata and block databases of the node over SHARDS databases each (16, 64 or 256) original value given at command line.  */
+  const char *reshard_help; /**< @brief Redistribute the metadata and block databases of the node over SHARDS databases each (16, 64 or 256) help description.  */
+  const char *measure_blocks_help; /**< @brief Measure deduplication and space overhead of each block size on the sample files in STORAGE_PATH help description.  */
   const char *gc_help; /**< @brief Run GC on node immediately help description.  */
   const char *gc_expire_help; /**< @brief Run GC on node and expire its reservations immediately help description.  */
   const char *warm_cache_help; /**< @brief Warm DB caches help description.  */
   const char *vacuum_help; /**< @brief Vacuum help description.  */
   const char *get_definition_help; /**< @brief Print node definition in 'cluster --mod' format help description.  */
+  const char *dir_index_help; /**< @brief Build the directory index used by non recursive listings help description.  */
   char * cluster_key_arg;	/**< @brief File containing a pre-generated cluster authentication token or stdin if \"-\" is given (default autogenerate token)..  */
   char * cluster_key_orig;	/**< @brief File containing a pre-generated cluster authentication token or stdin if \"-\" is given (default autogenerate token). original value given at command line.  */
   const char *cluster_key_help; /**< @brief File containing a pre-generated cluster authentication token or stdin if \"-\" is given (default autogenerate token). help description.  */
   char * cluster_uuid_arg;	/**< @brief The SX cluster UUID (default autogenerate UUID)..  */
   char * cluster_uuid_orig;	/**< @brief The SX cluster UUID (default autogenerate UUID). original value given at command line.  */
   const char *cluster_uuid_help; /**< @brief The SX cluster UUID (default autogenerate UUID). help description.  */
+  int db_shards_arg;	/**< @brief Number of metadata and block databases (16, 64 or 256) (default='16').  */
+  char * db_shards_orig;	/**< @brief Number of metadata and block databases (16, 64 or 256) original value given at command line.  */
+  const char *db_shards_help; /**< @brief Number of metadata and block databases (16, 64 or 256) help description.  */
+  char * data_layout_arg;	/**< @brief Place the datafiles of some block size classes in other directories, as comma separated CLASS:DIR items (classes: small, medium, 64k, 256k, large).  */
+  char * data_layout_orig;	/**< @brief Place the datafiles of some block size classes in other directories, as comma separated CLASS:DIR items (classes: small, medium, 64k, 256k, large) original value given at command line.  */
+  const char *data_layout_help; /**< @brief Place the datafiles of some block size classes in other directories, as comma separated CLASS:DIR items (classes: small, medium, 64k, 256k, large) help description.  */
   const char *batch_mode_help; /**< @brief Turn off interactive confirmations, progress notifications and assume yes for all questions help description.  */
   int human_readable_flag;	/**< @brief Print human readable sizes (default=off).  */
   const char *human_readable_help; /**< @brief Print human readable sizes help description.  */
@@ -83,13 +94,18 @@ struct node_args_info
   unsigned int upgrade_given ;	/**< @brief Whether upgrade was given.  */
   unsigned int upgrade_job_given ;	/**< @brief Whether upgrade-job was given.  */
   unsigned int compact_given ;	/**< @brief Whether compact was given.  */
+  unsigned int reshard_given ;	/**< @brief Whether reshard was given.  */
+  unsigned int measure_blocks_given ;	/**< @brief Whether measure-blocks was given.  */
   unsigned int gc_given ;	/**< @brief Whether gc was given.  */
   unsigned int gc_expire_given ;	/**< @brief Whether gc-expire was given.  */
   unsigned int warm_cache_given ;	/**< @brief Whether warm-cache was given.  */
   unsigned int vacuum_given ;	/**< @brief Whether vacuum was given.  */
   unsigned int get_definition_given ;	/**< @brief Whether get-definition was given.  */
+  unsigned int dir_index_given ;	/**< @brief Whether dir-index was given.  */
   unsigned int cluster_key_given ;	/**< @brief Whether cluster-key was given.  */
   unsigned int cluster_uuid_given ;	/**< @brief Whether cluster-uuid was given.  */
+  unsigned int db_shards_given ;	/**< @brief Whether db-shards was given.  */
+  unsigned int data_layout_given ;	/**< @brief Whether data-layout was given.  */
   unsigned int batch_mode_given ;	/**< @brief Whether batch-mode was given.  */
   unsigned int human_readable_given ;	/**< @brief Whether human-readable was given.  */
   unsigned int debug_given ;	/**< @brief Whether debug was given.  */
@@ -40,6 +40,8 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "../libsxclient/src/clustcfg.h"
 #include "../libsxclient/src/jobpoll.h"
@@ -194,6 +196,11 @@ static int create_node(struct node_args_info *args) {
     } else if (uuid_generate(&cluster_uuid))
         return 1;
 
+    if(!sx_storage_valid_shards(args->db_shards_arg)) {
+	CRIT("Invalid number of databases %d: must be 16, 64 or 256", args->db_shards_arg);
+	return 1;
+    }
+
     if(read_or_gen_key(args->cluster_key_arg, ROLE_CLUSTER, &auth))
 	return 1;
 
@@ -212,7 +219,7 @@ static int create_node(struct node_args_info *args) {
 
     if(handle_owner(args))
         return 1;
-    rc_ty create_fail = sx_storage_create(args->inputs[0], &cluster_uuid, auth.key, sizeof(auth.key));
+    rc_ty create_fail = sx_storage_create(args->inputs[0], &cluster_uuid, auth.key, sizeof(auth.key), args->db_shards_arg, args->data_layout_arg);
     if(create_fail) {
 	printf("Failed to create storage for new node: %s\n", rc2str(create_fail));
 	return 1;
@@ -1210,6 +1217,7 @@ static int setfaulty_nodes(sxc_client_t *sx, struct cluster_args_info *args) {
 static int info_node(sxc_client_t *sx, const char *path, struct node_args_info *args)
 {
     int ret = 0;
+    unsigned int i;
     const sx_nodelist_t *nodes;
     sx_hashfs_t *h;
     char *hpath = malloc(strlen(path) + 1 + sizeof("hashfs.db")), *admin;
@@ -1252,10 +1260,13 @@ static int info_node(sxc_client_t *sx, const char *path, struct node_args_info *
     printf("Used disk space: %s\n", capastr);
     fmt_capa(dsk_used, capastr, sizeof(capastr), args->human_readable_flag);
     printf("Actual data size: %s\n", capastr);
+    printf("Datafile directories:\n");
+    for(i=0; i<sx_hashfs_nsizes(); i++)
+	printf("\t%s (%u bytes): %s\n", sx_hashfs_size_name(i), sx_hashfs_size_blocksize(i), sx_hashfs_size_datadir(h, i));
 
     nodes = sx_hashfs_all_nodes(h, NL_NEXT);
     if(nodes && sx_nodelist_count(nodes)) {
-	unsigned int i, nnodes = sx_nodelist_count(nodes);
+	unsigned int nnodes = sx_nodelist_count(nodes);
 	const sx_node_t *self = sx_hashfs_self(h);
 	printf("List of nodes:\n");
 	for(i=0; i<nnodes; i++) {
@@ -1942,6 +1953,211 @@ static int compact_data(sxc_client_t *sx, const char *path, int human_readable)
     return 0;
 }
 
+static int reshard_data(sxc_client_t *sx, const char *path, int shards) {
+    sx_hashfs_t *h = NULL;
+    rc_ty s;
+
+    if(!path || !sx) {
+        fprintf(stderr, "ERROR: Failed to reshard data: NULL argument\n");
+        return 1;
+    }
+
+    if(shards < 0 || !sx_storage_valid_shards(shards)) {
+        fprintf(stderr, "ERROR: Invalid number of databases %d: must be 16, 64 or 256\n", shards);
+        return 1;
+    }
+
+    if(access(path, R_OK)) {
+        if(errno == EACCES)
+            fprintf(stderr, "ERROR: Can't access %s\n", path);
+        else if(errno == ENOENT)
+            fprintf(stderr, "ERROR: No valid SX storage found at %s\n", path);
+        else
+            fprintf(stderr, "ERROR: Can't open SX storage at %s\n", path);
+        return 1;
+    }
+
+    h = sx_hashfs_open(path, sx);
+    if(!h)
+        return 1;
+
+    s = sx_hashfs_reshard(h, shards);
+    sx_hashfs_close(h);
+    if(s) {
+        fprintf(stderr, "Failed to reshard node data: %s\n", rc2str(s));
+	return 1;
+    }
+
+    printf("Operation complete (the node now has %d metadata and block databases)\n", shards);
+    return 0;
+}
+
+/* Rough on disk size of a row in the blocks table, including its index */
+#define MEASURE_ROW_SIZE 64
+#define MEASURE_CHUNK (4*SX_BS_LARGE)
+
+struct measure_bs {
+    uint64_t blocks, padded, unique, stored;
+    sxi_ht *uniq;
+};
+
+struct measure_ctx {
+    unsigned int nsizes;
+    struct measure_bs *sizes; /* nsizes classes followed by the current policy */
+    uint8_t *buf;
+    sx_hash_t *hashes;
+    uint64_t files, bytes;
+};
+
+static int measure_add(struct measure_ctx *ctx, struct measure_bs *m, unsigned int bs, unsigned int len) {
+    unsigned int i, nblocks = (len + bs - 1) / bs;
+
+    if(sx_hashfs_hash_bufs(NULL, 0, ctx->buf, nblocks, bs, ctx->hashes))
+        return -1;
+    for(i=0; i<nblocks; i++) {
+        if(!sxi_ht_get(m->uniq, &ctx->hashes[i], sizeof(ctx->hashes[i]), NULL))
+            continue;
+        if(sxi_ht_add(m->uniq, &ctx->hashes[i], sizeof(ctx->hashes[i]), NULL))
+            return -1;
+        m->unique++;
+        m->stored += bs;
+    }
+    m->blocks += nblocks;
+    m->padded += (uint64_t)nblocks * bs;
+    return 0;
+}
+
+static int measure_file(struct measure_ctx *ctx, const char *path, int64_t size) {
+    unsigned int i, policy_bs = sx_hashfs_blocksize(size);
+    int64_t done = 0;
+    int fd, ret = -1;
+
+    if((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "WARNING: Skipping %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    while(done < size) {
+        unsigned int len = MIN(size - done, MEASURE_CHUNK), got = 0;
+        while(got < len) {
+            ssize_t r = read(fd, ctx->buf + got, len - got);
+            if(r < 0 && errno == EINTR)
+                continue;
+            if(r <= 0) {
+                fprintf(stderr, "ERROR: Failed to read %s: %s\n", path, r ? strerror(errno) : "Unexpected end of file");
+                goto measure_file_out;
+            }
+            got += r;
+        }
+        done += len;
+        /* The last block is zero padded, just like the clients do */
+        if(len % SX_BS_LARGE)
+            memset(ctx->buf + len, 0, SX_BS_LARGE - len % SX_BS_LARGE);
+        for(i=0; i<ctx->nsizes; i++)
+            if(measure_add(ctx, &ctx->sizes[i], sx_hashfs_size_blocksize(i), len))
+                break;
+        if(i < ctx->nsizes || measure_add(ctx, &ctx->sizes[i], policy_bs, len)) {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            goto measure_file_out;
+        }
+    }
+    ctx->files++;
+    ctx->bytes += size;
+    ret = 0;
+
+ measure_file_out:
+    close(fd);
+    return ret;
+}
+
+static int measure_path(struct measure_ctx *ctx, const char *path) {
+    struct dirent *dentry;
+    struct stat st;
+    DIR *d;
+    int ret = 0;
+
+    if(lstat(path, &st)) {
+        fprintf(stderr, "WARNING: Skipping %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if(S_ISREG(st.st_mode))
+        return measure_file(ctx, path, st.st_size);
+    if(!S_ISDIR(st.st_mode))
+        return 0;
+    if(!(d = opendir(path))) {
+        fprintf(stderr, "WARNING: Skipping %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    while(!ret && (dentry = readdir(d))) {
+        char name[4096];
+        if(!strcmp(dentry->d_name, ".") || !strcmp(dentry->d_name, ".."))
+            continue;
+        snprintf(name, sizeof(name), "%s/%s", path, dentry->d_name);
+        ret = measure_path(ctx, name);
+    }
+    closedir(d);
+    return ret;
+}
+
+static int measure_blocks(sxc_client_t *sx, const char *path, int human_readable) {
+    struct measure_ctx ctx;
+    unsigned int i;
+    int ret = 1;
+
+    if(!path || !sx) {
+        fprintf(stderr, "ERROR: Failed to measure block sizes: NULL argument\n");
+        return 1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nsizes = sx_hashfs_nsizes();
+    ctx.sizes = calloc(ctx.nsizes + 1, sizeof(*ctx.sizes));
+    ctx.buf = malloc(MEASURE_CHUNK);
+    ctx.hashes = malloc(MEASURE_CHUNK / SX_BS_SMALL * sizeof(*ctx.hashes));
+    if(!ctx.sizes || !ctx.buf || !ctx.hashes) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        goto measure_out;
+    }
+    for(i=0; i<=ctx.nsizes; i++) {
+        if(!(ctx.sizes[i].uniq = sxi_ht_new(sx, 0))) {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            goto measure_out;
+        }
+    }
+
+    if(measure_path(&ctx, path))
+        goto measure_out;
+
+    printf("Files: %llu, total size: %llu bytes\n", (unsigned long long)ctx.files, (unsigned long long)ctx.bytes);
+    printf("%-12s %12s %12s %8s %12s %12s %12s\n", "Block size", "Blocks", "Unique", "Dedup", "Stored", "Padding", "Metadata");
+    for(i=0; i<=ctx.nsizes; i++) {
+        struct measure_bs *m = &ctx.sizes[i];
+        char name[16], stored[32], meta[32];
+        double padding = ctx.bytes ? 100.0 * (m->padded - ctx.bytes) / ctx.bytes : 0;
+
+        if(i < ctx.nsizes)
+            snprintf(name, sizeof(name), "%u", sx_hashfs_size_blocksize(i));
+        else
+            snprintf(name, sizeof(name), "current");
+        fmt_capa(m->stored, stored, sizeof(stored), human_readable);
+        /* Each file revision lists its block hashes, each unique block takes a row */
+        fmt_capa(m->blocks * sizeof(sx_hash_t) + m->unique * MEASURE_ROW_SIZE, meta, sizeof(meta), human_readable);
+        printf("%-12s %12llu %12llu %7.2fx %12s %11.2f%% %12s\n", name,
+               (unsigned long long)m->blocks, (unsigned long long)m->unique,
+               m->unique ? (double)m->blocks / m->unique : 1.0,
+               stored, padding, meta);
+    }
+    ret = 0;
+
+ measure_out:
+    if(ctx.sizes)
+        for(i=0; i<=ctx.nsizes; i++)
+            sxi_ht_free(ctx.sizes[i].uniq);
+    free(ctx.sizes);
+    free(ctx.buf);
+    free(ctx.hashes);
+    return ret;
+}
+
 static void print_status(sxc_client_t *sx, int http_code, const sxi_node_status_t *status, int human_readable) {
     unsigned int i;
     char str[64];
@@ -2028,6 +2244,25 @@ static void print_status(sxc_client_t *sx, int http_code, const sxi_node_status_
     } else
         printf("        Swap free: N/A\n");
 
+    if(status->bloom_neg != -1 && status->bloom_fp != -1) {
+	printf("    Block index:\n");
+	printf("        Bloom filter: %lld misses answered, %lld false positives", (long long)status->bloom_neg, (long long)status->bloom_fp);
+	if(status->bloom_neg + status->bloom_fp > 0)
+	    printf(" (%.2lf%%)", (double)status->bloom_fp * 100.0 / (status->bloom_neg + status->bloom_fp));
+	printf("\n");
+    }
+
+    if(status->worker_open_usec != -1) {
+	printf("    Worker:\n");
+	printf("        Storage opened in: %.1lf ms\n", (double)status->worker_open_usec / 1000.0);
+	if(status->worker_prepared != -1 && status->worker_lazy != -1)
+	    printf("        Statements prepared: %lld of %lld\n", (long long)status->worker_prepared, (long long)status->worker_lazy);
+	if(status->worker_maxrss != -1) {
+	    fmt_capa(status->worker_maxrss, str, sizeof(str), human_readable);
+	    printf("        Peak RSS: %s\n", str);
+	}
+    }
+
     printf("    Queues:\n");
     printf("        Events: %lld job(s) queued (%lld user, %lld system)\n",
 	   (long long)(status->usrjobs + status->sysjobs),
@@ -2308,6 +2543,24 @@ static int vacuum_node(sxc_client_t *sx, const char *path)
     return s;
 }
 
+static int dir_index_node(sxc_client_t *sx, const char *path)
+{
+    if (!sxc_is_verbose(sx)) {
+        log_setminlevel(sx, SX_LOG_INFO);
+        sxc_set_verbose(sx, 1);
+    }
+    sx_hashfs_t *hashfs = sx_hashfs_open(path, sx);
+    if (!hashfs)
+        return 1;
+    rc_ty s = sx_hashfs_dir_index_build(hashfs);
+    if (s == OK)
+        printf("Directory index built\n");
+    else
+        fprintf(stderr, "ERROR: Failed to build the directory index\n");
+    sx_hashfs_close(hashfs);
+    return s != OK;
+}
+
 static int get_cluster_meta_common(sxc_client_t *sx, sxc_cluster_t *cluster, sxc_meta_t *meta, const char *key, int is_cluster_meta) {
     unsigned int i, count;
     unsigned int max_value_len = is_cluster_meta ? SXLIMIT_META_MAX_VALUE_LEN : SXLIMIT_SETTINGS_MAX_VALUE_LEN;
@@ -2587,6 +2840,8 @@ int main(int argc, char **argv) {
 	}
 	if(node_args.new_given)
 	    ret = create_node(&node_args);
+	else if(node_args.measure_blocks_given)
+	    ret = measure_blocks(sx, node_args.inputs[0], node_args.human_readable_flag);
 	else {
             if(handle_owner(&node_args))
                 ret = 1;
@@ -2604,6 +2859,8 @@ int main(int argc, char **argv) {
                 ret = upgrade_job_node(sx, node_args.inputs[0]);
 	    else if(node_args.compact_given)
 		ret = compact_data(sx, node_args.inputs[0], node_args.human_readable_flag);
+	    else if(node_args.reshard_given)
+		ret = reshard_data(sx, node_args.inputs[0], node_args.reshard_arg);
             else if(node_args.gc_given || node_args.gc_expire_given)
                 ret = gc_node(sx, node_args.inputs[0], node_args.gc_expire_given);
             else if(node_args.warm_cache_given)
@@ -2612,6 +2869,8 @@ int main(int argc, char **argv) {
                 ret = vacuum_node(sx, node_args.inputs[0]);
             else if(node_args.get_definition_given)
                 ret = get_node_definition(sx, node_args.inputs[0]);
+            else if(node_args.dir_index_given)
+                ret = dir_index_node(sx, node_args.inputs[0]);
         }
     node_out:
 	node_cmdline_parser_free(&node_args);
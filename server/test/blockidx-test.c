@@ -0,0 +1,198 @@
+/*
+ *  Copyright (C) 2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Checks the block index lookups, updates, staleness and rebuilds */
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockidx.h"
+#include "init.h"
+#include "log.h"
+
+#define GTFO(...) do { CRIT(__VA_ARGS__); goto out; } while(0)
+
+#define NITEMS 5000
+#define NMISSING 1000
+
+struct scan_ctx {
+    const sx_hash_t *hashes;
+    unsigned int pos, count;
+};
+
+static int scan_cb(void *ctx, sx_hash_t *hash, uint64_t *blockno, unsigned int *clen) {
+    struct scan_ctx *c = ctx;
+
+    if(c->pos >= c->count)
+	return 0;
+    *hash = c->hashes[c->pos];
+    *blockno = c->pos + 1;
+    *clen = (c->pos & 1) ? c->pos + 100 : 0;
+    c->pos++;
+    return 1;
+}
+
+/* Expects each of the first count hashes to map to its own position */
+static int check_items(sx_blockidx_t *bi, const sx_hash_t *hashes, unsigned int count) {
+    unsigned int i, clen;
+    uint64_t blockno;
+
+    for(i=0; i<count; i++) {
+	if(sx_blockidx_get(bi, &hashes[i], &blockno, &clen) != 1) {
+	    CRIT("Item %u not found", i);
+	    return -1;
+	}
+	if(blockno != i + 1 || clen != ((i & 1) ? i + 100 : 0)) {
+	    CRIT("Item %u has the wrong location", i);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    sxc_client_t *sx = sx_init(NULL, NULL, NULL, 0, argc, argv);
+    sx_blockidx_t *bi = NULL, *bi2 = NULL, *bi3 = NULL;
+    sx_hash_t *hashes = NULL, *missing;
+    unsigned int seed = time(NULL), i, j, clen;
+    char path[] = "blockidx-test.XXXXXX", tmppath[sizeof(path) + 4];
+    struct scan_ctx ctx;
+    uint64_t blockno;
+    int fd, ret = 1;
+
+    if(!sx)
+	GTFO("Failed ot init library");
+
+    if(argc == 2 && !strcmp(argv[1], "--debug"))
+	log_setminlevel(sx, SX_LOG_DEBUG);
+
+    /* Only the name is needed: the index is created by the rebuild */
+    if((fd = mkstemp(path)) < 0)
+	GTFO("Failed to create the index file");
+    close(fd);
+    unlink(path);
+    sprintf(tmppath, "%s.tmp", path);
+
+    if(!(hashes = malloc((NITEMS * 2 + NMISSING) * sizeof(*hashes))))
+	GTFO("Out of memory");
+    missing = &hashes[NITEMS * 2];
+    INFO("Testing the block index (seed %u)", seed);
+    srand(seed);
+    for(i=0; i<NITEMS * 2 + NMISSING; i++)
+	for(j=0; j<sizeof(hashes[i].b); j++)
+	    hashes[i].b[j] = rand();
+
+    if(!(bi = sx_blockidx_new(path, "sig", 3)) ||
+       !(bi2 = sx_blockidx_new(path, "sig", 3)) ||
+       !(bi3 = sx_blockidx_new(path, "other sig", 9)))
+	GTFO("Failed to create the index handles");
+
+    /* Nothing on disk yet */
+    if(sx_blockidx_get(bi, &hashes[0], &blockno, NULL) != -1 || sx_blockidx_current(bi, 0))
+	GTFO("Missing index is usable");
+    if(!sx_blockidx_check(bi, 0, 0))
+	GTFO("Missing index passes the check");
+
+    ctx.hashes = hashes;
+    ctx.pos = 0;
+    ctx.count = NITEMS;
+    if(sx_blockidx_rebuild(bi, 1, NITEMS, scan_cb, &ctx))
+	GTFO("Failed to build the index");
+    if(!sx_blockidx_current(bi, 1) || sx_blockidx_current(bi, 2))
+	GTFO("Wrong generation after the build");
+    if(sx_blockidx_check(bi, 1, 0) || !sx_blockidx_check(bi, 2, 0))
+	GTFO("Wrong check result after the build");
+    if(!sx_blockidx_check(bi, 1, NITEMS * 2))
+	GTFO("Overfull index passes the check");
+    if(check_items(bi, hashes, NITEMS))
+	GTFO("Lookup failed after the build");
+    for(i=0; i<NMISSING; i++)
+	if(sx_blockidx_get(bi, &missing[i], &blockno, NULL) != 0)
+	    GTFO("Missing item %u found", i);
+
+    /* Updates in place are seen by the other processes mapping the file */
+    if(check_items(bi2, hashes, NITEMS))
+	GTFO("Lookup failed through another handle");
+    if(sx_blockidx_get(bi3, &hashes[0], &blockno, NULL) != -1)
+	GTFO("Index with another signature is usable");
+    for(i=0; i<NITEMS; i+=2)
+	sx_blockidx_del(bi, &hashes[i]);
+    for(i=NITEMS; i<NITEMS + NITEMS / 2; i++)
+	sx_blockidx_add(bi, &hashes[i], i + 1, (i & 1) ? i + 100 : 0);
+    sx_blockidx_setgen(bi, 2);
+    if(!sx_blockidx_current(bi2, 2))
+	GTFO("Generation change not seen through another handle");
+    for(i=0; i<NITEMS + NITEMS / 2; i++) {
+	int r = sx_blockidx_get(bi2, &hashes[i], &blockno, &clen);
+	if(i < NITEMS && !(i & 1)) {
+	    if(r != 0)
+		GTFO("Deleted item %u found", i);
+	} else if(r != 1 || blockno != i + 1 || clen != ((i & 1) ? i + 100 : 0))
+	    GTFO("Item %u not found after the update", i);
+    }
+    /* Deleted slots are reused and moved blocks are updated */
+    sx_blockidx_add(bi, &hashes[0], 1, 0);
+    sx_blockidx_add(bi, &hashes[1], NITEMS * 4, 42);
+    if(sx_blockidx_get(bi2, &hashes[0], &blockno, &clen) != 1 || blockno != 1 || clen)
+	GTFO("Readded item not found");
+    if(sx_blockidx_get(bi2, &hashes[1], &blockno, &clen) != 1 || blockno != NITEMS * 4 || clen != 42)
+	GTFO("Moved item not updated");
+
+    /* An invalidated index is unusable everywhere until rebuilt */
+    sx_blockidx_invalidate(bi);
+    if(sx_blockidx_get(bi2, &hashes[1], &blockno, NULL) != -1 || sx_blockidx_current(bi2, 2))
+	GTFO("Invalidated index is usable");
+    if(!sx_blockidx_check(bi, 2, 0))
+	GTFO("Invalidated index passes the check");
+
+    /* A rebuild replaces the file under the other handles */
+    ctx.pos = 0;
+    ctx.count = NITEMS * 2;
+    if(sx_blockidx_rebuild(bi, 3, NITEMS * 2, scan_cb, &ctx))
+	GTFO("Failed to rebuild the index");
+    if(access(tmppath, F_OK) == 0)
+	GTFO("Temporary index left behind");
+    if(!sx_blockidx_current(bi2, 3) || check_items(bi2, hashes, NITEMS * 2))
+	GTFO("Rebuilt index not seen through another handle");
+    for(i=0; i<NMISSING; i++)
+	if(sx_blockidx_get(bi2, &missing[i], &blockno, NULL) != 0)
+	    GTFO("Missing item %u found after the rebuild", i);
+
+    INFO("Block index checks passed");
+    ret = 0;
+ out:
+    sx_blockidx_free(bi);
+    sx_blockidx_free(bi2);
+    sx_blockidx_free(bi3);
+    unlink(path);
+    free(hashes);
+    sx_done(&sx);
+    return ret;
+}
@@ -766,7 +766,15 @@ static int create_file(const char* local_file_path, uint64_t block_size, uint64_
                     WARNING("Wrong blocksize");
                 break;
             case SX_BS_MEDIUM:
-                if(block_count < 8 || block_count > 8192)
+                if(block_count < 8 || block_count > 128)
+                    WARNING("Wrong blocksize");
+                break;
+            case SX_BS_64K:
+                if(block_count < 33 || block_count > 256)
+                    WARNING("Wrong blocksize");
+                break;
+            case SX_BS_256K:
+                if(block_count < 65 || block_count > 512)
                     WARNING("Wrong blocksize");
                 break;
             case SX_BS_LARGE:
@@ -3185,7 +3193,9 @@ test_acl_err:
 /* For test_transfer:
  *       Block size | Available number of blocks
  *    SX_BS_SMALL   |  0 - 31
- *    SX_BS_MEDIUM  |  8 - 8192
+ *    SX_BS_MEDIUM  |  8 - 128
+ *    SX_BS_64K     |  33 - 256
+ *    SX_BS_256K    |  65 - 512
  *    SX_BS_LARGE   |  129+
  * REMEMBER TO CHECK WHETHER THE VOLUME SIZE IS BIG ENOUGH!!
  */
@@ -3194,9 +3204,12 @@ client_test_t tests[] = {
     {1, 1, 0, 0, 0, 0, 0, "empty_file", test_empty_file},
     {1, 0, 0, 0, 0, SX_BS_SMALL, 15, "transfer:small", test_transfer},
     {1, 0, 0, 1, 0, SX_BS_MEDIUM, 10, "transfer:medium", test_transfer},
+    {1, 0, 0, 1, 0, SX_BS_64K, 40, "transfer:64k", test_transfer},
+    {1, 0, 0, 1, 0, SX_BS_256K, 80, "transfer:256k", test_transfer},
     {1, 0, 0, 1, 0, SX_BS_LARGE, 130, "transfer:large", test_transfer},
     {1, 1, 0, 0, 0, SX_BS_SMALL, 15, "revision:small", test_revision},
     {1, 1, 0, 1, 0, SX_BS_MEDIUM, 10, "revision:medium", test_revision},
+    {1, 1, 0, 1, 0, SX_BS_64K, 40, "revision:64k", test_revision},
     {1, 1, 0, 1, 0, SX_BS_LARGE, 130, "revision:large", test_revision},
     {1, 1, 0, 0, 0, 0, 0, "cat", test_cat},
     {1, 1, 0, 0, 1, 0, 0, "rename", test_rename},
@@ -20,7 +20,8 @@ die "Usage: <[host:]port> <hashfsdir>\n" unless $#ARGV == 1;
 my $HASHFS_DIR = $ARGV[1];
 
 sub read_auth {
-    open(F, "<", "$HASHFS_DIR/admin.key") || die "cannot open $HASHFS_DIR/admin.key";
+    my $keyfile = shift || 'admin.key';
+    open(F, "<", "$HASHFS_DIR/$keyfile") || die "cannot open $HASHFS_DIR/$keyfile";
     my $auth = readline(*F);
     close(F);
     return $auth;
@@ -370,6 +371,7 @@ sub test_upload {
     my $expect = shift;
     my $meta = shift;
     my $expectrc = shift; #Expected return code for PUT operation
+    my $batched = shift; #Send all the needed blocks of a node in as few PUTs as possible
     my $len = length $file;
     my $grow = ($len+0 > 128*1024*1024);
 
@@ -430,6 +432,7 @@ sub test_upload {
     my $nrecv = 0;
     my $token;
     my $blocks_per_loop = 5;
+    my %batches;
     do {
 	my @subhashes = @hashes[$i..min($i+$blocks_per_loop-1, $#hashes)];
 	my $content = { 'fileData' => [@subhashes] };
@@ -508,6 +511,10 @@ sub test_upload {
 		return;
 	    }
 	    my $node = $NODEHOST ? $NODEHOST : $nodes->[0].$PORT;
+	    if($batched) {
+		$batches{$node} .= substr($file, $blocko[$i + $j], $blocksize);
+		next;
+	    }
 	    $req = HTTP::Request->new('PUT', "http://$node/.data/$blocksize/$token");
 	    $req->content(substr($file, $blocko[$i + $j], $blocksize));
 	    $repl = do_query $req, $auth;
@@ -521,6 +528,20 @@ sub test_upload {
 	$i += $blocks_per_loop;
     } while ($i <= $#hashes);
 
+    # PUT batched blocks (at most 4MB per request)
+    foreach my $node (keys %batches) {
+	my $batch = $batches{$node};
+	for(my $boff = 0; $boff < length $batch; $boff += 4*1024*1024) {
+	    $req = HTTP::Request->new('PUT', "http://$node/.data/$blocksize/$token");
+	    $req->content(substr($batch, $boff, 4*1024*1024));
+	    $repl = do_query $req, $auth;
+	    if($repl->code != 200) {
+		fail 'cannot upload batched hashes - bad status '.$repl->code;
+		return;
+	    }
+	}
+    }
+
     $expect = $nsent unless defined $expect;
     if($expect != $nrecv) {
 	fail "cannot request file upload - unexpected hash count: expected $expect, returned $nrecv";
@@ -833,6 +854,41 @@ test_upload 'file upload (mid blocksize)', 'admin', $blk, "large$vol", 'adm';
 random_data_r(\$blk, $blocksize);
 test_upload 'file upload (mid blocksize, repeating)', $writer, $blk.random_data(14*$blocksize).$blk, "large$vol", 'rep', 15;
 test_upload 'file upload (mid blocksize, previous)', $writer, $blk x 16, "large$vol", 'prev', 0;
+# All the needed blocks are sent in one PUT and stored in a single batch
+random_data_r(\$blk, 128*$blocksize);
+test_upload 'file upload (mid blocksize, batched)', $writer, $blk, "large$vol", 'batched', undef, undef, undef, 1;
+my $batchedlist;
+test_get "batched file block list ($_)", {$writer=>[200,'application/json']}, "large$vol/batched", undef, sub { my $content = shift; my $json = get_json($content) or return 0; return 0 unless is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 128; $batchedlist = $content unless defined($batchedlist); return $content eq $batchedlist; } foreach (1..4);
+test_upload 'file upload (mid blocksize, batched, repeating)', $writer, substr($blk, 0, 64*$blocksize).random_data(64*$blocksize), "large$vol", 'batchedrep', 64, undef, undef, 1;
+# The blocks of an upload are verified in windows of 30 unique blocks, each
+# job run resuming where the previous one stopped: mix new, already stored
+# and repeated blocks over several windows
+my $windowed = '';
+my $windowednew = 0;
+foreach (0..119) {
+    if($_ % 4 == 0) {
+	$windowed .= substr($blk, ($_ / 4) * $blocksize, $blocksize);
+    } elsif($_ % 4 == 3 && $_ > 60) {
+	$windowed .= substr($windowed, ($_ - 60) * $blocksize, $blocksize);
+    } else {
+	$windowed .= random_data($blocksize);
+	$windowednew++;
+    }
+}
+test_upload 'file upload (mid blocksize, several check windows)', $writer, $windowed, "large$vol", 'windowed', $windowednew;
+undef $windowed;
+
+$blocksize = 64*1024;
+random_data_r(\$blk, 48*$blocksize);
+test_upload 'file upload (64k blocksize)', $writer, $blk, "large$vol", '64k';
+random_data_r(\$blk, $blocksize);
+test_upload 'file upload (64k blocksize, repeating)', $writer, ($blk x 20).random_data($blocksize).($blk x 20), "large$vol", '64krep', 2;
+
+$blocksize = 256*1024;
+random_data_r(\$blk, 80*$blocksize);
+test_upload 'file upload (256k blocksize)', $writer, $blk, "large$vol", '256k';
+random_data_r(\$blk, 80*$blocksize + 500);
+test_upload 'file upload (256k blocksize + 500)', $writer, $blk, "large$vol", '256k+1';
 
 $blocksize = 1*1024*1024;
 
@@ -846,6 +902,28 @@ test_upload 'file upload (big blocksize, previous)', $writer, $blk x 160, "large
 
 test_get 'get min growable size', authed_only(200, 'application/json'), "large$vol?o=locate&size=growable", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'growableSize'}) && $json->{'growableSize'} == 128*1024*1024+1 && is_int($json->{'blockSize'}) && $json->{'blockSize'} == $blocksize; };
 
+# Blocks made of a repeated kilobyte are stored compressed when block-compression is on
+my $cblk = join('', map { random_data(1024) x 16 } 1..16);
+test_upload 'file upload (mid blocksize, compressible)', $writer, $cblk, "large$vol", 'compr16k';
+test_upload 'file upload (mid blocksize, compressible, previous)', $writer, $cblk, "large$vol", 'compr16kprev', 0;
+$cblk = join('', map { random_data(1024) x 64 } 1..48);
+test_upload 'file upload (64k blocksize, compressible)', $writer, $cblk, "large$vol", 'compr64k';
+$cblk = random_data(1024) x 1024;
+test_upload 'file upload (big blocksize, compressible)', $writer, ($cblk x 129).random_data($blocksize), "large$vol", 'compr1m', 2;
+undef $cblk;
+
+# Above 1024 blocks the block list is stored in chunks: block 1024 opens the second one
+test_mkvol "volume creation (chunked files)", admin_only(200), "chunked$vol", "{\"volumeSize\":".(2*$volumesize).",\"owner\":\"admin\",\"replicaCount\":1}";
+test_put_job 'granting rights on newly created volume', admin_only(200), "chunked$vol?o=acl", "{\"grant-read\":[\"$reader\",\"$writer\"],\"grant-write\":[\"$writer\"] }";
+random_data_r(\$blk, $blocksize);
+test_upload 'file upload (big blocksize, chunked)', $writer, ($blk x 1024).random_data($blocksize).($blk x 99), "chunked$vol", 'chunked', 2;
+undef $blk;
+test_get 'listing chunked file', authed_only(200, 'application/json'), "chunked$vol", undef, sub { my $json = get_json(shift) or return 0; return is_hash($json->{'fileList'}) && is_hash($json->{'fileList'}->{'/chunked'}) && $json->{'fileList'}->{'/chunked'}->{'fileSize'} == 1124*$blocksize && $json->{'fileList'}->{'/chunked'}->{'blockSize'} == $blocksize };
+test_get 'get chunked file block range', authed_only(200, 'application/json'), "chunked$vol/chunked?offset=".(1023*$blocksize)."&length=".(3*$blocksize), undef, sub { my $json = get_json(shift) or return 0; return 0 unless is_int($json->{'fileDataStart'}) && $json->{'fileDataStart'} == 1023 && is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 3; my @h = map { keys %$_ } @{$json->{'fileData'}}; return $h[0] ne $h[1] && $h[0] eq $h[2]; };
+test_delete_job "delete chunked file", {'badauth'=>[401],$reader=>[403],$writer=>[200]}, "chunked$vol/chunked";
+test_get 'checking deleted chunked file', authed_only(200, 'application/json'), "chunked$vol", undef, sub { my $json = get_json(shift) or return 0; return is_hash($json->{'fileList'}) && scalar keys %{$json->{'fileList'}} == 0 };
+test_get 'getting deleted chunked file', authed_only(404), "chunked$vol/chunked";
+
 ### Check quota handling ###
 # This file should not be allowed to be uploaded because quota will be exceeded by one byte
 test_upload 'file upload: (exceeding volume capacity)', $writer, random_data($tinyvolumesize-length('toobig')+1), "tiny$vol", 'toobig', undef, {}, 413;
@@ -951,10 +1029,14 @@ test_get 'listing all \'tree/\' files', authed_only(200, 'application/json'), "$
         return 0 unless is_int($f->{'fileSize'}) && $f->{'fileSize'} == 0 && is_int($f->{'blockSize'}) && $f->{'blockSize'} == 4096;
         return 0 unless is_hash($json->{'fileList'}->{'/tree/[]/'});
         return 0 unless is_hash($json->{'fileList'}->{'/tree/a/'});
+        $f = $json->{'fileList'}->{'/tree/a/'} or return 0;
+        return 0 unless is_int($f->{'fileCount'}) && $f->{'fileCount'} == 3 && is_int($f->{'createdAt'});
         return 0 unless is_hash($json->{'fileList'}->{'/tree/b'});
         $f = $json->{'fileList'}->{'/tree/b'} or return 0;
         return 0 unless is_int($f->{'fileSize'}) && $f->{'fileSize'} == 0 && is_int($f->{'blockSize'}) && $f->{'blockSize'} == 4096;
         return 0 unless is_hash($json->{'fileList'}->{'/tree/b/'});
+        $f = $json->{'fileList'}->{'/tree/[]/'} or return 0;
+        return 0 unless is_int($f->{'fileCount'}) && $f->{'fileCount'} == 4;
     };
 
 # List all files from 'tree' (recursively)
@@ -1497,6 +1579,13 @@ test_get 'listing all volumes', {'badauth'=>[401],$reader=>[200,'application/jso
 test_get 'meta get - empty on create', authed_only(200, 'application/json'), "$vol/1bs+1?fileMeta", undef, sub { my $json = get_json(shift) or return 0; return is_hash($json->{'fileMeta'}) && keys %{$json->{'fileMeta'}} == 0 };
 test_get 'meta get - set on create', authed_only(200, 'application/json'), "$vol/0.5bs?fileMeta", undef, sub { my $json = get_json(shift) or return 0; return is_hash($json->{'fileMeta'}) && keys %{$json->{'fileMeta'}} == 2 && ($json->{'fileMeta'}->{'key1'} eq '6669727374') && ($json->{'fileMeta'}->{'key2'} eq '7365636f6e64'); };
 
+test_get 'get file block range', authed_only(200, 'application/json'), "$vol/rep?offset=5000&length=4000", undef, sub { my $json = get_json(shift) or return 0; return $json->{'fileSize'} == 3*4096 && is_int($json->{'fileDataStart'}) && $json->{'fileDataStart'} == 1 && is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 2; };
+test_get 'get file block range (zero length)', authed_only(200, 'application/json'), "$vol/rep?offset=5000&length=0", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'fileDataStart'}) && $json->{'fileDataStart'} == 1 && is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 0; };
+test_get 'get file block range (length only)', authed_only(200, 'application/json'), "$vol/rep?length=5000", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'fileDataStart'}) && $json->{'fileDataStart'} == 0 && is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 2; };
+test_get 'get file block range (length past the end)', authed_only(200, 'application/json'), "$vol/rep?offset=9000&length=10000", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'fileDataStart'}) && $json->{'fileDataStart'} == 2 && is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 1; };
+test_get 'get file block range past the end', authed_only(200, 'application/json'), "$vol/rep?offset=20000", undef, sub { my $json = get_json(shift) or return 0; return is_array($json->{'fileData'}) && @{$json->{'fileData'}} == 0; };
+test_get 'get file block range (bad offset)', authed_only(400), "$vol/rep?offset=-1";
+
 test_get 'get revisions', authed_only(200, 'application/json'), "$vol/1bs?fileRevisions", undef, sub { my $json = get_json(shift) or return 0; return 0 unless is_hash($json->{'fileRevisions'}) && keys %{$json->{'fileRevisions'}} == 1; my $r = $json->{'fileRevisions'}{(keys %{$json->{'fileRevisions'}})[0]}; return $r->{'blockSize'} == 4096 && $r->{'fileSize'} == 4096 && is_int($r->{'createdAt'}); };
 
 test_delete_job "delete file as writer", {'badauth'=>[401],$reader=>[403],$writer=>[200]}, "$vol/file";
@@ -1685,6 +1774,82 @@ test_get "tiny$vol current usage (locate)", {'admin'=>[200,'application/json']},
 test_get "tiny$vol current usage (volume list)", {'admin'=>[200,'application/json']}, "tiny$vol?o=locate", undef, sub { my $json = get_json(shift) or return 0; return is_array($json->{'nodeList'}) && is_int($json->{'usedSize'}) && is_int($json->{'filesSize'}) && is_int($json->{'filesCount'}) && $json->{'usedSize'} == 0 && $json->{'filesSize'} == 0 && $json->{'filesCount'} == 0; };
 
 
+### Check concurrent deletes and renames ###
+# The deletes are applied directly with the cluster key by the fcgi workers
+# while the job manager renames the other files of the volume; the listing
+# sums and the directory index are recounted by 'sxadm node --check'
+if(-f "$HASHFS_DIR/cluster.key") {
+    my $clusterauth = read_auth 'cluster.key';
+    my $nconc = 32;
+    my ($globalid, %revs);
+    test_mkvol "volume creation (concurrent operations)", admin_only(200), "conc$vol", "{\"volumeSize\":$volumesize,\"owner\":\"admin\"}";
+    foreach (1..$nconc) {
+	test_upload "file upload (concurrent/del/$_)", 'admin', '', "conc$vol", "concurrent/del/$_";
+	test_upload "file upload (concurrent/mv/$_)", 'admin', '', "conc$vol", "concurrent/mv/$_";
+    }
+    test_get "conc$vol global ID", {'admin'=>[200,'application/json']}, "conc$vol?o=locate", undef, sub { my $json = get_json(shift) or return 0; $globalid = $json->{'globalID'}; return is_string($globalid); };
+    test_get 'listing files to delete', {'admin'=>[200,'application/json']}, "conc$vol?filter=concurrent/del/&recursive", undef, sub { my $json = get_json(shift) or return 0; return 0 unless is_hash($json->{'fileList'}); $revs{$_} = $json->{'fileList'}->{$_}->{'fileRevision'} foreach (keys %{$json->{'fileList'}}); return scalar keys %revs == $nconc; };
+
+    print "Checking concurrent deletes and mass rename on conc$vol... ";
+    my @names = sort keys %revs;
+    my @pids;
+    foreach my $worker (0, 1) {
+	my $pid = fork;
+	if(defined($pid) && !$pid) {
+	    my $failed = 0;
+	    for(my $i = $worker; $i < @names; $i += 2) {
+		my $req = HTTP::Request->new('DELETE', "http://$QUERYHOST/$globalid".uri_escape_noslash($names[$i])."?rev=".uri_escape_utf8($revs{$names[$i]}));
+		$req->header('content-length' => 0);
+		$failed++ if((do_query $req, $clusterauth)->code != 200);
+	    }
+	    exit($failed > 0);
+	}
+	push @pids, $pid;
+    }
+    my $jobid = job_submit 'PUT', "conc$vol?source=concurrent/mv/&dest=concurrent/moved/&recursive", undef, $TOK{'admin'}, 200;
+    my ($jobres) = defined($jobid) ? job_result($jobid, $TOK{'admin'}) : ('ERROR');
+    my $workers_ok = 1;
+    foreach (@pids) {
+	$workers_ok = 0 unless defined($_) && waitpid($_, 0) == $_ && !$?;
+    }
+    if(!$workers_ok) {
+	fail 'concurrent deletes failed';
+    } elsif(!defined($jobres) || $jobres ne 'OK') {
+	fail 'concurrent mass rename failed';
+    } else {
+	ok;
+    }
+    test_get 'listing after concurrent deletes and rename', {'admin'=>[200,'application/json']}, "conc$vol?filter=concurrent/&recursive", undef, sub { my $json = get_json(shift) or return 0; return 0 unless is_hash($json->{'fileList'}) && scalar keys %{$json->{'fileList'}} == $nconc; return !grep { !m{^/concurrent/moved/} } keys %{$json->{'fileList'}}; };
+} else {
+    test_skip 'concurrent deletes and renames (no cluster key)';
+}
+
+
+### Check lookup caches invalidation ###
+# Every fcgi worker caches volumes, users and privileges; each check is
+# repeated so that all the workers answer from their own (warm) cache
+my $cacheu = "cache" . (random_string 32);
+my $ncache = 4;
+test_create_user $cacheu;
+test_mkvol "volume creation (cache checks)", admin_only(200), "cache$vol", "{\"volumeSize\":$tinyvolumesize,\"owner\":\"admin\"}";
+test_put_job "granting read rights to $cacheu", admin_only(200), "cache$vol?o=acl", "{\"grant-read\":[\"$cacheu\"]}";
+test_get "listing cache$vol (granted, $_)", {$cacheu=>[200,'application/json']}, "cache$vol" foreach (1..$ncache);
+test_put_job "revoking read rights from $cacheu", admin_only(200), "cache$vol?o=acl", "{\"revoke-read\":[\"$cacheu\"]}";
+test_get "listing cache$vol (revoked, $_)", {$cacheu=>[403]}, "cache$vol" foreach (1..$ncache);
+test_put_job "granting read rights to $cacheu again", admin_only(200), "cache$vol?o=acl", "{\"grant-read\":[\"$cacheu\"]}";
+test_get "listing cache$vol (granted again, $_)", {$cacheu=>[200,'application/json']}, "cache$vol" foreach (1..$ncache);
+test_put_job "resizing cache$vol", admin_only(200), "cache$vol?o=mod", "{\"size\":".(2*$tinyvolumesize)."}";
+test_get "cache$vol size after resize ($_)", {'admin'=>[200,'application/json']}, "cache$vol?o=locate", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'sizeBytes'}) && $json->{'sizeBytes'} == 2*$tinyvolumesize; } foreach (1..$ncache);
+test_upload 'file upload (cache checks)', 'admin', random_data($blocksize), "cache$vol", 'cached';
+test_get "cache$vol files count after upload ($_)", {'admin'=>[200,'application/json']}, "cache$vol?o=locate", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'filesCount'}) && $json->{'filesCount'} == 1; } foreach (1..$ncache);
+test_delete_job "file delete (cache checks)", {'admin'=>[200]}, "cache$vol/cached";
+test_get "cache$vol files count after delete ($_)", {'admin'=>[200,'application/json']}, "cache$vol?o=locate", undef, sub { my $json = get_json(shift) or return 0; return is_int($json->{'filesCount'}) && $json->{'filesCount'} == 0; } foreach (1..$ncache);
+my $newcachekey = random_data(20);
+test_put_job "changing the key of $cacheu", admin_only(200), ".users/$cacheu", "{\"userKey\":\"".bin_to_hex($newcachekey)."\"}";
+test_get "listing cache$vol (old key, $_)", {$cacheu=>[401]}, "cache$vol" foreach (1..$ncache);
+$TOK{$cacheu} = encode_base64(sha1($cacheu) . $newcachekey . chr(0) . chr(0));
+test_get "listing cache$vol (new key, $_)", {$cacheu=>[200,'application/json']}, "cache$vol" foreach (1..$ncache);
+
 
 # Check cluster meta operations
 test_get "cluster meta (empty)", {'badauth'=>[401],$reader=>[200,'application/json'],$writer=>[200,'application/json'],'admin'=>[200,'application/json']}, "?clusterMeta", undef, sub { my $json = get_json(shift) or return 0; return 0 unless is_hash($json->{'clusterMeta'}); $cleanupm = $json->{'clusterMeta'}; };
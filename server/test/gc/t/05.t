@@ -0,0 +1,56 @@
+#!/bin/bash
+. ./common.sh
+
+plan 4
+N=1 require_cmd test/start-nginx.sh
+require_cmd $SXVOL create -s 64M -o admin -r 1 $SXURI/vol1
+STORAGE=test-sx/1/var/lib/sxserver/storage
+
+set +e
+(
+    testcase 1 "freed slots do not clobber live blocks"
+    mkdir -p slots
+    for round in 1 2 3; do
+        for i in $(seq 1 8); do $RANDGEN 65536 65536 >slots/$round-$i 2>/dev/null || exit 1; done
+        $SXCP -r slots $SXURI/vol1/
+        for i in 2 4 6 8; do $SXRM $SXURI/vol1/slots/$round-$i; rm slots/$round-$i; done
+        nodegc 1 >$LOGFILE 2>&1
+        grep -c 'freeing block with hash' $LOGFILE | is 64
+    done
+    for f in slots/*; do
+        $SXCP $SXURI/vol1/$f $f.d
+        cmp $f $f.d
+        rm $f.d
+    done
+)
+
+(
+    testcase 2 "compaction releases the freed slots"
+    test-sx/1/sbin/sxserver stop
+    $SXADM node --compact $STORAGE
+    $SXADM node --check $STORAGE
+    test-sx/1/sbin/sxserver start
+)
+
+(
+    testcase 3 "uploads after compaction"
+    for i in $(seq 1 8); do $RANDGEN 65536 65536 >slots/4-$i 2>/dev/null || exit 1; done
+    $SXCP -r slots $SXURI/vol1/
+    $SXRM $SXURI/vol1/slots/1-1
+    rm slots/1-1
+    nodegc 1 >$LOGFILE 2>&1
+    grep -c 'freeing block with hash' $LOGFILE | is 16
+    for f in slots/*; do
+        $SXCP $SXURI/vol1/$f $f.d
+        cmp $f $f.d
+        rm $f.d
+    done
+)
+
+(
+    testcase 4 "storage is consistent"
+    test-sx/1/sbin/sxserver stop
+    $SXADM node --check $STORAGE
+)
+
+rm -rf slots
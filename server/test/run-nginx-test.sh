@@ -64,6 +64,7 @@ socket-mode=0660
 data-dir="$SXSTOREDIR/data"
 children=2
 reserved-children=2
+block-compression
 EOF
 if [ "x$VERBOSE" = "x1" ]; then
     echo debug >>"$prefix/etc/sxserver/sxfcgi.conf"
@@ -88,6 +89,8 @@ mv "$prefix/etc/sxserver/sxhttpd.conf.1" "$prefix/etc/sxserver/sxhttpd.conf"
 # TODO: sxadm should be more easily scriptable
 "$prefix/sbin/sxadm" node --info "$SXSTOREDIR/data" | grep 'Admin key: ' | cut -d\  -f3 >"$SXSTOREDIR/data/admin.key"
 chmod 600 "$SXSTOREDIR/data/admin.key"
+"$prefix/sbin/sxadm" node --info "$SXSTOREDIR/data" | grep 'Cluster key: ' | cut -d\  -f3 >"$SXSTOREDIR/data/cluster.key"
+chmod 600 "$SXSTOREDIR/data/cluster.key"
 
 cleanup () {
     echo "cleaning up"
@@ -118,6 +121,16 @@ perl `dirname $0`/fcgi-test.pl 127.0.0.1:8013 $SXSTOREDIR/data || {
 
 "$prefix/sbin/sxserver" stop
 
+# Run the client tests again with the block I/O done synchronously, as on
+# systems lacking io_uring
+echo "io-uring-depth=0" >>"$prefix/etc/sxserver/sxfcgi.conf"
+"$prefix/sbin/sxserver" start
+"$prefix/bin/client-test" --config-dir="$prefix/.sx" --filter-dir="`pwd`/../client/src/filters" sx://localhost || {
+    cat $prefix/var/log/sxserver/sxhttpd-error.log;
+    exit 1
+}
+"$prefix/sbin/sxserver" stop
+
 "$prefix/sbin/sxadm" node --check "$SXSTOREDIR/data" || {
     exit 1
 }
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2016 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Checks the batched block hashing against sxi_sha1_calc() */
+
+#include "default.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1batch.h"
+#include "init.h"
+#include "log.h"
+#include "../libsxclient/src/vcrypto.h"
+
+#define GTFO(...) do { CRIT(__VA_ARGS__); goto out; } while(0)
+
+/* Batch sizes around the group widths (2 SHA-NI ways, 8 AVX2 and 16
+ * AVX-512 lanes) so that full, padded and leftover groups are all hit */
+static const unsigned int counts[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 11, 15, 16, 17, 24, 31, 32, 33, 100 };
+
+/* Lengths around the 64 byte SHA1 block and its padding boundary */
+static const unsigned int lengths[] = { 0, 1, 20, 35, 36, 43, 44, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 4096, 65536 };
+
+/* No salt, a cluster UUID sized one and one spanning a whole SHA1 block */
+static const unsigned int saltlens[] = { 0, 16, 20, 64 };
+
+#define MAX_COUNT 100
+#define MAX_LENGTH 65536
+#define MAX_SALT 64
+
+int main(int argc, char **argv) {
+    sxc_client_t *sx = sx_init(NULL, NULL, NULL, 0, argc, argv);
+    unsigned int seed = time(NULL), c, l, s, i, ntests = 0;
+    uint8_t *data = NULL, salt[MAX_SALT];
+    sx_hash_t hashes[MAX_COUNT], ref;
+    int ret = 1;
+
+    if(!sx)
+	GTFO("Failed ot init library");
+
+    if(argc == 2 && !strcmp(argv[1], "--debug"))
+	log_setminlevel(sx, SX_LOG_DEBUG);
+
+    if(!(data = malloc(MAX_COUNT * MAX_LENGTH)))
+	GTFO("Out of memory");
+
+    INFO("Testing the %s SHA1 implementation (seed %u)", sx_sha1batch_impl(), seed);
+    srand(seed);
+    for(i=0; i<MAX_COUNT * MAX_LENGTH; i++)
+	data[i] = rand();
+    for(i=0; i<sizeof(salt); i++)
+	salt[i] = rand();
+
+    for(s=0; s<sizeof(saltlens) / sizeof(*saltlens); s++) {
+	for(l=0; l<sizeof(lengths) / sizeof(*lengths); l++) {
+	    for(c=0; c<sizeof(counts) / sizeof(*counts); c++) {
+		unsigned int n = counts[c], len = lengths[l];
+
+		/* Equal buffers must still get their own hashes */
+		if(c & 1 && n > 1)
+		    memcpy(data + len, data, len);
+		memset(hashes, 0, sizeof(hashes));
+		if(sx_sha1batch(saltlens[s] ? salt : NULL, saltlens[s], data, n, len, hashes))
+		    GTFO("Batch hashing failed (salt %u, length %u, count %u)", saltlens[s], len, n);
+		for(i=0; i<n; i++) {
+		    if(sxi_sha1_calc(saltlens[s] ? salt : NULL, saltlens[s], data + (uint64_t)i * len, len, ref.b))
+			GTFO("Reference hashing failed");
+		    if(memcmp(&ref, &hashes[i], sizeof(ref)))
+			GTFO("Hash mismatch on buffer %u (salt %u, length %u, count %u, seed %u)", i, saltlens[s], len, n, seed);
+		}
+		/* Nothing past the requested hashes is written */
+		for(i=n; i<MAX_COUNT; i++) {
+		    unsigned int j;
+		    for(j=0; j<sizeof(hashes[i].b); j++)
+			if(hashes[i].b[j])
+			    GTFO("Batch hashing wrote past the end (salt %u, length %u, count %u)", saltlens[s], len, n);
+		}
+		ntests++;
+	    }
+	}
+    }
+    INFO("%u batches checked", ntests);
+    ret = 0;
+ out:
+    free(data);
+    sx_done(&sx);
+    return ret;
+}